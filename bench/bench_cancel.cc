@@ -0,0 +1,253 @@
+// SPDX-License-Identifier: MIT
+// Copyright 2023 - Present, Syoyo Fujita.
+//
+// Progress reporting and cancellation harness.
+//
+// Runs `load_from_file`, `load_from_memory`, `save_to_file` and
+// `mmap_writer::finalize` on a synthetic model of several
+// `kProgressChunkSize` chunks with a thread progress callback, once to
+// completion and once cancelling from the callback at the second chunk.
+// Verifies that:
+//
+// - completed runs report monotonic progress up to `bytes_total`,
+// - cancelled runs fail with "Cancelled" error right after the cancelling
+//   callback, release the loaded storage and leave no output file behind,
+// - only the outermost call reports(e.g. not `save_to_memory` called by
+//   `save_to_file`).
+//
+// Reports seconds of each run in JSON.
+//
+// $ bench_cancel [--tensors N] [--bytes N]
+//
+// Files are generated to `bench_cancel*.safetensors` and removed at exit.
+//
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <set>
+
+#if !defined(SAFETENSORS_CPP_NO_IMPLEMENTATION)
+#define SAFETENSORS_CPP_IMPLEMENTATION
+#endif
+#include "bench_util.hh"
+#include "synthetic.hh"
+
+namespace {
+
+const char *kInput = "bench_cancel_input.safetensors";
+const char *kOutput = "bench_cancel_output.safetensors";
+
+// Callback invocations of one run.
+struct progress_log {
+  size_t cancel_at{0};  // cancel at this call(1-based). 0 = never.
+  size_t calls{0};
+  std::set<std::string> operations;
+  uint64_t bytes_done{0};
+  uint64_t bytes_total{0};
+  bool monotonic{true};
+};
+
+bool on_progress(const safetensors::progress_info &info, void *userdata) {
+  progress_log *log = reinterpret_cast<progress_log *>(userdata);
+  log->calls++;
+  log->operations.insert(info.operation);
+  if ((info.bytes_done <= log->bytes_done) ||
+      (info.bytes_done > info.bytes_total)) {
+    log->monotonic = false;
+  }
+  log->bytes_done = info.bytes_done;
+  log->bytes_total = info.bytes_total;
+  return (log->cancel_at == 0) || (log->calls < log->cancel_at);
+}
+
+bool file_exists(const char *filename) {
+  std::ifstream ifs(filename, std::ios::binary);
+  return bool(ifs);
+}
+
+// `filename` exists and has the bytes of `expected`.
+bool same_file(const char *filename, const std::vector<uint8_t> &expected) {
+  std::ifstream ifs(filename, std::ios::binary);
+  std::vector<uint8_t> data((std::istreambuf_iterator<char>(ifs)),
+                            std::istreambuf_iterator<char>());
+  return bool(ifs.is_open()) && (data == expected);
+}
+
+// Run `fn(err)` with the progress callback bound to the thread, cancelling
+// at `cancel_at`-th call(0 = never), and check the outcome and that only
+// `operation` reported. Returns seconds of the run, or negative on failure.
+template <typename F>
+double run(const char *operation, size_t cancel_at, F fn, std::string *err) {
+  progress_log log;
+  log.cancel_at = cancel_at;
+  safetensors::set_thread_progress_callback(on_progress, &log);
+  std::string e;
+  auto t = std::chrono::steady_clock::now();
+  bool ok = fn(&e);
+  double seconds = bench::seconds_since(t);
+  safetensors::set_thread_progress_callback(nullptr, nullptr);
+
+  std::string what;
+  if (cancel_at) {
+    if (ok || (e.find("Cancelled") == std::string::npos)) {
+      what = "not cancelled";
+    } else if (log.calls != cancel_at) {
+      what = "called back " + std::to_string(log.calls) + " times";
+    }
+  } else if (!ok) {
+    what = "failed: " + e;
+  } else if ((log.calls < 2) || (log.bytes_done != log.bytes_total)) {
+    what = "incomplete progress";
+  }
+  if (what.empty() && !log.monotonic) {
+    what = "progress is not monotonic";
+  }
+  if (what.empty() && ((log.operations.size() != 1) ||
+                       (*log.operations.begin() != operation))) {
+    what = "reported by";
+    for (const std::string &op : log.operations) {
+      what += " " + op;
+    }
+  }
+  if (!what.empty()) {
+    (*err) += std::string(operation) + (cancel_at ? "(cancel)" : "") +
+              ": " + what + "\n";
+    return -1.0;
+  }
+  return seconds;
+}
+
+// Copy tensor data of `st` to the writer.
+bool fill_writer(const safetensors::safetensors_t &st,
+                 safetensors::mmap_writer *writer, std::string *err) {
+  for (const std::string &name : st.tensors.keys()) {
+    const uint8_t *src{nullptr};
+    uint8_t *dst{nullptr};
+    size_t n{0}, m{0};
+    if (!safetensors::get_tensor_data(st, name, &src, &n) ||
+        !writer->get_tensor_data(name, &dst, &m, err) || (n != m)) {
+      return false;
+    }
+    memcpy(dst, src, n);
+  }
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  size_t num_tensors = 4;
+  size_t tensor_bytes = 12 * 1024 * 1024;
+
+  auto option = [&](const std::string &arg, const std::string &val) {
+    size_t n = bench::to_size(val);
+    if (arg == "--tensors") {
+      num_tensors = (std::max)(size_t(1), n);
+    } else if (arg == "--bytes") {
+      tensor_bytes = (std::max)(size_t(4), n);
+    } else {
+      return false;
+    }
+    return true;
+  };
+  if (!bench::parse_args(argc, argv, nullptr, option)) {
+    return EXIT_FAILURE;
+  }
+  // Cancelling at the second chunk must leave work undone.
+  if (num_tensors * tensor_bytes <= 2 * safetensors::kProgressChunkSize) {
+    std::cerr << "Model must be larger than 2 x kProgressChunkSize bytes.\n";
+    return EXIT_FAILURE;
+  }
+
+  bench::temp_files temp;
+  temp.paths = {kInput, kOutput};
+
+  safetensors::safetensors_t model;
+  model.storage.resize(num_tensors * (tensor_bytes / 4) * 4);
+  for (size_t i = 0; i < num_tensors; i++) {
+    safetensors::tensor_t t;
+    t.dtype = safetensors::dtype::kFLOAT32;
+    t.shape = {tensor_bytes / 4};
+    t.data_offsets = {{i * t.shape[0] * 4, (i + 1) * t.shape[0] * 4}};
+    model.tensors.insert("layers." + std::to_string(i) + ".weight", t);
+  }
+  synthetic::fill_random(model.storage.data(), model.storage.size(), 1);
+
+  std::string warn, err;
+  std::vector<uint8_t> input;
+  if (!safetensors::save_to_file(model, kInput, &warn, &err) ||
+      !safetensors::save_to_memory(model, &input, &warn, &err)) {
+    std::cerr << "Failed to generate the model: " << err;
+    return EXIT_FAILURE;
+  }
+
+  const char *kOps[] = {"load_from_file", "load_from_memory", "save_to_file",
+                        "mmap_writer::finalize"};
+  double seconds[4][2];
+  bool cleaned_up = true;
+  for (size_t k = 0; k < 2; k++) {
+    const size_t cancel_at = k ? 2 : 0;
+
+    safetensors::safetensors_t st;
+    seconds[0][k] = run(kOps[0], cancel_at, [&](std::string *e) {
+      return safetensors::load_from_file(kInput, &st, &warn, e);
+    }, &err);
+    cleaned_up &= !cancel_at || st.storage.empty();
+
+    safetensors::safetensors_t st_mem;
+    seconds[1][k] = run(kOps[1], cancel_at, [&](std::string *e) {
+      return safetensors::load_from_memory(input.data(), input.size(), "",
+                                           &st_mem, &warn, e);
+    }, &err);
+    cleaned_up &= !cancel_at || st_mem.storage.empty();
+
+    // Output files must be complete, or removed when cancelled.
+    seconds[2][k] = run(kOps[2], cancel_at, [&](std::string *e) {
+      return safetensors::save_to_file(model, kOutput, &warn, e);
+    }, &err);
+    bool saved_ok =
+        cancel_at ? !file_exists(kOutput) : same_file(kOutput, input);
+    std::remove(kOutput);
+
+    seconds[3][k] = run(kOps[3], cancel_at, [&](std::string *e) {
+      // The writer removes the file when destroyed unfinalized.
+      safetensors::mmap_writer writer;
+      return writer.open(kOutput, model, &warn, e) &&
+             fill_writer(model, &writer, e) && writer.finalize(e);
+    }, &err);
+    bool written_ok =
+        cancel_at ? !file_exists(kOutput) : same_file(kOutput, input);
+    std::remove(kOutput);
+
+    if (!saved_ok || !written_ok) {
+      err += std::string(cancel_at ? "cancelled output file was left behind"
+                                   : "output file differs") +
+             "\n";
+      cleaned_up = false;
+    }
+  }
+
+  bool ok = cleaned_up;
+  for (size_t i = 0; i < 4; i++) {
+    ok &= (seconds[i][0] >= 0.0) && (seconds[i][1] >= 0.0);
+  }
+  if (!ok) {
+    std::cerr << err;
+  }
+
+  std::cout << "{\n  \"tensors\": " << num_tensors
+            << ",\n  \"bytes\": " << model.storage.size();
+  const char *kKeys[] = {"load_from_file", "load_from_memory", "save_to_file",
+                         "mmap_writer_finalize"};
+  for (size_t i = 0; i < 4; i++) {
+    std::cout << ",\n  \"" << kKeys[i] << "_seconds\": " << seconds[i][0]
+              << ",\n  \"" << kKeys[i] << "_cancel_seconds\": "
+              << seconds[i][1];
+  }
+  std::cout << ",\n  \"cleaned_up\": " << (cleaned_up ? "true" : "false")
+            << ",\n";
+  return bench::finish(ok);
+}
@@ -0,0 +1,252 @@
+// SPDX-License-Identifier: MIT
+// Copyright 2023 - Present, Syoyo Fujita.
+//
+// Benchmark and self-check of `compare`.
+//
+// Generates an FP32 file, a copy, a BF16 conversion and a copy with one
+// perturbed element, then compares them in bitwise, tolerance and ULP modes
+// (single thread and thread pool). Checks the expected outcomes and reports
+// seconds and GB/s in JSON. Also checks that `early_exit` reports the
+// tensors it skipped separately from mismatches, and the FP64 ULP distance
+// of values far apart(no overflow).
+//
+// $ bench_compare [--tensors N] [--bytes N] [--threads N]
+//
+// Files are generated to `bench_compare_*.safetensors` and removed at exit.
+//
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+
+#if !defined(SAFETENSORS_CPP_NO_IMPLEMENTATION)
+#define SAFETENSORS_CPP_IMPLEMENTATION
+#endif
+#include "bench_util.hh"
+#include "synthetic.hh"
+
+namespace {
+
+const char *kRef = "bench_compare_ref.safetensors";
+const char *kCopy = "bench_compare_copy.safetensors";
+const char *kBF16 = "bench_compare_bf16.safetensors";
+const char *kPerturbed = "bench_compare_perturbed.safetensors";
+
+// Write `ref` with every tensor converted to `dtype`(FP32 or BF16).
+bool write_as(const safetensors::safetensors_t &ref, safetensors::dtype dtype,
+              const std::string &filename, std::string *err) {
+  safetensors::safetensors_t layout;
+  for (size_t i = 0; i < ref.tensors.size(); i++) {
+    safetensors::tensor_t t;
+    ref.tensors.at(i, &t);
+    t.dtype = dtype;
+    layout.tensors.insert(ref.tensors.keys()[i], t);
+  }
+  std::string warn;
+  safetensors::mmap_writer writer;
+  if (!writer.open(filename, layout, &warn, err)) {
+    return false;
+  }
+  for (size_t i = 0; i < ref.tensors.size(); i++) {
+    const std::string &name = ref.tensors.keys()[i];
+    const uint8_t *src;
+    uint8_t *dst;
+    size_t src_nbytes, dst_nbytes;
+    safetensors::get_tensor_data(ref, name, &src, &src_nbytes);
+    if (!writer.get_tensor_data(name, &dst, &dst_nbytes, err)) {
+      return false;
+    }
+    if (dtype == safetensors::dtype::kFLOAT32) {
+      memcpy(dst, src, src_nbytes);
+    } else {
+      std::vector<float> f(src_nbytes / 4);
+      std::vector<uint16_t> h(f.size());
+      memcpy(f.data(), src, src_nbytes);
+      safetensors::float_to_bfloat16(f.data(), f.size(), h.data());
+      memcpy(dst, h.data(), dst_nbytes);
+    }
+  }
+  return writer.finalize(err);
+}
+
+// ULP distances of FP64 extremes, signed zeros and adjacent values.
+bool check_f64_ulp() {
+  const double max = std::numeric_limits<double>::max();
+  const double xa[] = {-max, max, -0.0, 1.0};
+  const double xb[] = {max, -max, 0.0, std::nextafter(1.0, 2.0)};
+  safetensors::safetensors_t a, b;
+  safetensors::tensor_t t;
+  t.dtype = safetensors::dtype::kFLOAT64;
+  t.shape = {4};
+  t.data_offsets = {{0, sizeof(xa)}};
+  a.tensors.insert("x", t);
+  b.tensors.insert("x", t);
+  a.storage.resize(sizeof(xa));
+  b.storage.resize(sizeof(xb));
+  memcpy(a.storage.data(), xa, sizeof(xa));
+  memcpy(b.storage.data(), xb, sizeof(xb));
+
+  safetensors::compare_options options;
+  options.mode = safetensors::kCOMPARE_ULP;
+  options.max_ulp = 1;
+  safetensors::compare_result result;
+  std::string err;
+  if (!safetensors::compare(a, b, options, &result, &err)) {
+    return false;
+  }
+  // max - (-max) is twice the magnitude bits of max.
+  uint64_t bits;
+  memcpy(&bits, &max, 8);
+  const safetensors::tensor_compare_result &tr = result.tensors[0];
+  return (tr.mismatches == 2) && (tr.first_mismatch == 0) &&
+         (tr.max_ulp_error == 2 * bits);
+}
+
+struct run {
+  const char *name;
+  const char *file;
+  safetensors::compare_mode mode;
+  bool early_exit;
+  bool expect_match;
+};
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  size_t num_threads = 0;
+  synthetic::config cfg;
+  cfg.num_tensors = 32;
+  cfg.tensor_bytes = 4 * 1024 * 1024;
+  cfg.distribution = synthetic::kSizeFixed;
+
+  auto option = [&](const std::string &arg, const std::string &val) {
+    size_t n = bench::to_size(val);
+    if (arg == "--tensors") {
+      cfg.num_tensors = (std::max)(size_t(1), n);
+    } else if (arg == "--bytes") {
+      cfg.tensor_bytes = (std::max)(size_t(4), n);
+    } else if (arg == "--threads") {
+      num_threads = n;
+    } else {
+      return false;
+    }
+    return true;
+  };
+  if (!bench::parse_args(argc, argv, nullptr, option)) {
+    return EXIT_FAILURE;
+  }
+
+  bench::temp_files temp;
+  temp.paths = {kRef, kCopy, kBF16, kPerturbed};
+
+  // Finite values in [-1, 1).
+  std::string warn, err;
+  safetensors::safetensors_t ref;
+  synthetic::make_layout(cfg, &ref);
+  size_t total = 0;
+  for (size_t i = 0; i < ref.tensors.size(); i++) {
+    safetensors::tensor_t t;
+    ref.tensors.at(i, &t);
+    size_t n = safetensors::get_shape_size(t) * 4;
+    t.data_offsets = {{total, total + n}};
+    total += n;
+    ref.tensors.insert(ref.tensors.keys()[i], t);
+  }
+  ref.storage.resize(total);
+  std::mt19937 engine(cfg.seed);
+  std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+  for (size_t i = 0; i < total; i += 4) {
+    float v = dist(engine);
+    memcpy(ref.storage.data() + i, &v, 4);
+  }
+
+  // Perturb one element in the middle of the last tensor.
+  safetensors::safetensors_t perturbed;
+  perturbed.tensors = ref.tensors;
+  perturbed.storage = ref.storage;
+  const std::string &last = ref.tensors.keys().back();
+  safetensors::tensor_t last_tensor;
+  ref.tensors.at(last, &last_tensor);
+  size_t perturbed_index = safetensors::get_shape_size(last_tensor) / 2;
+  float *p = reinterpret_cast<float *>(perturbed.storage.data() +
+                                       last_tensor.data_offsets[0]) +
+             perturbed_index;
+  (*p) += 0.5f;
+
+  if (!write_as(ref, safetensors::dtype::kFLOAT32, kRef, &err) ||
+      !write_as(ref, safetensors::dtype::kFLOAT32, kCopy, &err) ||
+      !write_as(ref, safetensors::dtype::kBFLOAT16, kBF16, &err) ||
+      !write_as(perturbed, safetensors::dtype::kFLOAT32, kPerturbed, &err)) {
+    std::cerr << "Failed to write files: " << err << "\n";
+    return EXIT_FAILURE;
+  }
+
+  const run runs[] = {
+      {"bitwise_copy", kCopy, safetensors::kCOMPARE_BITWISE, false, true},
+      {"tolerance_copy", kCopy, safetensors::kCOMPARE_TOLERANCE, false, true},
+      {"tolerance_bf16", kBF16, safetensors::kCOMPARE_TOLERANCE, false, true},
+      {"ulp_bf16", kBF16, safetensors::kCOMPARE_ULP, false, true},
+      {"bitwise_perturbed", kPerturbed, safetensors::kCOMPARE_BITWISE, false,
+       false},
+      {"early_exit_perturbed", kPerturbed, safetensors::kCOMPARE_BITWISE, true,
+       false},
+  };
+
+  bool pass = true;
+  std::cout << "{\n  \"data_bytes\": " << total << ",\n  \"results\": [\n";
+  const size_t num_runs = sizeof(runs) / sizeof(runs[0]);
+  for (size_t k = 0; k < 2 * num_runs; k++) {
+    const run &r = runs[k % num_runs];
+    safetensors::compare_options options;
+    options.mode = r.mode;
+    options.early_exit = r.early_exit;
+    options.rtol = 1.0 / 128;  // BF16 rounding
+    options.max_ulp = 0;       // measured in BF16
+    options.num_threads = (k < num_runs) ? 1 : num_threads;
+
+    safetensors::compare_result result;
+    bool ok = safetensors::compare_files(kRef, r.file, options, &result, &warn,
+                                         &err);
+    ok = ok && (result.match == r.expect_match);
+    if (ok && !r.expect_match) {
+      // Only the perturbed element differs.
+      const safetensors::tensor_compare_result &tr = result.tensors.back();
+      ok = (result.num_mismatched == 1) && (tr.name == last) &&
+           (tr.mismatches == 1) && (tr.first_mismatch == perturbed_index);
+    }
+    pass = pass && ok;
+
+    std::cout << "    {\"mode\": \"" << r.name << "\", \"threads\": "
+              << options.num_threads << ", \"seconds\": " << result.seconds
+              << ", \"gb_per_second\": "
+              << ((result.seconds > 0.0)
+                      ? (double(total) / result.seconds / 1e9)
+                      : 0.0)
+              << ", \"mismatched_tensors\": " << result.num_mismatched
+              << ", \"pass\": " << (ok ? "true" : "false") << "}"
+              << ((k + 1 < 2 * num_runs) ? "," : "") << "\n";
+  }
+  std::cout << "  ],\n";
+
+  // A mismatch in the first tensor: the others are skipped, not mismatched.
+  safetensors::safetensors_t perturbed_first;
+  perturbed_first.tensors = ref.tensors;
+  perturbed_first.storage = ref.storage;
+  perturbed_first.storage[0] ^= 1;
+  safetensors::compare_options options;
+  options.early_exit = true;
+  options.num_threads = 1;
+  safetensors::compare_result result;
+  bool skip_ok =
+      safetensors::compare(ref, perturbed_first, options, &result, &err) &&
+      !result.match && (result.num_mismatched == 1) &&
+      (result.num_skipped == ref.tensors.size() - 1) &&
+      (result.tensors[0].mismatches == 1);
+  bool ulp_ok = check_f64_ulp();
+  std::cout << "  \"early_exit_skipped\": " << result.num_skipped
+            << ",\n  \"early_exit_ok\": " << (skip_ok ? "true" : "false")
+            << ",\n  \"f64_ulp_ok\": " << (ulp_ok ? "true" : "false")
+            << ",\n";
+  return bench::finish(pass && skip_ok && ulp_ok);
+}
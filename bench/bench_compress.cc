@@ -0,0 +1,251 @@
+// SPDX-License-Identifier: MIT
+// Copyright 2023 - Present, Syoyo Fujita.
+//
+// Benchmark of chunked compression(`save_compressed`).
+//
+// Generates weight-like data(normal distribution, std 0.02) per dtype and
+// saves it uncompressed and compressed with and without byte shuffle.
+// Verifies the compressed files load to the same data and reports the
+// compression ratio and load GB/s(uncompressed bytes per second) of the
+// uncompressed and compressed files in JSON. Also checks that compressed
+// headers with out-of-range chunk tables fail to load.
+//
+// $ bench_compress [--bytes N] [--chunk N] [--threads N] [--repeat N]
+//
+// Files are generated to `bench_compress_*.safetensors` and removed at exit.
+//
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+#if !defined(SAFETENSORS_CPP_NO_IMPLEMENTATION)
+#define SAFETENSORS_CPP_IMPLEMENTATION
+#endif
+#include "bench_util.hh"
+#include "synthetic.hh"
+
+namespace {
+
+const char *kRaw = "bench_compress_raw.safetensors";
+const char *kCompressed = "bench_compress_lz.safetensors";
+
+// Build a file of 8 tensors of `dtype` with `total` bytes in all.
+void make_weights(safetensors::dtype dtype, size_t total, uint32_t seed,
+                  safetensors::safetensors_t *st) {
+  const size_t itemsize = safetensors::get_dtype_bytes(dtype);
+  const size_t count = (std::max)(total / itemsize / 8, size_t(1));
+  std::mt19937 engine(seed);
+  std::normal_distribution<float> dist(0.0f, 0.02f);
+  size_t offset = 0;
+  for (size_t i = 0; i < 8; i++) {
+    safetensors::tensor_t t;
+    t.dtype = dtype;
+    t.shape = {count};
+    t.data_offsets = {{offset, offset + count * itemsize}};
+    offset += count * itemsize;
+    st->tensors.insert("layers." + std::to_string(i) + ".weight", t);
+  }
+  st->storage.resize(offset);
+  uint8_t *p = st->storage.data();
+  for (size_t k = 0; k < offset / itemsize; k++) {
+    float v = dist(engine);
+    if (dtype == safetensors::dtype::kFLOAT32) {
+      memcpy(p + k * 4, &v, 4);
+    } else if (dtype == safetensors::dtype::kINT32) {
+      int32_t q = int32_t(v * 1000.0f);  // quantized
+      memcpy(p + k * 4, &q, 4);
+    } else {
+      uint16_t h = (dtype == safetensors::dtype::kBFLOAT16)
+                       ? safetensors::float_to_bfloat16(v)
+                       : safetensors::float_to_fp16(v);
+      memcpy(p + k * 2, &h, 2);
+    }
+  }
+}
+
+// Best of `repeat` `load_from_file` runs. Returns a negative value on failure
+// or when the data differs from `ref`.
+double time_load(const char *filename, const safetensors::safetensors_t &ref,
+                 size_t repeat, std::string *err) {
+  return bench::best_of(repeat, [&]() {
+    std::string warn;
+    safetensors::safetensors_t st;
+    if (!safetensors::load_from_file(filename, &st, &warn, err)) {
+      return false;
+    }
+    if ((st.storage != ref.storage) ||
+        (st.tensors.keys() != ref.tensors.keys())) {
+      (*err) += std::string(filename) + ": data mismatch\n";
+      return false;
+    }
+    return true;
+  });
+}
+
+// A compressed file whose `__compression__` entries are `entries`(pairs of
+// key suffix and value) with `data_size` bytes of compressed data.
+std::vector<uint8_t> make_malformed(
+    const std::vector<std::pair<std::string, std::string>> &entries,
+    size_t data_size) {
+  safetensors::safetensors_t st;
+  st.metadata.insert("__compression__.format", "st-lz/1");
+  st.metadata.insert("__compression__.shuffle", "0");
+  for (const auto &e : entries) {
+    st.metadata.insert("__compression__." + e.first, e.second);
+  }
+  safetensors::tensor_t t;
+  t.dtype = safetensors::dtype::kUINT8;
+  t.shape = {data_size};
+  t.data_offsets = {{0, data_size}};
+  st.tensors.insert("__compressed__", t);
+  st.storage.resize(data_size);
+  std::vector<uint8_t> buf;
+  std::string warn, err;
+  safetensors::save_to_memory(st, &buf, &warn, &err);
+  return buf;
+}
+
+// Headers whose sizes wrap around or exceed the data must be rejected by
+// `load_from_memory`, `load_from_file` and `compressed_reader`.
+bool check_malformed(std::string *err) {
+  const std::vector<std::vector<uint8_t>> inputs = {
+      // Chunk size wraps the compressed offset.
+      make_malformed({{"chunk_size", "8"},
+                      {"chunks", "18446744073709551612,8"},
+                      {"tensor.x", "U8;16"}},
+                     4),
+      // Tensor size and chunk size wrap.
+      make_malformed({{"chunk_size", "18446744073709551608"},
+                      {"chunks", "4,4"},
+                      {"tensor.x", "U64;2305843009213693951"},
+                      {"tensor.y", "U8;24"}},
+                     8),
+      // Chunk beyond the compressed data.
+      make_malformed(
+          {{"chunk_size", "8"}, {"chunks", "8,8"}, {"tensor.x", "U8;16"}}, 8),
+      // Chunk decoding to more than the codec allows.
+      make_malformed({{"chunk_size", "1024"},
+                      {"chunks", "1"},
+                      {"tensor.x", "U8;1024"}},
+                     1),
+      // Trailing garbage in the chunk table.
+      make_malformed(
+          {{"chunk_size", "8"}, {"chunks", "8,"}, {"tensor.x", "U8;8"}}, 8),
+  };
+  for (size_t i = 0; i < inputs.size(); i++) {
+    const std::vector<uint8_t> &buf = inputs[i];
+    std::string warn, e;
+    safetensors::safetensors_t st;
+    bool loaded = buf.empty() ||
+                  safetensors::load_from_memory(buf.data(), buf.size(), "",
+                                                &st, &warn, &e);
+    FILE *fp = fopen(kCompressed, "wb");
+    if (fp) {
+      fwrite(buf.data(), 1, buf.size(), fp);
+      fclose(fp);
+    }
+    safetensors::compressed_reader reader;
+    loaded = loaded || !fp ||
+             safetensors::load_from_file(kCompressed, &st, &warn, &e) ||
+             reader.open(kCompressed, 1, &warn, &e);
+    if (loaded) {
+      (*err) += "malformed input " + std::to_string(i) + " was accepted\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  size_t total = 64 * 1024 * 1024;
+  size_t repeat = 3;
+  safetensors::compress_options options;
+
+  auto option = [&](const std::string &arg, const std::string &val) {
+    size_t n = bench::to_size(val);
+    if (arg == "--bytes") {
+      total = (std::max)(size_t(64), n);
+    } else if (arg == "--chunk") {
+      options.chunk_size = (std::max)(size_t(8), n);
+    } else if (arg == "--threads") {
+      options.num_threads = n;
+    } else if (arg == "--repeat") {
+      repeat = (std::max)(size_t(1), n);
+    } else {
+      return false;
+    }
+    return true;
+  };
+  if (!bench::parse_args(argc, argv, nullptr, option)) {
+    return EXIT_FAILURE;
+  }
+
+  bench::temp_files temp;
+  temp.paths = {kRaw, kCompressed};
+
+  const safetensors::dtype dtypes[] = {
+      safetensors::dtype::kFLOAT32, safetensors::dtype::kFLOAT16,
+      safetensors::dtype::kBFLOAT16, safetensors::dtype::kINT32};
+  const size_t num_dtypes = sizeof(dtypes) / sizeof(dtypes[0]);
+
+  bool pass = true;
+  std::cout << "{\n  \"chunk_size\": " << options.chunk_size
+            << ",\n  \"results\": [\n";
+  for (size_t d = 0; d < num_dtypes; d++) {
+    std::string warn, err;
+    safetensors::safetensors_t ref;
+    make_weights(dtypes[d], total, uint32_t(d + 1), &ref);
+    const size_t nbytes = ref.storage.size();
+    bool ok = safetensors::save_to_file(ref, kRaw, &warn, &err);
+    double raw_seconds = ok ? time_load(kRaw, ref, repeat, &err) : -1.0;
+    ok = ok && (raw_seconds >= 0.0);
+
+    for (int shuffle = 1; shuffle >= 0; shuffle--) {
+      options.shuffle = (shuffle != 0);
+      size_t compressed_bytes = 0;
+      auto t = std::chrono::steady_clock::now();
+      bool saved = ok && safetensors::save_compressed(
+                             ref, kCompressed, options, &compressed_bytes,
+                             &warn, &err);
+      double save_seconds = bench::seconds_since(t);
+      double load_seconds =
+          saved ? time_load(kCompressed, ref, repeat, &err) : -1.0;
+      bool r_ok = saved && (load_seconds >= 0.0);
+      pass = pass && r_ok;
+      if (!r_ok) {
+        std::cerr << err;
+      }
+
+      std::cout << "    {\"dtype\": \""
+                << safetensors::get_dtype_str(dtypes[d])
+                << "\", \"shuffle\": " << (options.shuffle ? "true" : "false")
+                << ", \"bytes\": " << nbytes
+                << ", \"compressed_bytes\": " << compressed_bytes
+                << ", \"ratio\": "
+                << (compressed_bytes ? (double(nbytes) / compressed_bytes)
+                                     : 0.0)
+                << ", \"save_seconds\": " << save_seconds
+                << ", \"load_gb_per_second\": "
+                << ((load_seconds > 0.0) ? (double(nbytes) / load_seconds / 1e9)
+                                         : 0.0)
+                << ", \"uncompressed_load_gb_per_second\": "
+                << ((raw_seconds > 0.0) ? (double(nbytes) / raw_seconds / 1e9)
+                                        : 0.0)
+                << ", \"pass\": " << (r_ok ? "true" : "false") << "}"
+                << (((d + 1 < num_dtypes) || shuffle) ? "," : "") << "\n";
+    }
+  }
+  std::string err;
+  bool malformed_ok = check_malformed(&err);
+  if (!malformed_ok) {
+    std::cerr << err;
+  }
+  std::cout << "  ],\n  \"malformed_rejected\": "
+            << (malformed_ok ? "true" : "false") << ",\n";
+  return bench::finish(pass && malformed_ok);
+}
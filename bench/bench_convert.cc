@@ -0,0 +1,334 @@
+// SPDX-License-Identifier: MIT
+// Copyright 2023 - Present, Syoyo Fujita.
+//
+// dtype conversion kernel benchmark.
+//
+// Measures each conversion kernel over working sets from L1-resident to
+// DRAM-sized and reports GB/s(bytes read + written) and elements/cycle as
+// JSON. The per-element scalar API(`float_to_fp16` etc.) is the baseline,
+// `bulk` is the array API which is what load/convert paths use.
+//
+// There is no runtime SIMD dispatch in safetensors-cpp. Bulk kernels are
+// auto-vectorized for the ISA enabled at compile time, which is reported as
+// `isa`(e.g. build with -march=native to measure AVX2/AVX-512).
+//
+// Bulk kernels are verified to be bit-exact with the scalar API before
+// measurement. Exits with failure when a bulk kernel is slower than the
+// scalar API(geometric mean of the speedup over the working sets below
+// `--min-speedup`, default 1).
+//
+// $ bench_convert [--min-seconds S] [--ghz F] [--min-speedup F]
+//
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <random>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_HAS_TSC
+#elif defined(_M_X64)
+#include <intrin.h>
+#define BENCH_HAS_TSC
+#endif
+
+#if !defined(SAFETENSORS_CPP_NO_IMPLEMENTATION)
+#define SAFETENSORS_CPP_IMPLEMENTATION
+#endif
+#include "safetensors.hh"
+
+#include "bench_util.hh"
+
+namespace {
+
+const char *get_isa() {
+#if defined(__AVX512F__)
+  return "avx512";
+#elif defined(__AVX2__)
+  return "avx2";
+#elif defined(__AVX__)
+  return "avx";
+#elif defined(__SSE4_2__)
+  return "sse4.2";
+#elif defined(__SSE2__) || defined(_M_X64)
+  return "sse2";
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+  return "neon";
+#else
+  return "generic";
+#endif
+}
+
+uint64_t read_cycles() {
+#if defined(BENCH_HAS_TSC)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+struct buffers {
+  std::vector<float> f32;
+  std::vector<uint16_t> u16;
+  std::vector<float> f32_out;
+  std::vector<uint16_t> u16_out;
+};
+
+typedef void (*kernel_fn)(buffers &b, size_t n);
+
+void scalar_bf16_to_f32(buffers &b, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    b.f32_out[i] = safetensors::bfloat16_to_float(b.u16[i]);
+  }
+}
+
+void bulk_bf16_to_f32(buffers &b, size_t n) {
+  safetensors::bfloat16_to_float(b.u16.data(), n, b.f32_out.data());
+}
+
+void scalar_f32_to_bf16(buffers &b, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    b.u16_out[i] = safetensors::float_to_bfloat16(b.f32[i]);
+  }
+}
+
+void bulk_f32_to_bf16(buffers &b, size_t n) {
+  safetensors::float_to_bfloat16(b.f32.data(), n, b.u16_out.data());
+}
+
+void scalar_f16_to_f32(buffers &b, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    b.f32_out[i] = safetensors::fp16_to_float(b.u16[i]);
+  }
+}
+
+void bulk_f16_to_f32(buffers &b, size_t n) {
+  safetensors::fp16_to_float(b.u16.data(), n, b.f32_out.data());
+}
+
+void scalar_f32_to_f16(buffers &b, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    b.u16_out[i] = safetensors::float_to_fp16(b.f32[i]);
+  }
+}
+
+void bulk_f32_to_f16(buffers &b, size_t n) {
+  safetensors::float_to_fp16(b.f32.data(), n, b.u16_out.data());
+}
+
+// Bandwidth reference.
+void memcpy_f32(buffers &b, size_t n) {
+  memcpy(b.f32_out.data(), b.f32.data(), n * sizeof(float));
+}
+
+struct kernel_entry {
+  const char *name;
+  const char *variant;
+  size_t src_bytes;  // per element
+  size_t dst_bytes;
+  kernel_fn fn;
+};
+
+const kernel_entry kKernels[] = {
+    {"bf16_to_f32", "scalar", 2, 4, scalar_bf16_to_f32},
+    {"bf16_to_f32", "bulk", 2, 4, bulk_bf16_to_f32},
+    {"f32_to_bf16", "scalar", 4, 2, scalar_f32_to_bf16},
+    {"f32_to_bf16", "bulk", 4, 2, bulk_f32_to_bf16},
+    {"f16_to_f32", "scalar", 2, 4, scalar_f16_to_f32},
+    {"f16_to_f32", "bulk", 2, 4, bulk_f16_to_f32},
+    {"f32_to_f16", "scalar", 4, 2, scalar_f32_to_f16},
+    {"f32_to_f16", "bulk", 4, 2, bulk_f32_to_f16},
+    {"f32_copy", "memcpy", 4, 4, memcpy_f32},
+};
+
+bool same_bits(float a, float b) { return memcmp(&a, &b, 4) == 0; }
+
+// Check bulk kernels are bit-exact with the scalar API.
+bool verify() {
+  std::vector<uint16_t> h(65536);
+  for (size_t i = 0; i < h.size(); i++) {
+    h[i] = uint16_t(i);
+  }
+  std::vector<float> f(h.size());
+
+  safetensors::bfloat16_to_float(h.data(), h.size(), f.data());
+  for (size_t i = 0; i < h.size(); i++) {
+    if (!same_bits(f[i], safetensors::bfloat16_to_float(h[i]))) {
+      std::cerr << "bf16_to_f32 mismatch at 0x" << std::hex << i << "\n";
+      return false;
+    }
+  }
+
+  safetensors::fp16_to_float(h.data(), h.size(), f.data());
+  for (size_t i = 0; i < h.size(); i++) {
+    if (!same_bits(f[i], safetensors::fp16_to_float(h[i]))) {
+      std::cerr << "f16_to_f32 mismatch at 0x" << std::hex << i << "\n";
+      return false;
+    }
+  }
+
+  // Random bit patterns + interesting values(rounding boundaries, denormals,
+  // Inf/NaN).
+  std::vector<float> src;
+  std::mt19937 engine(0);
+  for (size_t i = 0; i < (1u << 22); i++) {
+    uint32_t u = engine();
+    float x;
+    memcpy(&x, &u, 4);
+    src.push_back(x);
+  }
+  for (uint32_t e = 0; e < 256; e++) {
+    for (uint32_t m : {0u, 1u, 0xfffu, 0x1000u, 0x1fffu, 0x7fffu, 0x8000u,
+                       0x18000u, 0x7fffffu, 0x400000u}) {
+      for (uint32_t s : {0u, 1u}) {
+        uint32_t u = (s << 31) | (e << 23) | m;
+        float x;
+        memcpy(&x, &u, 4);
+        src.push_back(x);
+      }
+    }
+    // fp16 subnormal rounding ties with an even and an odd result.
+    for (uint32_t k = 0; k < 22; k++) {
+      for (uint32_t m : {1u << k, 3u << k}) {
+        uint32_t u = (e << 23) | m;
+        float x;
+        memcpy(&x, &u, 4);
+        src.push_back(x);
+      }
+    }
+  }
+
+  std::vector<uint16_t> out(src.size());
+  safetensors::float_to_bfloat16(src.data(), src.size(), out.data());
+  for (size_t i = 0; i < src.size(); i++) {
+    if (out[i] != safetensors::float_to_bfloat16(src[i])) {
+      std::cerr << "f32_to_bf16 mismatch for " << src[i] << "\n";
+      return false;
+    }
+  }
+
+  safetensors::float_to_fp16(src.data(), src.size(), out.data());
+  for (size_t i = 0; i < src.size(); i++) {
+    if (out[i] != safetensors::float_to_fp16(src[i])) {
+      std::cerr << "f32_to_f16 mismatch for " << src[i] << "\n";
+      return false;
+    }
+  }
+
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  double min_seconds = 0.1;
+  double ghz = 0.0;
+  double min_speedup = 1.0;
+  auto option = [&](const std::string &arg, const std::string &val) {
+    if (arg == "--min-seconds") {
+      min_seconds = std::atof(val.c_str());
+    } else if (arg == "--ghz") {
+      ghz = std::atof(val.c_str());
+    } else if (arg == "--min-speedup") {
+      min_speedup = std::atof(val.c_str());
+    } else {
+      return false;
+    }
+    return true;
+  };
+  if (!bench::parse_args(argc, argv, nullptr, option)) {
+    std::cerr
+        << "bench_convert [--min-seconds S] [--ghz F] [--min-speedup F]\n";
+    return EXIT_FAILURE;
+  }
+
+  if (!verify()) {
+    std::cerr << "Bulk conversion does not match scalar conversion.\n";
+    return EXIT_FAILURE;
+  }
+
+  // Working set(src + dst) from L1-resident to DRAM-sized.
+  const size_t kWorkingSets[] = {16 * 1024, 256 * 1024, 4 * 1024 * 1024,
+                                 256 * 1024 * 1024};
+
+  size_t max_elems = kWorkingSets[3] / 6 + 1;
+  buffers b;
+  b.f32.resize(max_elems);
+  b.u16.resize(max_elems);
+  b.f32_out.resize(max_elems);
+  b.u16_out.resize(max_elems);
+
+  std::mt19937 engine(0);
+  std::normal_distribution<float> dist(0.0f, 1.0f);
+  for (size_t i = 0; i < max_elems; i++) {
+    b.f32[i] = dist(engine);
+    b.u16[i] = safetensors::float_to_bfloat16(b.f32[i]);
+  }
+
+  std::cout << "{\n  \"isa\": \"" << get_isa() << "\",\n  \"results\": [";
+  bool first = true;
+
+  // Sum of log(scalar seconds / bulk seconds) per kernel.
+  std::map<std::string, double> log_speedup;
+  double scalar_seconds = 0.0;
+
+  for (size_t ws : kWorkingSets) {
+    for (const kernel_entry &k : kKernels) {
+      size_t n = ws / (k.src_bytes + k.dst_bytes);
+
+      double best = 1e30;
+      uint64_t best_cycles = 0;
+      double start = bench::now_seconds();
+      size_t iters = 0;
+      while ((iters < 3) || ((bench::now_seconds() - start) < min_seconds)) {
+        uint64_t c0 = read_cycles();
+        double t0 = bench::now_seconds();
+        k.fn(b, n);
+        double t = bench::now_seconds() - t0;
+        uint64_t c = read_cycles() - c0;
+        if (t < best) {
+          best = t;
+          best_cycles = c;
+        }
+        iters++;
+      }
+
+      if (strcmp(k.variant, "scalar") == 0) {
+        scalar_seconds = best;
+      } else if (strcmp(k.variant, "bulk") == 0) {
+        log_speedup[k.name] += std::log(scalar_seconds / best);
+      }
+
+      double gbps = double(n * (k.src_bytes + k.dst_bytes)) / best / 1e9;
+      double cycles = (ghz > 0.0) ? best * ghz * 1e9 : double(best_cycles);
+
+      std::cout << (first ? "\n" : ",\n");
+      first = false;
+      std::cout << "    {\"kernel\": \"" << k.name << "\", \"variant\": \""
+                << k.variant << "\", \"working_set_bytes\": " << ws
+                << ", \"elements\": " << n << ", \"seconds\": " << best
+                << ", \"gbps\": " << gbps;
+      if (cycles > 0.0) {
+        std::cout << ", \"elements_per_cycle\": " << double(n) / cycles;
+      }
+      std::cout << "}";
+    }
+  }
+
+  const size_t num_sets = sizeof(kWorkingSets) / sizeof(kWorkingSets[0]);
+  bool pass = true;
+  std::cout << "\n  ],\n  \"bulk_speedup\": {";
+  first = true;
+  for (const auto &it : log_speedup) {
+    double speedup = std::exp(it.second / double(num_sets));
+    pass = pass && (speedup >= min_speedup);
+    std::cout << (first ? "" : ", ") << "\"" << it.first << "\": " << speedup;
+    first = false;
+  }
+  std::cout << "},\n";
+  return bench::finish(pass);
+}
@@ -0,0 +1,179 @@
+// SPDX-License-Identifier: MIT
+// Copyright 2023 - Present, Syoyo Fujita.
+//
+// Benchmark of cross-file tensor deduplication(`dedup_pool`).
+//
+// Generates a base file and fine-tunes of it which modify a fraction of its
+// tensors, then loads every file with `load_from_file` and into a
+// `dedup_pool`. Verifies the pool returns the same data and reports resident
+// bytes, bytes saved and seconds in JSON. Finally unloads and loads one
+// fine-tune again to exercise the hash cache, verifies its data and checks
+// that the cache is empty once every model is unloaded.
+//
+// $ bench_dedup [--models N] [--changed PERCENT] [--tensors N] [--bytes N]
+//     [--threads N]
+//
+// Files are generated to `bench_dedup_<index>.safetensors` and removed at
+// exit.
+//
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+
+#if !defined(SAFETENSORS_CPP_NO_IMPLEMENTATION)
+#define SAFETENSORS_CPP_IMPLEMENTATION
+#endif
+#include "bench_util.hh"
+#include "synthetic.hh"
+
+namespace {
+
+// Write a fine-tune of `base` with `changed` percent of tensors modified.
+bool make_finetune(const safetensors::safetensors_t &base, size_t index,
+                   size_t changed, const std::string &filename,
+                   std::string *err) {
+  std::string warn;
+  safetensors::safetensors_t st;
+  st.tensors = base.tensors;
+  st.metadata = base.metadata;
+  st.storage = base.storage;
+  for (size_t i = 0; i < st.tensors.size(); i++) {
+    if (((i * 100) / st.tensors.size()) >= changed) {
+      continue;
+    }
+    uint8_t *data{nullptr};
+    size_t nbytes{0};
+    safetensors::get_mutable_tensor_data(&st, st.tensors.keys()[i], &data,
+                                         &nbytes);
+    synthetic::fill_random(data, nbytes, uint64_t(index) * 7919 + i);
+  }
+  return safetensors::save_to_file(st, filename, &warn, err);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  size_t num_models = 4;
+  size_t changed = 10;
+  safetensors::dedup_options options;
+  synthetic::config cfg;
+  cfg.num_tensors = 64;
+  cfg.tensor_bytes = 256 * 1024;
+
+  auto option = [&](const std::string &arg, const std::string &val) {
+    size_t n = bench::to_size(val);
+    if (arg == "--models") {
+      num_models = (std::max)(size_t(1), n);
+    } else if (arg == "--changed") {
+      changed = (std::min)(size_t(100), n);
+    } else if (arg == "--tensors") {
+      cfg.num_tensors = n;
+    } else if (arg == "--bytes") {
+      cfg.tensor_bytes = n;
+    } else if (arg == "--threads") {
+      options.num_threads = n;
+    } else {
+      return false;
+    }
+    return true;
+  };
+  if (!bench::parse_args(argc, argv, nullptr, option)) {
+    return EXIT_FAILURE;
+  }
+
+  std::string warn, err;
+  bench::temp_files temp;
+  std::vector<std::string> paths;
+  paths.push_back(temp.add("bench_dedup_0.safetensors"));
+  safetensors::safetensors_t base;
+  if (!synthetic::generate(paths[0], cfg, &err) ||
+      !safetensors::load_from_file(paths[0], &base, &warn, &err)) {
+    std::cerr << "Failed to generate synthetic file: " << err << "\n";
+    return EXIT_FAILURE;
+  }
+  for (size_t m = 1; m < num_models; m++) {
+    paths.push_back(
+        temp.add("bench_dedup_" + std::to_string(m) + ".safetensors"));
+    if (!make_finetune(base, m, changed, paths.back(), &err)) {
+      std::cerr << "Failed to write fine-tune: " << err << "\n";
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Separate copies.
+  std::vector<safetensors::safetensors_t> files(paths.size());
+  auto t = std::chrono::steady_clock::now();
+  for (size_t m = 0; m < paths.size(); m++) {
+    if (!safetensors::load_from_file(paths[m], &files[m], &warn, &err)) {
+      std::cerr << "load_from_file failed: " << err << "\n";
+      return EXIT_FAILURE;
+    }
+  }
+  double copy_seconds = bench::seconds_since(t);
+
+  safetensors::dedup_pool pool(options);
+  std::vector<size_t> ids(paths.size());
+  t = std::chrono::steady_clock::now();
+  for (size_t m = 0; m < paths.size(); m++) {
+    if (!pool.load(paths[m], &ids[m], &warn, &err)) {
+      std::cerr << "dedup_pool::load failed: " << err << "\n";
+      return EXIT_FAILURE;
+    }
+  }
+  double pool_seconds = bench::seconds_since(t);
+  safetensors::dedup_stats stats = pool.stats();
+
+  size_t mismatches = 0;
+  auto verify = [&](size_t m) {
+    for (const std::string &name : files[m].tensors.keys()) {
+      const uint8_t *x, *y;
+      size_t nx, ny;
+      safetensors::get_tensor_data(files[m], name, &x, &nx);
+      if (!pool.get_tensor_data(ids[m], name, &y, &ny) || (nx != ny) ||
+          (memcmp(x, y, nx) != 0)) {
+        mismatches++;
+      }
+    }
+  };
+  for (size_t m = 0; m < paths.size(); m++) {
+    verify(m);
+  }
+
+  // Load the last fine-tune again. Unchanged tensors are shared through the
+  // hash cache without reading them.
+  size_t last = paths.size() - 1;
+  pool.unload(ids[last]);
+  t = std::chrono::steady_clock::now();
+  bool reload_ok = pool.load(paths[last], &ids[last], &warn, &err);
+  double reload_seconds = bench::seconds_since(t);
+  safetensors::dedup_stats reload_stats = pool.stats();
+  if (reload_ok) {
+    verify(last);
+  }
+
+  // Cache entries are dropped with their buffers.
+  for (size_t m = 0; m < paths.size(); m++) {
+    pool.unload(ids[m]);
+  }
+  safetensors::dedup_stats empty_stats = pool.stats();
+
+  bool ok = (mismatches == 0) && reload_ok &&
+            (reload_stats.resident_bytes == stats.resident_bytes) &&
+            (empty_stats.buffers == 0) && (empty_stats.hash_cache_entries == 0);
+  std::cout << "{\n  \"models\": " << paths.size()
+            << ",\n  \"changed_percent\": " << changed
+            << ",\n  \"logical_bytes\": " << stats.logical_bytes
+            << ",\n  \"resident_bytes\": " << stats.resident_bytes
+            << ",\n  \"bytes_saved\": " << stats.bytes_saved
+            << ",\n  \"buffers\": " << stats.buffers
+            << ",\n  \"load_from_file_seconds\": " << copy_seconds
+            << ",\n  \"dedup_seconds\": " << pool_seconds
+            << ",\n  \"reload_seconds\": " << reload_seconds
+            << ",\n  \"hash_cache_hits\": " << reload_stats.hash_cache_hits
+            << ",\n  \"hash_cache_entries\": "
+            << reload_stats.hash_cache_entries
+            << ",\n  \"mismatches\": " << mismatches
+            << ",\n";
+  return bench::finish(ok);
+}
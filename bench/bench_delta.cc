@@ -0,0 +1,273 @@
+// SPDX-License-Identifier: MIT
+// Copyright 2023 - Present, Syoyo Fujita.
+//
+// Round trip of delta checkpoints(`save_delta`, `delta_view`).
+//
+// Saves a chain of two deltas over a base: the first modifies, removes,
+// retypes, reshapes and adds tensors, the second modifies and removes more
+// and re-adds a removed tensor. Deltas are written to subdirectories so that
+// the recorded base paths are relative to the delta, not to the working
+// directory. Verifies the number of stored tensors, the recorded base paths,
+// that `delta_view::to_safetensors` equals the source model and that a
+// replaced base is detected: through the header hash, and through the
+// tensor hashes when the base is rewritten with the same header but other
+// weights. Reports bytes and seconds in JSON.
+//
+// $ bench_delta [--tensors N] [--bytes N]
+//
+// Files are generated to `bench_delta_base.safetensors` and
+// `bench_delta_dir/` and removed at exit.
+//
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+
+#if defined(_WIN32)
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+#if !defined(SAFETENSORS_CPP_NO_IMPLEMENTATION)
+#define SAFETENSORS_CPP_IMPLEMENTATION
+#endif
+#include "bench_util.hh"
+#include "synthetic.hh"
+
+namespace {
+
+const char *kBase = "bench_delta_base.safetensors";
+const char *kDir = "bench_delta_dir";
+const char *kSubDir = "bench_delta_dir/sub";
+const char *kDelta1 = "bench_delta_dir/d1.safetensors";
+const char *kDelta2 = "bench_delta_dir/sub/d2.safetensors";
+
+void make_dir(const char *path) {
+#if defined(_WIN32)
+  _mkdir(path);
+#else
+  mkdir(path, 0755);
+#endif
+}
+
+std::string weight(size_t i) {
+  return "model.layers." + std::to_string(i) + ".weight";
+}
+
+// Append tensor `name` filled with random bytes(or replace it in place when
+// the size matches).
+void set_tensor(safetensors::safetensors_t *st, const std::string &name,
+                safetensors::dtype dtype, const std::vector<size_t> &shape,
+                uint64_t seed) {
+  safetensors::tensor_t t;
+  t.dtype = dtype;
+  t.shape = shape;
+  size_t nbytes = safetensors::get_shape_size(t) *
+                  safetensors::get_dtype_bytes(dtype);
+  safetensors::tensor_t old;
+  if (st->tensors.at(name, &old) &&
+      ((old.data_offsets[1] - old.data_offsets[0]) == nbytes)) {
+    t.data_offsets = old.data_offsets;
+  } else {
+    t.data_offsets = {{st->storage.size(), st->storage.size() + nbytes}};
+    st->storage.resize(st->storage.size() + nbytes);
+  }
+  synthetic::fill_random(st->storage.data() + t.data_offsets[0], nbytes,
+                         seed);
+  st->tensors.insert(name, t);
+}
+
+// Same tensors(in any order), dtypes, shapes, bytes and metadata.
+bool same_model(const safetensors::safetensors_t &a,
+                const safetensors::safetensors_t &b, std::string *err) {
+  if ((a.tensors.size() != b.tensors.size()) ||
+      (a.metadata.size() != b.metadata.size())) {
+    (*err) += "tensor or metadata count differs\n";
+    return false;
+  }
+  for (size_t i = 0; i < a.tensors.size(); i++) {
+    const std::string &name = a.tensors.keys()[i];
+    safetensors::tensor_t x, y;
+    a.tensors.at(i, &x);
+    const uint8_t *px, *py;
+    size_t nx, ny;
+    if (!b.tensors.at(name, &y) || (x.dtype != y.dtype) ||
+        (x.shape != y.shape) ||
+        !safetensors::get_tensor_data(a, name, &px, &nx) ||
+        !safetensors::get_tensor_data(b, name, &py, &ny) || (nx != ny) ||
+        (memcmp(px, py, nx) != 0)) {
+      (*err) += "tensor `" + name + "` differs\n";
+      return false;
+    }
+  }
+  for (size_t i = 0; i < a.metadata.size(); i++) {
+    std::string x, y;
+    a.metadata.at(i, &x);
+    if (!b.metadata.at(a.metadata.keys()[i], &y) || (x != y)) {
+      (*err) += "metadata `" + a.metadata.keys()[i] + "` differs\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+// Open the chain of `filename` and compare it with `ref`.
+bool check_view(const char *filename, const safetensors::safetensors_t &ref,
+                size_t num_files, std::string *err) {
+  std::string warn;
+  safetensors::delta_view view;
+  safetensors::safetensors_t merged;
+  if (!view.open(filename, &warn, err) ||
+      !view.to_safetensors(&merged, err)) {
+    return false;
+  }
+  if (view.num_files() != num_files) {
+    (*err) += std::string(filename) + ": " +
+              std::to_string(view.num_files()) + " files in the chain\n";
+    return false;
+  }
+  return same_model(ref, merged, err);
+}
+
+std::string recorded_base(const char *filename) {
+  std::string warn, err, base;
+  safetensors::safetensors_t st;
+  if (safetensors::mmap_from_file(filename, &st, &warn, &err)) {
+    st.metadata.at("__delta__.base", &base);
+  }
+  return base;
+}
+
+size_t file_bytes(const char *filename) {
+  std::string warn, err;
+  safetensors::safetensors_t st;
+  return safetensors::mmap_from_file(filename, &st, &warn, &err)
+             ? st.mmap_size
+             : 0;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  size_t num_tensors = 64;
+  size_t tensor_bytes = 256 * 1024;
+
+  auto option = [&](const std::string &arg, const std::string &val) {
+    size_t n = bench::to_size(val);
+    if (arg == "--tensors") {
+      num_tensors = (std::max)(size_t(8), n);
+    } else if (arg == "--bytes") {
+      tensor_bytes = (std::max)(size_t(1024), n);
+    } else {
+      return false;
+    }
+    return true;
+  };
+  if (!bench::parse_args(argc, argv, nullptr, option)) {
+    return EXIT_FAILURE;
+  }
+
+  bench::temp_files temp;
+  temp.paths = {kBase, kDelta2, kDelta1, kSubDir, kDir};
+  make_dir(kDir);
+  make_dir(kSubDir);
+
+  const safetensors::dtype f32 = safetensors::dtype::kFLOAT32;
+  const size_t rows = tensor_bytes / 4 / 256;
+
+  // v0: base.
+  safetensors::safetensors_t v0;
+  for (size_t i = 0; i < num_tensors; i++) {
+    set_tensor(&v0, weight(i), f32, {rows, 256}, i + 1);
+  }
+  v0.metadata.insert("version", "0");
+
+  // v1: modify, remove, change dtype, change shape, add.
+  safetensors::safetensors_t v1 = v0;
+  set_tensor(&v1, weight(0), f32, {rows, 256}, 1001);
+  v1.tensors.erase(weight(1));
+  safetensors::tensor_t t;
+  v1.tensors.at(weight(2), &t);
+  t.dtype = safetensors::dtype::kINT32;
+  v1.tensors.insert(weight(2), t);
+  v1.tensors.at(weight(3), &t);
+  t.shape = {rows * 256};
+  v1.tensors.insert(weight(3), t);
+  set_tensor(&v1, "lm_head.weight", f32, {rows, 256}, 1002);
+  v1.metadata.insert("version", "1");
+
+  // v2: modify an added tensor, remove more, re-add a removed tensor.
+  safetensors::safetensors_t v2 = v1;
+  set_tensor(&v2, "lm_head.weight", f32, {rows, 256}, 2001);
+  v2.tensors.erase(weight(4));
+  set_tensor(&v2, weight(1), f32, {rows, 256}, 2002);
+  v2.metadata.insert("version", "2");
+
+  std::string warn, err;
+  size_t stored1 = 0, stored2 = 0;
+  auto t0 = std::chrono::steady_clock::now();
+  bool ok = safetensors::save_to_file(v0, kBase, &warn, &err) &&
+            safetensors::save_delta(v1, kBase, kDelta1, &stored1, &warn,
+                                    &err) &&
+            safetensors::save_delta(v2, kDelta1, kDelta2, &stored2, &warn,
+                                    &err);
+  double save_seconds = bench::seconds_since(t0);
+  if (!ok) {
+    std::cerr << "save failed: " << err;
+  }
+
+  // Stored: v1 {0, 2, 3, lm_head}, v2 {lm_head, 1}.
+  bool stored_ok = ok && (stored1 == 4) && (stored2 == 2);
+  bool paths_ok = ok &&
+                  (recorded_base(kDelta1) == "../" + std::string(kBase)) &&
+                  (recorded_base(kDelta2) == "../d1.safetensors");
+
+  t0 = std::chrono::steady_clock::now();
+  bool chain_ok = ok && check_view(kDelta1, v1, 2, &err) &&
+                  check_view(kDelta2, v2, 3, &err);
+  double view_seconds = bench::seconds_since(t0);
+  if (ok && !chain_ok) {
+    std::cerr << "delta_view: " << err;
+  }
+
+  // Rewrite the base with the same header and one changed weight that both
+  // deltas rely on: the chain must not open.
+  safetensors::safetensors_t rewritten = v0;
+  set_tensor(&rewritten, weight(5), f32, {rows, 256}, 4001);
+  safetensors::delta_view rewritten_view;
+  std::string rewritten_err;
+  bool rewritten_ok =
+      ok && safetensors::save_to_file(rewritten, kBase, &warn, &err) &&
+      !rewritten_view.open(kDelta1, &warn, &rewritten_err) &&
+      !rewritten_view.open(kDelta2, &warn, &rewritten_err) &&
+      (rewritten_err.find("hash") != std::string::npos);
+
+  // Replace the base with another model: the chain must not open.
+  safetensors::safetensors_t other = v0;
+  set_tensor(&other, "extra.weight", f32, {rows, 256}, 3001);
+  safetensors::delta_view view;
+  std::string view_err;
+  bool replaced_ok = ok &&
+                     safetensors::save_to_file(other, kBase, &warn, &err) &&
+                     !view.open(kDelta2, &warn, &view_err) &&
+                     !view_err.empty();
+
+  ok = stored_ok && paths_ok && chain_ok && rewritten_ok && replaced_ok;
+  std::cout << "{\n  \"tensors\": " << num_tensors
+            << ",\n  \"base_bytes\": " << v0.storage.size()
+            << ",\n  \"delta1_bytes\": " << file_bytes(kDelta1)
+            << ",\n  \"delta2_bytes\": " << file_bytes(kDelta2)
+            << ",\n  \"delta1_stored\": " << stored1
+            << ",\n  \"delta2_stored\": " << stored2
+            << ",\n  \"save_seconds\": " << save_seconds
+            << ",\n  \"view_seconds\": " << view_seconds
+            << ",\n  \"base_paths_relative_to_delta\": "
+            << (paths_ok ? "true" : "false")
+            << ",\n  \"round_trip\": " << (chain_ok ? "true" : "false")
+            << ",\n  \"rewritten_base_detected\": "
+            << (rewritten_ok ? "true" : "false")
+            << ",\n  \"replaced_base_detected\": "
+            << (replaced_ok ? "true" : "false") << ",\n";
+  return bench::finish(ok);
+}
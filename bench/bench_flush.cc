@@ -0,0 +1,136 @@
+// SPDX-License-Identifier: MIT
+// Copyright 2023 - Present, Syoyo Fujita.
+//
+// Benchmark of in-place tensor updates(`kMMAP_READ_WRITE` + `flush_tensors`).
+//
+// Maps a synthetic file read-write, overwrites a few tensors and flushes only
+// their pages, then flushes every tensor as a baseline. Verifies that the
+// updates persist when the file is loaded again, that other tensors are
+// unchanged and that flushing neither records trace accesses nor counts
+// materialized tensors. Reports seconds in JSON. (The reload reads through
+// the page cache, so it checks that the mapping is shared with the file,
+// not that the pages reached the disk.)
+//
+// $ bench_flush [--updates N] [--tensors N] [--bytes N] [--dist ...]
+//
+// The file is generated to `bench_flush.safetensors` and removed at exit.
+//
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+
+#if !defined(SAFETENSORS_CPP_NO_IMPLEMENTATION)
+#define SAFETENSORS_CPP_IMPLEMENTATION
+#endif
+#include "bench_util.hh"
+#include "synthetic.hh"
+
+namespace {
+
+const char *kFile = "bench_flush.safetensors";
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  size_t updates = 4;
+  synthetic::config cfg;
+  cfg.num_tensors = 256;
+  cfg.tensor_bytes = 256 * 1024;
+
+  std::string option_err;
+  auto option = [&](const std::string &arg, const std::string &val) {
+    if (arg == "--updates") {
+      updates = (std::max)(size_t(1), bench::to_size(val));
+      return true;
+    }
+    return synthetic::apply_option(arg, val, &cfg, &option_err);
+  };
+  if (!bench::parse_args(argc, argv, nullptr, option) ||
+      !option_err.empty()) {
+    std::cerr << option_err;
+    return EXIT_FAILURE;
+  }
+
+  bench::temp_files temp;
+  temp.add(kFile);
+  std::string warn, err;
+  if (!synthetic::generate(kFile, cfg, &err)) {
+    std::cerr << "Failed to generate synthetic file: " << err << "\n";
+    return EXIT_FAILURE;
+  }
+
+  // Checksums after the update. Every `stride`-th tensor is overwritten.
+  std::vector<std::string> names, updated;
+  std::vector<uint64_t> expected;
+  double flush_seconds = -1.0, full_flush_seconds = -1.0;
+  bool side_effect_free = false;
+  {
+    safetensors::safetensors_t st;
+    if (!safetensors::mmap_from_file(kFile, &st, &warn, &err,
+                                     safetensors::kMMAP_READ_WRITE)) {
+      std::cerr << "mmap_from_file failed: " << err << "\n";
+      return EXIT_FAILURE;
+    }
+    names = st.tensors.keys();
+    const size_t stride = (std::max)(size_t(1), names.size() / updates);
+    for (size_t i = 0; i < names.size(); i++) {
+      uint8_t *data{nullptr};
+      size_t nbytes{0};
+      if (!safetensors::get_mutable_tensor_data(&st, names[i], &data,
+                                                &nbytes, &err)) {
+        std::cerr << err;
+        return EXIT_FAILURE;
+      }
+      if (((i % stride) == 0) && (updated.size() < updates)) {
+        synthetic::fill_random(data, nbytes, 0xf1u + i);
+        updated.push_back(names[i]);
+      }
+      expected.push_back(bench::checksum(data, nbytes));
+    }
+
+    safetensors::access_trace trace;
+    st.trace = &trace;
+    safetensors::global_counters before = safetensors::get_global_counters();
+    flush_seconds = bench::best_of(1, [&]() {
+      return safetensors::flush_tensors(st, updated, &err);
+    });
+    full_flush_seconds = bench::best_of(1, [&]() {
+      return safetensors::flush_tensors(st, names, &err);
+    });
+    bool ok = (flush_seconds >= 0.0) && (full_flush_seconds >= 0.0);
+    safetensors::global_counters after = safetensors::get_global_counters();
+    side_effect_free =
+        ok && trace.records.empty() &&
+        (after.tensors_materialized == before.tensors_materialized);
+    if (!ok) {
+      std::cerr << "flush_tensors failed: " << err << "\n";
+    }
+  }
+
+  // Reopen from disk.
+  size_t mismatches = 0;
+  safetensors::safetensors_t loaded;
+  if (!safetensors::load_from_file(kFile, &loaded, &warn, &err)) {
+    std::cerr << "load_from_file failed: " << err << "\n";
+    return EXIT_FAILURE;
+  }
+  for (size_t i = 0; i < names.size(); i++) {
+    const uint8_t *data{nullptr};
+    size_t nbytes{0};
+    if (!safetensors::get_tensor_data(loaded, names[i], &data, &nbytes) ||
+        (bench::checksum(data, nbytes) != expected[i])) {
+      mismatches++;
+    }
+  }
+
+  bool ok = (flush_seconds >= 0.0) && side_effect_free && (mismatches == 0);
+  std::cout << "{\n  \"tensors\": " << names.size()
+            << ",\n  \"updated\": " << updated.size()
+            << ",\n  \"flush_seconds\": " << flush_seconds
+            << ",\n  \"full_flush_seconds\": " << full_flush_seconds
+            << ",\n  \"side_effect_free\": "
+            << (side_effect_free ? "true" : "false")
+            << ",\n  \"mismatches\": " << mismatches << ",\n";
+  return bench::finish(ok);
+}
@@ -0,0 +1,262 @@
+// SPDX-License-Identifier: MIT
+// Copyright 2023 - Present, Syoyo Fujita.
+//
+// Header parsing and lookup microbenchmark.
+//
+// Measures header JSON parse(`mmap_from_memory`, no data copy), `ordered_dict`
+// lookup/iteration and `save_to_memory` header serialization over realistic
+// and adversarial headers. Reports ns/tensor and allocations/tensor(counted
+// with replaced global operator new) as JSON.
+//
+// $ bench_header [--min-seconds S]
+//
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <sstream>
+
+#if !defined(SAFETENSORS_CPP_NO_IMPLEMENTATION)
+#define SAFETENSORS_CPP_IMPLEMENTATION
+#endif
+#include "safetensors.hh"
+
+#include "bench_util.hh"
+
+//
+// Interposed allocator counter.
+//
+static uint64_t g_num_allocs = 0;
+static uint64_t g_alloc_bytes = 0;
+
+void *operator new(size_t n) {
+  g_num_allocs++;
+  g_alloc_bytes += n;
+  void *p = std::malloc(n ? n : 1);
+  if (!p) {
+    std::abort();
+  }
+  return p;
+}
+
+void *operator new[](size_t n) { return operator new(n); }
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete[](void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+void operator delete[](void *p, size_t) noexcept { std::free(p); }
+
+namespace {
+
+struct header_case {
+  std::string name;
+  size_t num_tensors{0};
+  std::vector<uint8_t> file;  // 8 + header + data
+};
+
+//
+// @param[in] name_fn Generate i'th tensor name(JSON-escaped)
+//
+template <typename F>
+header_case make_case(const std::string &case_name, size_t num_tensors,
+                      size_t metadata_items, size_t metadata_value_bytes,
+                      F name_fn) {
+  std::stringstream ss;
+  ss << "{";
+  if (metadata_items) {
+    ss << "\"__metadata__\": {";
+    for (size_t i = 0; i < metadata_items; i++) {
+      if (i > 0) {
+        ss << ", ";
+      }
+      ss << "\"key" << i << "\": \"" << std::string(metadata_value_bytes, 'v')
+         << "\"";
+    }
+    ss << "}";
+    if (num_tensors) {
+      ss << ", ";
+    }
+  }
+  for (size_t i = 0; i < num_tensors; i++) {
+    if (i > 0) {
+      ss << ", ";
+    }
+    ss << "\"" << name_fn(i) << "\": {\"dtype\": \"F32\", \"shape\": [1], "
+       << "\"data_offsets\": [" << i * 4 << ", " << (i + 1) * 4 << "]}";
+  }
+  ss << "}";
+
+  std::string header = ss.str();
+  while (header.size() % 8) {
+    header += ' ';
+  }
+
+  header_case c;
+  c.name = case_name;
+  c.num_tensors = num_tensors;
+  uint64_t header_size = header.size();
+  c.file.resize(8 + header.size() + num_tensors * 4);
+  memcpy(c.file.data(), &header_size, 8);
+  memcpy(c.file.data() + 8, header.data(), header.size());
+  return c;
+}
+
+struct measurement {
+  double ns_per_tensor{0.0};
+  double allocs_per_tensor{0.0};
+  double alloc_bytes_per_tensor{0.0};
+  bool ok{true};
+};
+
+//
+// Run `fn` repeatedly for at least `min_seconds` and report the best time.
+//
+template <typename F>
+measurement measure(size_t num_tensors, double min_seconds, F fn) {
+  measurement m;
+  double best = 1e30;
+  double start = bench::now_seconds();
+  size_t iters = 0;
+  while ((iters < 3) || ((bench::now_seconds() - start) < min_seconds)) {
+    uint64_t a0 = g_num_allocs;
+    uint64_t b0 = g_alloc_bytes;
+    double t0 = bench::now_seconds();
+    if (!fn()) {
+      m.ok = false;
+      return m;
+    }
+    double t = bench::now_seconds() - t0;
+    if (t < best) {
+      best = t;
+    }
+    double n = double((std::max)(num_tensors, size_t(1)));
+    m.allocs_per_tensor = double(g_num_allocs - a0) / n;
+    m.alloc_bytes_per_tensor = double(g_alloc_bytes - b0) / n;
+    iters++;
+  }
+  m.ns_per_tensor = best * 1e9 / double((std::max)(num_tensors, size_t(1)));
+  return m;
+}
+
+std::string pad_name(size_t i, size_t len) {
+  std::string s = "model.layers." + std::to_string(i) + ".weight";
+  if (s.size() < len) {
+    s += std::string(len - s.size(), 'n');
+  }
+  return s;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  double min_seconds = 0.2;
+  auto option = [&](const std::string &arg, const std::string &val) {
+    if (arg == "--min-seconds") {
+      min_seconds = std::atof(val.c_str());
+    } else {
+      return false;
+    }
+    return true;
+  };
+  if (!bench::parse_args(argc, argv, nullptr, option)) {
+    std::cerr << "bench_header [--min-seconds S]\n";
+    return EXIT_FAILURE;
+  }
+
+  std::vector<header_case> cases;
+  for (size_t n : {size_t(10), size_t(1000), size_t(100000)}) {
+    cases.push_back(make_case("tensors_" + std::to_string(n), n, 0, 0,
+                              [](size_t i) { return pad_name(i, 0); }));
+  }
+  cases.push_back(make_case("long_names_1k", 1000, 0, 0,
+                            [](size_t i) { return pad_name(i, 1024); }));
+  cases.push_back(make_case("large_metadata_1k", 1000, 1000, 1024,
+                            [](size_t i) { return pad_name(i, 0); }));
+  cases.push_back(make_case("deep_escapes_1k", 1000, 0, 0, [](size_t i) {
+    std::string s;
+    for (size_t k = 0; k < 32; k++) {
+      s += "\\u00e9\\\"\\\\\\n";
+    }
+    return s + std::to_string(i);
+  }));
+
+  std::cout << "{\n  \"results\": [";
+  bool first = true;
+
+  for (const header_case &c : cases) {
+    safetensors::safetensors_t st;
+    std::string warn, err;
+
+    measurement parse = measure(c.num_tensors, min_seconds, [&]() {
+      safetensors::safetensors_t tmp;
+      std::string w, e;
+      return safetensors::mmap_from_memory(c.file.data(), c.file.size(), "",
+                                           &tmp, &w, &e);
+    });
+
+    if (!safetensors::mmap_from_memory(c.file.data(), c.file.size(), "", &st,
+                                       &warn, &err)) {
+      std::cerr << c.name << ": failed to parse header: " << err << "\n";
+      return EXIT_FAILURE;
+    }
+
+    const std::vector<std::string> keys = st.tensors.keys();
+
+    measurement lookup = measure(c.num_tensors, min_seconds, [&]() {
+      safetensors::tensor_t t;
+      size_t sum = 0;
+      for (const std::string &k : keys) {
+        if (!st.tensors.at(k, &t)) {
+          return false;
+        }
+        sum += t.data_offsets[0];
+      }
+      return sum != size_t(-1);
+    });
+
+    measurement iterate = measure(c.num_tensors, min_seconds, [&]() {
+      safetensors::tensor_t t;
+      size_t sum = 0;
+      for (size_t i = 0; i < st.tensors.size(); i++) {
+        if (!st.tensors.at(i, &t)) {
+          return false;
+        }
+        sum += t.data_offsets[0];
+      }
+      return sum != size_t(-1);
+    });
+
+    measurement serialize = measure(c.num_tensors, min_seconds, [&]() {
+      std::vector<uint8_t> out;
+      std::string w, e;
+      return safetensors::save_to_memory(st, &out, &w, &e);
+    });
+
+    struct {
+      const char *name;
+      const measurement *m;
+    } ops[] = {{"parse_header", &parse},
+               {"lookup_by_name", &lookup},
+               {"iterate_by_index", &iterate},
+               {"save_to_memory", &serialize}};
+
+    for (const auto &op : ops) {
+      std::cout << (first ? "\n" : ",\n");
+      first = false;
+      std::cout << "    {\"case\": \"" << c.name
+                << "\", \"tensors\": " << c.num_tensors
+                << ", \"header_bytes\": " << st.header_size
+                << ", \"op\": \"" << op.name
+                << "\", \"ok\": " << (op.m->ok ? "true" : "false")
+                << ", \"ns_per_tensor\": " << op.m->ns_per_tensor
+                << ", \"allocs_per_tensor\": " << op.m->allocs_per_tensor
+                << ", \"alloc_bytes_per_tensor\": "
+                << op.m->alloc_bytes_per_tensor << "}";
+    }
+  }
+
+  std::cout << "\n  ]\n}\n";
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,336 @@
+// SPDX-License-Identifier: MIT
+// Copyright 2023 - Present, Syoyo Fujita.
+//
+// Load-path benchmark.
+//
+// Measures each load mode under warm and cold page cache and reports
+// throughput(GB/s), time-to-first-tensor and peak RSS as JSON.
+// Each (mode, cache) pair runs in a child process so that peak RSS is not
+// polluted by previous runs. Cold cache is simulated with
+// posix_fadvise(POSIX_FADV_DONTNEED)(Linux only).
+//
+// $ bench_load [file.safetensors] [--runs N] [gen_synthetic options]
+//
+// When no file is given, a synthetic file is generated to
+// `bench_load.safetensors`.
+//
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+
+#if !defined(SAFETENSORS_CPP_NO_IMPLEMENTATION)
+#define SAFETENSORS_CPP_IMPLEMENTATION
+#endif
+#include "bench_util.hh"
+#include "synthetic.hh"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define BENCH_USE_FORK
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+struct run_result {
+  int ok{0};
+  double open_seconds{0.0};   // API call
+  double ttft_seconds{0.0};   // until the first tensor's data is readable
+  double total_seconds{0.0};  // until all tensor data was read once
+  uint64_t peak_rss_bytes{0};
+  char err[256]{};
+};
+
+typedef bool (*mode_fn)(const std::string &filename, run_result *r,
+                        std::string *err);
+
+// Read one byte per page so that every page is faulted in.
+uint64_t touch(const uint8_t *p, size_t n) {
+  uint64_t sum = 0;
+  for (size_t i = 0; i < n; i += 4096) {
+    sum += p[i];
+  }
+  return sum;
+}
+
+volatile uint64_t g_sink;
+
+// Touch the first tensor, record ttft, then touch all tensors.
+bool touch_tensors(const safetensors::safetensors_t &st, double t0,
+                   run_result *r, std::string *err) {
+  uint64_t sum = 0;
+  for (size_t i = 0; i < st.tensors.size(); i++) {
+    const uint8_t *data{nullptr};
+    size_t nbytes{0};
+    if (!safetensors::get_tensor_data(st, st.tensors.keys()[i], &data,
+                                      &nbytes, err)) {
+      return false;
+    }
+    sum += touch(data, nbytes);
+    if (i == 0) {
+      r->ttft_seconds = bench::now_seconds() - t0;
+    }
+  }
+  g_sink = sum;
+  r->total_seconds = bench::now_seconds() - t0;
+  return true;
+}
+
+bool run_load_from_file(const std::string &filename, run_result *r,
+                        std::string *err) {
+  std::string warn;
+  safetensors::safetensors_t st;
+  double t0 = bench::now_seconds();
+  if (!safetensors::load_from_file(filename, &st, &warn, err)) {
+    return false;
+  }
+  r->open_seconds = bench::now_seconds() - t0;
+  return touch_tensors(st, t0, r, err);
+}
+
+// File read is excluded. Measures header parse + copy to `storage`.
+bool run_load_from_memory(const std::string &filename, run_result *r,
+                          std::string *err) {
+  std::vector<uint8_t> data;
+  {
+    std::ifstream ifs(filename, std::ios::binary | std::ios::ate);
+    if (!ifs) {
+      (*err) += "Failed to open " + filename + "\n";
+      return false;
+    }
+    data.resize(size_t(ifs.tellg()));
+    ifs.seekg(0);
+    ifs.read(reinterpret_cast<char *>(data.data()),
+             std::streamsize(data.size()));
+  }
+  std::string warn;
+  safetensors::safetensors_t st;
+  double t0 = bench::now_seconds();
+  if (!safetensors::load_from_memory(data.data(), data.size(), filename, &st,
+                                     &warn, err)) {
+    return false;
+  }
+  r->open_seconds = bench::now_seconds() - t0;
+  return touch_tensors(st, t0, r, err);
+}
+
+bool run_mmap(const std::string &filename, safetensors::mmap_mode mode,
+              run_result *r, std::string *err) {
+  std::string warn;
+  safetensors::safetensors_t st;
+  double t0 = bench::now_seconds();
+  if (!safetensors::mmap_from_file(filename, &st, &warn, err, mode)) {
+    return false;
+  }
+  r->open_seconds = bench::now_seconds() - t0;
+  return touch_tensors(st, t0, r, err);
+}
+
+bool run_mmap_from_file(const std::string &filename, run_result *r,
+                        std::string *err) {
+  return run_mmap(filename, safetensors::kMMAP_READ_ONLY, r, err);
+}
+
+bool run_mmap_copy_on_write(const std::string &filename, run_result *r,
+                            std::string *err) {
+  return run_mmap(filename, safetensors::kMMAP_COPY_ON_WRITE, r, err);
+}
+
+// mmap + prefetcher(one group per tensor, lookahead 8).
+bool run_mmap_prefetch(const std::string &filename, run_result *r,
+                       std::string *err) {
+  std::string warn;
+  safetensors::safetensors_t st;
+  double t0 = bench::now_seconds();
+  if (!safetensors::mmap_from_file(filename, &st, &warn, err)) {
+    return false;
+  }
+
+  std::vector<std::vector<std::string>> groups;
+  for (size_t i = 0; i < st.tensors.size(); i++) {
+    groups.push_back({st.tensors.keys()[i]});
+  }
+
+  safetensors::prefetcher pf;
+  if (!pf.init(st, groups, 8, err)) {
+    return false;
+  }
+  r->open_seconds = bench::now_seconds() - t0;
+
+  uint64_t sum = 0;
+  for (size_t g = 0; g < groups.size(); g++) {
+    pf.acquire(g);
+    const uint8_t *data{nullptr};
+    size_t nbytes{0};
+    safetensors::get_tensor_data(st, groups[g][0], &data, &nbytes);
+    sum += touch(data, nbytes);
+    if (g == 0) {
+      r->ttft_seconds = bench::now_seconds() - t0;
+    }
+    pf.release(g);
+  }
+  g_sink = sum;
+  r->total_seconds = bench::now_seconds() - t0;
+  return true;
+}
+
+struct mode_entry {
+  const char *name;
+  mode_fn fn;
+};
+
+const mode_entry kModes[] = {
+    {"load_from_file", run_load_from_file},
+    {"load_from_memory", run_load_from_memory},
+    {"mmap_from_file", run_mmap_from_file},
+    {"mmap_copy_on_write", run_mmap_copy_on_write},
+    {"mmap_prefetch", run_mmap_prefetch},
+};
+
+// Drop file pages from the page cache.
+bool drop_page_cache(const std::string &filename) {
+#if defined(__linux__)
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  fdatasync(fd);
+  int ret = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+  return ret == 0;
+#else
+  (void)filename;
+  return false;
+#endif
+}
+
+void run_mode(const mode_entry &m, const std::string &filename, bool cold,
+              run_result *r) {
+  std::string err;
+  if (cold && !drop_page_cache(filename)) {
+    err = "cold cache is not supported on this platform";
+  } else if (m.fn(filename, r, &err)) {
+    r->ok = 1;
+  }
+  r->peak_rss_bytes = bench::get_peak_rss_bytes();
+  snprintf(r->err, sizeof(r->err), "%s", err.c_str());
+}
+
+// Run in a child process to isolate peak RSS.
+void run_isolated(const mode_entry &m, const std::string &filename, bool cold,
+                  run_result *r) {
+#if defined(BENCH_USE_FORK)
+  int fds[2];
+  if (pipe(fds) != 0) {
+    snprintf(r->err, sizeof(r->err), "pipe failed");
+    return;
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(fds[0]);
+    run_result cr;
+    run_mode(m, filename, cold, &cr);
+    ssize_t n = write(fds[1], &cr, sizeof(cr));
+    close(fds[1]);
+    _exit(n == ssize_t(sizeof(cr)) ? 0 : 1);
+  }
+  close(fds[1]);
+  ssize_t n = read(fds[0], r, sizeof(*r));
+  close(fds[0]);
+  int status = 0;
+  waitpid(pid, &status, 0);
+  if (n != ssize_t(sizeof(*r))) {
+    *r = run_result();
+    snprintf(r->err, sizeof(r->err), "child process failed");
+  }
+#else
+  run_mode(m, filename, cold, r);
+#endif
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  std::string filename;
+  int runs = 3;
+  synthetic::config cfg;
+  cfg.num_tensors = 256;
+  cfg.tensor_bytes = 1024 * 1024;
+
+  std::vector<std::string> positional;
+  std::string err;
+  auto option = [&](const std::string &arg, const std::string &val) {
+    if (arg == "--runs") {
+      runs = (std::max)(1, std::atoi(val.c_str()));
+      return true;
+    }
+    return synthetic::apply_option(arg, val, &cfg, &err);
+  };
+  if (!bench::parse_args(argc, argv, &positional, option) ||
+      !err.empty()) {
+    std::cerr << err;
+    return EXIT_FAILURE;
+  }
+  if (!positional.empty()) {
+    filename = positional.back();
+  }
+
+  if (filename.empty()) {
+    filename = "bench_load.safetensors";
+    if (!synthetic::generate(filename, cfg, &err)) {
+      std::cerr << "Failed to generate synthetic file: " << err << "\n";
+      return EXIT_FAILURE;
+    }
+  }
+
+  size_t file_bytes{0};
+  {
+    safetensors::safetensors_t st;
+    std::string warn;
+    if (!safetensors::mmap_from_file(filename, &st, &warn, &err)) {
+      std::cerr << "Failed to open " << filename << ": " << err << "\n";
+      return EXIT_FAILURE;
+    }
+    file_bytes = st.mmap_size;
+  }
+
+  std::cout << "{\n";
+  std::cout << "  \"file\": \"" << bench::json_escape(filename) << "\",\n";
+  std::cout << "  \"file_bytes\": " << file_bytes << ",\n";
+  std::cout << "  \"results\": [";
+
+  bool first = true;
+  for (const mode_entry &m : kModes) {
+    for (int cold = 0; cold < 2; cold++) {
+      for (int run = 0; run < runs; run++) {
+        run_result r;
+        run_isolated(m, filename, cold != 0, &r);
+
+        double gbps = (r.ok && (r.total_seconds > 0.0))
+                          ? (double(file_bytes) / r.total_seconds) / 1e9
+                          : 0.0;
+
+        std::cout << (first ? "\n" : ",\n");
+        first = false;
+        std::cout << "    {\"mode\": \"" << m.name << "\", \"cache\": \""
+                  << (cold ? "cold" : "warm") << "\", \"run\": " << run
+                  << ", \"ok\": " << (r.ok ? "true" : "false")
+                  << ", \"open_seconds\": " << r.open_seconds
+                  << ", \"ttft_seconds\": " << r.ttft_seconds
+                  << ", \"total_seconds\": " << r.total_seconds
+                  << ", \"gbps\": " << gbps
+                  << ", \"peak_rss_bytes\": " << r.peak_rss_bytes;
+        if (!r.ok) {
+          std::cout << ", \"error\": \"" << bench::json_escape(r.err) << "\"";
+        }
+        std::cout << "}";
+      }
+    }
+  }
+
+  std::cout << "\n  ]\n}\n";
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,300 @@
+// SPDX-License-Identifier: MIT
+// Copyright 2023 - Present, Syoyo Fujita.
+//
+// Benchmark of merging a low-rank adapter(LoRA) at load time.
+//
+// Compares loading the base and the adapter followed by a separate
+// W += scale * B * A pass with the fused `load_with_lora`. Verifies that both
+// give the same weights and reports seconds in JSON.
+//
+// `overlap` compares the fused load with `num_threads` 1(merge on the
+// reading thread, `serial_seconds`) and the default(background merge): the
+// part of min(read, merge) hidden by overlapping them, where merge is
+// `serial_seconds` minus the plain load time. 0 means no overlap.
+//
+// $ bench_lora [--layers N] [--hidden N] [--rank N] [--dtype BF16|F16|F32]
+//     [--repeat N]
+//
+// Files are generated to `bench_lora_base.safetensors` and
+// `bench_lora_adapter.safetensors` and removed at exit.
+//
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+
+#if !defined(SAFETENSORS_CPP_NO_IMPLEMENTATION)
+#define SAFETENSORS_CPP_IMPLEMENTATION
+#endif
+#include "bench_util.hh"
+#include "synthetic.hh"
+
+namespace {
+
+const char *kBase = "bench_lora_base.safetensors";
+const char *kAdapter = "bench_lora_adapter.safetensors";
+const float kAlpha = 16.0f;
+
+float get_value(const uint8_t *p, safetensors::dtype dtype, size_t i) {
+  if (dtype == safetensors::dtype::kFLOAT32) {
+    float f;
+    memcpy(&f, p + i * 4, 4);
+    return f;
+  }
+  uint16_t h;
+  memcpy(&h, p + i * 2, 2);
+  return (dtype == safetensors::dtype::kBFLOAT16)
+             ? safetensors::bfloat16_to_float(h)
+             : safetensors::fp16_to_float(h);
+}
+
+void set_value(uint8_t *p, safetensors::dtype dtype, size_t i, float v) {
+  if (dtype == safetensors::dtype::kFLOAT32) {
+    memcpy(p + i * 4, &v, 4);
+    return;
+  }
+  uint16_t h = (dtype == safetensors::dtype::kBFLOAT16)
+                   ? safetensors::float_to_bfloat16(v)
+                   : safetensors::float_to_fp16(v);
+  memcpy(p + i * 2, &h, 2);
+}
+
+// Write tensors of `layout` filled with small random values.
+bool write_file(const std::string &filename,
+                const safetensors::safetensors_t &layout, uint32_t seed,
+                std::string *err) {
+  std::string warn;
+  safetensors::mmap_writer writer;
+  if (!writer.open(filename, layout, &warn, err)) {
+    return false;
+  }
+  std::mt19937 engine(seed);
+  std::uniform_real_distribution<float> dist(-0.05f, 0.05f);
+  for (size_t i = 0; i < layout.tensors.size(); i++) {
+    safetensors::tensor_t t;
+    layout.tensors.at(i, &t);
+    uint8_t *data{nullptr};
+    size_t nbytes{0};
+    if (!writer.get_tensor_data(layout.tensors.keys()[i], &data, &nbytes,
+                                err)) {
+      return false;
+    }
+    size_t n = safetensors::get_shape_size(t);
+    bool alpha = (t.shape.size() == 0);
+    for (size_t k = 0; k < n; k++) {
+      set_value(data, t.dtype, k, alpha ? kAlpha : dist(engine));
+    }
+  }
+  return writer.finalize(err);
+}
+
+bool generate(size_t layers, size_t hidden, size_t rank,
+              safetensors::dtype dtype, std::string *err) {
+  safetensors::safetensors_t base, adapter;
+  const char *projs[] = {"q_proj", "k_proj", "v_proj", "o_proj"};
+  for (size_t l = 0; l < layers; l++) {
+    std::string layer = "model.layers." + std::to_string(l);
+    safetensors::tensor_t norm;
+    norm.dtype = dtype;
+    norm.shape = {hidden};
+    base.tensors.insert(layer + ".input_layernorm.weight", norm);
+    for (const char *proj : projs) {
+      std::string stem = layer + ".self_attn." + proj;
+      safetensors::tensor_t w, a, b, alpha;
+      w.dtype = dtype;
+      w.shape = {hidden, hidden};
+      base.tensors.insert(stem + ".weight", w);
+
+      a.dtype = dtype;
+      a.shape = {rank, hidden};
+      b.dtype = dtype;
+      b.shape = {hidden, rank};
+      alpha.dtype = safetensors::dtype::kFLOAT32;
+      alpha.shape = {};
+      std::string prefix = "base_model.model." + stem;
+      adapter.tensors.insert(prefix + ".lora_A.weight", a);
+      adapter.tensors.insert(prefix + ".lora_B.weight", b);
+      adapter.tensors.insert(prefix + ".alpha", alpha);
+    }
+  }
+  return write_file(kBase, base, 1, err) &&
+         write_file(kAdapter, adapter, 2, err);
+}
+
+// Reference: load both, then merge in a separate pass. `read_seconds`
+// receives the time of the loads.
+bool run_separate(safetensors::safetensors_t *st, double *read_seconds,
+                  std::string *err) {
+  std::string warn;
+  safetensors::safetensors_t adapter;
+  auto t = std::chrono::steady_clock::now();
+  if (!safetensors::load_from_file(kBase, st, &warn, err) ||
+      !safetensors::load_from_file(kAdapter, &adapter, &warn, err)) {
+    return false;
+  }
+  (*read_seconds) = bench::seconds_since(t);
+  const std::string prefix = "base_model.model.";
+  const std::string suffix = ".lora_A.weight";
+  for (size_t i = 0; i < adapter.tensors.size(); i++) {
+    const std::string &name = adapter.tensors.keys()[i];
+    if ((name.size() < suffix.size()) ||
+        (name.compare(name.size() - suffix.size(), suffix.size(), suffix) !=
+         0)) {
+      continue;
+    }
+    std::string stem = name.substr(0, name.size() - suffix.size());
+    safetensors::tensor_t ta, tb, tw, talpha;
+    adapter.tensors.at(name, &ta);
+    adapter.tensors.at(stem + ".lora_B.weight", &tb);
+    adapter.tensors.at(stem + ".alpha", &talpha);
+    std::string wname = stem.substr(prefix.size()) + ".weight";
+    st->tensors.at(wname, &tw);
+
+    const uint8_t *a, *b, *alpha;
+    uint8_t *w;
+    size_t n;
+    safetensors::get_tensor_data(adapter, name, &a, &n);
+    safetensors::get_tensor_data(adapter, stem + ".lora_B.weight", &b, &n);
+    safetensors::get_tensor_data(adapter, stem + ".alpha", &alpha, &n);
+    safetensors::get_mutable_tensor_data(st, wname, &w, &n);
+
+    size_t rows = tw.shape[0], cols = tw.shape[1], rank = ta.shape[0];
+    float scale = get_value(alpha, talpha.dtype, 0) / float(rank);
+    for (size_t r = 0; r < rows; r++) {
+      for (size_t c = 0; c < cols; c++) {
+        float v = get_value(w, tw.dtype, r * cols + c);
+        for (size_t k = 0; k < rank; k++) {
+          v += scale * get_value(b, tb.dtype, r * rank + k) *
+               get_value(a, ta.dtype, k * cols + c);
+        }
+        set_value(w, tw.dtype, r * cols + c, v);
+      }
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  size_t layers = 4;
+  size_t hidden = 1024;
+  size_t rank = 16;
+  size_t repeat = 3;
+  safetensors::dtype dtype = safetensors::dtype::kBFLOAT16;
+
+  auto option = [&](const std::string &arg, const std::string &val) {
+    size_t n = bench::to_size(val);
+    if (arg == "--layers") {
+      layers = n;
+    } else if (arg == "--hidden") {
+      hidden = (std::max)(size_t(1), n);
+    } else if (arg == "--rank") {
+      rank = (std::max)(size_t(1), n);
+    } else if (arg == "--repeat") {
+      repeat = (std::max)(size_t(1), n);
+    } else if (arg == "--dtype") {
+      return synthetic::parse_dtype(val, &dtype) &&
+             ((dtype == safetensors::dtype::kBFLOAT16) ||
+              (dtype == safetensors::dtype::kFLOAT16) ||
+              (dtype == safetensors::dtype::kFLOAT32));
+    } else {
+      return false;
+    }
+    return true;
+  };
+  if (!bench::parse_args(argc, argv, nullptr, option)) {
+    return EXIT_FAILURE;
+  }
+
+  bench::temp_files temp;
+  temp.paths = {kBase, kAdapter};
+  std::string err;
+  if (!generate(layers, hidden, rank, dtype, &err)) {
+    std::cerr << "Failed to generate files: " << err << "\n";
+    return EXIT_FAILURE;
+  }
+
+  // Best of `repeat` runs.
+  double separate_seconds = 0.0, fused_seconds = 0.0;
+  double read_seconds = 0.0, serial_seconds = 0.0;
+  safetensors::safetensors_t ref, fused;
+  bool ok = true;
+  for (size_t k = 0; ok && (k < repeat); k++) {
+    ref = safetensors::safetensors_t();
+    fused = safetensors::safetensors_t();
+
+    auto t = std::chrono::steady_clock::now();
+    double read = 0.0;
+    ok = run_separate(&ref, &read, &err);
+    double s = bench::seconds_since(t);
+    separate_seconds = (k == 0) ? s : (std::min)(separate_seconds, s);
+    read_seconds = (k == 0) ? read : (std::min)(read_seconds, read);
+
+    std::string warn;
+    safetensors::lora_options serial;
+    serial.num_threads = 1;
+    safetensors::safetensors_t serial_st;
+    t = std::chrono::steady_clock::now();
+    ok = ok && safetensors::load_with_lora(kBase, kAdapter, serial,
+                                           &serial_st, &warn, &err);
+    s = bench::seconds_since(t);
+    serial_seconds = (k == 0) ? s : (std::min)(serial_seconds, s);
+
+    t = std::chrono::steady_clock::now();
+    ok = ok && safetensors::load_with_lora(kBase, kAdapter,
+                                           safetensors::lora_options(), &fused,
+                                           &warn, &err);
+    s = bench::seconds_since(t);
+    fused_seconds = (k == 0) ? s : (std::min)(fused_seconds, s);
+    ok = ok && (serial_st.storage == fused.storage);
+  }
+  if (!ok) {
+    std::cerr << "Load failed: " << err << "\n";
+  }
+
+  // Differences come from the summation order only. Allow 2 ulp of the
+  // storage dtype.
+  const float ulp = (dtype == safetensors::dtype::kBFLOAT16)  ? 1.0f / 128
+                    : (dtype == safetensors::dtype::kFLOAT16) ? 1.0f / 1024
+                                                              : 1e-6f;
+  size_t mismatches = 0;
+  double max_diff = 0.0;
+  for (size_t i = 0; ok && (i < ref.tensors.size()); i++) {
+    safetensors::tensor_t t;
+    ref.tensors.at(i, &t);
+    const uint8_t *x, *y;
+    size_t n;
+    safetensors::get_tensor_data(ref, ref.tensors.keys()[i], &x, &n);
+    safetensors::get_tensor_data(fused, ref.tensors.keys()[i], &y, &n);
+    for (size_t e = 0; e < safetensors::get_shape_size(t); e++) {
+      float a = get_value(x, t.dtype, e), b = get_value(y, t.dtype, e);
+      float d = std::fabs(a - b);
+      max_diff = (std::max)(max_diff, double(d));
+      if (d > 2.0f * ulp * (std::max)(std::fabs(a), 1e-3f)) {
+        mismatches++;
+      }
+    }
+  }
+  ok = ok && (mismatches == 0);
+
+  double merge_seconds = (std::max)(0.0, serial_seconds - read_seconds);
+  double shorter = (std::min)(read_seconds, merge_seconds);
+  double overlap =
+      (shorter > 0.0) ? (serial_seconds - fused_seconds) / shorter : 0.0;
+  overlap = (std::max)(0.0, (std::min)(1.0, overlap));
+
+  std::cout << "{\n  \"layers\": " << layers << ",\n  \"hidden\": " << hidden
+            << ",\n  \"rank\": " << rank << ",\n  \"dtype\": \""
+            << safetensors::get_dtype_str(dtype)
+            << "\",\n  \"separate_seconds\": " << separate_seconds
+            << ",\n  \"read_seconds\": " << read_seconds
+            << ",\n  \"serial_seconds\": " << serial_seconds
+            << ",\n  \"fused_seconds\": " << fused_seconds
+            << ",\n  \"overlap\": " << overlap
+            << ",\n  \"max_diff\": " << max_diff
+            << ",\n  \"mismatches\": " << mismatches
+            << ",\n";
+  return bench::finish(ok);
+}
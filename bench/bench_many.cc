@@ -0,0 +1,142 @@
+// SPDX-License-Identifier: MIT
+// Copyright 2023 - Present, Syoyo Fujita.
+//
+// Benchmark of loading many small files(e.g. LoRA adapters).
+//
+// Compares `load_from_file` one by one with `load_many`(single thread and
+// thread pool) and reports files/sec in JSON.
+//
+// $ bench_many [--files N] [--tensors N] [--bytes N] [--threads N]
+//     [--repeat N]
+//
+// Files are generated to `bench_many_<index>.safetensors` and removed at
+// exit.
+//
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+
+#if !defined(SAFETENSORS_CPP_NO_IMPLEMENTATION)
+#define SAFETENSORS_CPP_IMPLEMENTATION
+#endif
+#include "bench_util.hh"
+#include "synthetic.hh"
+
+namespace {
+
+struct result {
+  const char *mode;
+  double seconds{0.0};
+  size_t failed{0};
+};
+
+result run_load_from_file(const std::vector<std::string> &paths) {
+  result r;
+  r.mode = "load_from_file";
+  // Keep every file loaded, as `load_many` does.
+  std::vector<safetensors::safetensors_t> files(paths.size());
+  auto t = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < paths.size(); i++) {
+    std::string warn, err;
+    if (!safetensors::load_from_file(paths[i], &files[i], &warn, &err)) {
+      r.failed++;
+    }
+  }
+  r.seconds = bench::seconds_since(t);
+  return r;
+}
+
+// `lr` is kept across runs to reuse the arena, as a server reloading the
+// same set of adapters would.
+result run_load_many(const char *mode, const std::vector<std::string> &paths,
+                     size_t num_threads, safetensors::load_many_result *lr) {
+  result r;
+  r.mode = mode;
+  safetensors::load_many_options options;
+  options.num_threads = num_threads;
+  std::string warn, err;
+  safetensors::load_many(paths, options, lr, &warn, &err);
+  r.seconds = lr->seconds;
+  r.failed = lr->num_failed;
+  return r;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  size_t num_files = 1000;
+  size_t num_threads = 0;
+  size_t repeat = 3;
+  synthetic::config cfg;
+  cfg.num_tensors = 8;
+  cfg.tensor_bytes = 8 * 1024;
+
+  auto option = [&](const std::string &arg, const std::string &val) {
+    size_t n = bench::to_size(val);
+    if (arg == "--files") {
+      num_files = n;
+    } else if (arg == "--tensors") {
+      cfg.num_tensors = n;
+    } else if (arg == "--bytes") {
+      cfg.tensor_bytes = n;
+    } else if (arg == "--threads") {
+      num_threads = n;
+    } else if (arg == "--repeat") {
+      repeat = (std::max)(size_t(1), n);
+    } else {
+      return false;
+    }
+    return true;
+  };
+  if (!bench::parse_args(argc, argv, nullptr, option)) {
+    return EXIT_FAILURE;
+  }
+
+  bench::temp_files files;
+  std::vector<std::string> paths;
+  for (size_t i = 0; i < num_files; i++) {
+    char name[64];
+    snprintf(name, sizeof(name), "bench_many_%05zu.safetensors", i);
+    synthetic::config c = cfg;
+    c.seed = uint32_t(i);
+    std::string err;
+    if (!synthetic::generate(name, c, &err)) {
+      std::cerr << "Failed to generate synthetic file: " << err << "\n";
+      return EXIT_FAILURE;
+    }
+    paths.push_back(files.add(name));
+  }
+
+  // Best of `repeat` runs(page cache is warm after the first run).
+  std::vector<result> results;
+  safetensors::load_many_result lr[2];
+  for (size_t k = 0; k < repeat; k++) {
+    result rs[] = {run_load_from_file(paths),
+                   run_load_many("load_many_1thread", paths, 1, &lr[0]),
+                   run_load_many("load_many", paths, num_threads, &lr[1])};
+    for (size_t m = 0; m < sizeof(rs) / sizeof(rs[0]); m++) {
+      if (k == 0) {
+        results.push_back(rs[m]);
+      } else if (rs[m].seconds < results[m].seconds) {
+        results[m] = rs[m];
+      }
+    }
+  }
+
+  bool ok = true;
+  std::cout << "{\n  \"files\": " << num_files
+            << ",\n  \"tensors_per_file\": " << cfg.num_tensors
+            << ",\n  \"results\": [\n";
+  for (size_t m = 0; m < results.size(); m++) {
+    const result &r = results[m];
+    ok = ok && (r.failed == 0);
+    std::cout << "    {\"mode\": \"" << r.mode << "\", \"seconds\": "
+              << r.seconds << ", \"files_per_second\": "
+              << ((r.seconds > 0.0) ? (double(num_files) / r.seconds) : 0.0)
+              << ", \"failed\": " << r.failed << "}"
+              << ((m + 1 < results.size()) ? "," : "") << "\n";
+  }
+  std::cout << "  ],\n";
+  return bench::finish(ok);
+}
@@ -0,0 +1,562 @@
+// SPDX-License-Identifier: MIT
+// Copyright 2023 - Present, Syoyo Fujita.
+//
+// Peak-memory regression harness.
+//
+// Runs each load/save mode in a child process and records
+//
+//   - peak RSS(ru_maxrss) growth during the mode
+//   - RSS, anonymous and file-backed memory growth(/proc/self/smaps_rollup)
+//   - page cache growth(`Cached` in /proc/meminfo. System-wide, so noisy)
+//
+// relative to the state just before the mode runs, and checks them against
+// the expected bound of each mode(a multiple of the file size plus a fixed
+// slack). Exits with failure when any mode exceeds its bound, so it can be
+// used as a regression test. `mmap_copy_on_write` also fails when writes
+// through the mapping reach the file or are missing from `save_to_file` of
+// the mapping.
+//
+// $ bench_memory [file.safetensors] [--slack BYTES] [gen_synthetic options]
+//
+// When no file is given, a synthetic file is generated to
+// `bench_memory.safetensors`.
+//
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+
+#if !defined(SAFETENSORS_CPP_NO_IMPLEMENTATION)
+#define SAFETENSORS_CPP_IMPLEMENTATION
+#endif
+#include "bench_util.hh"
+#include "synthetic.hh"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define BENCH_USE_FORK
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+struct mem_sample {
+  uint64_t peak_rss{0};
+  uint64_t rss{0};
+  uint64_t anon{0};
+  uint64_t file{0};
+  uint64_t page_cache{0};
+};
+
+struct run_result {
+  int ok{0};
+  int has_smaps{0};
+  mem_sample before;
+  mem_sample after;
+  char err[256]{};
+};
+
+// Expected upper bound of growth: `ratio` * file size + slack.
+// Negative ratio disables the check.
+struct bound {
+  double peak_rss;
+  double anon;
+};
+
+typedef bool (*mode_fn)(const std::string &filename, run_result *r,
+                        std::string *err);
+
+// Read `<key>: <value> kB` lines.
+bool read_kb_fields(const char *path, const char *const *keys, size_t nkeys,
+                    uint64_t *values) {
+  std::ifstream ifs(path);
+  if (!ifs) {
+    return false;
+  }
+  std::string line;
+  while (std::getline(ifs, line)) {
+    for (size_t k = 0; k < nkeys; k++) {
+      std::string prefix = std::string(keys[k]) + ":";
+      if (line.compare(0, prefix.size(), prefix) == 0) {
+        values[k] =
+            std::strtoull(line.c_str() + prefix.size(), nullptr, 10) * 1024;
+      }
+    }
+  }
+  return true;
+}
+
+bool sample_memory(mem_sample *s) {
+  s->peak_rss = bench::get_peak_rss_bytes();
+
+  const char *const kMemInfoKeys[] = {"Cached"};
+  read_kb_fields("/proc/meminfo", kMemInfoKeys, 1, &s->page_cache);
+
+  const char *const kSmapsKeys[] = {"Rss", "Anonymous"};
+  uint64_t v[2] = {0, 0};
+  if (!read_kb_fields("/proc/self/smaps_rollup", kSmapsKeys, 2, v)) {
+    s->rss = s->anon = s->file = 0;
+    return false;
+  }
+  s->rss = v[0];
+  s->anon = v[1];
+  s->file = (v[0] > v[1]) ? (v[0] - v[1]) : 0;
+  return true;
+}
+
+volatile uint64_t g_sink;
+
+// Read one byte per page of every tensor.
+bool touch_tensors(const safetensors::safetensors_t &st, std::string *err) {
+  uint64_t sum = 0;
+  for (size_t i = 0; i < st.tensors.size(); i++) {
+    const uint8_t *data{nullptr};
+    size_t nbytes{0};
+    if (!safetensors::get_tensor_data(st, st.tensors.keys()[i], &data,
+                                      &nbytes, err)) {
+      return false;
+    }
+    for (size_t k = 0; k < nbytes; k += 4096) {
+      sum += data[k];
+    }
+  }
+  g_sink = sum;
+  return true;
+}
+
+// Write one byte per page of every tensor.
+bool dirty_tensors(safetensors::safetensors_t *st, std::string *err) {
+  for (size_t i = 0; i < st->tensors.size(); i++) {
+    uint8_t *data{nullptr};
+    size_t nbytes{0};
+    if (!safetensors::get_mutable_tensor_data(st, st->tensors.keys()[i],
+                                              &data, &nbytes, err)) {
+      return false;
+    }
+    for (size_t k = 0; k < nbytes; k += 4096) {
+      data[k] = uint8_t(data[k] + 1);
+    }
+  }
+  return true;
+}
+
+bool run_load_from_file(const std::string &filename, run_result *r,
+                        std::string *err) {
+  sample_memory(&r->before);
+  std::string warn;
+  safetensors::safetensors_t st;
+  if (!safetensors::load_from_file(filename, &st, &warn, err)) {
+    return false;
+  }
+  bool ret = touch_tensors(st, err);
+  r->has_smaps = sample_memory(&r->after);
+  return ret;
+}
+
+// The input buffer is allocated before the measurement.
+bool run_load_from_memory(const std::string &filename, run_result *r,
+                          std::string *err) {
+  std::vector<uint8_t> data;
+  {
+    std::ifstream ifs(filename, std::ios::binary | std::ios::ate);
+    if (!ifs) {
+      (*err) += "Failed to open " + filename + "\n";
+      return false;
+    }
+    data.resize(size_t(ifs.tellg()));
+    ifs.seekg(0);
+    ifs.read(reinterpret_cast<char *>(data.data()),
+             std::streamsize(data.size()));
+  }
+
+  sample_memory(&r->before);
+  std::string warn;
+  safetensors::safetensors_t st;
+  if (!safetensors::load_from_memory(data.data(), data.size(), filename, &st,
+                                     &warn, err)) {
+    return false;
+  }
+  bool ret = touch_tensors(st, err);
+  r->has_smaps = sample_memory(&r->after);
+  return ret;
+}
+
+bool run_mmap_from_file(const std::string &filename, run_result *r,
+                        std::string *err) {
+  sample_memory(&r->before);
+  std::string warn;
+  safetensors::safetensors_t st;
+  if (!safetensors::mmap_from_file(filename, &st, &warn, err)) {
+    return false;
+  }
+  bool ret = touch_tensors(st, err);
+  r->has_smaps = sample_memory(&r->after);
+  return ret;
+}
+
+// Checksum of each tensor.
+std::vector<uint64_t> tensor_checksums(const safetensors::safetensors_t &st) {
+  std::vector<uint64_t> sums;
+  for (size_t i = 0; i < st.tensors.size(); i++) {
+    const uint8_t *data{nullptr};
+    size_t nbytes{0};
+    safetensors::get_tensor_data(st, st.tensors.keys()[i], &data, &nbytes);
+    sums.push_back(bench::checksum(data, nbytes));
+  }
+  return sums;
+}
+
+// Checksums of the tensors in `filename`.
+bool file_checksums(const std::string &filename, std::vector<uint64_t> *sums,
+                    std::string *err) {
+  std::string warn;
+  safetensors::safetensors_t st;
+  if (!safetensors::mmap_from_file(filename, &st, &warn, err)) {
+    return false;
+  }
+  (*sums) = tensor_checksums(st);
+  return true;
+}
+
+std::string output_filename(const std::string &filename) {
+  return filename + ".out";
+}
+
+// Modify every page, so all pages are duplicated to anonymous memory.
+// After the measurement, checks that the file is unchanged and that
+// `save_to_file` of the modified mapping writes the modification.
+bool run_mmap_copy_on_write(const std::string &filename, run_result *r,
+                            std::string *err) {
+  sample_memory(&r->before);
+  std::string warn;
+  safetensors::safetensors_t st;
+  if (!safetensors::mmap_from_file(filename, &st, &warn, err,
+                                   safetensors::kMMAP_COPY_ON_WRITE)) {
+    return false;
+  }
+  std::vector<uint64_t> original = tensor_checksums(st);
+  bool ret = dirty_tensors(&st, err);
+  r->has_smaps = sample_memory(&r->after);
+  if (!ret) {
+    return false;
+  }
+
+  std::vector<uint64_t> modified = tensor_checksums(st), on_disk, saved;
+  for (size_t i = 0; i < modified.size(); i++) {
+    const uint8_t *data{nullptr};
+    size_t nbytes{0};
+    safetensors::get_tensor_data(st, st.tensors.keys()[i], &data, &nbytes);
+    if (nbytes && (modified[i] == original[i])) {
+      (*err) += "Writes through the copy-on-write mapping are not visible.\n";
+      return false;
+    }
+  }
+  if (!file_checksums(filename, &on_disk, err)) {
+    return false;
+  }
+  if (on_disk != original) {
+    (*err) += "Writes through the copy-on-write mapping reached the file.\n";
+    return false;
+  }
+  const std::string out = output_filename(filename);
+  ret = safetensors::save_to_file(st, out, &warn, err) &&
+        file_checksums(out, &saved, err);
+  std::remove(out.c_str());
+  if (ret && (saved != modified)) {
+    (*err) += "save_to_file of the copy-on-write mapping lost the writes.\n";
+    ret = false;
+  }
+  return ret;
+}
+
+// mmap + prefetcher(one group per tensor, lookahead 8).
+bool run_mmap_prefetch(const std::string &filename, run_result *r,
+                       std::string *err) {
+  sample_memory(&r->before);
+  std::string warn;
+  safetensors::safetensors_t st;
+  if (!safetensors::mmap_from_file(filename, &st, &warn, err)) {
+    return false;
+  }
+
+  std::vector<std::vector<std::string>> groups;
+  for (size_t i = 0; i < st.tensors.size(); i++) {
+    groups.push_back({st.tensors.keys()[i]});
+  }
+
+  safetensors::prefetcher pf;
+  if (!pf.init(st, groups, 8, err)) {
+    return false;
+  }
+
+  uint64_t sum = 0;
+  for (size_t g = 0; g < groups.size(); g++) {
+    pf.acquire(g);
+    const uint8_t *data{nullptr};
+    size_t nbytes{0};
+    safetensors::get_tensor_data(st, groups[g][0], &data, &nbytes);
+    for (size_t k = 0; k < nbytes; k += 4096) {
+      sum += data[k];
+    }
+    pf.release(g);
+  }
+  g_sink = sum;
+  r->has_smaps = sample_memory(&r->after);
+  return true;
+}
+
+// Source `safetensors_t` for save modes. Mapped and faulted in before the
+// measurement.
+bool open_source(const std::string &filename, safetensors::safetensors_t *st,
+                 std::string *err) {
+  std::string warn;
+  if (!safetensors::mmap_from_file(filename, st, &warn, err)) {
+    return false;
+  }
+  return touch_tensors(*st, err);
+}
+
+bool run_save_to_memory(const std::string &filename, run_result *r,
+                        std::string *err) {
+  safetensors::safetensors_t st;
+  if (!open_source(filename, &st, err)) {
+    return false;
+  }
+
+  sample_memory(&r->before);
+  std::string warn;
+  std::vector<uint8_t> buf;
+  if (!safetensors::save_to_memory(st, &buf, &warn, err)) {
+    return false;
+  }
+  r->has_smaps = sample_memory(&r->after);
+  return true;
+}
+
+bool run_save_to_file(const std::string &filename, run_result *r,
+                      std::string *err) {
+  safetensors::safetensors_t st;
+  if (!open_source(filename, &st, err)) {
+    return false;
+  }
+
+  sample_memory(&r->before);
+  std::string warn;
+  bool ret = safetensors::save_to_file(st, output_filename(filename), &warn,
+                                       err);
+  r->has_smaps = sample_memory(&r->after);
+  std::remove(output_filename(filename).c_str());
+  return ret;
+}
+
+bool run_mmap_writer(const std::string &filename, run_result *r,
+                     std::string *err) {
+  safetensors::safetensors_t st;
+  if (!open_source(filename, &st, err)) {
+    return false;
+  }
+
+  sample_memory(&r->before);
+  std::string warn;
+  bool ret = false;
+  {
+    safetensors::mmap_writer writer;
+    if (writer.open(output_filename(filename), st, &warn, err)) {
+      ret = true;
+      for (size_t i = 0; ret && (i < st.tensors.size()); i++) {
+        const std::string &name = st.tensors.keys()[i];
+        const uint8_t *src{nullptr};
+        uint8_t *dst{nullptr};
+        size_t src_bytes{0}, dst_bytes{0};
+        ret = safetensors::get_tensor_data(st, name, &src, &src_bytes, err) &&
+              writer.get_tensor_data(name, &dst, &dst_bytes, err) &&
+              (src_bytes == dst_bytes);
+        if (ret) {
+          memcpy(dst, src, src_bytes);
+        }
+      }
+      ret = ret && writer.finalize(err);
+    }
+    r->has_smaps = sample_memory(&r->after);
+  }
+  std::remove(output_filename(filename).c_str());
+  return ret;
+}
+
+struct mode_entry {
+  const char *name;
+  mode_fn fn;
+  bound expected;
+};
+
+// Expected growth relative to the file size.
+// - load_from_file reads tensor data directly into `storage`.
+// - mmap_from_file/mmap_prefetch map the whole file with MAP_POPULATE, so
+//   the peak includes every file page. Anonymous memory must not grow.
+// - mmap_copy_on_write: modified pages are replaced by anonymous copies.
+//   Fails when the writes reach the file or are not saved by
+//   `save_to_file`.
+// - save_to_file serializes to memory first.
+// - mmap_writer writes through a shared file mapping.
+const mode_entry kModes[] = {
+    {"load_from_file", run_load_from_file, {1.05, 1.05}},
+    {"load_from_memory", run_load_from_memory, {1.05, 1.05}},
+    {"mmap_from_file", run_mmap_from_file, {1.05, 0.0}},
+    {"mmap_copy_on_write", run_mmap_copy_on_write, {1.05, 1.05}},
+    {"mmap_prefetch", run_mmap_prefetch, {1.05, 0.0}},
+    {"save_to_memory", run_save_to_memory, {1.05, 1.05}},
+    {"save_to_file", run_save_to_file, {1.05, 1.05}},
+    {"mmap_writer", run_mmap_writer, {1.05, 0.0}},
+};
+
+void run_mode(const mode_entry &m, const std::string &filename,
+              run_result *r) {
+  std::string err;
+  if (m.fn(filename, r, &err)) {
+    r->ok = 1;
+  }
+  snprintf(r->err, sizeof(r->err), "%s", err.c_str());
+}
+
+// Run in a child process to isolate peak RSS.
+void run_isolated(const mode_entry &m, const std::string &filename,
+                  run_result *r) {
+#if defined(BENCH_USE_FORK)
+  int fds[2];
+  if (pipe(fds) != 0) {
+    snprintf(r->err, sizeof(r->err), "pipe failed");
+    return;
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(fds[0]);
+    run_result cr;
+    run_mode(m, filename, &cr);
+    ssize_t n = write(fds[1], &cr, sizeof(cr));
+    close(fds[1]);
+    _exit(n == ssize_t(sizeof(cr)) ? 0 : 1);
+  }
+  close(fds[1]);
+  ssize_t n = read(fds[0], r, sizeof(*r));
+  close(fds[0]);
+  int status = 0;
+  waitpid(pid, &status, 0);
+  if (n != ssize_t(sizeof(*r))) {
+    *r = run_result();
+    snprintf(r->err, sizeof(r->err), "child process failed");
+  }
+#else
+  run_mode(m, filename, r);
+#endif
+}
+
+int64_t growth(uint64_t before, uint64_t after) {
+  return int64_t(after) - int64_t(before);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  std::string filename;
+  uint64_t slack = 16 * 1024 * 1024;
+  synthetic::config cfg;
+  cfg.num_tensors = 256;
+  cfg.tensor_bytes = 1024 * 1024;
+
+  std::vector<std::string> positional;
+  std::string err;
+  auto option = [&](const std::string &arg, const std::string &val) {
+    if (arg == "--slack") {
+      slack = std::strtoull(val.c_str(), nullptr, 10);
+      return true;
+    }
+    return synthetic::apply_option(arg, val, &cfg, &err);
+  };
+  if (!bench::parse_args(argc, argv, &positional, option) ||
+      !err.empty()) {
+    std::cerr << err;
+    return EXIT_FAILURE;
+  }
+  if (!positional.empty()) {
+    filename = positional.back();
+  }
+
+  if (filename.empty()) {
+    filename = "bench_memory.safetensors";
+    if (!synthetic::generate(filename, cfg, &err)) {
+      std::cerr << "Failed to generate synthetic file: " << err << "\n";
+      return EXIT_FAILURE;
+    }
+  }
+
+  uint64_t file_bytes{0};
+  {
+    safetensors::safetensors_t st;
+    std::string warn;
+    if (!safetensors::mmap_from_file(filename, &st, &warn, &err)) {
+      std::cerr << "Failed to open " << filename << ": " << err << "\n";
+      return EXIT_FAILURE;
+    }
+    file_bytes = st.mmap_size;
+  }
+
+  std::cout << "{\n";
+  std::cout << "  \"file\": \"" << bench::json_escape(filename) << "\",\n";
+  std::cout << "  \"file_bytes\": " << file_bytes << ",\n";
+  std::cout << "  \"slack_bytes\": " << slack << ",\n";
+  std::cout << "  \"results\": [";
+
+  bool all_pass = true;
+  bool first = true;
+  for (const mode_entry &m : kModes) {
+    run_result r;
+    run_isolated(m, filename, &r);
+
+    // ru_maxrss is the high-water mark of the process. Growth is measured
+    // from the RSS just before the mode(fall back to the previous peak).
+    uint64_t base_rss = r.has_smaps ? r.before.rss : r.before.peak_rss;
+    int64_t peak_growth = growth(base_rss, r.after.peak_rss);
+    int64_t anon_growth = growth(r.before.anon, r.after.anon);
+
+    uint64_t peak_limit =
+        uint64_t(m.expected.peak_rss * double(file_bytes)) + slack;
+    uint64_t anon_limit =
+        uint64_t(m.expected.anon * double(file_bytes)) + slack;
+
+    bool pass = r.ok != 0;
+    if ((m.expected.peak_rss >= 0.0) && (peak_growth > int64_t(peak_limit))) {
+      pass = false;
+    }
+    if (r.has_smaps && (m.expected.anon >= 0.0) &&
+        (anon_growth > int64_t(anon_limit))) {
+      pass = false;
+    }
+    all_pass = all_pass && pass;
+
+    std::cout << (first ? "\n" : ",\n");
+    first = false;
+    std::cout << "    {\"mode\": \"" << m.name
+              << "\", \"ok\": " << (r.ok ? "true" : "false")
+              << ", \"pass\": " << (pass ? "true" : "false")
+              << ", \"peak_rss_growth\": " << peak_growth
+              << ", \"peak_rss_limit\": " << peak_limit
+              << ", \"peak_rss_ratio\": "
+              << double(peak_growth) / double(file_bytes);
+    if (r.has_smaps) {
+      std::cout << ", \"rss_growth\": " << growth(r.before.rss, r.after.rss)
+                << ", \"anon_growth\": " << anon_growth
+                << ", \"anon_limit\": " << anon_limit
+                << ", \"file_growth\": "
+                << growth(r.before.file, r.after.file)
+                << ", \"page_cache_growth\": "
+                << growth(r.before.page_cache, r.after.page_cache);
+    }
+    if (!r.ok) {
+      std::cout << ", \"error\": \"" << bench::json_escape(r.err) << "\"";
+    }
+    std::cout << "}";
+  }
+
+  std::cout << "\n  ],\n";
+  return bench::finish(all_pass);
+}
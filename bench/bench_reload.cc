@@ -0,0 +1,238 @@
+// SPDX-License-Identifier: MIT
+// Copyright 2023 - Present, Syoyo Fujita.
+//
+// Benchmark of checkpoint rotation(`reload_into`).
+//
+// Loads a synthetic model with `load_from_file`, then reloads checkpoints of
+// the same tensors into it: one with the same data layout(read at once) and
+// one with the tensors stored in reverse order(read tensor by tensor).
+// Verifies that data pointers stay the same and that the tensor bytes and
+// metadata are those of the reloaded file. Checkpoints whose header does not
+// match(a changed shape, an extra tensor, a renamed tensor) must fail and
+// leave the loaded model unmodified. Reports seconds of `reload_into` and of
+// a fresh `load_from_file` in JSON.
+//
+// $ bench_reload [--tensors N] [--bytes N] [--repeat N]
+//
+// Files are generated to `bench_reload_*.safetensors` and removed at exit.
+//
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+
+#if !defined(SAFETENSORS_CPP_NO_IMPLEMENTATION)
+#define SAFETENSORS_CPP_IMPLEMENTATION
+#endif
+#include "bench_util.hh"
+#include "synthetic.hh"
+
+namespace {
+
+const char *kBase = "bench_reload_base.safetensors";
+const char *kSame = "bench_reload_same.safetensors";
+const char *kPermuted = "bench_reload_permuted.safetensors";
+const char *kMismatch = "bench_reload_mismatch.safetensors";
+
+std::string weight(size_t i) {
+  return "layers." + std::to_string(i) + ".weight";
+}
+
+// `num_tensors` F32 tensors of slightly different sizes filled with random
+// bytes. With `reversed`, the data of the last tensor comes first.
+void make_model(size_t num_tensors, size_t tensor_bytes, uint64_t seed,
+                bool reversed, safetensors::safetensors_t *st) {
+  std::vector<size_t> counts(num_tensors);
+  size_t total = 0;
+  for (size_t i = 0; i < num_tensors; i++) {
+    counts[i] = tensor_bytes / 4 + i * 16;
+    total += counts[i] * 4;
+  }
+  st->storage.resize(total);
+  size_t offset = 0;
+  for (size_t k = 0; k < num_tensors; k++) {
+    size_t i = reversed ? (num_tensors - 1 - k) : k;
+    safetensors::tensor_t t;
+    t.dtype = safetensors::dtype::kFLOAT32;
+    t.shape = {counts[i]};
+    t.data_offsets = {{offset, offset + counts[i] * 4}};
+    offset += counts[i] * 4;
+    st->tensors.insert(weight(i), t);
+  }
+  synthetic::fill_random(st->storage.data(), total, seed);
+  st->metadata.insert("step", std::to_string(seed));
+}
+
+// Data pointer of each tensor in `st`.
+std::vector<const uint8_t *> data_pointers(
+    const safetensors::safetensors_t &st) {
+  std::vector<const uint8_t *> ptrs;
+  for (const std::string &name : st.tensors.keys()) {
+    const uint8_t *data{nullptr};
+    size_t nbytes{0};
+    safetensors::get_tensor_data(st, name, &data, &nbytes);
+    ptrs.push_back(data);
+  }
+  return ptrs;
+}
+
+// Tensors of `st` have the bytes of `ref`(looked up by name) and the same
+// metadata.
+bool same_data(const safetensors::safetensors_t &st,
+               const safetensors::safetensors_t &ref, std::string *err) {
+  for (const std::string &name : st.tensors.keys()) {
+    const uint8_t *p{nullptr}, *q{nullptr};
+    size_t n{0}, m{0};
+    if (!safetensors::get_tensor_data(st, name, &p, &n) ||
+        !safetensors::get_tensor_data(ref, name, &q, &m) || (n != m) ||
+        (memcmp(p, q, n) != 0)) {
+      (*err) += "tensor `" + name + "` differs\n";
+      return false;
+    }
+  }
+  std::string x, y;
+  if (!st.metadata.at("step", &x) || !ref.metadata.at("step", &y) ||
+      (x != y)) {
+    (*err) += "metadata differs\n";
+    return false;
+  }
+  return true;
+}
+
+// Reload `filename`(saved from `ref`) into `st`. Checks that pointers are
+// unchanged and the data is that of `ref`.
+double time_reload(const char *filename, const safetensors::safetensors_t &ref,
+                   size_t repeat, safetensors::safetensors_t *st,
+                   std::string *err) {
+  std::string warn;
+  const uint8_t *storage = st->storage.data();
+  std::vector<const uint8_t *> ptrs = data_pointers(*st);
+  double seconds = bench::best_of(repeat, [&]() {
+    return safetensors::reload_into(st, filename, &warn, err);
+  });
+  if (seconds < 0.0) {
+    return -1.0;
+  }
+  if ((st->storage.data() != storage) || (data_pointers(*st) != ptrs)) {
+    (*err) += std::string(filename) + ": data pointers changed\n";
+    return -1.0;
+  }
+  if (!same_data(*st, ref, err)) {
+    return -1.0;
+  }
+  return seconds;
+}
+
+// Headers that do not match `base` must be rejected without touching `st`.
+bool check_mismatch(const safetensors::safetensors_t &base,
+                    safetensors::safetensors_t *st, std::string *err) {
+  const size_t n = base.tensors.size();
+  std::vector<safetensors::safetensors_t> inputs(3, base);
+  // Shape of the last tensor(validated after all others).
+  safetensors::tensor_t t;
+  inputs[0].tensors.at(n - 1, &t);
+  t.shape = {1, t.shape[0]};
+  inputs[0].tensors.insert(weight(n - 1), t);
+  // Extra tensor.
+  const size_t size = inputs[1].storage.size();
+  t.data_offsets = {{size, size + 16}};
+  t.shape = {4};
+  inputs[1].tensors.insert("extra.weight", t);
+  inputs[1].storage.resize(size + 16);
+  // Renamed tensor.
+  inputs[2].tensors.at(n - 1, &t);
+  inputs[2].tensors.erase(weight(n - 1));
+  inputs[2].tensors.insert("renamed.weight", t);
+
+  const std::vector<uint8_t> storage = st->storage;
+  const uint8_t *storage_addr = st->storage.data();
+  const std::vector<std::string> keys = st->tensors.keys();
+  const std::vector<const uint8_t *> ptrs = data_pointers(*st);
+  std::string step;
+  st->metadata.at("step", &step);
+  for (size_t i = 0; i < inputs.size(); i++) {
+    inputs[i].metadata.insert("step", "mismatch");
+    std::string warn, e;
+    if (!safetensors::save_to_file(inputs[i], kMismatch, &warn, err)) {
+      return false;
+    }
+    bool reloaded = safetensors::reload_into(st, kMismatch, &warn, &e);
+    std::string s;
+    if (reloaded || e.empty() || (st->storage.data() != storage_addr) ||
+        (st->storage != storage) || (st->tensors.keys() != keys) ||
+        (data_pointers(*st) != ptrs) || !st->metadata.at("step", &s) ||
+        (s != step)) {
+      (*err) += "mismatched header " + std::to_string(i) +
+                " was accepted or modified the model\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  size_t num_tensors = 64;
+  size_t tensor_bytes = 1024 * 1024;
+  size_t repeat = 3;
+
+  auto option = [&](const std::string &arg, const std::string &val) {
+    size_t n = bench::to_size(val);
+    if (arg == "--tensors") {
+      num_tensors = (std::max)(size_t(2), n);
+    } else if (arg == "--bytes") {
+      tensor_bytes = (std::max)(size_t(64), n);
+    } else if (arg == "--repeat") {
+      repeat = (std::max)(size_t(1), n);
+    } else {
+      return false;
+    }
+    return true;
+  };
+  if (!bench::parse_args(argc, argv, nullptr, option)) {
+    return EXIT_FAILURE;
+  }
+
+  bench::temp_files temp;
+  temp.paths = {kBase, kSame, kPermuted, kMismatch};
+
+  safetensors::safetensors_t base, same, permuted;
+  make_model(num_tensors, tensor_bytes, 1, false, &base);
+  make_model(num_tensors, tensor_bytes, 2, false, &same);
+  make_model(num_tensors, tensor_bytes, 3, true, &permuted);
+
+  std::string warn, err;
+  safetensors::safetensors_t st;
+  if (!safetensors::save_to_file(base, kBase, &warn, &err) ||
+      !safetensors::save_to_file(same, kSame, &warn, &err) ||
+      !safetensors::save_to_file(permuted, kPermuted, &warn, &err) ||
+      !safetensors::load_from_file(kBase, &st, &warn, &err)) {
+    std::cerr << "Failed to generate the models: " << err;
+    return EXIT_FAILURE;
+  }
+
+  double load_seconds = bench::best_of(repeat, [&]() {
+    safetensors::safetensors_t fresh;
+    return safetensors::load_from_file(kSame, &fresh, &warn, &err);
+  });
+  double same_seconds = time_reload(kSame, same, repeat, &st, &err);
+  double permuted_seconds =
+      time_reload(kPermuted, permuted, repeat, &st, &err);
+  bool reload_ok = (same_seconds >= 0.0) && (permuted_seconds >= 0.0);
+  bool mismatch_ok = reload_ok && check_mismatch(permuted, &st, &err);
+  if (!reload_ok || !mismatch_ok) {
+    std::cerr << err;
+  }
+
+  std::cout << "{\n  \"tensors\": " << num_tensors
+            << ",\n  \"bytes\": " << base.storage.size()
+            << ",\n  \"load_seconds\": " << load_seconds
+            << ",\n  \"reload_same_layout_seconds\": " << same_seconds
+            << ",\n  \"reload_permuted_seconds\": " << permuted_seconds
+            << ",\n  \"reloaded_in_place\": "
+            << (reload_ok ? "true" : "false")
+            << ",\n  \"mismatch_rejected\": "
+            << (mismatch_ok ? "true" : "false") << ",\n";
+  return bench::finish(reload_ok && mismatch_ok);
+}
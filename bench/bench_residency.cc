@@ -0,0 +1,363 @@
+// SPDX-License-Identifier: MIT
+// Copyright 2023 - Present, Syoyo Fujita.
+//
+// `residency_report` harness(Linux only).
+//
+// 1. Exact residency: a safetensors image is copied to anonymous memory at
+//    an offset that makes the first(64 bytes) tensor span a page boundary,
+//    and opened with `mmap_from_memory`. Pages of some tensors are dropped
+//    with madvise(MADV_DONTNEED)(only pages fully covered by the tensor, as
+//    `prefetcher` does) and some of those are read again. Anonymous memory
+//    has no readahead, so the per-tensor `resident_pages`, the read/layout
+//    amplification and the unused resident pages of the report must equal
+//    the expected page states exactly.
+// 2. File mapping: `mmap_from_file` of a synthetic file must report every
+//    tensor resident(the mapping is prefetched). Then the file is dropped
+//    from the page cache, mapped without prefetch and every `--stride`-th
+//    tensor is read. Read tensors must be resident, and the readahead
+//    figures(unused resident pages, read amplification) must be consistent
+//    with the page counts. Reports them in JSON.
+//
+// $ bench_residency [--stride N] [--tensors N] [--bytes N] [--dist ...]
+//
+// The file is generated to `bench_residency.safetensors` and removed at
+// exit.
+//
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+
+#if !defined(SAFETENSORS_CPP_NO_IMPLEMENTATION)
+#define SAFETENSORS_CPP_IMPLEMENTATION
+#endif
+#include "bench_util.hh"
+#include "synthetic.hh"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace {
+
+const char *kFile = "bench_residency.safetensors";
+
+// Anonymous read-write mapping. Unmapped at scope exit.
+struct anon_mapping {
+  uint8_t *addr{nullptr};
+  size_t size{0};
+
+  bool map(size_t n) {
+    void *p = mmap(nullptr, n, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+      return false;
+    }
+    addr = reinterpret_cast<uint8_t *>(p);
+    size = n;
+    // A huge zero page would make reads of dropped pages fault in their
+    // neighbors.
+    madvise(p, n, MADV_NOHUGEPAGE);
+    return true;
+  }
+
+  ~anon_mapping() {
+    if (addr) {
+      munmap(addr, size);
+    }
+  }
+};
+
+// Read every byte of tensor `name`.
+uint64_t read_tensor(const safetensors::safetensors_t &st,
+                     const std::string &name) {
+  const uint8_t *data{nullptr};
+  size_t nbytes{0};
+  safetensors::get_tensor_data(st, name, &data, &nbytes);
+  return bench::checksum(data, nbytes);
+}
+
+bool near(double x, double y) { return std::fabs(x - y) <= 1e-9 * y; }
+
+// Tensors of `st` are laid out so that tensor 0(64 bytes) starts 32 bytes
+// before a page boundary. Tensors are dropped/read by index:
+// i % 3 == 1: dropped and read again, i % 3 == 2: dropped, others: kept.
+bool check_exact(size_t num_tensors, size_t page_size, std::string *err) {
+  safetensors::safetensors_t model;
+  std::vector<size_t> sizes = {64};
+  for (size_t i = 1; i < num_tensors; i++) {
+    sizes.push_back((2 + i % 3) * page_size + 12 * i);
+  }
+  size_t offset = 0;
+  for (size_t i = 0; i < sizes.size(); i++) {
+    safetensors::tensor_t t;
+    t.dtype = safetensors::dtype::kFLOAT32;
+    t.shape = {sizes[i] / 4};
+    t.data_offsets = {{offset, offset + sizes[i]}};
+    offset += sizes[i];
+    model.tensors.insert("t." + std::to_string(i), t);
+  }
+  model.storage.resize(offset);
+  synthetic::fill_random(model.storage.data(), offset, 7);
+
+  std::string warn;
+  std::vector<uint8_t> image;
+  if (!safetensors::save_to_memory(model, &image, &warn, err)) {
+    return false;
+  }
+  uint64_t header_size{0};
+  memcpy(&header_size, image.data(), 8);
+  const size_t data_start = size_t(8 + header_size);
+  const size_t shift =
+      (page_size - 32 + page_size - (data_start % page_size)) % page_size;
+
+  anon_mapping m;
+  if (!m.map(shift + image.size())) {
+    (*err) += "mmap failed\n";
+    return false;
+  }
+  memcpy(m.addr + shift, image.data(), image.size());
+  safetensors::safetensors_t st;
+  if (!safetensors::mmap_from_memory(m.addr + shift, image.size(), "", &st,
+                                     &warn, err)) {
+    return false;
+  }
+
+  // Expected page states, relative to the page of the databuffer start.
+  const uintptr_t db = uintptr_t(m.addr + shift + data_start);
+  const uintptr_t base = db & ~uintptr_t(page_size - 1);
+  std::vector<uint8_t> resident(
+      (db + offset - base + page_size - 1) / page_size, 1);
+  auto span = [&](size_t i, size_t *first, size_t *last) {
+    safetensors::tensor_t t;
+    st.tensors.at(i, &t);
+    (*first) = (db + t.data_offsets[0] - base) / page_size;
+    (*last) = (db + t.data_offsets[1] - base + page_size - 1) / page_size;
+  };
+
+  std::vector<std::string> used;
+  for (size_t i = 1; i < num_tensors; i++) {
+    if ((i % 3) == 0) {
+      continue;
+    }
+    // Pages fully covered by the tensor.
+    safetensors::tensor_t t;
+    st.tensors.at(i, &t);
+    size_t first = (db + t.data_offsets[0] - base + page_size - 1) / page_size;
+    size_t last = (db + t.data_offsets[1] - base) / page_size;
+    if ((last > first) &&
+        (madvise(reinterpret_cast<void *>(base + first * page_size),
+                 (last - first) * page_size, MADV_DONTNEED) != 0)) {
+      (*err) += "madvise failed\n";
+      return false;
+    }
+    for (size_t p = first; p < last; p++) {
+      resident[p] = 0;
+    }
+  }
+  for (size_t i = 1; i < num_tensors; i++) {
+    if ((i % 3) == 1) {
+      read_tensor(st, st.tensors.keys()[i]);
+      size_t first, last;
+      span(i, &first, &last);
+      for (size_t p = first; p < last; p++) {
+        resident[p] = 1;
+      }
+      used.push_back(st.tensors.keys()[i]);
+    }
+  }
+
+  safetensors::page_residency r;
+  if (!safetensors::residency_report(st, used, &r, err)) {
+    return false;
+  }
+
+  bool ok = (r.page_size == page_size) && (r.pages == resident.size()) &&
+            (r.tensors.size() == num_tensors);
+  size_t total = 0;
+  for (uint8_t v : resident) {
+    total += v;
+  }
+  ok &= (r.resident_pages == total);
+  for (size_t i = 0; ok && (i < num_tensors); i++) {
+    size_t first, last, n = 0;
+    span(i, &first, &last);
+    for (size_t p = first; p < last; p++) {
+      n += resident[p];
+    }
+    if ((r.tensors[i].pages != (last - first)) ||
+        (r.tensors[i].resident_pages != n) ||
+        (r.tensors[i].nbytes != sizes[i])) {
+      (*err) += "tensor " + std::to_string(i) + ": " +
+                std::to_string(r.tensors[i].resident_pages) + " of " +
+                std::to_string(r.tensors[i].pages) +
+                " pages resident, expected " + std::to_string(n) + " of " +
+                std::to_string(last - first) + "\n";
+      return false;
+    }
+  }
+
+  // Read tensors do not share pages, so the union is the sum.
+  size_t used_bytes = 0, used_pages = 0;
+  for (size_t i = 1; i < num_tensors; i += 3) {
+    size_t first, last;
+    span(i, &first, &last);
+    used_bytes += sizes[i];
+    used_pages += last - first;
+  }
+  ok &= (r.used_bytes == used_bytes) && (r.used_pages == used_pages) &&
+        (r.used_resident_pages == used_pages) &&
+        (r.unused_resident_pages == (total - used_pages)) &&
+        near(r.layout_amplification,
+             double(used_pages * page_size) / double(used_bytes)) &&
+        near(r.read_amplification,
+             double(total * page_size) / double(used_bytes));
+  if (!ok) {
+    (*err) += "page counts or amplification of the report differ\n";
+    return false;
+  }
+
+  // 64 bytes spanning two pages.
+  if (!safetensors::residency_report(st, {"t.0"}, &r, err)) {
+    return false;
+  }
+  if ((r.tensors[0].pages != 2) || (r.used_pages != 2) ||
+      !near(r.layout_amplification, double(2 * page_size) / 64.0)) {
+    (*err) += "layout amplification of a tensor spanning a page boundary "
+              "differs\n";
+    return false;
+  }
+  return true;
+}
+
+struct file_result {
+  size_t cold_resident_pages{0};
+  safetensors::page_residency report;
+};
+
+bool check_file(size_t stride, size_t page_size, file_result *result,
+                std::string *err) {
+  std::string warn;
+  {
+    safetensors::safetensors_t st;
+    safetensors::page_residency r;
+    if (!safetensors::mmap_from_file(kFile, &st, &warn, err) ||
+        !safetensors::residency_report(st, {}, &r, err)) {
+      return false;
+    }
+    for (const safetensors::tensor_residency &t : r.tensors) {
+      if (t.resident_pages != t.pages) {
+        (*err) += "tensor `" + t.name + "` of a prefetched mapping is " +
+                  "not resident\n";
+        return false;
+      }
+    }
+  }
+
+  // `mmap_from_file` prefetches the whole file, so map it here to measure
+  // what reads fault in from a cold page cache.
+  int fd = open(kFile, O_RDONLY);
+  if (fd < 0) {
+    (*err) += "Failed to open the file\n";
+    return false;
+  }
+  fdatasync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  off_t size = lseek(fd, 0, SEEK_END);
+  void *addr = mmap(nullptr, size_t(size), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    (*err) += "mmap failed\n";
+    return false;
+  }
+
+  bool ok = false;
+  {
+    safetensors::safetensors_t st;
+    safetensors::page_residency cold;
+    std::vector<std::string> used;
+    if (safetensors::mmap_from_memory(reinterpret_cast<uint8_t *>(addr),
+                                      size_t(size), kFile, &st, &warn, err) &&
+        safetensors::residency_report(st, {}, &cold, err)) {
+      for (size_t i = 0; i < st.tensors.size(); i += stride) {
+        read_tensor(st, st.tensors.keys()[i]);
+        used.push_back(st.tensors.keys()[i]);
+      }
+      ok = safetensors::residency_report(st, used, &result->report, err);
+    }
+    result->cold_resident_pages = cold.resident_pages;
+    const safetensors::page_residency &r = result->report;
+    for (size_t i = 0; ok && (i < r.tensors.size()); i += stride) {
+      ok = (r.tensors[i].resident_pages == r.tensors[i].pages);
+    }
+    ok = ok && (r.page_size == page_size) && (r.used_pages > 0) &&
+         (r.used_resident_pages == r.used_pages) &&
+         (r.resident_pages == (r.used_resident_pages +
+                               r.unused_resident_pages)) &&
+         near(r.layout_amplification,
+              double(r.used_pages * page_size) / double(r.used_bytes)) &&
+         near(r.read_amplification,
+              double(r.resident_pages * page_size) / double(r.used_bytes)) &&
+         (r.read_amplification >= r.layout_amplification);
+    if (!ok) {
+      (*err) += "residency of the file mapping is inconsistent\n";
+    }
+  }
+  munmap(addr, size_t(size));
+  return ok;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  size_t stride = 4;
+  const size_t exact_tensors = 32;
+  synthetic::config cfg;
+  cfg.num_tensors = 256;
+  cfg.tensor_bytes = 64 * 1024;
+
+  std::string option_err;
+  auto option = [&](const std::string &arg, const std::string &val) {
+    if (arg == "--stride") {
+      stride = (std::max)(size_t(1), bench::to_size(val));
+      return true;
+    }
+    return synthetic::apply_option(arg, val, &cfg, &option_err);
+  };
+  if (!bench::parse_args(argc, argv, nullptr, option) ||
+      !option_err.empty()) {
+    std::cerr << option_err;
+    return EXIT_FAILURE;
+  }
+
+  bench::temp_files temp;
+  temp.add(kFile);
+  std::string err;
+  if (!synthetic::generate(kFile, cfg, &err)) {
+    std::cerr << "Failed to generate synthetic file: " << err << "\n";
+    return EXIT_FAILURE;
+  }
+
+  const size_t page_size = size_t(sysconf(_SC_PAGESIZE));
+  bool exact = check_exact(exact_tensors, page_size, &err);
+  file_result fr;
+  bool file = check_file(stride, page_size, &fr, &err);
+  if (!exact || !file) {
+    std::cerr << err;
+  }
+
+  const safetensors::page_residency &r = fr.report;
+  std::cout << "{\n  \"tensors\": " << cfg.num_tensors
+            << ",\n  \"page_size\": " << page_size
+            << ",\n  \"pages\": " << r.pages
+            << ",\n  \"cold_resident_pages\": " << fr.cold_resident_pages
+            << ",\n  \"used_bytes\": " << r.used_bytes
+            << ",\n  \"used_pages\": " << r.used_pages
+            << ",\n  \"readahead_pages\": " << r.unused_resident_pages
+            << ",\n  \"layout_amplification\": " << r.layout_amplification
+            << ",\n  \"read_amplification\": " << r.read_amplification
+            << ",\n  \"exact_residency\": " << (exact ? "true" : "false")
+            << ",\n  \"file_residency\": " << (file ? "true" : "false")
+            << ",\n";
+  return bench::finish(exact && file);
+}
@@ -0,0 +1,240 @@
+// SPDX-License-Identifier: MIT
+// Copyright 2023 - Present, Syoyo Fujita.
+//
+// Cross-process zero-copy sharing harness(Linux only).
+//
+// A loader process loads a file with a copy(`load_from_file`), exports it to
+// a sealed memfd and sends the fd to worker processes over Unix domain
+// sockets. Each worker maps it with `open_shared`, verifies every tensor
+// against the loader's checksums and records its memory growth
+// (/proc/self/smaps_rollup). Workers must not duplicate the weights:
+// anonymous memory growth of each worker must stay below `--slack` bytes.
+// Exits with failure on any mismatch or when the bound is exceeded.
+//
+// $ bench_shared [file.safetensors] [--workers N] [--slack BYTES]
+//
+// When no file is given, a synthetic file is generated to
+// `bench_shared.safetensors`.
+//
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+
+#if !defined(SAFETENSORS_CPP_NO_IMPLEMENTATION)
+#define SAFETENSORS_CPP_IMPLEMENTATION
+#endif
+#include "bench_util.hh"
+#include "synthetic.hh"
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+
+struct mem_sample {
+  uint64_t rss{0};
+  uint64_t pss{0};
+  uint64_t anon{0};
+};
+
+struct worker_result {
+  int ok{0};
+  mem_sample before;
+  mem_sample after;
+  uint64_t tensors_verified{0};
+  char err[256]{};
+};
+
+bool sample_memory(mem_sample *s) {
+  std::ifstream ifs("/proc/self/smaps_rollup");
+  if (!ifs) {
+    return false;
+  }
+  std::string line;
+  while (std::getline(ifs, line)) {
+    uint64_t *dst = nullptr;
+    if (line.compare(0, 4, "Rss:") == 0) {
+      dst = &s->rss;
+    } else if (line.compare(0, 4, "Pss:") == 0) {
+      dst = &s->pss;
+    } else if (line.compare(0, 10, "Anonymous:") == 0) {
+      dst = &s->anon;
+    }
+    if (dst) {
+      size_t pos = line.find(':');
+      (*dst) = std::strtoull(line.c_str() + pos + 1, nullptr, 10) * 1024;
+    }
+  }
+  return true;
+}
+
+void run_worker(int sock, const std::vector<uint64_t> &expected,
+                worker_result *r) {
+  std::string warn, err;
+  sample_memory(&r->before);
+
+  int fd = -1;
+  safetensors::safetensors_t st;
+  if (!safetensors::recv_fd(sock, &fd, &err) ||
+      !safetensors::open_shared(fd, &st, &warn, &err)) {
+    snprintf(r->err, sizeof(r->err), "%s", err.c_str());
+    return;
+  }
+  close(fd);  // `st` holds its own reference.
+
+  if (st.tensors.size() != expected.size()) {
+    snprintf(r->err, sizeof(r->err), "tensor count mismatch");
+    return;
+  }
+  for (size_t i = 0; i < st.tensors.size(); i++) {
+    const uint8_t *data{nullptr};
+    size_t nbytes{0};
+    if (!safetensors::get_tensor_data(st, st.tensors.keys()[i], &data,
+                                      &nbytes, &err) ||
+        (bench::checksum(data, nbytes) != expected[i])) {
+      snprintf(r->err, sizeof(r->err), "data mismatch: %s",
+               st.tensors.keys()[i].c_str());
+      return;
+    }
+    r->tensors_verified++;
+  }
+
+  sample_memory(&r->after);
+  r->ok = 1;
+}
+
+int64_t growth(uint64_t before, uint64_t after) {
+  return int64_t(after) - int64_t(before);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  std::string filename;
+  size_t num_workers = 4;
+  uint64_t slack = 16ull * 1024 * 1024;
+  synthetic::config cfg;
+  cfg.num_tensors = 64;
+  cfg.tensor_bytes = 1024 * 1024;
+
+  std::vector<std::string> positional;
+  auto option = [&](const std::string &arg, const std::string &val) {
+    if (arg == "--workers") {
+      num_workers = (std::max)(size_t(1), bench::to_size(val));
+    } else if (arg == "--slack") {
+      slack = std::strtoull(val.c_str(), nullptr, 10);
+    } else {
+      return false;
+    }
+    return true;
+  };
+  if (!bench::parse_args(argc, argv, &positional, option)) {
+    return EXIT_FAILURE;
+  }
+  if (!positional.empty()) {
+    filename = positional.back();
+  }
+
+  if (filename.empty()) {
+    filename = "bench_shared.safetensors";
+    std::string err;
+    if (!synthetic::generate(filename, cfg, &err)) {
+      std::cerr << "Failed to generate synthetic file: " << err << "\n";
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Loader: copy the data to memory(as a converted load would), then export
+  // it.
+  std::vector<uint64_t> expected;
+  int mfd = -1;
+  size_t databuffer_size = 0;
+  {
+    std::string warn, err;
+    safetensors::safetensors_t st;
+    if (!safetensors::load_from_file(filename, &st, &warn, &err)) {
+      std::cerr << "Failed to load " << filename << ": " << err << "\n";
+      return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < st.tensors.size(); i++) {
+      const uint8_t *data{nullptr};
+      size_t nbytes{0};
+      safetensors::get_tensor_data(st, st.tensors.keys()[i], &data, &nbytes);
+      expected.push_back(bench::checksum(data, nbytes));
+    }
+    databuffer_size = st.storage.size();
+    if (!safetensors::export_to_memfd(st, "bench_shared", &mfd, &warn,
+                                      &err)) {
+      std::cerr << "export_to_memfd failed: " << err << "\n";
+      return EXIT_FAILURE;
+    }
+  }
+
+  std::vector<pid_t> pids;
+  std::vector<int> socks;
+  for (size_t w = 0; w < num_workers; w++) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+      std::cerr << "socketpair failed\n";
+      return EXIT_FAILURE;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(sv[0]);
+      close(mfd);  // the worker gets the fd only through the socket.
+      worker_result r;
+      run_worker(sv[1], expected, &r);
+      ssize_t n = write(sv[1], &r, sizeof(r));
+      close(sv[1]);
+      _exit(n == ssize_t(sizeof(r)) ? 0 : 1);
+    }
+    close(sv[1]);
+    pids.push_back(pid);
+    socks.push_back(sv[0]);
+  }
+
+  bool pass = true;
+  for (size_t w = 0; w < num_workers; w++) {
+    std::string err;
+    if (!safetensors::send_fd(socks[w], mfd, &err)) {
+      std::cerr << "send_fd failed: " << err << "\n";
+      pass = false;
+    }
+  }
+  close(mfd);
+
+  std::cout << "{\n  \"file\": \"" << filename
+            << "\",\n  \"data_bytes\": " << databuffer_size
+            << ",\n  \"slack\": " << slack << ",\n  \"workers\": [\n";
+  for (size_t w = 0; w < num_workers; w++) {
+    worker_result r;
+    ssize_t n = read(socks[w], &r, sizeof(r));
+    close(socks[w]);
+    int status = 0;
+    waitpid(pids[w], &status, 0);
+    if (n != ssize_t(sizeof(r))) {
+      r = worker_result();
+      snprintf(r.err, sizeof(r.err), "worker process failed");
+    }
+
+    int64_t anon = growth(r.before.anon, r.after.anon);
+    bool ok = r.ok && (anon <= int64_t(slack));
+    pass = pass && ok;
+
+    std::cout << "    {\"worker\": " << w << ", \"ok\": "
+              << (r.ok ? "true" : "false")
+              << ", \"pass\": " << (ok ? "true" : "false")
+              << ", \"tensors_verified\": " << r.tensors_verified
+              << ", \"rss_growth\": " << growth(r.before.rss, r.after.rss)
+              << ", \"pss_growth\": " << growth(r.before.pss, r.after.pss)
+              << ", \"anon_growth\": " << anon;
+    if (!r.ok) {
+      std::cout << ", \"error\": \"" << bench::json_escape(r.err) << "\"";
+    }
+    std::cout << "}" << ((w + 1 < num_workers) ? "," : "") << "\n";
+  }
+  std::cout << "  ],\n";
+  return bench::finish(pass);
+}
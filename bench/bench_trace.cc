@@ -0,0 +1,238 @@
+// SPDX-License-Identifier: MIT
+// Copyright 2023 - Present, Syoyo Fujita.
+//
+// Benchmark of access tracing and trace-driven prefetch.
+//
+// Maps a synthetic file, records the tensors a workload reads(a byte range
+// of the first tensor, then every `--stride`-th tensor in reverse order) to
+// `st.trace`, then serializes the trace, parses it back, saves and
+// loads it as a sidecar file and as `__metadata__` of a copy of the file,
+// and replays it. Verifies the records survive each round trip and that
+// stale traces are rejected: a trace for another file with the same # of
+// tensors, for the same tensors in another order, for a reshaped tensor,
+// and corrupted strings. Reports seconds in JSON.
+//
+// $ bench_trace [--stride N] [--tensors N] [--bytes N] [--dist ...]
+//
+// Files are generated to `bench_trace*` and removed at exit.
+//
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+
+#if !defined(SAFETENSORS_CPP_NO_IMPLEMENTATION)
+#define SAFETENSORS_CPP_IMPLEMENTATION
+#endif
+#include "bench_util.hh"
+#include "synthetic.hh"
+
+namespace {
+
+const char *kFile = "bench_trace.safetensors";
+const char *kSidecar = "bench_trace.safetensors.trace";
+const char *kEmbedded = "bench_trace_embedded.safetensors";
+const char *kStale = "bench_trace_stale.safetensors";
+
+bool same_records(const safetensors::access_trace &a,
+                  const safetensors::access_trace &b) {
+  if (a.records.size() != b.records.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < a.records.size(); i++) {
+    const safetensors::access_record &x = a.records[i];
+    const safetensors::access_record &y = b.records[i];
+    if ((x.name != y.name) || (x.begin != y.begin) || (x.end != y.end)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// `s` must fail to parse against `st` with an error and leave `trace`
+// untouched.
+bool rejected(const safetensors::safetensors_t &st, const std::string &s,
+              const char *what, std::string *err) {
+  safetensors::access_trace trace;
+  trace.record("sentinel", 0, 1);
+  std::string e;
+  if (safetensors::parse_access_trace(st, s, &trace, &e) || e.empty() ||
+      (trace.records.size() != 1) || (trace.records[0].name != "sentinel")) {
+    (*err) += std::string("stale trace was accepted: ") + what + "\n";
+    return false;
+  }
+  return true;
+}
+
+// Stale traces: `s`(recorded for `st`) against other tensor tables, and
+// corrupted strings against `st`.
+bool check_stale(const safetensors::safetensors_t &st, const std::string &s,
+                 const synthetic::config &cfg, std::string *err) {
+  std::string warn;
+  bool ok = true;
+
+  // Another file with the same # of tensors.
+  synthetic::config other = cfg;
+  other.seed = cfg.seed + 1;
+  other.tensor_bytes = cfg.tensor_bytes + 64;
+  safetensors::safetensors_t st_other;
+  if (!synthetic::generate(kStale, other, err) ||
+      !safetensors::load_from_file(kStale, &st_other, &warn, err)) {
+    return false;
+  }
+  ok &= rejected(st_other, s, "other file", err);
+
+  // Same tensors in reverse order.
+  safetensors::safetensors_t copy;
+  if (!safetensors::load_from_file(kFile, &copy, &warn, err)) {
+    return false;
+  }
+  safetensors::safetensors_t reordered = copy;
+  for (const std::string &name : copy.tensors.keys()) {
+    reordered.tensors.erase(name);
+  }
+  for (size_t i = copy.tensors.size(); i > 0; i--) {
+    safetensors::tensor_t t;
+    copy.tensors.at(i - 1, &t);
+    reordered.tensors.insert(copy.tensors.keys()[i - 1], t);
+  }
+  ok &= rejected(reordered, s, "reordered tensors", err);
+
+  // Same names and data, one tensor reshaped.
+  safetensors::safetensors_t reshaped = copy;
+  safetensors::tensor_t t;
+  reshaped.tensors.at(0, &t);
+  t.shape.insert(t.shape.begin(), 1);
+  reshaped.tensors.insert(copy.tensors.keys()[0], t);
+  ok &= rejected(reshaped, s, "reshaped tensor", err);
+
+  // Corrupted strings.
+  const size_t hash_pos = s.find('/', 3) + 1;
+  std::string bad_hash = s;
+  bad_hash[hash_pos] = (bad_hash[hash_pos] == '0') ? '1' : '0';
+  ok &= rejected(st, bad_hash, "modified hash", err);
+  ok &= rejected(st, s.substr(0, hash_pos + 8), "truncated hash", err);
+  ok &= rejected(st, "v1/" + std::to_string(st.tensors.size()),
+                 "missing hash", err);
+  ok &= rejected(st, s + ";", "trailing separator", err);
+  ok &= rejected(st, s + ";" + std::to_string(st.tensors.size()),
+                 "tensor index out of range", err);
+  ok &= rejected(st, s + ";0:8:4", "reversed byte range", err);
+  ok &= rejected(st, "v2" + s.substr(2), "unknown version", err);
+  return ok;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  size_t stride = 3;
+  synthetic::config cfg;
+  cfg.num_tensors = 256;
+  cfg.tensor_bytes = 64 * 1024;
+
+  std::string option_err;
+  auto option = [&](const std::string &arg, const std::string &val) {
+    if (arg == "--stride") {
+      stride = (std::max)(size_t(1), bench::to_size(val));
+      return true;
+    }
+    return synthetic::apply_option(arg, val, &cfg, &option_err);
+  };
+  if (!bench::parse_args(argc, argv, nullptr, option) ||
+      !option_err.empty()) {
+    std::cerr << option_err;
+    return EXIT_FAILURE;
+  }
+
+  bench::temp_files temp;
+  temp.paths = {kFile, kSidecar, kEmbedded, kStale};
+  std::string warn, err;
+  if (!synthetic::generate(kFile, cfg, &err)) {
+    std::cerr << "Failed to generate synthetic file: " << err << "\n";
+    return EXIT_FAILURE;
+  }
+
+  safetensors::safetensors_t st;
+  if (!safetensors::mmap_from_file(kFile, &st, &warn, &err)) {
+    std::cerr << "mmap_from_file failed: " << err << "\n";
+    return EXIT_FAILURE;
+  }
+
+  // Record. The byte range of the first tensor comes first so it is not
+  // merged into the whole-tensor read of it.
+  safetensors::access_trace trace;
+  const std::vector<std::string> &names = st.tensors.keys();
+  size_t expected_records = 0;
+  safetensors::tensor_t first;
+  st.tensors.at(0, &first);
+  const size_t first_bytes = first.data_offsets[1] - first.data_offsets[0];
+  if ((first_bytes >= 2) && (names.size() > 1)) {
+    trace.record(names[0], first_bytes / 2, first_bytes);
+    expected_records++;
+  }
+  st.trace = &trace;
+  for (size_t i = names.size(); i > 0; i -= (std::min)(i, stride)) {
+    const uint8_t *data{nullptr};
+    size_t nbytes{0};
+    if (!safetensors::get_tensor_data(st, names[i - 1], &data, &nbytes)) {
+      std::cerr << "get_tensor_data failed\n";
+      return EXIT_FAILURE;
+    }
+    expected_records++;
+  }
+  st.trace = nullptr;
+  bool recorded = (trace.records.size() == expected_records);
+  if (!recorded) {
+    err += "recorded " + std::to_string(trace.records.size()) +
+           " accesses, expected " + std::to_string(expected_records) + "\n";
+  }
+
+  // Round trips.
+  std::string s;
+  safetensors::access_trace parsed, loaded, embedded;
+  bool round_trip =
+      safetensors::serialize_access_trace(st, trace, &s, &err) &&
+      safetensors::parse_access_trace(st, s, &parsed, &err) &&
+      same_records(parsed, trace) &&
+      safetensors::save_access_trace(st, trace, kSidecar, &err) &&
+      safetensors::load_access_trace(st, kSidecar, &loaded, &err) &&
+      same_records(loaded, trace);
+  if (round_trip) {
+    // The table hash does not cover `__metadata__`.
+    safetensors::safetensors_t copy, reopened;
+    std::string stored;
+    round_trip = safetensors::load_from_file(kFile, &copy, &warn, &err);
+    copy.metadata.insert(safetensors::kAccessTraceMetadataKey, s);
+    round_trip =
+        round_trip &&
+        safetensors::save_to_file(copy, kEmbedded, &warn, &err) &&
+        safetensors::load_from_file(kEmbedded, &reopened, &warn, &err) &&
+        reopened.metadata.at(safetensors::kAccessTraceMetadataKey,
+                             &stored) &&
+        safetensors::parse_access_trace(reopened, stored, &embedded, &err) &&
+        same_records(embedded, trace);
+  }
+  if (!round_trip) {
+    err += "trace round trip failed\n";
+  }
+
+  double replay_seconds = bench::best_of(1, [&]() {
+    return safetensors::replay_access_trace(st, parsed, &err);
+  });
+
+  bool stale_rejected = round_trip && check_stale(st, s, cfg, &err);
+
+  bool ok = recorded && round_trip && (replay_seconds >= 0.0) &&
+            stale_rejected;
+  if (!ok) {
+    std::cerr << err;
+  }
+  std::cout << "{\n  \"tensors\": " << names.size()
+            << ",\n  \"records\": " << trace.records.size()
+            << ",\n  \"trace_bytes\": " << s.size()
+            << ",\n  \"replay_seconds\": " << replay_seconds
+            << ",\n  \"round_trip\": " << (round_trip ? "true" : "false")
+            << ",\n  \"stale_rejected\": "
+            << (stale_rejected ? "true" : "false") << ",\n";
+  return bench::finish(ok);
+}
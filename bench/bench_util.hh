@@ -0,0 +1,149 @@
+// SPDX-License-Identifier: MIT
+// Copyright 2023 - Present, Syoyo Fujita.
+//
+// Common helpers for benchmarks: timing, command line, JSON output.
+//
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#define BENCH_HAS_RUSAGE
+#endif
+
+namespace bench {
+
+inline double now_seconds() {
+  return std::chrono::duration<double>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+inline double seconds_since(std::chrono::steady_clock::time_point t) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - t)
+      .count();
+}
+
+//
+// Best(minimum) seconds of `repeat` runs of `fn`. Returns a negative value
+// when `fn` returns false.
+//
+template <typename F>
+double best_of(size_t repeat, F fn) {
+  double best = -1.0;
+  for (size_t k = 0; k < repeat; k++) {
+    auto t = std::chrono::steady_clock::now();
+    if (!fn()) {
+      return -1.0;
+    }
+    double s = seconds_since(t);
+    best = (k == 0) ? s : (std::min)(best, s);
+  }
+  return best;
+}
+
+inline uint64_t get_peak_rss_bytes() {
+#if defined(BENCH_HAS_RUSAGE)
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru) != 0) {
+    return 0;
+  }
+#if defined(__APPLE__)
+  return uint64_t(ru.ru_maxrss);  // bytes
+#else
+  return uint64_t(ru.ru_maxrss) * 1024;  // KB
+#endif
+#else
+  return 0;
+#endif
+}
+
+inline std::string json_escape(const std::string &s) {
+  std::string o;
+  for (char c : s) {
+    if ((c == '"') || (c == '\\')) {
+      o += '\\';
+      o += c;
+    } else if (uint8_t(c) < 0x20) {
+      o += ' ';
+    } else {
+      o += c;
+    }
+  }
+  return o;
+}
+
+// FNV-1a
+inline uint64_t checksum(const uint8_t *p, size_t n) {
+  uint64_t h = 1469598103934665603ull;
+  for (size_t i = 0; i < n; i++) {
+    h = (h ^ p[i]) * 1099511628211ull;
+  }
+  return h;
+}
+
+inline size_t to_size(const std::string &s) {
+  return size_t(std::strtoull(s.c_str(), nullptr, 10));
+}
+
+//
+// Parse `--name value` options. `fn(name, value)` returns false for an
+// unknown name. Other arguments are appended to `positional`(an error when
+// nullptr). Prints the error and returns false on failure.
+//
+template <typename F>
+bool parse_args(int argc, char **argv, std::vector<std::string> *positional,
+                F fn) {
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg.compare(0, 2, "--") != 0) {
+      if (!positional) {
+        std::cerr << "Unexpected argument: " << arg << "\n";
+        return false;
+      }
+      positional->push_back(arg);
+      continue;
+    }
+    if ((i + 1) >= argc) {
+      std::cerr << "Missing value for " << arg << "\n";
+      return false;
+    }
+    if (!fn(arg, std::string(argv[++i]))) {
+      std::cerr << "Unknown option: " << arg << "\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+// Files generated by a benchmark. Removed at exit.
+struct temp_files {
+  std::vector<std::string> paths;
+
+  std::string add(const std::string &path) {
+    paths.push_back(path);
+    return path;
+  }
+
+  ~temp_files() {
+    for (const std::string &path : paths) {
+      std::remove(path.c_str());
+    }
+  }
+};
+
+// Close the top-level JSON object with `"pass"` and return the exit code.
+inline int finish(bool pass) {
+  std::cout << "  \"pass\": " << (pass ? "true" : "false") << "\n}\n";
+  return pass ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+}  // namespace bench
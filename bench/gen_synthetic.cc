@@ -0,0 +1,52 @@
+// SPDX-License-Identifier: MIT
+// Copyright 2023 - Present, Syoyo Fujita.
+//
+// Generate synthetic safetensors file for benchmarks.
+//
+// $ gen_synthetic out.safetensors --tensors 512 --bytes 4194304
+//     --dist lognormal --dtypes F32,BF16 --name-length 64
+//
+#include <cstdlib>
+#include <iostream>
+
+#if !defined(SAFETENSORS_CPP_NO_IMPLEMENTATION)
+#define SAFETENSORS_CPP_IMPLEMENTATION
+#endif
+#include "bench_util.hh"
+#include "synthetic.hh"
+
+static void usage() {
+  std::cout << "gen_synthetic <output.safetensors> [options]\n"
+            << "  --tensors N         The number of tensors(default 128)\n"
+            << "  --bytes N           Mean(median) tensor size in bytes\n"
+            << "  --dist D            fixed, uniform or lognormal\n"
+            << "  --dtypes A,B,..     dtypes assigned round-robin(e.g. "
+               "F32,BF16)\n"
+            << "  --name-length N     Tensor name length\n"
+            << "  --metadata-bytes N  Extra __metadata__ bytes\n"
+            << "  --seed N            Random seed\n";
+}
+
+int main(int argc, char **argv) {
+  std::vector<std::string> positional;
+  synthetic::config cfg;
+  std::string err;
+  auto option = [&](const std::string &arg, const std::string &val) {
+    return synthetic::apply_option(arg, val, &cfg, &err);
+  };
+  if (!bench::parse_args(argc, argv, &positional, option) ||
+      !err.empty() || (positional.size() != 1)) {
+    std::cerr << err;
+    usage();
+    return EXIT_FAILURE;
+  }
+
+  const std::string &filename = positional[0];
+  if (!synthetic::generate(filename, cfg, &err)) {
+    std::cerr << "Failed to generate " << filename << "\n";
+    std::cerr << "  ERR: " << err << "\n";
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
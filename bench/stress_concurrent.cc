@@ -0,0 +1,456 @@
+// SPDX-License-Identifier: MIT
+// Copyright 2023 - Present, Syoyo Fujita.
+//
+// Multi-threaded stress test of concurrent read-only access.
+//
+// Many threads share one `safetensors_t`(load_from_file and mmap_from_file)
+// and one `lazy_loader`, look up random tensors and verify data checksums,
+// while other threads hit error paths(strerror) and global counters. Reads
+// of the mapped one are recorded to a shared `access_trace`. The
+// lazy loader must read each tensor once, and retry a read which failed
+// (the file is truncated and restored under it).
+// Then readers acquire snapshots from a `model_registry` while a writer
+// keeps replacing the file(rename) and reloading it.
+// Exits with failure on any mismatch. Build with ThreadSanitizer to check
+// data races:
+//
+// $ cmake -DSAFETENSORS_CPP_USE_THREADS=On -DSAFETENSORS_CPP_BUILD_BENCHMARKS=On
+//     -DCMAKE_CXX_FLAGS="-fsanitize=thread -g" -Bbuild-tsan -H.
+// $ ./build-tsan/stress_concurrent [file.safetensors] [--threads N]
+//     [--iterations N]
+//
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <unordered_map>
+
+#if !defined(SAFETENSORS_CPP_NO_IMPLEMENTATION)
+#define SAFETENSORS_CPP_IMPLEMENTATION
+#endif
+#include "bench_util.hh"
+#include "synthetic.hh"
+
+namespace {
+
+// Start all threads at once to maximize contention.
+struct start_gate {
+  std::atomic<size_t> waiting{0};
+  size_t count{0};
+
+  void arrive_and_wait() {
+    waiting.fetch_add(1);
+    while (waiting.load() < count) {
+      std::this_thread::yield();
+    }
+  }
+};
+
+struct shared_state {
+  std::vector<std::string> names;
+  std::vector<uint64_t> expected;  // checksum per tensor
+  const safetensors::safetensors_t *loaded{nullptr};
+  const safetensors::safetensors_t *mapped{nullptr};
+  safetensors::lazy_loader *lazy{nullptr};
+  size_t iterations{0};
+  std::atomic<size_t> failures{0};
+};
+
+void fail(shared_state *s, const std::string &msg) {
+  if (s->failures.fetch_add(1) < 8) {
+    std::cerr << msg;
+  }
+}
+
+void verify_st(shared_state *s, const safetensors::safetensors_t &st,
+               size_t i, const char *what) {
+  safetensors::tensor_t tensor;
+  if (!st.tensors.at(s->names[i], &tensor)) {
+    fail(s, std::string(what) + ": lookup failed\n");
+    return;
+  }
+  const uint8_t *data{nullptr};
+  size_t nbytes{0};
+  std::string err;
+  if (!safetensors::get_tensor_data(st, s->names[i], &data, &nbytes, &err) ||
+      (bench::checksum(data, nbytes) != s->expected[i])) {
+    fail(s, std::string(what) + ": data mismatch " + s->names[i] + " " +
+                err + "\n");
+  }
+}
+
+void reader(shared_state *s, start_gate *gate, uint32_t seed) {
+  std::mt19937 engine(seed);
+  std::uniform_int_distribution<size_t> pick(0, s->names.size() - 1);
+  gate->arrive_and_wait();
+
+  for (size_t it = 0; it < s->iterations; it++) {
+    size_t i = pick(engine);
+    verify_st(s, *s->loaded, i, "load_from_file");
+    verify_st(s, *s->mapped, i, "mmap_from_file");
+
+    const uint8_t *data{nullptr};
+    size_t nbytes{0};
+    std::string err;
+    if (!s->lazy->get_tensor_data(s->names[i], &data, &nbytes, &err) ||
+        (bench::checksum(data, nbytes) != s->expected[i])) {
+      fail(s, "lazy_loader: data mismatch " + s->names[i] + " " + err + "\n");
+    }
+  }
+}
+
+// Error paths and process-wide counters.
+void error_path(shared_state *s, start_gate *gate, size_t id) {
+  gate->arrive_and_wait();
+
+  for (size_t it = 0; it < (s->iterations / 16) + 1; it++) {
+    safetensors::safetensors_t st;
+    std::string warn, err;
+    std::string path = "/nonexistent/stress_" + std::to_string(id) + ".st";
+    if (safetensors::mmap_from_file(path, &st, &warn, &err) || err.empty()) {
+      fail(s, "error path: expected failure\n");
+    }
+    safetensors::global_counters c = safetensors::get_global_counters();
+    (void)c;
+  }
+}
+
+typedef std::unordered_map<std::string, uint64_t> checksum_map;
+
+bool compute_checksums(const std::string &filename, checksum_map *m) {
+  std::string warn, err;
+  safetensors::safetensors_t st;
+  if (!safetensors::mmap_from_file(filename, &st, &warn, &err)) {
+    std::cerr << err;
+    return false;
+  }
+  for (size_t i = 0; i < st.tensors.size(); i++) {
+    const std::string &name = st.tensors.keys()[i];
+    const uint8_t *data{nullptr};
+    size_t nbytes{0};
+    safetensors::get_tensor_data(st, name, &data, &nbytes);
+    (*m)[name] = bench::checksum(data, nbytes);
+  }
+  return true;
+}
+
+bool copy_file(const std::string &src, const std::string &dst) {
+  std::ifstream ifs(src, std::ios::binary);
+  std::ofstream ofs(dst, std::ios::binary | std::ios::trunc);
+  ofs << ifs.rdbuf();
+  return ifs.good() && ofs.good();
+}
+
+struct registry_state {
+  safetensors::model_registry registry;
+  std::string path;
+  checksum_map versions[2];
+  std::atomic<bool> done{false};
+  std::atomic<size_t> acquired{0};
+  std::atomic<size_t> failures{0};
+};
+
+// Each snapshot must be entirely one of the two versions.
+void registry_reader(registry_state *r, start_gate *gate, uint32_t seed) {
+  std::mt19937 engine(seed);
+  gate->arrive_and_wait();
+
+  while (!r->done.load()) {
+    safetensors::model_snapshot snap;
+    if (!r->registry.acquire(r->path, &snap)) {
+      r->failures++;
+      continue;
+    }
+    r->acquired++;
+    const safetensors::safetensors_t &st = snap.get();
+    if (st.tensors.size() == 0) {
+      r->failures++;
+      continue;
+    }
+
+    const checksum_map *expected = nullptr;
+    for (size_t k = 0; k < 8; k++) {
+      size_t i = engine() % st.tensors.size();
+      const std::string &name = st.tensors.keys()[i];
+      const uint8_t *data{nullptr};
+      size_t nbytes{0};
+      safetensors::get_tensor_data(st, name, &data, &nbytes);
+      uint64_t h = bench::checksum(data, nbytes);
+      if (!expected) {
+        for (const checksum_map &m : r->versions) {
+          auto it = m.find(name);
+          if ((it != m.end()) && (it->second == h)) {
+            expected = &m;
+          }
+        }
+        if (!expected) {
+          r->failures++;
+          break;
+        }
+      } else {
+        auto it = expected->find(name);
+        if ((it == expected->end()) || (it->second != h)) {
+          r->failures++;
+          break;
+        }
+      }
+    }
+  }
+}
+
+size_t registry_stress(const std::string &a, const std::string &b,
+                       size_t num_threads, size_t reloads) {
+  registry_state r;
+  r.path = "stress_concurrent_live.safetensors";
+  std::string tmp = r.path + ".tmp";
+  if (!compute_checksums(a, &r.versions[0]) ||
+      !compute_checksums(b, &r.versions[1]) || !copy_file(a, r.path)) {
+    return 1;
+  }
+
+  std::string warn, err;
+  if (!r.registry.add(r.path, &warn, &err)) {
+    std::cerr << "model_registry::add failed: " << err << "\n";
+    return 1;
+  }
+
+  start_gate gate;
+  gate.count = num_threads + 1;
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < num_threads; t++) {
+    threads.emplace_back(registry_reader, &r, &gate, uint32_t(t));
+  }
+
+  gate.arrive_and_wait();
+  size_t reloaded = 0;
+  for (size_t i = 0; i < reloads; i++) {
+    if (!copy_file((i & 1) ? a : b, tmp) ||
+        (std::rename(tmp.c_str(), r.path.c_str()) != 0)) {
+      std::cerr << "Failed to replace " << r.path << "\n";
+      r.failures++;
+      break;
+    }
+    // Force: a recycled inode with the same size and mtime is not detected.
+    if (!r.registry.reload(r.path, /* force */ true, &warn, &err)) {
+      std::cerr << "model_registry::reload failed: " << err << "\n";
+      r.failures++;
+      break;
+    }
+    reloaded++;
+  }
+  r.done = true;
+  for (std::thread &t : threads) {
+    t.join();
+  }
+  r.registry.collect();
+
+  std::cout << "{\"registry_reloads\": " << reloaded
+            << ", \"registry_acquired\": " << r.acquired.load()
+            << ", \"registry_failures\": " << r.failures.load() << "}\n";
+  std::remove(r.path.c_str());
+
+  return r.failures.load();
+}
+
+// Threads first access a tensor of a `lazy_loader` while its file is
+// truncated: all must fail with an error and publish nothing. After the file
+// is restored, all must get the data, read exactly once more.
+size_t lazy_retry_stress(const std::string &filename, const shared_state &s,
+                         size_t num_threads) {
+  const std::string path = "stress_concurrent_lazy.safetensors";
+  bench::temp_files temp;
+  temp.add(path);
+  std::string warn, err;
+  safetensors::lazy_loader lazy;
+  if (!copy_file(filename, path) || !lazy.open(path, &warn, &err)) {
+    std::cerr << "Failed to open " << path << ": " << err << "\n";
+    return 1;
+  }
+  std::ofstream(path, std::ios::binary | std::ios::trunc).close();
+
+  std::atomic<size_t> failures{0};
+  auto access_all = [&](bool expect_ok) {
+    start_gate gate;
+    gate.count = num_threads;
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < num_threads; t++) {
+      threads.emplace_back([&]() {
+        gate.arrive_and_wait();
+        const uint8_t *data{nullptr};
+        size_t nbytes{0};
+        std::string e;
+        bool ok = lazy.get_tensor_data(s.names[0], &data, &nbytes, &e);
+        bool good = ok && (bench::checksum(data, nbytes) == s.expected[0]);
+        if (expect_ok ? !good : (ok || e.empty())) {
+          failures++;
+        }
+      });
+    }
+    for (std::thread &t : threads) {
+      t.join();
+    }
+  };
+
+  access_all(false);
+  size_t failed_reads = lazy.num_reads();
+  if (!copy_file(filename, path)) {
+    return 1;
+  }
+  access_all(true);
+  if ((failed_reads != num_threads) ||
+      (lazy.num_reads() != num_threads + 1)) {
+    std::cerr << "lazy_loader retry: " << lazy.num_reads()
+              << " reads, expected " << (num_threads + 1) << ".\n";
+    failures++;
+  }
+
+  std::cout << "{\"lazy_retry_reads\": " << lazy.num_reads()
+            << ", \"lazy_retry_failures\": " << failures.load() << "}\n";
+  return failures.load();
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  std::string filename;
+  size_t num_threads = 16;
+  size_t iterations = 2000;
+  synthetic::config cfg;
+  cfg.num_tensors = 512;
+  cfg.tensor_bytes = 16 * 1024;
+
+  std::vector<std::string> positional;
+  auto option = [&](const std::string &arg, const std::string &val) {
+    if (arg == "--threads") {
+      num_threads = (std::max)(size_t(1), bench::to_size(val));
+    } else if (arg == "--iterations") {
+      iterations = bench::to_size(val);
+    } else {
+      return false;
+    }
+    return true;
+  };
+  if (!bench::parse_args(argc, argv, &positional, option)) {
+    return EXIT_FAILURE;
+  }
+  if (!positional.empty()) {
+    filename = positional.back();
+  }
+
+  if (filename.empty()) {
+    filename = "stress_concurrent.safetensors";
+    std::string err;
+    if (!synthetic::generate(filename, cfg, &err)) {
+      std::cerr << "Failed to generate synthetic file: " << err << "\n";
+      return EXIT_FAILURE;
+    }
+  }
+
+  std::string warn, err;
+  safetensors::safetensors_t loaded, mapped;
+  safetensors::lazy_loader lazy;
+  if (!safetensors::load_from_file(filename, &loaded, &warn, &err) ||
+      !safetensors::mmap_from_file(filename, &mapped, &warn, &err) ||
+      !lazy.open(filename, &warn, &err)) {
+    std::cerr << "Failed to open " << filename << ": " << err << "\n";
+    return EXIT_FAILURE;
+  }
+
+  shared_state s;
+  s.loaded = &loaded;
+  s.mapped = &mapped;
+  s.lazy = &lazy;
+  s.iterations = iterations;
+  size_t total_bytes = 0;
+  std::unordered_map<std::string, size_t> sizes;
+  for (size_t i = 0; i < loaded.tensors.size(); i++) {
+    const std::string &name = loaded.tensors.keys()[i];
+    const uint8_t *data{nullptr};
+    size_t nbytes{0};
+    safetensors::get_tensor_data(loaded, name, &data, &nbytes);
+    s.names.push_back(name);
+    s.expected.push_back(bench::checksum(data, nbytes));
+    sizes[name] = nbytes;
+    total_bytes += nbytes;
+  }
+  if (s.names.empty()) {
+    std::cerr << "No tensors in " << filename << "\n";
+    return EXIT_FAILURE;
+  }
+
+  size_t num_error_threads = (std::max)(size_t(1), num_threads / 8);
+
+  // Shared by all readers of `mapped`.
+  safetensors::access_trace trace;
+  mapped.trace = &trace;
+
+  start_gate gate;
+  gate.count = num_threads + num_error_threads;
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < num_threads; t++) {
+    threads.emplace_back(reader, &s, &gate, uint32_t(t));
+  }
+  for (size_t t = 0; t < num_error_threads; t++) {
+    threads.emplace_back(error_path, &s, &gate, t);
+  }
+  for (std::thread &t : threads) {
+    t.join();
+  }
+  mapped.trace = nullptr;
+
+  // Each read adds a whole-tensor record or is merged into the last one.
+  bool trace_ok = !trace.records.empty() &&
+                  (trace.records.size() <= num_threads * iterations);
+  for (const safetensors::access_record &r : trace.records) {
+    auto it = sizes.find(r.name);
+    trace_ok = trace_ok && (it != sizes.end()) && (r.begin == 0) &&
+               (r.end == it->second);
+  }
+  if (!trace_ok) {
+    std::cerr << "access_trace: " << trace.records.size()
+              << " records are inconsistent.\n";
+    s.failures++;
+  }
+
+  {
+    std::string other = "stress_concurrent_b.safetensors";
+    synthetic::config cfg_b = cfg;
+    cfg_b.seed = cfg.seed + 1;
+    std::string err_b;
+    if (!synthetic::generate(other, cfg_b, &err_b)) {
+      std::cerr << "Failed to generate synthetic file: " << err_b << "\n";
+      return EXIT_FAILURE;
+    }
+    s.failures += registry_stress(filename, other, num_threads,
+                                  (std::max)(size_t(1), iterations / 20));
+  }
+
+  // Every tensor is read exactly once by the lazy loader.
+  for (size_t i = 0; i < s.names.size(); i++) {
+    const uint8_t *data{nullptr};
+    size_t nbytes{0};
+    lazy.get_tensor_data(s.names[i], &data, &nbytes, &err);
+  }
+  if ((lazy.num_reads() != s.names.size()) ||
+      (lazy.materialized_bytes() != total_bytes)) {
+    std::cerr << "lazy_loader read " << lazy.num_reads() << " times("
+              << lazy.materialized_bytes() << " bytes) for "
+              << s.names.size() << " tensors(" << total_bytes
+              << " bytes).\n";
+    s.failures++;
+  }
+  s.failures += lazy_retry_stress(filename, s, num_threads);
+
+  std::cout << "{\"threads\": " << num_threads
+            << ", \"iterations\": " << iterations
+            << ", \"tensors\": " << s.names.size()
+            << ", \"lazy_materialized_bytes\": " << lazy.materialized_bytes()
+            << ", \"lazy_reads\": " << lazy.num_reads()
+            << ", \"trace_records\": " << trace.records.size()
+            << ", \"failures\": " << s.failures.load() << "}\n";
+
+  return (s.failures.load() == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
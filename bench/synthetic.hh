@@ -0,0 +1,207 @@
+// SPDX-License-Identifier: MIT
+// Copyright 2023 - Present, Syoyo Fujita.
+//
+// Synthetic safetensors file generator for benchmarks.
+//
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "safetensors.hh"
+
+namespace synthetic {
+
+enum size_distribution {
+  kSizeFixed,      // every tensor has `tensor_bytes` bytes
+  kSizeUniform,    // uniform in [1, 2 * tensor_bytes]
+  kSizeLogNormal,  // log-normal with median `tensor_bytes`(like real models:
+                   // many small biases/norms, a few huge matrices)
+};
+
+struct config {
+  size_t num_tensors{128};
+  size_t tensor_bytes{1024 * 1024};  // mean/median tensor size
+  size_distribution distribution{kSizeLogNormal};
+  std::vector<safetensors::dtype> dtypes{safetensors::dtype::kFLOAT32};
+  size_t name_length{48};       // tensor name length(affects header size)
+  size_t metadata_bytes{0};     // extra `__metadata__` payload(header size)
+  uint32_t seed{0};
+};
+
+inline bool parse_dtype(const std::string &s, safetensors::dtype *dtype) {
+  static const safetensors::dtype kAll[] = {
+      safetensors::dtype::kBOOL,    safetensors::dtype::kUINT8,
+      safetensors::dtype::kINT8,    safetensors::dtype::kINT16,
+      safetensors::dtype::kUINT16,  safetensors::dtype::kFLOAT16,
+      safetensors::dtype::kBFLOAT16, safetensors::dtype::kINT32,
+      safetensors::dtype::kUINT32,  safetensors::dtype::kFLOAT32,
+      safetensors::dtype::kFLOAT64, safetensors::dtype::kINT64,
+      safetensors::dtype::kUINT64};
+  for (safetensors::dtype d : kAll) {
+    if (safetensors::get_dtype_str(d) == s) {
+      (*dtype) = d;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Parse a comma separated dtype list(e.g. `F32,BF16`).
+inline bool parse_dtypes(const std::string &s,
+                         std::vector<safetensors::dtype> *dtypes,
+                         std::string *err) {
+  dtypes->clear();
+  size_t begin = 0;
+  while (begin <= s.size()) {
+    size_t end = s.find(',', begin);
+    if (end == std::string::npos) {
+      end = s.size();
+    }
+    std::string item = s.substr(begin, end - begin);
+    safetensors::dtype dtype;
+    if (!parse_dtype(item, &dtype)) {
+      (*err) += "Unknown dtype: " + item + "\n";
+      return false;
+    }
+    dtypes->push_back(dtype);
+    begin = end + 1;
+  }
+  return true;
+}
+
+//
+// Apply a generator option(`--tensors`, `--bytes`, `--dist`, `--dtypes`,
+// `--name-length`, `--metadata-bytes` or `--seed`) to `cfg`.
+//
+// @return true when `name` is a generator option. An invalid value is
+// reported to `err`.
+inline bool apply_option(const std::string &name, const std::string &value,
+                         config *cfg, std::string *err) {
+  size_t n = size_t(std::strtoull(value.c_str(), nullptr, 10));
+  if (name == "--tensors") {
+    cfg->num_tensors = n;
+  } else if (name == "--bytes") {
+    cfg->tensor_bytes = n;
+  } else if (name == "--dist") {
+    if (value == "fixed") {
+      cfg->distribution = kSizeFixed;
+    } else if (value == "uniform") {
+      cfg->distribution = kSizeUniform;
+    } else if (value == "lognormal") {
+      cfg->distribution = kSizeLogNormal;
+    } else {
+      (*err) += "Unknown distribution: " + value + "\n";
+    }
+  } else if (name == "--dtypes") {
+    parse_dtypes(value, &cfg->dtypes, err);
+  } else if (name == "--name-length") {
+    cfg->name_length = n;
+  } else if (name == "--metadata-bytes") {
+    cfg->metadata_bytes = n;
+  } else if (name == "--seed") {
+    cfg->seed = uint32_t(n);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Build the layout(tensors and metadata, no data) of a synthetic file.
+inline void make_layout(const config &cfg, safetensors::safetensors_t *st) {
+  std::mt19937 engine(cfg.seed);
+  std::uniform_real_distribution<double> uniform(0.0, 1.0);
+  std::lognormal_distribution<double> lognormal(
+      std::log(double((std::max)(cfg.tensor_bytes, size_t(1)))), 1.5);
+
+  for (size_t i = 0; i < cfg.num_tensors; i++) {
+    safetensors::tensor_t tensor;
+    tensor.dtype = cfg.dtypes.empty()
+                       ? safetensors::dtype::kFLOAT32
+                       : cfg.dtypes[i % cfg.dtypes.size()];
+    size_t itembytes = safetensors::get_dtype_bytes(tensor.dtype);
+
+    double bytes = double(cfg.tensor_bytes);
+    if (cfg.distribution == kSizeUniform) {
+      bytes = 1.0 + uniform(engine) * 2.0 * double(cfg.tensor_bytes);
+    } else if (cfg.distribution == kSizeLogNormal) {
+      bytes = lognormal(engine);
+    }
+
+    size_t nitems = (std::max)(size_t(bytes) / itembytes, size_t(1));
+
+    // 2D [rows, 256] when possible, like weight matrices.
+    if ((nitems >= 256) && ((nitems % 256) == 0)) {
+      tensor.shape = {nitems / 256, 256};
+    } else {
+      tensor.shape = {nitems};
+    }
+    tensor.data_offsets = {{0, 0}};  // computed by writer
+
+    std::string name = "model.layers." + std::to_string(i) + ".weight";
+    if (name.size() < cfg.name_length) {
+      name = std::string(cfg.name_length - name.size(), 'x') + "." + name;
+    }
+
+    st->tensors.insert(name, tensor);
+  }
+
+  if (cfg.metadata_bytes) {
+    st->metadata.insert("synthetic.padding",
+                        std::string(cfg.metadata_bytes, 'm'));
+  }
+  st->metadata.insert("synthetic.seed", std::to_string(cfg.seed));
+}
+
+// Fill `n` bytes with pseudo random values(non-zero, so that the data is not
+// trivially compressible nor sparse).
+inline void fill_random(uint8_t *dst, size_t n, uint64_t seed) {
+  uint64_t x = seed * 0x9E3779B97F4A7C15ull + 1;
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    // xorshift64
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    memcpy(dst + i, &x, 8);
+  }
+  for (; i < n; i++) {
+    dst[i] = uint8_t(i * 31 + seed);
+  }
+}
+
+//
+// Generate synthetic safetensors file.
+//
+// @return true upon success. `err` will be filled when false.
+inline bool generate(const std::string &filename, const config &cfg,
+                     std::string *err) {
+  safetensors::safetensors_t layout;
+  make_layout(cfg, &layout);
+
+  std::string warn;
+  safetensors::mmap_writer writer;
+  if (!writer.open(filename, layout, &warn, err)) {
+    return false;
+  }
+
+  for (size_t i = 0; i < layout.tensors.size(); i++) {
+    uint8_t *data{nullptr};
+    size_t nbytes{0};
+    if (!writer.get_tensor_data(layout.tensors.keys()[i], &data, &nbytes,
+                                err)) {
+      return false;
+    }
+    fill_random(data, nbytes, cfg.seed + i);
+  }
+
+  return writer.finalize(err);
+}
+
+}  // namespace synthetic
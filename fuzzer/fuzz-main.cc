@@ -1,6 +1,8 @@
 #define SAFETENSORS_CPP_IMPLEMENTATION
 #include "safetensors.hh"
 
+// `load_from_memory` also decodes compressed files(`save_compressed`), so the
+// seeds in `corpus/` reach the chunk table parser.
 static void parse_safetensors(const uint8_t *data, size_t size)
 {
   safetensors::safetensors_t st;
@@ -176,6 +176,58 @@ const char *safetensors_c_get_metadata_at(const safetensors_c_safetensors_t *st,
 
 // TODO: Write API
 
+///
+/// Cumulative process-wide counters. See `safetensors::global_counters`.
+///
+typedef struct safetensors_c_counters {
+  uint64_t files_opened;
+  uint64_t bytes_mapped;
+  uint64_t bytes_read;
+  uint64_t bytes_written;
+  uint64_t tensors_materialized;
+  uint64_t cache_hits;
+  uint64_t cache_misses;
+  uint64_t cache_evictions;
+  uint64_t prefetch_issued;
+  uint64_t prefetch_used;
+  uint64_t convert_bytes;
+} safetensors_c_counters_t;
+
+///
+/// Take a snapshot of process-wide counters.
+/// @return SAFETENSORS_C_SUCCESS upon success.
+///
+int safetensors_c_get_counters(safetensors_c_counters_t *counters);
+
+///
+/// Reset process-wide counters to zero.
+///
+void safetensors_c_reset_counters(void);
+
+///
+/// Format current counters in Prometheus text exposition format.
+/// Memory will be allocated for `text`. Need to free `text` after using it.
+/// @param[in] prefix Metric name prefix. Can be NULL("safetensors").
+/// @return SAFETENSORS_C_SUCCESS upon success.
+///
+int safetensors_c_format_counters(const char *prefix, char **text);
+
+///
+/// Progress callback. Return 0 to cancel the operation.
+/// See `safetensors::set_thread_progress_callback` for details.
+///
+typedef int (*safetensors_c_progress_callback_t)(const char *operation,
+                                                 uint64_t bytes_done,
+                                                 uint64_t bytes_total,
+                                                 const char *tensor,
+                                                 void *userdata);
+
+///
+/// Bind progress callback to the calling thread. Pass NULL to unbind.
+///
+void safetensors_c_set_progress_callback(
+    safetensors_c_progress_callback_t callback, void *userdata);
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif
@@ -212,6 +264,21 @@ safetensors_c_dtype_t convert_cpp_dtype(safetensors::dtype dtype) {
   return SAFETENSORS_C_DTYPE_INVALID;
 }
 
+struct progress_binding {
+  safetensors_c_progress_callback_t callback{nullptr};
+  void *userdata{nullptr};
+};
+
+thread_local progress_binding tls_progress_binding;
+
+bool progress_trampoline(const safetensors::progress_info &info,
+                         void *userdata) {
+  const progress_binding *b =
+      reinterpret_cast<const progress_binding *>(userdata);
+  return b->callback(info.operation, info.bytes_done, info.bytes_total,
+                     info.tensor, b->userdata) != 0;
+}
+
 }
 };
 
@@ -439,6 +506,65 @@ void safetensors_c_tensor_free(safetensors_c_tensor_t *st) {
   return;
 }
 
+int safetensors_c_get_counters(safetensors_c_counters_t *counters) {
+  if (!counters) {
+    return SAFETENSORS_C_INVALID_ARGUMENT;
+  }
+
+  safetensors::global_counters c = safetensors::get_global_counters();
+
+  counters->files_opened = c.files_opened;
+  counters->bytes_mapped = c.bytes_mapped;
+  counters->bytes_read = c.bytes_read;
+  counters->bytes_written = c.bytes_written;
+  counters->tensors_materialized = c.tensors_materialized;
+  counters->cache_hits = c.cache_hits;
+  counters->cache_misses = c.cache_misses;
+  counters->cache_evictions = c.cache_evictions;
+  counters->prefetch_issued = c.prefetch_issued;
+  counters->prefetch_used = c.prefetch_used;
+  counters->convert_bytes = c.convert_bytes;
+
+  return SAFETENSORS_C_SUCCESS;
+}
+
+void safetensors_c_reset_counters(void) {
+  safetensors::reset_global_counters();
+}
+
+void safetensors_c_set_progress_callback(
+    safetensors_c_progress_callback_t callback, void *userdata) {
+  safetensors_c::detail::progress_binding &b =
+      safetensors_c::detail::tls_progress_binding;
+  b.callback = callback;
+  b.userdata = userdata;
+  if (callback) {
+    safetensors::set_thread_progress_callback(
+        safetensors_c::detail::progress_trampoline, &b);
+  } else {
+    safetensors::set_thread_progress_callback(nullptr, nullptr);
+  }
+}
+
+int safetensors_c_format_counters(const char *prefix, char **text) {
+  if (!text) {
+    return SAFETENSORS_C_INVALID_ARGUMENT;
+  }
+
+  std::string s = safetensors::format_global_counters(
+      safetensors::get_global_counters(), prefix ? prefix : "safetensors");
+
+  char *buf = reinterpret_cast<char *>(malloc(s.size() + 1));
+  if (!buf) {
+    return SAFETENSORS_C_MALLOC_ERROR;
+  }
+  memcpy(buf, s.c_str(), s.size() + 1);
+
+  (*text) = buf;
+
+  return SAFETENSORS_C_SUCCESS;
+}
+
 
 #ifdef __cplusplus
 }  // extern "C"
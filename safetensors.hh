@@ -5,7 +5,9 @@
 #pragma once
 
 #include <array>
+#include <limits>
 #include <map>
+#include <memory>
 #include <string>
 #include <vector>
 #include <cstdint>
@@ -129,12 +131,78 @@ class ordered_dict {
 template <typename T>
 using ordered_dict = minijson::ordered_dict<T>;
 
+enum mmap_mode {
+  kMMAP_READ_ONLY,      // MAP_SHARED + PROT_READ
+  kMMAP_COPY_ON_WRITE,  // MAP_PRIVATE + PROT_READ|PROT_WRITE. Modification is
+                        // not written back to the file. Only touched pages
+                        // are duplicated.
+  kMMAP_READ_WRITE,     // MAP_SHARED + PROT_READ|PROT_WRITE. Modification is
+                        // written back to the file(use `flush_tensors` to
+                        // persist it explicitly).
+};
+
 struct tensor_t {
   safetensors::dtype dtype;
   std::vector<size_t> shape;
   std::array<size_t, 2> data_offsets;
 };
 
+//
+// Access trace: which tensors(and byte ranges) a workload touched, in the
+// order of first access.
+//
+struct access_record {
+  std::string name;  // tensor name
+  size_t begin{0};   // byte range relative to the beginning of the tensor data
+  size_t end{0};
+};
+
+struct access_trace {
+  std::vector<access_record> records;
+
+  // Record access to [begin, end) bytes of tensor `name`.
+  // Access contiguous to(or same as) the last record is merged into it.
+  // `record` and `clear` are serialized by a mutex when
+  // `SAFETENSORS_CPP_USE_THREADS` is defined.
+  void record(const std::string &name, size_t begin, size_t end);
+
+  void clear();
+};
+
+//
+// Concurrency model
+//
+// - `safetensors_t` is not modified by the library after `load_from_*` or
+//   `mmap_from_*` returns. Any number of threads can read it concurrently
+//   without locking: `tensors`/`metadata` lookup and iteration,
+//   `get_tensor_data`, `validate_data_offsets`, `save_to_*`, etc.
+//   Exceptions:
+//   - `trace` records accesses under a mutex when
+//     `SAFETENSORS_CPP_USE_THREADS` is defined, otherwise only one thread
+//     may read a traced `safetensors_t` at a time. Read `records` after
+//     the traced readers have finished.
+//   - Writing through `get_mutable_tensor_data` and `flush_tensors` on the
+//     same tensor must be synchronized by the app.
+// - Loading into/destroying a `safetensors_t` must not race with readers.
+// - `lazy_loader::get_tensor_data` is thread-safe. Each tensor is read once
+//   under a per-tensor mutex and published atomically(a failed read is
+//   retried by the next caller). After that, access is lock-free.
+// - `model_registry::acquire` is lock-free and can be called from any
+//   thread. Other `model_registry` methods are serialized by a mutex when
+//   `SAFETENSORS_CPP_USE_THREADS` is defined, otherwise they must be called
+//   from one thread at a time.
+// - `prefetcher` and `mmap_writer` methods must be called from one thread
+//   at a time.
+// - `io_stats` and progress callback are bound per thread. Process-wide
+//   counters are atomic.
+// - Error messages use thread-safe `strerror_r`.
+// - `num_threads` of `load_many_options`, `dedup_options`,
+//   `compare_options` and `compress_options`: the size of the worker pool,
+//   including the calling thread. 0 = std::thread::hardware_concurrency().
+//   Ignored(always 1) unless `SAFETENSORS_CPP_USE_THREADS` is defined.
+//   `lora_options::num_threads` is 1(merge on the reading thread) or any
+//   other value(one background merge thread).
+//
 struct safetensors_t {
   // we need ordered dict(preserves the order of key insertion)
   // as done in Python's OrderedDict, since JSON data may not be sorted by its key string.
@@ -144,6 +212,7 @@ struct safetensors_t {
   size_t header_size{0};         // JSON size
 
   bool mmaped{false};
+  mmap_mode map_mode{kMMAP_READ_ONLY};
 
   //
   // Following members are set when mmaped.
@@ -155,10 +224,111 @@ struct safetensors_t {
   // opaque pointer to safetensors_file and safetensors_mmap
   void *st_file{nullptr};
   void *st_mmap{nullptr};
+  // opaque pointer to the mapping shared through the mapping cache.
+  // `st_file` and `st_mmap` are nullptr when set.
+  void *st_shared{nullptr};
+
+  // Opt-in access recorder. When set, `get_tensor_data` records accesses to
+  // it.
+  access_trace *trace{nullptr};
 
   ~safetensors_t();
 };
 
+//
+// Per-phase load/save statistics.
+//
+// Compiled in only when `SAFETENSORS_CPP_ENABLE_STATS` is defined. Otherwise
+// instrumentation compiles to nothing and `set_thread_io_stats` is no-op.
+//
+// Bind `io_stats` to the calling thread with `set_thread_io_stats`, then
+// every load/save API called on the thread accumulates into it(values are
+// not reset by the library).
+//
+struct io_stats {
+  double open_seconds{0.0};         // file open(+ size query)
+  double header_read_seconds{0.0};  // read/copy header JSON
+  double parse_seconds{0.0};        // JSON parse
+  double validate_seconds{0.0};     // validate_data_offsets
+  double data_seconds{0.0};         // tensor data read/copy
+  double mmap_seconds{0.0};         // mmap(+ populate)
+  double serialize_seconds{0.0};    // header JSON serialization
+  double write_seconds{0.0};        // file write
+  double flush_seconds{0.0};        // msync
+  uint64_t bytes_read{0};           // from file
+  uint64_t bytes_copied{0};         // memory to memory
+  uint64_t bytes_written{0};        // to file
+  uint64_t syscalls{0};  // I/O syscalls issued(approx. for iostream path)
+  int64_t minor_faults{0};  // getrusage delta of the API call
+  int64_t major_faults{0};
+};
+
+// Bind `stats` to the calling thread. nullptr to unbind.
+void set_thread_io_stats(io_stats *stats);
+
+//
+// Cumulative process-wide counters.
+//
+// Always enabled(independent of `SAFETENSORS_CPP_ENABLE_STATS`). Counters are
+// relaxed atomics, so they can be read at any time from any thread.
+//
+struct global_counters {
+  uint64_t files_opened{0};
+  uint64_t bytes_mapped{0};
+  uint64_t bytes_read{0};     // read() to memory(`load_from_file`)
+  uint64_t bytes_written{0};  // file write + msync
+  uint64_t tensors_materialized{0};  // tensor data copied or accessed
+  uint64_t cache_hits{0};       // data was resident on access
+  uint64_t cache_misses{0};     // access waited for I/O
+  uint64_t cache_evictions{0};  // data dropped by the library
+  uint64_t prefetch_issued{0};  // speculative loads/readahead hints
+  uint64_t prefetch_used{0};    // speculative loads consumed later
+  uint64_t convert_bytes{0};    // source bytes of bulk dtype conversion
+};
+
+// Take a snapshot of the counters.
+global_counters get_global_counters();
+
+// Reset all counters to zero.
+void reset_global_counters();
+
+//
+// Format counters in Prometheus text exposition format.
+// Each counter is exported as `<prefix>_<name>_total`(byte counters are
+// named `<prefix>_<what>_bytes_total`. e.g. `safetensors_mapped_bytes_total`).
+//
+std::string format_global_counters(const global_counters &counters,
+                                   const std::string &prefix = "safetensors");
+
+//
+// Progress reporting and cancellation.
+//
+// Bind a callback to the calling thread with `set_thread_progress_callback`.
+// `load_from_file`, `load_from_memory`, `save_to_file`, `save_to_memory` and
+// `mmap_writer::finalize` called on the thread invoke it after each chunk
+// (`kProgressChunkSize` bytes) of data is processed. For nested calls(e.g.
+// `save_to_file` calls `save_to_memory`), only the outermost operation
+// reports.
+//
+// Returning false from the callback cancels the operation: it returns false
+// with "Cancelled" error, memory allocated for the operation is released and
+// a partially written output file is removed.
+//
+constexpr size_t kProgressChunkSize = 16 * 1024 * 1024;
+
+struct progress_info {
+  const char *operation{""};  // API name. e.g. "load_from_file"
+  uint64_t bytes_done{0};
+  uint64_t bytes_total{0};
+  const char *tensor{""};  // tensor being processed. Empty when unknown.
+};
+
+// @return false to cancel the operation.
+typedef bool (*progress_callback)(const progress_info &info, void *userdata);
+
+// nullptr to unbind.
+void set_thread_progress_callback(progress_callback callback, void *userdata);
+
 //
 // Load safetensors from file.
 // databuffer is copied to `safetensors_t::storage`.
@@ -174,6 +344,66 @@ struct safetensors_t {
 bool load_from_file(const std::string &filename, safetensors_t *st,
                     std::string *warn, std::string *err);
 
+//
+// Reload tensor data of `filename` into `st` loaded with `load_from_file` or
+// `load_from_memory`(e.g. rotating checkpoints of the same architecture).
+//
+// The header of `filename` must have the same tensors(names, dtypes and
+// shapes) as `st`. Tensor data is read directly into the existing
+// `storage`, so data pointers stay valid and `storage`/`tensors` are not
+// reallocated. When the data layout(data_offsets) also matches, the whole
+// databuffer is read at once, otherwise tensor by tensor. `metadata` is
+// replaced with the one of `filename`.
+//
+// `st` is not modified when the header does not match. When reading data
+// fails, tensor data in `st` is partially updated.
+//
+// @param[inout] st safetensors data.
+// @param[in] filename Filepath. Assume UTF-8 filepath.
+// @param[out] warn Warning message buffer(can be nullptr)
+// @param[out] err Error message buffer(can be nullptr)
+//
+// @return true upon success.
+bool reload_into(safetensors_t *st, const std::string &filename,
+                 std::string *warn, std::string *err);
+
+// Low-rank adapter(LoRA) naming convention and scale.
+//
+// An adapter tensor pair `<prefix><stem><a_suffix>`(A: [rank, in]) and
+// `<prefix><stem><b_suffix>`(B: [out, rank]) is merged into the base tensor
+// `<stem><base_suffix>`(W: [out, in]). `prefix` is optional in adapter
+// names. Trailing dims of 1x1 conv weights are flattened into `in`.
+struct lora_options {
+  // Multiplier of the update. When the adapter has a `<prefix><stem>.alpha`
+  // scalar, `scale * alpha / rank` is used instead.
+  float scale{1.0f};
+  std::string prefix{"base_model.model."};
+  std::string a_suffix{".lora_A.weight"};
+  std::string b_suffix{".lora_B.weight"};
+  std::string base_suffix{".weight"};
+  size_t num_threads{0};  // see "Concurrency model"
+};
+
+//
+// Load `base_filename` to `storage` and merge the adapter `adapter_filename`
+// into it: W += scale * B * A for each A/B pair.
+//
+// The base is read in `kProgressChunkSize` chunks and each base tensor is
+// merged in place right after its data is read(on a background thread
+// overlapping the following reads when SAFETENSORS_CPP_USE_THREADS is
+// defined and `num_threads` is not 1). The update is blocked over
+// columns and accumulated in FP32; W can be F32, F16 or BF16, A and B can be
+// F32, F16 or BF16. No full-size temporary buffer is allocated.
+//
+// Fails when an A/B pair is incomplete, its base tensor does not exist or
+// shapes do not match. Other adapter tensors are ignored with a warning.
+//
+// @return true upon success.
+bool load_with_lora(const std::string &base_filename,
+                    const std::string &adapter_filename,
+                    const lora_options &options, safetensors_t *st,
+                    std::string *warn, std::string *err);
+
 //
 // Load safetensors data from memory.
 // databuffer is copied to `safetensors_t::storage`.
@@ -198,16 +428,40 @@ bool load_from_memory(const uint8_t *addr, const size_t nbytes,
 // databuffer is not copied to `safetensors_t` object, thus the app must hold
 // file during `safetensor_t` object is live.
 //
+// With `kMMAP_COPY_ON_WRITE`, tensor data can be modified in memory through
+// `get_mutable_tensor_data`, and saved with `save_to_file`(to another file.
+// Do not overwrite the mapped file).
+//
+// With `kMMAP_READ_WRITE`, tensor data is updated in place in the file. Header
+// is never modified, so tensor dtype/shape cannot be changed.
+//
 // @param[in] filename Filepath. Assume UTF-8 filepath.
 // @param[out] st safetensors data.
 // @param[out] warn Warning message buffer(can be nullptr if you don't need
 // warning message)
 // @param[out] err Error message buffer(can be nullptr if you don't need error
 // message)
+// @param[in] mode mmap mode.
 //
 // @return true upon success. `err` will be filled when false.
 bool mmap_from_file(const std::string &filename, safetensors_t *st,
-                    std::string *warn, std::string *err);
+                    std::string *warn, std::string *err,
+                    mmap_mode mode = kMMAP_READ_ONLY);
+
+//
+// Process-wide mapping cache.
+//
+// `mmap_from_file` with `kMMAP_READ_ONLY` shares the mapping and the parsed
+// header among `safetensors_t` objects opening the same file(same device,
+// inode, size and mtime). A repeat open costs a `stat` and a copy of the
+// tensor dict, and adds no mapping. The file is unmapped when the last
+// `safetensors_t` referencing it is destroyed.
+// Enabled by default. Not available on Windows.
+//
+void set_mapping_cache_enabled(bool enabled);
+
+// The number of distinct files currently mapped through the cache.
+size_t mapping_cache_size();
 
 //
 // Load safetensors from mmaped region.
@@ -228,6 +482,101 @@ bool mmap_from_memory(const uint8_t *arr, const size_t nbytes,
                       const std::string &filename, safetensors_t *st,
                       std::string *warn, std::string *err);
 
+//
+// Cross-process sharing(Linux only).
+//
+// A loader process writes safetensors data(e.g. loaded with a copy or
+// converted) to a sealed anonymous memory file(memfd) with
+// `export_to_memfd`, and passes the fd to worker processes over a Unix
+// domain socket with `send_fd`/`recv_fd`. Workers map the same physical
+// pages read-only with `open_shared`. The memfd holds a whole safetensors
+// image(header + data), so no other information needs to be sent.
+// The loader can drop its `safetensors_t` after exporting and
+// `open_shared` the memfd itself.
+//
+
+//
+// @param[in] st safetensors data.
+// @param[in] name memfd name(for debugging. Shown in /proc/<pid>/fd).
+// @param[out] fd Sealed memfd(close-on-exec). The app closes it.
+// @param[out] warn Warning message buffer(can be nullptr)
+// @param[out] err Error message buffer(can be nullptr)
+//
+// @return true upon success.
+bool export_to_memfd(const safetensors_t &st, const std::string &name,
+                     int *fd, std::string *warn, std::string *err);
+
+//
+// Map a memfd exported with `export_to_memfd` read-only. `fd` is
+// duplicated, so the app still owns `fd`. Fails when `fd` is not sealed
+// against write and shrink, since then another process could modify or
+// truncate the data under the mapping.
+//
+bool open_shared(int fd, safetensors_t *st, std::string *warn,
+                 std::string *err);
+
+// Send `fd` over a connected Unix domain socket `sock`(SCM_RIGHTS).
+bool send_fd(int sock, int fd, std::string *err);
+
+// Receive an fd sent with `send_fd`. The received fd is close-on-exec.
+bool recv_fd(int sock, int *fd, std::string *err);
+
+//
+// Batch loading of many small files(e.g. LoRA adapters).
+//
+struct load_many_options {
+  size_t num_threads{0};  // see "Concurrency model"
+};
+
+struct load_many_result {
+  // `files[i]` is a read-only view of `paths[i]` in `arena`(`mmaped` is
+  // true, `storage` is empty). Empty when loading `paths[i]` failed.
+  std::vector<safetensors_t> files;
+  std::vector<std::string> errors;  // per file. Empty upon success.
+
+  // Every file image(header + data), each aligned to 64 bytes.
+  // Not zero-initialized.
+  std::unique_ptr<uint8_t[]> arena;
+  size_t arena_size{0};
+  size_t arena_capacity{0};
+
+  size_t num_failed{0};
+  uint64_t bytes_read{0};
+  double seconds{0.0};
+  double files_per_second{0.0};
+
+  load_many_result() = default;
+  load_many_result(const load_many_result &) = delete;
+  load_many_result &operator=(const load_many_result &) = delete;
+  load_many_result(load_many_result &&) = default;
+  load_many_result &operator=(load_many_result &&) = default;
+};
+
+//
+// Load many files into one contiguous arena.
+//
+// File sizes are queried first to allocate the arena once. Then each file
+// is read with one positional read directly into its slot in the arena and
+// its header is parsed in place(no per-file data allocation/copy). Files
+// are processed in parallel with a thread pool when
+// `SAFETENSORS_CPP_USE_THREADS` is defined.
+//
+// Passing `result` of a previous call reuses its arena when it is large
+// enough(e.g. reloading a set of adapters). Views of the previous call are
+// invalidated.
+//
+// @param[in] paths Filepaths. Assume UTF-8 filepath.
+// @param[in] options Options.
+// @param[out] result Loaded files and throughput.
+// @param[out] warn Warning message buffer(can be nullptr)
+// @param[out] err Error message buffer(can be nullptr)
+//
+// @return true when all files are loaded. Files loaded successfully are
+// usable even when false is returned(see `result->errors`).
+bool load_many(const std::vector<std::string> &paths,
+               const load_many_options &options, load_many_result *result,
+               std::string *warn, std::string *err);
+
 //
 // Save safetensors to file.
 //
@@ -253,4611 +602,11383 @@ bool save_to_file(const safetensors_t &st, const std::string &filename,
 // message)
 //
 // @return true upon success. `err` will be filled when false.
-bool save_to_memory(const std::string &filename, std::vector<uint8_t> *data_out,
+bool save_to_memory(const safetensors_t &st, std::vector<uint8_t> *data_out,
                     std::string *warn, std::string *err);
 
 //
-// Utility functions
+// Memory-mapped zero-copy writer.
 //
+// Usage:
+//  - Fill `tensors`(dtype and shape) and `metadata` of layout
+//    `safetensors_t`. data_offsets are ignored and computed by the writer
+//    (tensors are packed in insertion order).
+//  - `open()` writes the header, resizes the file to its final size and maps
+//    it writable.
+//  - Write tensor data directly to the address from `get_tensor_data()`.
+//  - `finalize()` writes back the mapping(msync) and closes the file.
+//
+// If the writer is destroyed without `finalize()`, the incomplete output file
+// is removed.
+//
+class mmap_writer {
+ public:
+  mmap_writer() = default;
+  ~mmap_writer();
 
-// Returns shape[0] * shape[1] * ...
-// Empty Tensor(any shape[i] is 0) returns 0.
-// Zero-rank tensor([]) return 1.
-size_t get_shape_size(const tensor_t &t);
-
-// Returns dtype size in bytes.
-size_t get_dtype_bytes(const safetensors::dtype dtype);
-std::string get_dtype_str(const safetensors::dtype dtype);
+  mmap_writer(const mmap_writer &) = delete;
+  mmap_writer &operator=(const mmap_writer &) = delete;
 
-// Validate data_offsets of all tensors in safetensors_t.
-bool validate_data_offsets(const safetensors_t &st, std::string &err);
+  //
+  // @param[in] filename Output filepath. Assume UTF-8 filepath.
+  // @param[in] layout Tensors and metadata to write.
+  // @param[out] warn Warning message buffer(can be nullptr)
+  // @param[out] err Error message buffer(can be nullptr)
+  //
+  // @return true upon success.
+  bool open(const std::string &filename, const safetensors_t &layout,
+            std::string *warn, std::string *err);
 
-uint16_t float_to_bfloat16(float x);
-float bfloat16_to_float(uint16_t x);
+  //
+  // Get the address of tensor data in the output file.
+  //
+  bool get_tensor_data(const std::string &name, uint8_t **data,
+                       size_t *nbytes, std::string *err = nullptr);
 
-uint16_t float_to_fp16(float x);
-float fp16_to_float(uint16_t x);
+  //
+  // Write back all pages and close the file.
+  //
+  bool finalize(std::string *err);
 
-}  // namespace safetensors
+  // Total file size in bytes(valid after `open()`)
+  size_t file_size() const;
 
-#if defined(SAFETENSORS_CPP_IMPLEMENTATION)
+ private:
+  void *_impl{nullptr};
+};
 
-#include <cstring>
-#include <fstream>
-#include <memory>
+//
+// Lazy loader: parses the header on `open()`, and reads each tensor's data
+// from the file(pread) on its first access.
+//
+// `get_tensor_data` can be called from multiple threads concurrently. Data of
+// a tensor is read once(when compiled with `SAFETENSORS_CPP_USE_THREADS`.
+// Otherwise concurrent first accesses may read it more than once, but only
+// one copy is published) and never freed until the loader is destroyed, so
+// returned pointers stay valid. A failed read is retried on the next access.
+//
+class lazy_loader {
+ public:
+  lazy_loader() = default;
+  ~lazy_loader();
 
-#ifdef __has_include
-#if __has_include(<unistd.h>)
-#include <unistd.h>
-#if defined(_POSIX_MAPPED_FILES)
-#include <sys/mman.h>
-#endif
-#if defined(_POSIX_MEMLOCK_RANGE)
-#include <sys/resource.h>
-#endif
-#endif
-#endif
+  lazy_loader(const lazy_loader &) = delete;
+  lazy_loader &operator=(const lazy_loader &) = delete;
 
-#if defined(_WIN32)
-#define WIN32_LEAN_AND_MEAN
-#ifndef NOMINMAX
-#define NOMINMAX
-#endif
-#include <io.h>
-#include <stdio.h>  // for _fseeki64
-#include <windows.h>
-#endif
+  //
+  // @param[in] filename Filepath. Assume UTF-8 filepath.
+  // @param[out] warn Warning message buffer(can be nullptr)
+  // @param[out] err Error message buffer(can be nullptr)
+  //
+  // @return true upon success.
+  bool open(const std::string &filename, std::string *warn, std::string *err);
 
-#if !defined(MINIJSON_IMPLEMENTATION)
-#define MINIJSON_IMPLEMENTATION
-#endif
+  //
+  // Tensors and metadata. Data is not loaded(`storage` is empty).
+  //
+  const safetensors_t &header() const;
 
-// minijson: https://github.com/syoyo/minijson
+  //
+  // Get tensor data. Reads it from the file on the first call. Thread-safe.
+  //
+  bool get_tensor_data(const std::string &name, const uint8_t **data,
+                       size_t *nbytes, std::string *err = nullptr);
 
-/*
- * JSON parser: C++ oriented JSON parser.
- */
+  // Total bytes of tensor data read so far.
+  size_t materialized_bytes() const;
 
-#include <iostream>
-#include <map>
-#include <sstream>
-#include <string>
-#include <vector>
+  // Number of tensor reads from the file so far, including failed ones.
+  size_t num_reads() const;
 
-//#define __MINIJSON_LIBERAL
+ private:
+  void *_impl{nullptr};
+};
 
-// We recommended to use simdjson from_chars.
-// Using strtod() is a fallback
-#if defined(MINIJSON_USE_STRTOD)
-// Use stdlib's strtod
-#include <cstring>
-#else
+//
+// Refcounted read-only snapshot of a file in `model_registry`.
+// The snapshot stays mapped while any handle references it, even after a
+// newer version is published. Handles must not outlive the registry.
+//
+class model_snapshot {
+ public:
+  model_snapshot() = default;
+  ~model_snapshot();
 
-namespace minijson {
-namespace simdjson {
-namespace internal {
+  model_snapshot(const model_snapshot &rhs);
+  model_snapshot &operator=(const model_snapshot &rhs);
+  model_snapshot(model_snapshot &&rhs) noexcept;
+  model_snapshot &operator=(model_snapshot &&rhs) noexcept;
 
-double from_chars(const char *first) noexcept;
-double from_chars(const char *first, const char *end) noexcept;
+  bool valid() const { return _impl != nullptr; }
 
-char *to_chars(char *first, const char *last, double value);
+  // Returns empty `safetensors_t` when not valid.
+  const safetensors_t &get() const;
+  const safetensors_t *operator->() const { return &get(); }
 
-}  // namespace internal
-}  // namespace simdjson
-}  // namesapce minijson
+  // 1 for the first load. Incremented on each reload.
+  uint64_t version() const;
 
-#endif
+  // Drop the reference.
+  void reset();
 
-namespace minijson {
+ private:
+  friend class model_registry;
+  void *_impl{nullptr};
+};
 
-namespace detail {
+//
+// Registry of mmapped files keyed by path, with RCU-style hot reload.
+//
+// `acquire` is lock-free and never blocks on a reload: it returns the
+// currently published snapshot. A reload maps the new version first, then
+// atomically publishes it. The old version is retired and unmapped by the
+// next `poll`/`collect`(or the watcher thread) after its last reader drops
+// the reference.
+//
+// Files are compared by (device, inode, size, mtime). Replace files
+// atomically(write to a temporary file then `rename`). Truncating a mapped
+// file in-place crashes readers with SIGBUS.
+//
+class model_registry {
+ public:
+  model_registry();
+  ~model_registry();
 
-double from_chars(const char *p);
-const char *my_strchr(const char *p, int ch);
+  model_registry(const model_registry &) = delete;
+  model_registry &operator=(const model_registry &) = delete;
 
-}  // namespace detail
+  //
+  // Map `filename` and register it. Reloads it when already registered and
+  // changed on disk.
+  //
+  // @param[in] filename Filepath(used as the key). Assume UTF-8 filepath.
+  // @param[out] warn Warning message buffer(can be nullptr)
+  // @param[out] err Error message buffer(can be nullptr)
+  //
+  // @return true upon success.
+  bool add(const std::string &filename, std::string *warn, std::string *err);
 
-namespace detail {
+  //
+  // Unregister `filename`. Outstanding snapshots stay valid.
+  //
+  bool remove(const std::string &filename);
 
-//
-// Usage:
-//  - set_input()
-//  - scan_string()
-//    - success: use `token_buffer` string
-//    - error: use `error_message`
-//
-struct string_parser {
-  // input string must be UTF-8
-  void set_input(const std::string &s) { _input = s; }
+  //
+  // Get the current snapshot of `filename`. Lock-free. Thread-safe.
+  //
+  // @return false when `filename` is not registered.
+  bool acquire(const std::string &filename, model_snapshot *snapshot) const;
 
-  bool scan_string();
+  //
+  // Reload `filename` if it changed on disk(always when `force` is true).
+  // The current snapshot is kept when loading fails.
+  //
+  bool reload(const std::string &filename, bool force, std::string *warn,
+              std::string *err);
 
-  void reset() {
-    if (_input.size()) {
-      current = _input[0];
-    } else {
-      current = '\0';
-    }
-    curr_idx = 0;
-    token_buffer.clear();
-  }
+  //
+  // Reload all changed files and unmap retired snapshots no longer
+  // referenced.
+  //
+  // @return the number of reloaded files.
+  size_t poll(std::string *warn, std::string *err);
 
-  // fetch next token.
-  unsigned char get() {
-    if ((curr_idx + 1) < _input.size()) {
-      curr_idx++;
-      current = _input[curr_idx];
-      return current;
-    }
-    current = '\0';
-    return current;
-  }
+  //
+  // Unmap retired snapshots no longer referenced.
+  //
+  // @return the number of unmapped snapshots.
+  size_t collect();
 
-  bool eof() {
-    if (_input.empty()) {
-      return true;
-    }
+  //
+  // Watch registered files on a background thread and reload them on
+  // change. Uses inotify on Linux(plus polling every `interval_ms` as a
+  // fallback), polling otherwise. Requires `SAFETENSORS_CPP_USE_THREADS`.
+  //
+  bool start_watching(uint32_t interval_ms, std::string *err);
+  void stop_watching();
 
-    if (curr_idx >= _input.size()) {
-      return true;
-    }
+  // Error of the most recent failed reload on the watcher thread.
+  std::string last_error() const;
 
-    return false;
-  }
+ private:
+  void *_impl{nullptr};
+};
 
-  void add(const unsigned char c) { token_buffer += c; }
+//
+// Delta checkpoint.
+//
+// A delta file is a regular safetensors file holding only tensors which
+// differ from a base file. Its `__metadata__` records the chain:
+//
+// - `__delta__.base` : Path of the base file. A relative path is resolved
+//   against the directory of the delta file.
+// - `__delta__.base_hash` : Hash of the base file header(hex), to detect a
+//   replaced base.
+// - `__delta__.hash.<name>` : Content hash(`hash_bytes`, hex) of tensor
+//   `<name>` of the base, for each base tensor the delta does not store.
+//   Detects a base rewritten with the same header but other data.
+// - `__delta__.removed.<name>` : Tensor `<name>` of the base is removed.
+//
+// The base can itself be a delta, forming a chain.
+//
 
-  void add(const int i) {
-    // use lower 8bit
-    token_buffer += static_cast<unsigned char>(i & 0xff);
-  }
+//
+// Save tensors of `st` which differ from `base_filename`(a plain file or a
+// delta chain) to `filename`. A tensor is stored when it is not in the base,
+// or its dtype, shape or content differs. Metadata of `st` is stored as is.
+//
+// An absolute `base_filename` is recorded as is. A relative one is recorded
+// relative to the directory of `filename`, and fails when that is not
+// possible(`filename` is absolute or above the working directory).
+//
+// @param[out] num_stored The number of tensors stored in the delta(can be
+// nullptr).
+//
+// @return true upon success.
+bool save_delta(const safetensors_t &st, const std::string &base_filename,
+                const std::string &filename, size_t *num_stored,
+                std::string *warn, std::string *err);
 
-  int get_codepoint();
+//
+// Merged read-only view of a delta chain. Every file of the chain is
+// mmaped(read-only) and each tensor is served from the newest file holding
+// it, so only the tensors actually accessed are read from disk.
+//
+// Tensor order is the order of the root base, with tensors added by deltas
+// appended. Metadata is the one of the newest file(without `__delta__.*`).
+// Thread-safe for concurrent reads after `open()`.
+//
+class delta_view {
+ public:
+  delta_view() = default;
+  ~delta_view();
 
-  bool next_byte_in_range(const std::initializer_list<int> ranges);
+  delta_view(const delta_view &) = delete;
+  delta_view &operator=(const delta_view &) = delete;
 
-  std::string error_message;
-  std::string token_buffer;  // output
+  //
+  // Open `filename` and its chain of bases.
+  //
+  // Base tensors a delta relies on are read and checked against their
+  // recorded content hashes.
+  //
+  // @return true upon success. Fails when a file of the chain is missing, a
+  // base hash(header or tensor) does not match or the chain is too
+  // deep(cyclic).
+  bool open(const std::string &filename, std::string *warn, std::string *err);
 
-  unsigned char current{'\0'};
-  size_t curr_idx{0};
-  std::string _input;
+  // Merged tensors. data_offsets are relative to the file holding each
+  // tensor.
+  const ordered_dict<tensor_t> &tensors() const;
+  const ordered_dict<std::string> &metadata() const;
+
+  // The number of files in the chain(1 for a plain file).
+  size_t num_files() const;
+
+  // Index of the file holding tensor `name`(0 is the file given to
+  // `open()`, `num_files() - 1` the root base). SIZE_MAX when not found.
+  size_t file_index(const std::string &name) const;
+
+  bool get_tensor_data(const std::string &name, const uint8_t **data,
+                       size_t *nbytes, std::string *err = nullptr) const;
+
+  //
+  // Copy all tensors to `st::storage` as a single model.
+  //
+  bool to_safetensors(safetensors_t *st, std::string *err) const;
+
+ private:
+  friend bool save_delta(const safetensors_t &, const std::string &,
+                         const std::string &, size_t *, std::string *,
+                         std::string *);
+  void *_impl{nullptr};
 };
 
-}  // namespace detail
+struct dedup_options {
+  // The number of threads reading and hashing tensors of a file(see
+  // "Concurrency model").
+  size_t num_threads{0};
 
-typedef enum {
-  unknown_type,
-  null_type,
-  boolean_type,
-  number_type,
-  string_type,
-  array_type,
-  object_type,
-} type;
+  // Compare bytes on a hash match before sharing a buffer. When false, equal
+  // (hash, size) is trusted.
+  bool verify{true};
+};
 
-typedef enum {
-  no_error,
-  undefined_error,
-  invalid_token_error,
-  unknown_type_error,
-  memory_allocation_error,
-  corrupted_json_error,
-  duplicated_key_error,
-} error;
+struct dedup_stats {
+  size_t models{0};
+  size_t tensors{0};          // tensors of all loaded models
+  size_t buffers{0};          // unique resident buffers
+  uint64_t logical_bytes{0};  // total tensor bytes of all loaded models
+  uint64_t resident_bytes{0};
+  uint64_t bytes_saved{0};      // logical_bytes - resident_bytes
+  uint64_t hash_cache_hits{0};  // tensors shared without reading them
+  size_t hash_cache_entries{0};
+};
 
-class value;
+//
+// Content-deduplicating pool of loaded files(opt-in).
+//
+// Tensor data of every loaded file is indexed by content hash
+// (`hash_bytes`) and size. When a tensor of a newly loaded file has the same
+// bytes as one already resident(e.g. frozen layers shared by fine-tunes of
+// one base), it references the existing buffer instead of keeping a copy.
+// Tensors are read and hashed in parallel when
+// `SAFETENSORS_CPP_USE_THREADS` is defined.
+//
+// Buffers are cached per file version(device, inode, size, mtime) and
+// tensor range, so loading an unchanged file again shares the buffers its
+// tensors were stored in or verified against without reading them. Cache
+// entries are dropped with their buffer.
+//
+// Methods are thread-safe when compiled with `SAFETENSORS_CPP_USE_THREADS`.
+// Pointers returned by `header` and `get_tensor_data` stay valid until the
+// model is unloaded.
+//
+class dedup_pool {
+ public:
+  explicit dedup_pool(const dedup_options &options = dedup_options());
+  ~dedup_pool();
 
-typedef bool boolean;
-typedef double number;
-typedef std::string string;
-typedef safetensors::ordered_dict<value> object;
-typedef std::vector<value> array;
-typedef struct {
-} null_t;
+  dedup_pool(const dedup_pool &) = delete;
+  dedup_pool &operator=(const dedup_pool &) = delete;
 
-// null_t null;
+  //
+  // Load `filename` into the pool.
+  //
+  // @param[in] filename Filepath. Assume UTF-8 filepath.
+  // @param[out] id Model id used to access it.
+  // @param[out] warn Warning message buffer(can be nullptr)
+  // @param[out] err Error message buffer(can be nullptr)
+  //
+  // @return true upon success.
+  bool load(const std::string &filename, size_t *id, std::string *warn,
+            std::string *err);
 
-template <typename T>
-struct TypeTraits;
+  //
+  // Unload model `id`. Buffers no longer referenced are freed.
+  //
+  bool unload(size_t id);
 
-template <>
-struct TypeTraits<null_t> {
-  static constexpr uint32_t type_id() { return 0; }
+  //
+  // Tensors and metadata of model `id`(`storage` is empty, use
+  // `get_tensor_data` of the pool). nullptr when not found.
+  //
+  const safetensors_t *header(size_t id) const;
+
+  bool get_tensor_data(size_t id, const std::string &name,
+                       const uint8_t **data, size_t *nbytes,
+                       std::string *err = nullptr) const;
+
+  dedup_stats stats() const;
+
+ private:
+  void *_impl{nullptr};
 };
 
-template <>
-struct TypeTraits<boolean> {
-  static constexpr uint32_t type_id() { return 1; }
+enum compare_mode {
+  kCOMPARE_BITWISE,    // bytes must be identical
+  kCOMPARE_TOLERANCE,  // |a - b| <= atol + rtol * |b|
+  kCOMPARE_ULP,        // distance in units in the last place <= max_ulp
 };
 
-template <>
-struct TypeTraits<number> {
-  static constexpr uint32_t type_id() { return 2; }
+struct compare_options {
+  compare_mode mode{kCOMPARE_BITWISE};
+  double atol{0.0};
+  double rtol{0.0};
+  uint64_t max_ulp{0};
+
+  // NaN compares equal to NaN(in tolerance and ULP modes).
+  bool nan_equal{true};
+
+  // Stop at the first mismatch. Remaining elements and tensors are skipped
+  // (max errors then cover only the compared elements).
+  bool early_exit{false};
+
+  size_t num_threads{0};  // see "Concurrency model"
 };
 
-template <>
-struct TypeTraits<string> {
-  static constexpr uint32_t type_id() { return 3; }
+struct tensor_compare_result {
+  std::string name;
+  bool only_in_a{false};
+  bool only_in_b{false};
+  bool dtype_differs{false};
+  bool shape_differs{false};
+  bool match{false};  // within the tolerance of `compare_options::mode`
+  bool skipped{false};  // not fully compared due to `early_exit`
+
+  size_t mismatches{0};  // mismatching elements
+  // Index of the first mismatching element. SIZE_MAX when none.
+  size_t first_mismatch{(std::numeric_limits<size_t>::max)()};
+  double max_abs_error{0.0};
+  double max_rel_error{0.0};  // |a - b| / |b|, for b != 0
+  // In the coarser dtype of the two. Computed in `kCOMPARE_ULP` mode only.
+  uint64_t max_ulp_error{0};
 };
 
-template <>
-struct TypeTraits<object> {
-  static constexpr uint32_t type_id() { return 4; }
+struct compare_result {
+  // Tensors of `a` in order, then tensors only in `b`.
+  std::vector<tensor_compare_result> tensors;
+  size_t num_mismatched{0};  // tensors which do not match
+  // Tensors not compared(or only in part, without a mismatch found) due to
+  // `early_exit`. Not counted in `num_mismatched`.
+  size_t num_skipped{0};
+  bool match{false};
+  double seconds{0.0};
 };
 
-template <>
-struct TypeTraits<array> {
-  static constexpr uint32_t type_id() { return 5; }
+//
+// Compare two safetensors tensor by tensor. Tensors are matched by name,
+// then dtype and shape are checked and elements compared. Works directly on
+// mmaped data.
+//
+// Tensors of different dtypes(e.g. FP32 reference vs BF16 conversion) are
+// compared element-wise after widening both to double in tolerance and ULP
+// modes. ULP distance is measured in the coarser dtype. Bitwise mode
+// requires the same dtype.
+//
+// Elements are compared in chunks on a thread pool when
+// `SAFETENSORS_CPP_USE_THREADS` is defined.
+//
+// @return true when the comparison ran(see `result->match` for the
+// outcome).
+bool compare(const safetensors_t &a, const safetensors_t &b,
+             const compare_options &options, compare_result *result,
+             std::string *err);
+
+// mmap both files and `compare` them.
+bool compare_files(const std::string &filename_a,
+                   const std::string &filename_b,
+                   const compare_options &options, compare_result *result,
+                   std::string *warn, std::string *err);
+
+//
+// Chunked compression(opt-in).
+//
+// A compressed file is a regular safetensors file with a single U8 tensor
+// `__compressed__` holding the compressed chunks. Each tensor is split into
+// `chunk_size` chunks which are compressed independently with a built-in
+// LZ77-class codec(LZ4-like block format, no external dependency). Bytes of
+// float tensors are shuffled into byte planes before compression so that
+// the exponent bytes form long runs. `__metadata__` records:
+//
+// - `__compression__.format` : `st-lz/1`
+// - `__compression__.chunk_size`, `__compression__.shuffle`
+// - `__compression__.chunks` : Comma separated compressed chunk sizes. A
+//   chunk whose size equals the raw size is stored as is(not compressed nor
+//   shuffled).
+// - `__compression__.tensor.<name>` : `<dtype>;<shape>` of each tensor in
+//   order.
+//
+// `load_from_file` and `load_from_memory` detect compressed files and
+// decompress them transparently. `mmap_from_file` maps the compressed data as
+// is.
+//
+
+struct compress_options {
+  // Rounded down to a multiple of 8 bytes. At most 1 GB.
+  size_t chunk_size{1024 * 1024};
+  bool shuffle{true};              // byte-plane shuffle of float dtypes
+
+  // The number of threads compressing chunks(see "Concurrency model").
+  size_t num_threads{0};
 };
 
-class value {
- private:
-  type t;
-  union {
-    null_t n;
-    boolean b;
-    number d;
-    std::string *s;
-    array *a;
-    object *o;
-  } u;
+//
+// Save `st` compressed to `filename`.
+//
+// @param[out] compressed_bytes Total size of compressed chunks(can be
+// nullptr).
+//
+// @return true upon success.
+bool save_compressed(const safetensors_t &st, const std::string &filename,
+                     const compress_options &options,
+                     size_t *compressed_bytes, std::string *warn,
+                     std::string *err);
 
-  void _free_u() {
-    if (t == string_type) {
-      delete this->u.s;
-      this->u.s = nullptr;
-    }
-    if (t == array_type) {
-      delete this->u.a;
-      this->u.a = nullptr;
-    }
-    if (t == object_type) {
-      delete this->u.o;
-      this->u.o = nullptr;
-    }
-  }
+// True when `st` holds a compressed file(header only is needed).
+bool is_compressed(const safetensors_t &st);
 
+//
+// Random access to tensors of a compressed file. `open()` reads the header
+// only. `read_tensor()` reads and decompresses the chunks of one tensor
+// directly into the destination. Chunks are decompressed in parallel when
+// `SAFETENSORS_CPP_USE_THREADS` is defined. Thread-safe after `open()`.
+//
+class compressed_reader {
  public:
-  value() : t(unknown_type), u() {}
-  value(null_t n) : t(null_type), u() { u.n = n; }
-  value(boolean b) : t(boolean_type), u() { u.b = b; }
-  value(number d) : t(boolean_type), u() { u.d = d; }
-  value(const char *s) : t(string_type), u() { u.s = new std::string(s); }
-  value(const std::string &s) : t(string_type), u() {
-    u.s = new std::string(s);
-  }
-  value(const array &a) : t(array_type), u() { u.a = new array(a); }
-  value(const object &o) : t(object_type), u() { u.o = new object(o); }
-  value(const value &v) : t(v.t), u() {
-    if (t == array_type) {
-      u.a = new array();
-      *u.a = *v.u.a;
-    } else if (t == object_type) {
-      u.o = new object();
-      *u.o = *v.u.o;
-    } else if (t == string_type) {
-      u.s = new std::string();
-      *u.s = *v.u.s;
-    } else
-      u.d = v.u.d;
-  }
-  ~value() { _free_u(); }
+  compressed_reader() = default;
+  ~compressed_reader();
 
-  template <typename T>
-  bool is() const {
-    if (TypeTraits<T>::type_id() == TypeTraits<null_t>::type_id() &&
-        t == null_type)
-      return true;
-    if (TypeTraits<T>::type_id() == TypeTraits<boolean>::type_id() &&
-        t == boolean_type)
-      return true;
-    if (TypeTraits<T>::type_id() == TypeTraits<number>::type_id() &&
-        t == number_type)
-      return true;
-    if (TypeTraits<T>::type_id() == TypeTraits<std::string>::type_id() &&
-        t == string_type)
-      return true;
-    if (TypeTraits<T>::type_id() == TypeTraits<array>::type_id() &&
-        t == array_type)
-      return true;
-    if (TypeTraits<T>::type_id() == TypeTraits<object>::type_id() &&
-        t == object_type)
-      return true;
-    return false;
-  }
+  compressed_reader(const compressed_reader &) = delete;
+  compressed_reader &operator=(const compressed_reader &) = delete;
 
-  template <typename T>
-  const T *as() const {
-    if ((t == array_type) &&
-        (TypeTraits<T>::type_id() == TypeTraits<array>::type_id())) {
-      return reinterpret_cast<const T *>(u.a);
-    }
+  bool open(const std::string &filename, size_t num_threads,
+            std::string *warn, std::string *err);
 
-    if ((t == object_type) &&
-        (TypeTraits<T>::type_id() == TypeTraits<object>::type_id())) {
-      return reinterpret_cast<const T *>(u.o);
-    }
+  // Tensors(with uncompressed data_offsets) and metadata. `storage` is
+  // empty.
+  const safetensors_t &header() const;
 
-    if ((t == string_type) &&
-        (TypeTraits<T>::type_id() == TypeTraits<std::string>::type_id())) {
-      return reinterpret_cast<const T *>(u.s);
-    }
+  //
+  // Decompress tensor `name` to `dst`. `nbytes` must be the tensor size.
+  //
+  bool read_tensor(const std::string &name, uint8_t *dst, size_t nbytes,
+                   std::string *err) const;
 
-    if ((t == null_type) &&
-        (TypeTraits<T>::type_id() == TypeTraits<null_t>::type_id())) {
-      return reinterpret_cast<const T *>(&u.n);
-    }
+ private:
+  void *_impl{nullptr};
+};
 
-    if ((t == boolean_type) &&
-        (TypeTraits<T>::type_id() == TypeTraits<boolean>::type_id())) {
-      return reinterpret_cast<const T *>(&u.b);
-    }
+//
+// Utility functions
+//
 
-    if ((t == number_type) &&
-        (TypeTraits<T>::type_id() == TypeTraits<number>::type_id())) {
-      return reinterpret_cast<const T *>(&u.d);
-    }
+// Returns shape[0] * shape[1] * ...
+// Empty Tensor(any shape[i] is 0) returns 0.
+// Zero-rank tensor([]) return 1.
+size_t get_shape_size(const tensor_t &t);
 
-    return nullptr;
-  }
+// Returns dtype size in bytes.
+size_t get_dtype_bytes(const safetensors::dtype dtype);
+std::string get_dtype_str(const safetensors::dtype dtype);
 
-  template <typename T>
-  T *as() {
-    if ((t == array_type) &&
-        (TypeTraits<T>::type_id() == TypeTraits<array>::type_id())) {
-      return reinterpret_cast<T *>(u.a);
-    }
+// Validate data_offsets of all tensors in safetensors_t.
+bool validate_data_offsets(const safetensors_t &st, std::string &err);
 
-    if ((t == object_type) &&
-        (TypeTraits<T>::type_id() == TypeTraits<object>::type_id())) {
-      return reinterpret_cast<T *>(u.o);
-    }
+//
+// Get the address and byte size of tensor data(mmaped or not).
+// Access is recorded to `st.trace` when it is set.
+//
+// @return false when `name` is not found or has invalid data_offsets.
+bool get_tensor_data(const safetensors_t &st, const std::string &name,
+                     const uint8_t **data, size_t *nbytes,
+                     std::string *err = nullptr);
 
-    if ((t == string_type) &&
-        (TypeTraits<T>::type_id() == TypeTraits<string>::type_id())) {
-      return reinterpret_cast<T *>(u.s);
-    }
+//
+// Get the writable address of tensor data.
+// Available for non-mmaped `safetensors_t`, `kMMAP_COPY_ON_WRITE` and
+// `kMMAP_READ_WRITE` mapping.
+//
+// @return false when tensor data is read-only, or `name` is not found.
+bool get_mutable_tensor_data(safetensors_t *st, const std::string &name,
+                             uint8_t **data, size_t *nbytes,
+                             std::string *err = nullptr);
 
-    if ((t == null_type) &&
-        (TypeTraits<T>::type_id() == TypeTraits<null_t>::type_id())) {
-      return reinterpret_cast<T *>(&u.n);
-    }
+//
+// Synchronously write back modified pages of tensors `names` to the file.
+// Only pages covering the tensors are flushed(msync), so a few tensors in a
+// huge file can be persisted cheaply.
+// `st` must be mmaped with `kMMAP_READ_WRITE`.
+//
+// @return true upon success. `err` will be filled when false.
+bool flush_tensors(const safetensors_t &st,
+                   const std::vector<std::string> &names, std::string *err);
+
+struct tensor_residency {
+  std::string name;
+  size_t nbytes{0};          // tensor data size
+  size_t pages{0};           // pages spanned by tensor data
+  size_t resident_pages{0};  // pages in memory
+};
 
-    if ((t == boolean_type) &&
-        (TypeTraits<T>::type_id() == TypeTraits<boolean>::type_id())) {
-      return reinterpret_cast<T *>(&u.b);
-    }
+struct page_residency {
+  size_t page_size{0};
+  size_t pages{0};           // pages spanned by databuffer
+  size_t resident_pages{0};  // resident pages of databuffer
+  std::vector<tensor_residency> tensors;  // in `st.tensors` order
+
+  // Read amplification for `used` tensors. Zero when `used` is empty.
+  size_t used_bytes{0};  // tensor data bytes actually needed
+  size_t used_pages{0};  // pages spanned by `used` tensors(union)
+  size_t used_resident_pages{0};
+  size_t unused_resident_pages{0};  // resident pages no `used` tensor touches
+
+  // used_pages * page_size / used_bytes. > 1 due to page misalignment and
+  // small tensors sharing pages with unused ones.
+  double layout_amplification{0.0};
+  // resident_pages * page_size / used_bytes. Also includes readahead.
+  double read_amplification{0.0};
+};
 
-    if ((t == number_type) &&
-        (TypeTraits<T>::type_id() == TypeTraits<number>::type_id())) {
-      return reinterpret_cast<T *>(&u.d);
-    }
+//
+// Report which pages of tensor data are in memory(mincore).
+//
+// For file mapping, residency is of the page cache, so run the workload on a
+// cold cache and call this afterwards to see how many pages were actually
+// read for the tensors in `used`. Pass an empty `used` to get per-tensor
+// residency only.
+//
+// Not supported on Windows.
+//
+// @return false when `used` contains an unknown tensor or mincore failed.
+bool residency_report(const safetensors_t &st,
+                      const std::vector<std::string> &used,
+                      page_residency *report, std::string *err);
 
-    return nullptr;
-  }
+uint16_t float_to_bfloat16(float x);
+float bfloat16_to_float(uint16_t x);
 
-  null_t &operator=(null_t &n) {
-    t = null_type;
-    u.n = n;
-    return u.n;
-  }
-  boolean &operator=(boolean b) {
-    t = boolean_type;
-    u.b = b;
-    return u.b;
-  }
-  number &operator=(number d) {
-    t = number_type;
-    u.d = d;
-    return u.d;
-  }
-  const std::string &operator=(const char *s) {
-    _free_u();
-    t = string_type;
-    u.s = new std::string(s);
-    return *u.s;
-  }
-  const std::string &operator=(const std::string &s) {
-    _free_u();
-    t = string_type;
-    u.s = new std::string(s);
-    return *u.s;
-  }
-  const object &operator=(const object &o) {
-    _free_u();
-    t = object_type;
-    u.o = new object(o);
-    return *u.o;
-  }
-  const array &operator=(const array &a) {
-    _free_u();
-    t = array_type;
-    u.a = new array(a);
-    return *u.a;
-  }
-  const value &operator=(const value &v) {
-    _free_u();
-    t = v.t;
-    if (t == array_type) {
-      u.a = new array(*v.u.a);
-    } else if (t == object_type) {
-      u.o = new object(*v.u.o);
-    } else if (t == string_type) {
-      u.s = new std::string(*v.u.s);
-    } else
-      u.d = v.u.d;
-    return *this;
-  }
+uint16_t float_to_fp16(float x);
+float fp16_to_float(uint16_t x);
 
-  std::string type_name() const {
-    if (t == array_type) {
-      return "array";
-    }
+//
+// Bulk conversion of `n` elements.
+// Branch-free kernels over fixed-size blocks so that compilers can
+// auto-vectorize them(also at -O2). Results are bit-exact with the scalar
+// version above.
+//
+void bfloat16_to_float(const uint16_t *src, size_t n, float *dst);
+void float_to_bfloat16(const float *src, size_t n, uint16_t *dst);
+void fp16_to_float(const uint16_t *src, size_t n, float *dst);
+void float_to_fp16(const float *src, size_t n, uint16_t *dst);
 
-    if (t == object_type) {
-      return "object";
-    }
+// 64-bit non-cryptographic hash(XXH64) of `n` bytes. Used to identify tensor
+// content.
+uint64_t hash_bytes(const uint8_t *data, size_t n, uint64_t seed = 0);
 
-    if (t == string_type) {
-      return "string";
-    }
+//
+// Prefetcher for sequential(layer-by-layer) tensor access.
+//
+// Takes an ordered list of tensor groups(e.g. layers) and keeps `lookahead`
+// groups ahead of the consumer faulted in. Groups behind the consumer are
+// released(pages are dropped from the process with madvise) so the resident
+// set stays bounded by the window size.
+//
+// When compiled with `SAFETENSORS_CPP_USE_THREADS`, pages are faulted in on a
+// background thread so I/O overlaps the consumer's compute. Otherwise
+// `acquire()` faults in the requested group synchronously and only issues
+// readahead hints for the groups in the window.
+//
+// For non-mmaped `safetensors_t`, data is already in `storage`, so
+// `acquire()`/`release()` do no I/O.
+//
+struct prefetch_stats {
+  uint64_t acquires{0};        // # of acquire() calls
+  uint64_t stalls{0};          // # of acquire() calls which waited for I/O
+  double stall_seconds{0.0};   // total time spent waiting in acquire()
+  double max_stall_seconds{0.0};
+  uint64_t groups_loaded{0};   // # of groups faulted in
+  uint64_t bytes_loaded{0};
+  uint64_t groups_released{0};
+};
 
-    if (t == null_type) {
-      return "null";
-    }
+//
+// Access trace serialization.
+//
+// The trace is serialized to a compact ASCII string:
+//
+//   v1/<# of tensors>/<table hash>;<tensor index>[:<begin>:<end>];...
+//
+// Tensors are referred by the index in `st.tensors`. `<table hash>`(hex)
+// is the hash of the tensor names, dtypes, shapes and data_offsets in
+// order, so a trace recorded for another file(or reordered tensors) is
+// rejected. It does not cover `__metadata__`, so the string can be stored
+// there as is. Byte range is omitted when the whole tensor is accessed.
+//
 
-    if (t == boolean_type) {
-      return "boolean";
-    }
+// `__metadata__` key to store the trace.
+constexpr const char *kAccessTraceMetadataKey = "safetensors_cpp.access_trace";
 
-    if (t == number_type) {
-      return "number";
-    }
+bool serialize_access_trace(const safetensors_t &st, const access_trace &trace,
+                            std::string *out, std::string *err);
+bool parse_access_trace(const safetensors_t &st, const std::string &s,
+                        access_trace *trace, std::string *err);
 
-    return "[[invalid]]";
-  }
+// Save/load the trace as a sidecar file(e.g. `model.safetensors.trace`).
+bool save_access_trace(const safetensors_t &st, const access_trace &trace,
+                       const std::string &filename, std::string *err);
+bool load_access_trace(const safetensors_t &st, const std::string &filename,
+                       access_trace *trace, std::string *err);
 
-  std::string str(const char *p) const {
-    std::stringstream ss;
-    ss << '"';
-    while (*p) {
-      if (*p == '\n') {
-        ss << "\\n";
-      } else if (*p == '\r') {
-        ss << "\\r";
-      } else if (*p == '\t') {
-        ss << "\\t";
-      } else if (detail::my_strchr("\"", *p)) {
-        ss << "\\" << *p;
-      } else {
-        ss << *p;
-      }
-      p++;
-    }
-    ss << '"';
-    return ss.str();
-  }
+//
+// Replay the trace as an ordered prefetch plan: issue readahead for each
+// recorded range in the recorded order. Returns immediately(kernel reads
+// pages asynchronously). Does nothing for non-mmaped `safetensors_t`.
+//
+bool replay_access_trace(const safetensors_t &st, const access_trace &trace,
+                         std::string *err);
 
-  std::string str() const {
-    std::stringstream ss;
-    if (t == unknown_type) {
-      ss << "undefined";
-    } else if (t == null_type) {
-      ss << "null";
-    } else if (t == boolean_type) {
-      ss << (u.b ? "true" : "false");
-    } else if (t == number_type) {
-      ss << double(u.d);
-    } else if (t == string_type) {
-      ss << str(u.s->c_str());
-    } else if (const array *pa = as<array>()) {
-      array::const_iterator i;
-      ss << "[";
-      // array a = get<array>();
-      for (i = pa->begin(); i != pa->end(); i++) {
-        if (i != pa->begin()) ss << ", ";
-        ss << i->str();
-      }
-      ss << "]";
-    } else if (auto po = as<object>()) {
-      // object::const_iterator i;
-      ss << "{";
-      // object o = get<object>();
-      for (size_t i = 0; i < po->size(); i++) {
-        if (i > 0) ss << ", ";
-        ss << "\"" << po->keys()[i] << "\"";
+class prefetcher {
+ public:
+  prefetcher() = default;
+  ~prefetcher();
 
-        value v;
-        if (po->at(i, &v)) {
-          ss << ": " << v.str();
-        } else {
-          // TODO: report error
-          ss << ": null";
-        }
-      }
-      ss << "}";
-    }
-    return ss.str();
-  }
+  prefetcher(const prefetcher &) = delete;
+  prefetcher &operator=(const prefetcher &) = delete;
+
+  //
+  // @param[in] st safetensors data. Must be live during prefetcher is live.
+  // @param[in] groups Ordered list of tensor names per group.
+  // @param[in] lookahead The number of groups to keep loaded ahead of the
+  // consumer(including the group currently acquired). Must be >= 1.
+  // @param[out] err Error message buffer(can be nullptr)
+  //
+  // @return true upon success.
+  bool init(const safetensors_t &st,
+            const std::vector<std::vector<std::string>> &groups,
+            size_t lookahead, std::string *err);
+
+  //
+  // Wait until `group` is loaded. Time spent waiting is reported as stall
+  // time in `stats()`.
+  //
+  // @return false when `group` is out-of-range or not initialized.
+  bool acquire(size_t group);
+
+  //
+  // Tell the prefetcher the consumer no longer needs `group`.
+  //
+  void release(size_t group);
+
+  size_t num_groups() const;
+
+  prefetch_stats stats() const;
+
+ private:
+  void *_impl{nullptr};
 };
 
-#define MINIJSON_SKIP(i)                           \
-  while (*i && detail::my_strchr("\r\n \t", *i)) { \
-    i++;                                           \
-  }
+}  // namespace safetensors
 
-template <typename Iter>
-inline error parse_object(Iter &i, value &v) {
-  object o;
-  i++;
-  MINIJSON_SKIP(i)
-  if (!(*i)) {
-    return corrupted_json_error;
-  }
-  if (*i != '\x7d') {
-    while (*i) {
-      value vk, vv;
-      error e = parse_string(i, vk);
-      if (e != no_error) return e;
-      MINIJSON_SKIP(i)
-      if (!(*i)) {
-        return corrupted_json_error;
-      }
-      if (*i != ':') return invalid_token_error;
-      i++;
-      e = parse_any(i, vv);
-      if (e != no_error) return e;
+#if defined(SAFETENSORS_CPP_IMPLEMENTATION)
 
-      auto ps = vk.as<std::string>();
-      if (!ps) {
-        return unknown_type_error;
-      }
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <memory>
 
-      if (o.count(*ps)) {
-        return duplicated_key_error;
-      }
-      o.insert(*ps, vv);
+#if defined(SAFETENSORS_CPP_ENABLE_STATS) && !defined(_WIN32)
+#include <sys/resource.h>
+#endif
 
-      MINIJSON_SKIP(i)
-      if (!(*i)) {
-        return corrupted_json_error;
-      }
-      if (*i == '\x7d') break;
-      if (*i != ',') return invalid_token_error;
-      i++;
-      MINIJSON_SKIP(i)
-      if (!(*i)) {
-        return corrupted_json_error;
-      }
-#ifdef __MINIJSON_LIBERAL
-      if (*i == '\x7d') break;
+#if defined(SAFETENSORS_CPP_USE_THREADS)
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 #endif
-    }
-  }
-  v = value(o);
-  i++;
-  return no_error;
-}
 
-template <typename Iter>
-inline error parse_array(Iter &i, value &v) {
-  array a;
-  i++;
-  MINIJSON_SKIP(i)
-  if (!(*i)) {
-    return corrupted_json_error;
-  }
-  if (*i != ']') {
-    while (*i) {
-      value va;
-      error e = parse_any(i, va);
-      if (e != no_error) return e;
-      a.push_back(va);
-      MINIJSON_SKIP(i)
-      if (!(*i)) {
-        return corrupted_json_error;
-      }
-      if (*i == ']') break;
-      if (*i != ',') return invalid_token_error;
-      i++;
-      MINIJSON_SKIP(i)
-      if (!(*i)) {
-        return corrupted_json_error;
-      }
-#ifdef __MINIJSON_LIBERAL
-      if (*i == '\x7d') break;
+#if defined(__linux__)
+#include <sys/socket.h>
+#include <sys/uio.h>
 #endif
-    }
-  }
-  v = value(a);
-  i++;
-  return no_error;
-}
 
-template <typename Iter>
-inline error parse_null(Iter &i, value &v) {
-  Iter p = i;
-  if (*i == 'n' && *(i + 1) == 'u' && *(i + 2) == 'l' && *(i + 3) == 'l') {
-    i += 4;
-    v = null_t();
-  }
-  if (*i && nullptr == detail::my_strchr(":,\x7d]\r\n ", *i)) {
-    i = p;
-    return undefined_error;
-  }
-  return no_error;
-}
+#if defined(SAFETENSORS_CPP_USE_THREADS) && defined(__linux__)
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#endif
 
-template <typename Iter>
-inline error parse_boolean(Iter &i, value &v) {
-  Iter p = i;
-  if (*i == 't' && *(i + 1) == 'r' && *(i + 2) == 'u' && *(i + 3) == 'e') {
-    i += 4;
-    v = static_cast<boolean>(true);
-  } else if (*i == 'f' && *(i + 1) == 'a' && *(i + 2) == 'l' &&
-             *(i + 3) == 's' && *(i + 4) == 'e') {
-    i += 5;
-    v = static_cast<boolean>(false);
-  }
-  if (*i && nullptr == detail::my_strchr(":,\x7d]\r\n ", *i)) {
-    i = p;
-    return undefined_error;
-  }
-  return no_error;
-}
+#ifdef __has_include
+#if __has_include(<unistd.h>)
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(_POSIX_MAPPED_FILES)
+#include <sys/mman.h>
+#endif
+#if defined(_POSIX_MEMLOCK_RANGE)
+#include <sys/resource.h>
+#endif
+#endif
+#endif
 
-template <typename Iter>
-inline error parse_number(Iter &i, value &v) {
-  Iter p = i;
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <fcntl.h>
+#include <io.h>
+#include <stdio.h>  // for _fseeki64
+#include <sys/stat.h>
+#include <windows.h>
+#endif
 
-  if (*i == '-') {
-    i++;
-  }
+#if !defined(MINIJSON_IMPLEMENTATION)
+#define MINIJSON_IMPLEMENTATION
+#endif
 
-#define MINIJSON_IS_NUM(x) ('0' <= x && x <= '9')
-#define MINIJSON_IS_ALNUM(x) \
-  (('0' <= x && x <= '9') || ('a' <= x && x <= 'f') || ('A' <= x && x <= 'F'))
-  if (*i == '0' && *(i + 1) == 'x' && MINIJSON_IS_ALNUM(*(i + 2))) {
-    i += 3;
-    while (MINIJSON_IS_ALNUM(*i)) i++;
-    v = static_cast<number>(detail::from_chars(p));
-  } else {
-    while (MINIJSON_IS_NUM(*i)) i++;
-    if (*i == '.') {
-      i++;
-      if (!MINIJSON_IS_NUM(*i)) {
-        i = p;
-        return invalid_token_error;
-      }
-      while (MINIJSON_IS_NUM(*i)) i++;
-    }
-    if (*i == 'e') {
-      i++;
-      if (!MINIJSON_IS_NUM(*i)) {
-        i = p;
-        return invalid_token_error;
-      }
-      while (MINIJSON_IS_NUM(*i)) i++;
-    }
-    v = static_cast<number>(detail::from_chars(p));
-  }
-  if (*i && nullptr == detail::my_strchr(":,\x7d]\r\n ", *i)) {
-    i = p;
-    return invalid_token_error;
-  }
-  return no_error;
-}
+// minijson: https://github.com/syoyo/minijson
 
-template <typename Iter>
-inline error parse_string(Iter &i, value &v) {
-  if (*i != '"') return invalid_token_error;
+/*
+ * JSON parser: C++ oriented JSON parser.
+ */
 
-  Iter s = i;
-  char t = *i++;  // = '"'
-  Iter p = i;
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
 
-#if 0
-  std::stringstream ss;
-  while (*i && *i != t) {
-    if (*i == '\\' && *(i + 1)) {
-      i++;
-      if (*i == 'n')
-        ss << "\n";
-      else if (*i == 'r')
-        ss << "\r";
-      else if (*i == 't')
-        ss << "\t";
-      else
-        ss << *i;
-    } else {
-      ss << *i;
-    }
-    i++;
-  }
-#else
-  // read until '"'
-  while (*i && *i != t) {
-    if (*i == '\\' && *(i + 1)) {
-      i++;
-    }
-    i++;
-  }
+//#define __MINIJSON_LIBERAL
 
-#endif
-  if (!*i) return invalid_token_error;
-  if (i < p) {
-    return corrupted_json_error;
-  }
+// We recommended to use simdjson from_chars.
+// Using strtod() is a fallback
+#if defined(MINIJSON_USE_STRTOD)
+// Use stdlib's strtod
+#include <cstring>
+#else
 
-#if 0
-  v = std::string(p, size_t(i - p));
+namespace minijson {
+namespace simdjson {
+namespace internal {
 
-  i++;
-  if (*i && nullptr == detail::my_strchr(":,\x7d]\r\n ", *i)) {
-    i = p;
-    return invalid_token_error;
-  }
+double from_chars(const char *first) noexcept;
+double from_chars(const char *first, const char *end) noexcept;
 
-#else
+char *to_chars(char *first, const char *last, double value);
 
-  i++;
-  if (*i && nullptr == detail::my_strchr(":,\x7d]\r\n ", *i)) {
-    i = p;
-    return invalid_token_error;
-  }
+}  // namespace internal
+}  // namespace simdjson
+}  // namesapce minijson
 
-  // include first and last '"' char
-  std::string buf(s, size_t(i - s));
+#endif
 
-  detail::string_parser str_parser;
-  str_parser.set_input(buf);
+namespace minijson {
 
-  if (!str_parser.scan_string()) {
-    // TODO: error message
-    // str_parser.error_message;
-    return invalid_token_error;
-  } else {
-    v = str_parser.token_buffer;
-  }
+namespace detail {
 
-#endif
+double from_chars(const char *p);
+const char *my_strchr(const char *p, int ch);
 
-  return no_error;
-}
+}  // namespace detail
 
-template <typename Iter>
-inline error parse_any(Iter &i, value &v) {
-  MINIJSON_SKIP(i)
-  if (*i == '\x7b') return parse_object(i, v);
-  if (*i == '[') return parse_array(i, v);
-  if (*i == 't' || *i == 'f') return parse_boolean(i, v);
-  if (*i == 'n') return parse_null(i, v);
-  if ((*i == '-') || ('0' <= *i && *i <= '9')) return parse_number(i, v);
-  if (*i == '"') return parse_string(i, v);
-  return invalid_token_error;
-}
+namespace detail {
 
-template <typename Iter>
-inline error parse(Iter &i, value &v) {
-  return parse_any(i, v);
-}
+//
+// Usage:
+//  - set_input()
+//  - scan_string()
+//    - success: use `token_buffer` string
+//    - error: use `error_message`
+//
+struct string_parser {
+  // input string must be UTF-8
+  void set_input(const std::string &s) { _input = s; }
 
-#undef MINIJSON_SKIP
+  bool scan_string();
 
-inline const char *errstr(error e) {
-  const char *s = "unknown error";
-  switch (e) {
-    case no_error: {
-      s = "no error";
-      break;
-    }
-    case undefined_error: {
-      s = "undefined";
-      break;
+  void reset() {
+    if (_input.size()) {
+      current = _input[0];
+    } else {
+      current = '\0';
     }
-    case invalid_token_error: {
-      s = "invalid token";
-      break;
-    }
-    case unknown_type_error: {
-      s = "unknown type";
-      break;
-    }
-    case memory_allocation_error: {
-      s = "memory allocation error";
-      break;
-    }
-    case corrupted_json_error: {
-      s = "input is corrupted";
-      break;
-    }
-    case duplicated_key_error: {
-      s = "duplicated key found";
-      break;
-    }
-      // default: return "unknown error";
+    curr_idx = 0;
+    token_buffer.clear();
   }
 
-  return s;
-}
-
-}  // namespace minijson
+  // fetch next token.
+  unsigned char get() {
+    if ((curr_idx + 1) < _input.size()) {
+      curr_idx++;
+      current = _input[curr_idx];
+      return current;
+    }
+    current = '\0';
+    return current;
+  }
 
-#if defined(MINIJSON_IMPLEMENTATION)
+  bool eof() {
+    if (_input.empty()) {
+      return true;
+    }
 
-namespace minijson {
+    if (curr_idx >= _input.size()) {
+      return true;
+    }
 
-namespace detail {
+    return false;
+  }
 
-// clang-format off
-//
-// From json.hpp ---------------------------------------------------------
-//     __ _____ _____ _____
-//  __|  |   __|     |   | |  JSON for Modern C++
-// |  |  |__   |  |  | | | |  version 3.11.3
-// |_____|_____|_____|_|___|  https://github.com/nlohmann/json
-//
-// SPDX-FileCopyrightText: 2013-2023 Niels Lohmann <https://nlohmann.me>
-// SPDX-License-Identifier: MIT
+  void add(const unsigned char c) { token_buffer += c; }
 
-#if 1
-    #define JSON_HEDLEY_UNLIKELY(cond) (cond)
-    #define JSON_HEDLEY_LIKELY(cond) (cond)
+  void add(const int i) {
+    // use lower 8bit
+    token_buffer += static_cast<unsigned char>(i & 0xff);
+  }
 
-    /*!
-    @brief get codepoint from 4 hex characters following `\u`
+  int get_codepoint();
 
-    For input "\u c1 c2 c3 c4" the codepoint is:
-      (c1 * 0x1000) + (c2 * 0x0100) + (c3 * 0x0010) + c4
-    = (c1 << 12) + (c2 << 8) + (c3 << 4) + (c4 << 0)
+  bool next_byte_in_range(const std::initializer_list<int> ranges);
 
-    Furthermore, the possible characters '0'..'9', 'A'..'F', and 'a'..'f'
-    must be converted to the integers 0x0..0x9, 0xA..0xF, 0xA..0xF, resp. The
-    conversion is done by subtracting the offset (0x30, 0x37, and 0x57)
-    between the ASCII value of the character and the desired integer value.
+  std::string error_message;
+  std::string token_buffer;  // output
 
-    @return codepoint (0x0000..0xFFFF) or -1 in case of an error (e.g. EOF or
-            non-hex character)
-    */
-    int string_parser::get_codepoint() 
-    {
-        // this function only makes sense after reading `\u`
-        //JSON_ASSERT(current == 'u');
-        if (current != 'u') {
-          return -1;
-        }
-        int codepoint = 0;
+  unsigned char current{'\0'};
+  size_t curr_idx{0};
+  std::string _input;
+};
 
-        const auto factors = { 12u, 8u, 4u, 0u };
-        for (const auto factor : factors)
-        {
-            get();
+}  // namespace detail
 
-            if (current >= '0' && current <= '9')
-            {
-                codepoint += static_cast<int>((static_cast<unsigned int>(current) - 0x30u) << factor);
-            }
-            else if (current >= 'A' && current <= 'F')
-            {
-                codepoint += static_cast<int>((static_cast<unsigned int>(current) - 0x37u) << factor);
-            }
-            else if (current >= 'a' && current <= 'f')
-            {
-                codepoint += static_cast<int>((static_cast<unsigned int>(current) - 0x57u) << factor);
-            }
-            else
-            {
-                return -1;
-            }
-        }
+typedef enum {
+  unknown_type,
+  null_type,
+  boolean_type,
+  number_type,
+  string_type,
+  array_type,
+  object_type,
+} type;
 
-        if (0x0000 <= codepoint && codepoint <= 0xFFFF) {
-        } else {
-          return -1;
-        }
-        return codepoint;
-    }
+typedef enum {
+  no_error,
+  undefined_error,
+  invalid_token_error,
+  unknown_type_error,
+  memory_allocation_error,
+  corrupted_json_error,
+  duplicated_key_error,
+} error;
 
-    /*!
-    @brief check if the next byte(s) are inside a given range
+class value;
 
-    Adds the current byte and, for each passed range, reads a new byte and
-    checks if it is inside the range. If a violation was detected, set up an
-    error message and return false. Otherwise, return true.
+typedef bool boolean;
+typedef double number;
+typedef std::string string;
+typedef safetensors::ordered_dict<value> object;
+typedef std::vector<value> array;
+typedef struct {
+} null_t;
 
-    @param[in] ranges  list of integers; interpreted as list of pairs of
-                       inclusive lower and upper bound, respectively
+// null_t null;
 
-    @pre The passed list @a ranges must have 2, 4, or 6 elements; that is,
-         1, 2, or 3 pairs. This precondition is enforced by an assertion.
+template <typename T>
+struct TypeTraits;
 
-    @return true if and only if no range violation was detected
-    */
-    bool string_parser::next_byte_in_range(const std::initializer_list<int> ranges)
-    {
-        if (ranges.size() == 2 || ranges.size() == 4 || ranges.size() == 6) {
-        } else {
-          return false;
-        }
+template <>
+struct TypeTraits<null_t> {
+  static constexpr uint32_t type_id() { return 0; }
+};
 
-        add(current);
+template <>
+struct TypeTraits<boolean> {
+  static constexpr uint32_t type_id() { return 1; }
+};
 
-        for (auto range = ranges.begin(); range != ranges.end(); ++range)
-        {
-            get();
-            if (JSON_HEDLEY_LIKELY(*range <= current && current <= *(++range))) // NOLINT(bugprone-inc-dec-in-conditions)
-            {
-                add(current);
-            }
-            else
-            {
-                error_message = "invalid string: ill-formed UTF-8 byte";
-                return false;
-            }
-        }
+template <>
+struct TypeTraits<number> {
+  static constexpr uint32_t type_id() { return 2; }
+};
 
-        return true;
-    }
-    /*!
-    @brief scan a string literal
+template <>
+struct TypeTraits<string> {
+  static constexpr uint32_t type_id() { return 3; }
+};
 
-    This function scans a string according to Sect. 7 of RFC 8259. While
-    scanning, bytes are escaped and copied into buffer token_buffer. Then the
-    function returns successfully, token_buffer is *not* null-terminated (as it
-    may contain \0 bytes), and token_buffer.size() is the number of bytes in the
-    string.
+template <>
+struct TypeTraits<object> {
+  static constexpr uint32_t type_id() { return 4; }
+};
 
-    @return true if string could be successfully scanned,
-            false otherwise
+template <>
+struct TypeTraits<array> {
+  static constexpr uint32_t type_id() { return 5; }
+};
 
-    @note In case of errors, variable error_message contains a textual
-          description.
-    */
-    bool string_parser::scan_string()
-    {
-        // reset token_buffer (ignore opening quote)
-        reset();
+class value {
+ private:
+  type t;
+  union {
+    null_t n;
+    boolean b;
+    number d;
+    std::string *s;
+    array *a;
+    object *o;
+  } u;
 
-        // we entered the function by reading an open quote
-        //JSON_ASSERT(current == '\"');
-        if (current != '\"') {
-            error_message = "first character must be '\"'";
-            return false;
-        }
+  void _free_u() {
+    if (t == string_type) {
+      delete this->u.s;
+      this->u.s = nullptr;
+    }
+    if (t == array_type) {
+      delete this->u.a;
+      this->u.a = nullptr;
+    }
+    if (t == object_type) {
+      delete this->u.o;
+      this->u.o = nullptr;
+    }
+  }
 
+ public:
+  value() : t(unknown_type), u() {}
+  value(null_t n) : t(null_type), u() { u.n = n; }
+  value(boolean b) : t(boolean_type), u() { u.b = b; }
+  value(number d) : t(boolean_type), u() { u.d = d; }
+  value(const char *s) : t(string_type), u() { u.s = new std::string(s); }
+  value(const std::string &s) : t(string_type), u() {
+    u.s = new std::string(s);
+  }
+  value(const array &a) : t(array_type), u() { u.a = new array(a); }
+  value(const object &o) : t(object_type), u() { u.o = new object(o); }
+  value(const value &v) : t(v.t), u() {
+    if (t == array_type) {
+      u.a = new array();
+      *u.a = *v.u.a;
+    } else if (t == object_type) {
+      u.o = new object();
+      *u.o = *v.u.o;
+    } else if (t == string_type) {
+      u.s = new std::string();
+      *u.s = *v.u.s;
+    } else
+      u.d = v.u.d;
+  }
+  ~value() { _free_u(); }
 
-        while (!eof())
-        {
+  template <typename T>
+  bool is() const {
+    if (TypeTraits<T>::type_id() == TypeTraits<null_t>::type_id() &&
+        t == null_type)
+      return true;
+    if (TypeTraits<T>::type_id() == TypeTraits<boolean>::type_id() &&
+        t == boolean_type)
+      return true;
+    if (TypeTraits<T>::type_id() == TypeTraits<number>::type_id() &&
+        t == number_type)
+      return true;
+    if (TypeTraits<T>::type_id() == TypeTraits<std::string>::type_id() &&
+        t == string_type)
+      return true;
+    if (TypeTraits<T>::type_id() == TypeTraits<array>::type_id() &&
+        t == array_type)
+      return true;
+    if (TypeTraits<T>::type_id() == TypeTraits<object>::type_id() &&
+        t == object_type)
+      return true;
+    return false;
+  }
 
-            // get next character
-            switch (get())
-            {
+  template <typename T>
+  const T *as() const {
+    if ((t == array_type) &&
+        (TypeTraits<T>::type_id() == TypeTraits<array>::type_id())) {
+      return reinterpret_cast<const T *>(u.a);
+    }
 
-                // closing quote
-                case '\"':
-                {
-                    return true;
-                }
+    if ((t == object_type) &&
+        (TypeTraits<T>::type_id() == TypeTraits<object>::type_id())) {
+      return reinterpret_cast<const T *>(u.o);
+    }
 
-                // escapes
-                case '\\':
-                {
-                    switch (get())
-                    {
-                        // quotation mark
-                        case '\"':
-                            add('\"');
-                            break;
-                        // reverse solidus
-                        case '\\':
-                            add('\\');
-                            break;
-                        // solidus
-                        case '/':
-                            add('/');
-                            break;
-                        // backspace
-                        case 'b':
-                            add('\b');
-                            break;
-                        // form feed
-                        case 'f':
-                            add('\f');
-                            break;
-                        // line feed
-                        case 'n':
-                            add('\n');
-                            break;
-                        // carriage return
-                        case 'r':
-                            add('\r');
-                            break;
-                        // tab
-                        case 't':
-                            add('\t');
-                            break;
+    if ((t == string_type) &&
+        (TypeTraits<T>::type_id() == TypeTraits<std::string>::type_id())) {
+      return reinterpret_cast<const T *>(u.s);
+    }
 
-                        // unicode escapes
-                        case 'u':
-                        {
-                            const int codepoint1 = get_codepoint();
-                            int codepoint = codepoint1; // start with codepoint1
+    if ((t == null_type) &&
+        (TypeTraits<T>::type_id() == TypeTraits<null_t>::type_id())) {
+      return reinterpret_cast<const T *>(&u.n);
+    }
 
-                            if (JSON_HEDLEY_UNLIKELY(codepoint1 == -1))
-                            {
-                                error_message = "invalid string: '\\u' must be followed by 4 hex digits";
-                                return false;
-                            }
+    if ((t == boolean_type) &&
+        (TypeTraits<T>::type_id() == TypeTraits<boolean>::type_id())) {
+      return reinterpret_cast<const T *>(&u.b);
+    }
 
-                            // check if code point is a high surrogate
-                            if (0xD800 <= codepoint1 && codepoint1 <= 0xDBFF)
-                            {
-                                // expect next \uxxxx entry
-                                if (JSON_HEDLEY_LIKELY(get() == '\\' && get() == 'u'))
-                                {
-                                    const int codepoint2 = get_codepoint();
+    if ((t == number_type) &&
+        (TypeTraits<T>::type_id() == TypeTraits<number>::type_id())) {
+      return reinterpret_cast<const T *>(&u.d);
+    }
 
-                                    if (JSON_HEDLEY_UNLIKELY(codepoint2 == -1))
-                                    {
-                                        error_message = "invalid string: '\\u' must be followed by 4 hex digits";
-                                        return false;
-                                    }
+    return nullptr;
+  }
 
-                                    // check if codepoint2 is a low surrogate
-                                    if (JSON_HEDLEY_LIKELY(0xDC00 <= codepoint2 && codepoint2 <= 0xDFFF))
-                                    {
-                                        // overwrite codepoint
-                                        codepoint = static_cast<int>(
-                                                        // high surrogate occupies the most significant 22 bits
-                                                        (static_cast<unsigned int>(codepoint1) << 10u)
-                                                        // low surrogate occupies the least significant 15 bits
-                                                        + static_cast<unsigned int>(codepoint2)
-                                                        // there is still the 0xD800, 0xDC00 and 0x10000 noise
-                                                        // in the result, so we have to subtract with:
-                                                        // (0xD800 << 10) + DC00 - 0x10000 = 0x35FDC00
-                                                        - 0x35FDC00u);
-                                    }
-                                    else
-                                    {
-                                        error_message = "invalid string: surrogate U+D800..U+DBFF must be followed by U+DC00..U+DFFF";
-                                        return false;
-                                    }
-                                }
-                                else
-                                {
-                                    error_message = "invalid string: surrogate U+D800..U+DBFF must be followed by U+DC00..U+DFFF";
-                                    return false;
-                                }
-                            }
-                            else
-                            {
-                                if (JSON_HEDLEY_UNLIKELY(0xDC00 <= codepoint1 && codepoint1 <= 0xDFFF))
-                                {
-                                    error_message = "invalid string: surrogate U+DC00..U+DFFF must follow U+D800..U+DBFF";
-                                    return false;
-                                }
-                            }
+  template <typename T>
+  T *as() {
+    if ((t == array_type) &&
+        (TypeTraits<T>::type_id() == TypeTraits<array>::type_id())) {
+      return reinterpret_cast<T *>(u.a);
+    }
 
-                            // result of the above calculation yields a proper codepoint
-                            //JSON_ASSERT(0x00 <= codepoint && codepoint <= 0x10FFFF);
-                            if (0x00 <= codepoint && codepoint <= 0x10FFFF) {
-                            } else {
-                                error_message = "invalid string: invalid codepoint";
-                                return false;
-                            }
+    if ((t == object_type) &&
+        (TypeTraits<T>::type_id() == TypeTraits<object>::type_id())) {
+      return reinterpret_cast<T *>(u.o);
+    }
 
-                            // translate codepoint into bytes
-                            if (codepoint < 0x80)
-                            {
-                                // 1-byte characters: 0xxxxxxx (ASCII)
-                                add(static_cast<int>(codepoint));
-                            }
-                            else if (codepoint <= 0x7FF)
-                            {
-                                // 2-byte characters: 110xxxxx 10xxxxxx
-                                add(static_cast<int>(0xC0u | (static_cast<unsigned int>(codepoint) >> 6u)));
-                                add(static_cast<int>(0x80u | (static_cast<unsigned int>(codepoint) & 0x3Fu)));
-                            }
-                            else if (codepoint <= 0xFFFF)
-                            {
-                                // 3-byte characters: 1110xxxx 10xxxxxx 10xxxxxx
-                                add(static_cast<int>(0xE0u | (static_cast<unsigned int>(codepoint) >> 12u)));
-                                add(static_cast<int>(0x80u | ((static_cast<unsigned int>(codepoint) >> 6u) & 0x3Fu)));
-                                add(static_cast<int>(0x80u | (static_cast<unsigned int>(codepoint) & 0x3Fu)));
-                            }
-                            else
-                            {
-                                // 4-byte characters: 11110xxx 10xxxxxx 10xxxxxx 10xxxxxx
-                                add(static_cast<int>(0xF0u | (static_cast<unsigned int>(codepoint) >> 18u)));
-                                add(static_cast<int>(0x80u | ((static_cast<unsigned int>(codepoint) >> 12u) & 0x3Fu)));
-                                add(static_cast<int>(0x80u | ((static_cast<unsigned int>(codepoint) >> 6u) & 0x3Fu)));
-                                add(static_cast<int>(0x80u | (static_cast<unsigned int>(codepoint) & 0x3Fu)));
-                            }
+    if ((t == string_type) &&
+        (TypeTraits<T>::type_id() == TypeTraits<string>::type_id())) {
+      return reinterpret_cast<T *>(u.s);
+    }
 
-                            break;
-                        }
+    if ((t == null_type) &&
+        (TypeTraits<T>::type_id() == TypeTraits<null_t>::type_id())) {
+      return reinterpret_cast<T *>(&u.n);
+    }
 
-                        // other characters after escape
-                        default:
-                            error_message = "invalid string: forbidden character after backslash";
-                            return false;
-                    }
+    if ((t == boolean_type) &&
+        (TypeTraits<T>::type_id() == TypeTraits<boolean>::type_id())) {
+      return reinterpret_cast<T *>(&u.b);
+    }
 
-                    break;
-                }
+    if ((t == number_type) &&
+        (TypeTraits<T>::type_id() == TypeTraits<number>::type_id())) {
+      return reinterpret_cast<T *>(&u.d);
+    }
 
-                // invalid control characters
-                case 0x00:
-                {
-                    error_message = "invalid string: control character U+0000 (NUL) must be escaped to \\u0000";
-                    return false;
-                }
+    return nullptr;
+  }
 
-                case 0x01:
+  null_t &operator=(null_t &n) {
+    t = null_type;
+    u.n = n;
+    return u.n;
+  }
+  boolean &operator=(boolean b) {
+    t = boolean_type;
+    u.b = b;
+    return u.b;
+  }
+  number &operator=(number d) {
+    t = number_type;
+    u.d = d;
+    return u.d;
+  }
+  const std::string &operator=(const char *s) {
+    _free_u();
+    t = string_type;
+    u.s = new std::string(s);
+    return *u.s;
+  }
+  const std::string &operator=(const std::string &s) {
+    _free_u();
+    t = string_type;
+    u.s = new std::string(s);
+    return *u.s;
+  }
+  const object &operator=(const object &o) {
+    _free_u();
+    t = object_type;
+    u.o = new object(o);
+    return *u.o;
+  }
+  const array &operator=(const array &a) {
+    _free_u();
+    t = array_type;
+    u.a = new array(a);
+    return *u.a;
+  }
+  const value &operator=(const value &v) {
+    _free_u();
+    t = v.t;
+    if (t == array_type) {
+      u.a = new array(*v.u.a);
+    } else if (t == object_type) {
+      u.o = new object(*v.u.o);
+    } else if (t == string_type) {
+      u.s = new std::string(*v.u.s);
+    } else
+      u.d = v.u.d;
+    return *this;
+  }
+
+  std::string type_name() const {
+    if (t == array_type) {
+      return "array";
+    }
+
+    if (t == object_type) {
+      return "object";
+    }
+
+    if (t == string_type) {
+      return "string";
+    }
+
+    if (t == null_type) {
+      return "null";
+    }
+
+    if (t == boolean_type) {
+      return "boolean";
+    }
+
+    if (t == number_type) {
+      return "number";
+    }
+
+    return "[[invalid]]";
+  }
+
+  std::string str(const char *p) const {
+    std::stringstream ss;
+    ss << '"';
+    while (*p) {
+      if (*p == '\n') {
+        ss << "\\n";
+      } else if (*p == '\r') {
+        ss << "\\r";
+      } else if (*p == '\t') {
+        ss << "\\t";
+      } else if (detail::my_strchr("\"", *p)) {
+        ss << "\\" << *p;
+      } else {
+        ss << *p;
+      }
+      p++;
+    }
+    ss << '"';
+    return ss.str();
+  }
+
+  std::string str() const {
+    std::stringstream ss;
+    if (t == unknown_type) {
+      ss << "undefined";
+    } else if (t == null_type) {
+      ss << "null";
+    } else if (t == boolean_type) {
+      ss << (u.b ? "true" : "false");
+    } else if (t == number_type) {
+      ss << double(u.d);
+    } else if (t == string_type) {
+      ss << str(u.s->c_str());
+    } else if (const array *pa = as<array>()) {
+      array::const_iterator i;
+      ss << "[";
+      // array a = get<array>();
+      for (i = pa->begin(); i != pa->end(); i++) {
+        if (i != pa->begin()) ss << ", ";
+        ss << i->str();
+      }
+      ss << "]";
+    } else if (auto po = as<object>()) {
+      // object::const_iterator i;
+      ss << "{";
+      // object o = get<object>();
+      for (size_t i = 0; i < po->size(); i++) {
+        if (i > 0) ss << ", ";
+        ss << "\"" << po->keys()[i] << "\"";
+
+        value v;
+        if (po->at(i, &v)) {
+          ss << ": " << v.str();
+        } else {
+          // TODO: report error
+          ss << ": null";
+        }
+      }
+      ss << "}";
+    }
+    return ss.str();
+  }
+};
+
+#define MINIJSON_SKIP(i)                           \
+  while (*i && detail::my_strchr("\r\n \t", *i)) { \
+    i++;                                           \
+  }
+
+template <typename Iter>
+inline error parse_object(Iter &i, value &v) {
+  object o;
+  i++;
+  MINIJSON_SKIP(i)
+  if (!(*i)) {
+    return corrupted_json_error;
+  }
+  if (*i != '\x7d') {
+    while (*i) {
+      value vk, vv;
+      error e = parse_string(i, vk);
+      if (e != no_error) return e;
+      MINIJSON_SKIP(i)
+      if (!(*i)) {
+        return corrupted_json_error;
+      }
+      if (*i != ':') return invalid_token_error;
+      i++;
+      e = parse_any(i, vv);
+      if (e != no_error) return e;
+
+      auto ps = vk.as<std::string>();
+      if (!ps) {
+        return unknown_type_error;
+      }
+
+      if (o.count(*ps)) {
+        return duplicated_key_error;
+      }
+      o.insert(*ps, vv);
+
+      MINIJSON_SKIP(i)
+      if (!(*i)) {
+        return corrupted_json_error;
+      }
+      if (*i == '\x7d') break;
+      if (*i != ',') return invalid_token_error;
+      i++;
+      MINIJSON_SKIP(i)
+      if (!(*i)) {
+        return corrupted_json_error;
+      }
+#ifdef __MINIJSON_LIBERAL
+      if (*i == '\x7d') break;
+#endif
+    }
+  }
+  v = value(o);
+  i++;
+  return no_error;
+}
+
+template <typename Iter>
+inline error parse_array(Iter &i, value &v) {
+  array a;
+  i++;
+  MINIJSON_SKIP(i)
+  if (!(*i)) {
+    return corrupted_json_error;
+  }
+  if (*i != ']') {
+    while (*i) {
+      value va;
+      error e = parse_any(i, va);
+      if (e != no_error) return e;
+      a.push_back(va);
+      MINIJSON_SKIP(i)
+      if (!(*i)) {
+        return corrupted_json_error;
+      }
+      if (*i == ']') break;
+      if (*i != ',') return invalid_token_error;
+      i++;
+      MINIJSON_SKIP(i)
+      if (!(*i)) {
+        return corrupted_json_error;
+      }
+#ifdef __MINIJSON_LIBERAL
+      if (*i == '\x7d') break;
+#endif
+    }
+  }
+  v = value(a);
+  i++;
+  return no_error;
+}
+
+template <typename Iter>
+inline error parse_null(Iter &i, value &v) {
+  Iter p = i;
+  if (*i == 'n' && *(i + 1) == 'u' && *(i + 2) == 'l' && *(i + 3) == 'l') {
+    i += 4;
+    v = null_t();
+  }
+  if (*i && nullptr == detail::my_strchr(":,\x7d]\r\n ", *i)) {
+    i = p;
+    return undefined_error;
+  }
+  return no_error;
+}
+
+template <typename Iter>
+inline error parse_boolean(Iter &i, value &v) {
+  Iter p = i;
+  if (*i == 't' && *(i + 1) == 'r' && *(i + 2) == 'u' && *(i + 3) == 'e') {
+    i += 4;
+    v = static_cast<boolean>(true);
+  } else if (*i == 'f' && *(i + 1) == 'a' && *(i + 2) == 'l' &&
+             *(i + 3) == 's' && *(i + 4) == 'e') {
+    i += 5;
+    v = static_cast<boolean>(false);
+  }
+  if (*i && nullptr == detail::my_strchr(":,\x7d]\r\n ", *i)) {
+    i = p;
+    return undefined_error;
+  }
+  return no_error;
+}
+
+template <typename Iter>
+inline error parse_number(Iter &i, value &v) {
+  Iter p = i;
+
+  if (*i == '-') {
+    i++;
+  }
+
+#define MINIJSON_IS_NUM(x) ('0' <= x && x <= '9')
+#define MINIJSON_IS_ALNUM(x) \
+  (('0' <= x && x <= '9') || ('a' <= x && x <= 'f') || ('A' <= x && x <= 'F'))
+  if (*i == '0' && *(i + 1) == 'x' && MINIJSON_IS_ALNUM(*(i + 2))) {
+    i += 3;
+    while (MINIJSON_IS_ALNUM(*i)) i++;
+    v = static_cast<number>(detail::from_chars(p));
+  } else {
+    while (MINIJSON_IS_NUM(*i)) i++;
+    if (*i == '.') {
+      i++;
+      if (!MINIJSON_IS_NUM(*i)) {
+        i = p;
+        return invalid_token_error;
+      }
+      while (MINIJSON_IS_NUM(*i)) i++;
+    }
+    if (*i == 'e') {
+      i++;
+      if (!MINIJSON_IS_NUM(*i)) {
+        i = p;
+        return invalid_token_error;
+      }
+      while (MINIJSON_IS_NUM(*i)) i++;
+    }
+    v = static_cast<number>(detail::from_chars(p));
+  }
+  if (*i && nullptr == detail::my_strchr(":,\x7d]\r\n ", *i)) {
+    i = p;
+    return invalid_token_error;
+  }
+  return no_error;
+}
+
+template <typename Iter>
+inline error parse_string(Iter &i, value &v) {
+  if (*i != '"') return invalid_token_error;
+
+  Iter s = i;
+  char t = *i++;  // = '"'
+  Iter p = i;
+
+#if 0
+  std::stringstream ss;
+  while (*i && *i != t) {
+    if (*i == '\\' && *(i + 1)) {
+      i++;
+      if (*i == 'n')
+        ss << "\n";
+      else if (*i == 'r')
+        ss << "\r";
+      else if (*i == 't')
+        ss << "\t";
+      else
+        ss << *i;
+    } else {
+      ss << *i;
+    }
+    i++;
+  }
+#else
+  // read until '"'
+  while (*i && *i != t) {
+    if (*i == '\\' && *(i + 1)) {
+      i++;
+    }
+    i++;
+  }
+
+#endif
+  if (!*i) return invalid_token_error;
+  if (i < p) {
+    return corrupted_json_error;
+  }
+
+#if 0
+  v = std::string(p, size_t(i - p));
+
+  i++;
+  if (*i && nullptr == detail::my_strchr(":,\x7d]\r\n ", *i)) {
+    i = p;
+    return invalid_token_error;
+  }
+
+#else
+
+  i++;
+  if (*i && nullptr == detail::my_strchr(":,\x7d]\r\n ", *i)) {
+    i = p;
+    return invalid_token_error;
+  }
+
+  // include first and last '"' char
+  std::string buf(s, size_t(i - s));
+
+  detail::string_parser str_parser;
+  str_parser.set_input(buf);
+
+  if (!str_parser.scan_string()) {
+    // TODO: error message
+    // str_parser.error_message;
+    return invalid_token_error;
+  } else {
+    v = str_parser.token_buffer;
+  }
+
+#endif
+
+  return no_error;
+}
+
+template <typename Iter>
+inline error parse_any(Iter &i, value &v) {
+  MINIJSON_SKIP(i)
+  if (*i == '\x7b') return parse_object(i, v);
+  if (*i == '[') return parse_array(i, v);
+  if (*i == 't' || *i == 'f') return parse_boolean(i, v);
+  if (*i == 'n') return parse_null(i, v);
+  if ((*i == '-') || ('0' <= *i && *i <= '9')) return parse_number(i, v);
+  if (*i == '"') return parse_string(i, v);
+  return invalid_token_error;
+}
+
+template <typename Iter>
+inline error parse(Iter &i, value &v) {
+  return parse_any(i, v);
+}
+
+#undef MINIJSON_SKIP
+
+inline const char *errstr(error e) {
+  const char *s = "unknown error";
+  switch (e) {
+    case no_error: {
+      s = "no error";
+      break;
+    }
+    case undefined_error: {
+      s = "undefined";
+      break;
+    }
+    case invalid_token_error: {
+      s = "invalid token";
+      break;
+    }
+    case unknown_type_error: {
+      s = "unknown type";
+      break;
+    }
+    case memory_allocation_error: {
+      s = "memory allocation error";
+      break;
+    }
+    case corrupted_json_error: {
+      s = "input is corrupted";
+      break;
+    }
+    case duplicated_key_error: {
+      s = "duplicated key found";
+      break;
+    }
+      // default: return "unknown error";
+  }
+
+  return s;
+}
+
+}  // namespace minijson
+
+#if defined(MINIJSON_IMPLEMENTATION)
+
+namespace minijson {
+
+namespace detail {
+
+// clang-format off
+//
+// From json.hpp ---------------------------------------------------------
+//     __ _____ _____ _____
+//  __|  |   __|     |   | |  JSON for Modern C++
+// |  |  |__   |  |  | | | |  version 3.11.3
+// |_____|_____|_____|_|___|  https://github.com/nlohmann/json
+//
+// SPDX-FileCopyrightText: 2013-2023 Niels Lohmann <https://nlohmann.me>
+// SPDX-License-Identifier: MIT
+
+#if 1
+    #define JSON_HEDLEY_UNLIKELY(cond) (cond)
+    #define JSON_HEDLEY_LIKELY(cond) (cond)
+
+    /*!
+    @brief get codepoint from 4 hex characters following `\u`
+
+    For input "\u c1 c2 c3 c4" the codepoint is:
+      (c1 * 0x1000) + (c2 * 0x0100) + (c3 * 0x0010) + c4
+    = (c1 << 12) + (c2 << 8) + (c3 << 4) + (c4 << 0)
+
+    Furthermore, the possible characters '0'..'9', 'A'..'F', and 'a'..'f'
+    must be converted to the integers 0x0..0x9, 0xA..0xF, 0xA..0xF, resp. The
+    conversion is done by subtracting the offset (0x30, 0x37, and 0x57)
+    between the ASCII value of the character and the desired integer value.
+
+    @return codepoint (0x0000..0xFFFF) or -1 in case of an error (e.g. EOF or
+            non-hex character)
+    */
+    int string_parser::get_codepoint() 
+    {
+        // this function only makes sense after reading `\u`
+        //JSON_ASSERT(current == 'u');
+        if (current != 'u') {
+          return -1;
+        }
+        int codepoint = 0;
+
+        const auto factors = { 12u, 8u, 4u, 0u };
+        for (const auto factor : factors)
+        {
+            get();
+
+            if (current >= '0' && current <= '9')
+            {
+                codepoint += static_cast<int>((static_cast<unsigned int>(current) - 0x30u) << factor);
+            }
+            else if (current >= 'A' && current <= 'F')
+            {
+                codepoint += static_cast<int>((static_cast<unsigned int>(current) - 0x37u) << factor);
+            }
+            else if (current >= 'a' && current <= 'f')
+            {
+                codepoint += static_cast<int>((static_cast<unsigned int>(current) - 0x57u) << factor);
+            }
+            else
+            {
+                return -1;
+            }
+        }
+
+        if (0x0000 <= codepoint && codepoint <= 0xFFFF) {
+        } else {
+          return -1;
+        }
+        return codepoint;
+    }
+
+    /*!
+    @brief check if the next byte(s) are inside a given range
+
+    Adds the current byte and, for each passed range, reads a new byte and
+    checks if it is inside the range. If a violation was detected, set up an
+    error message and return false. Otherwise, return true.
+
+    @param[in] ranges  list of integers; interpreted as list of pairs of
+                       inclusive lower and upper bound, respectively
+
+    @pre The passed list @a ranges must have 2, 4, or 6 elements; that is,
+         1, 2, or 3 pairs. This precondition is enforced by an assertion.
+
+    @return true if and only if no range violation was detected
+    */
+    bool string_parser::next_byte_in_range(const std::initializer_list<int> ranges)
+    {
+        if (ranges.size() == 2 || ranges.size() == 4 || ranges.size() == 6) {
+        } else {
+          return false;
+        }
+
+        add(current);
+
+        for (auto range = ranges.begin(); range != ranges.end(); ++range)
+        {
+            get();
+            if (JSON_HEDLEY_LIKELY(*range <= current && current <= *(++range))) // NOLINT(bugprone-inc-dec-in-conditions)
+            {
+                add(current);
+            }
+            else
+            {
+                error_message = "invalid string: ill-formed UTF-8 byte";
+                return false;
+            }
+        }
+
+        return true;
+    }
+    /*!
+    @brief scan a string literal
+
+    This function scans a string according to Sect. 7 of RFC 8259. While
+    scanning, bytes are escaped and copied into buffer token_buffer. Then the
+    function returns successfully, token_buffer is *not* null-terminated (as it
+    may contain \0 bytes), and token_buffer.size() is the number of bytes in the
+    string.
+
+    @return true if string could be successfully scanned,
+            false otherwise
+
+    @note In case of errors, variable error_message contains a textual
+          description.
+    */
+    bool string_parser::scan_string()
+    {
+        // reset token_buffer (ignore opening quote)
+        reset();
+
+        // we entered the function by reading an open quote
+        //JSON_ASSERT(current == '\"');
+        if (current != '\"') {
+            error_message = "first character must be '\"'";
+            return false;
+        }
+
+
+        while (!eof())
+        {
+
+            // get next character
+            switch (get())
+            {
+
+                // closing quote
+                case '\"':
+                {
+                    return true;
+                }
+
+                // escapes
+                case '\\':
+                {
+                    switch (get())
+                    {
+                        // quotation mark
+                        case '\"':
+                            add('\"');
+                            break;
+                        // reverse solidus
+                        case '\\':
+                            add('\\');
+                            break;
+                        // solidus
+                        case '/':
+                            add('/');
+                            break;
+                        // backspace
+                        case 'b':
+                            add('\b');
+                            break;
+                        // form feed
+                        case 'f':
+                            add('\f');
+                            break;
+                        // line feed
+                        case 'n':
+                            add('\n');
+                            break;
+                        // carriage return
+                        case 'r':
+                            add('\r');
+                            break;
+                        // tab
+                        case 't':
+                            add('\t');
+                            break;
+
+                        // unicode escapes
+                        case 'u':
+                        {
+                            const int codepoint1 = get_codepoint();
+                            int codepoint = codepoint1; // start with codepoint1
+
+                            if (JSON_HEDLEY_UNLIKELY(codepoint1 == -1))
+                            {
+                                error_message = "invalid string: '\\u' must be followed by 4 hex digits";
+                                return false;
+                            }
+
+                            // check if code point is a high surrogate
+                            if (0xD800 <= codepoint1 && codepoint1 <= 0xDBFF)
+                            {
+                                // expect next \uxxxx entry
+                                if (JSON_HEDLEY_LIKELY(get() == '\\' && get() == 'u'))
+                                {
+                                    const int codepoint2 = get_codepoint();
+
+                                    if (JSON_HEDLEY_UNLIKELY(codepoint2 == -1))
+                                    {
+                                        error_message = "invalid string: '\\u' must be followed by 4 hex digits";
+                                        return false;
+                                    }
+
+                                    // check if codepoint2 is a low surrogate
+                                    if (JSON_HEDLEY_LIKELY(0xDC00 <= codepoint2 && codepoint2 <= 0xDFFF))
+                                    {
+                                        // overwrite codepoint
+                                        codepoint = static_cast<int>(
+                                                        // high surrogate occupies the most significant 22 bits
+                                                        (static_cast<unsigned int>(codepoint1) << 10u)
+                                                        // low surrogate occupies the least significant 15 bits
+                                                        + static_cast<unsigned int>(codepoint2)
+                                                        // there is still the 0xD800, 0xDC00 and 0x10000 noise
+                                                        // in the result, so we have to subtract with:
+                                                        // (0xD800 << 10) + DC00 - 0x10000 = 0x35FDC00
+                                                        - 0x35FDC00u);
+                                    }
+                                    else
+                                    {
+                                        error_message = "invalid string: surrogate U+D800..U+DBFF must be followed by U+DC00..U+DFFF";
+                                        return false;
+                                    }
+                                }
+                                else
+                                {
+                                    error_message = "invalid string: surrogate U+D800..U+DBFF must be followed by U+DC00..U+DFFF";
+                                    return false;
+                                }
+                            }
+                            else
+                            {
+                                if (JSON_HEDLEY_UNLIKELY(0xDC00 <= codepoint1 && codepoint1 <= 0xDFFF))
+                                {
+                                    error_message = "invalid string: surrogate U+DC00..U+DFFF must follow U+D800..U+DBFF";
+                                    return false;
+                                }
+                            }
+
+                            // result of the above calculation yields a proper codepoint
+                            //JSON_ASSERT(0x00 <= codepoint && codepoint <= 0x10FFFF);
+                            if (0x00 <= codepoint && codepoint <= 0x10FFFF) {
+                            } else {
+                                error_message = "invalid string: invalid codepoint";
+                                return false;
+                            }
+
+                            // translate codepoint into bytes
+                            if (codepoint < 0x80)
+                            {
+                                // 1-byte characters: 0xxxxxxx (ASCII)
+                                add(static_cast<int>(codepoint));
+                            }
+                            else if (codepoint <= 0x7FF)
+                            {
+                                // 2-byte characters: 110xxxxx 10xxxxxx
+                                add(static_cast<int>(0xC0u | (static_cast<unsigned int>(codepoint) >> 6u)));
+                                add(static_cast<int>(0x80u | (static_cast<unsigned int>(codepoint) & 0x3Fu)));
+                            }
+                            else if (codepoint <= 0xFFFF)
+                            {
+                                // 3-byte characters: 1110xxxx 10xxxxxx 10xxxxxx
+                                add(static_cast<int>(0xE0u | (static_cast<unsigned int>(codepoint) >> 12u)));
+                                add(static_cast<int>(0x80u | ((static_cast<unsigned int>(codepoint) >> 6u) & 0x3Fu)));
+                                add(static_cast<int>(0x80u | (static_cast<unsigned int>(codepoint) & 0x3Fu)));
+                            }
+                            else
+                            {
+                                // 4-byte characters: 11110xxx 10xxxxxx 10xxxxxx 10xxxxxx
+                                add(static_cast<int>(0xF0u | (static_cast<unsigned int>(codepoint) >> 18u)));
+                                add(static_cast<int>(0x80u | ((static_cast<unsigned int>(codepoint) >> 12u) & 0x3Fu)));
+                                add(static_cast<int>(0x80u | ((static_cast<unsigned int>(codepoint) >> 6u) & 0x3Fu)));
+                                add(static_cast<int>(0x80u | (static_cast<unsigned int>(codepoint) & 0x3Fu)));
+                            }
+
+                            break;
+                        }
+
+                        // other characters after escape
+                        default:
+                            error_message = "invalid string: forbidden character after backslash";
+                            return false;
+                    }
+
+                    break;
+                }
+
+                // invalid control characters
+                case 0x00:
+                {
+                    error_message = "invalid string: control character U+0000 (NUL) must be escaped to \\u0000";
+                    return false;
+                }
+
+                case 0x01:
+                {
+                    error_message = "invalid string: control character U+0001 (SOH) must be escaped to \\u0001";
+                    return false;
+                }
+
+                case 0x02:
+                {
+                    error_message = "invalid string: control character U+0002 (STX) must be escaped to \\u0002";
+                    return false;
+                }
+
+                case 0x03:
+                {
+                    error_message = "invalid string: control character U+0003 (ETX) must be escaped to \\u0003";
+                    return false;
+                }
+
+                case 0x04:
+                {
+                    error_message = "invalid string: control character U+0004 (EOT) must be escaped to \\u0004";
+                    return false;
+                }
+
+                case 0x05:
+                {
+                    error_message = "invalid string: control character U+0005 (ENQ) must be escaped to \\u0005";
+                    return false;
+                }
+
+                case 0x06:
+                {
+                    error_message = "invalid string: control character U+0006 (ACK) must be escaped to \\u0006";
+                    return false;
+                }
+
+                case 0x07:
+                {
+                    error_message = "invalid string: control character U+0007 (BEL) must be escaped to \\u0007";
+                    return false;
+                }
+
+                case 0x08:
+                {
+                    error_message = "invalid string: control character U+0008 (BS) must be escaped to \\u0008 or \\b";
+                    return false;
+                }
+
+                case 0x09:
+                {
+                    error_message = "invalid string: control character U+0009 (HT) must be escaped to \\u0009 or \\t";
+                    return false;
+                }
+
+                case 0x0A:
+                {
+                    error_message = "invalid string: control character U+000A (LF) must be escaped to \\u000A or \\n";
+                    return false;
+                }
+
+                case 0x0B:
+                {
+                    error_message = "invalid string: control character U+000B (VT) must be escaped to \\u000B";
+                    return false;
+                }
+
+                case 0x0C:
+                {
+                    error_message = "invalid string: control character U+000C (FF) must be escaped to \\u000C or \\f";
+                    return false;
+                }
+
+                case 0x0D:
+                {
+                    error_message = "invalid string: control character U+000D (CR) must be escaped to \\u000D or \\r";
+                    return false;
+                }
+
+                case 0x0E:
+                {
+                    error_message = "invalid string: control character U+000E (SO) must be escaped to \\u000E";
+                    return false;
+                }
+
+                case 0x0F:
+                {
+                    error_message = "invalid string: control character U+000F (SI) must be escaped to \\u000F";
+                    return false;
+                }
+
+                case 0x10:
+                {
+                    error_message = "invalid string: control character U+0010 (DLE) must be escaped to \\u0010";
+                    return false;
+                }
+
+                case 0x11:
+                {
+                    error_message = "invalid string: control character U+0011 (DC1) must be escaped to \\u0011";
+                    return false;
+                }
+
+                case 0x12:
+                {
+                    error_message = "invalid string: control character U+0012 (DC2) must be escaped to \\u0012";
+                    return false;
+                }
+
+                case 0x13:
+                {
+                    error_message = "invalid string: control character U+0013 (DC3) must be escaped to \\u0013";
+                    return false;
+                }
+
+                case 0x14:
+                {
+                    error_message = "invalid string: control character U+0014 (DC4) must be escaped to \\u0014";
+                    return false;
+                }
+
+                case 0x15:
+                {
+                    error_message = "invalid string: control character U+0015 (NAK) must be escaped to \\u0015";
+                    return false;
+                }
+
+                case 0x16:
+                {
+                    error_message = "invalid string: control character U+0016 (SYN) must be escaped to \\u0016";
+                    return false;
+                }
+
+                case 0x17:
+                {
+                    error_message = "invalid string: control character U+0017 (ETB) must be escaped to \\u0017";
+                    return false;
+                }
+
+                case 0x18:
+                {
+                    error_message = "invalid string: control character U+0018 (CAN) must be escaped to \\u0018";
+                    return false;
+                }
+
+                case 0x19:
+                {
+                    error_message = "invalid string: control character U+0019 (EM) must be escaped to \\u0019";
+                    return false;
+                }
+
+                case 0x1A:
+                {
+                    error_message = "invalid string: control character U+001A (SUB) must be escaped to \\u001A";
+                    return false;
+                }
+
+                case 0x1B:
+                {
+                    error_message = "invalid string: control character U+001B (ESC) must be escaped to \\u001B";
+                    return false;
+                }
+
+                case 0x1C:
+                {
+                    error_message = "invalid string: control character U+001C (FS) must be escaped to \\u001C";
+                    return false;
+                }
+
+                case 0x1D:
+                {
+                    error_message = "invalid string: control character U+001D (GS) must be escaped to \\u001D";
+                    return false;
+                }
+
+                case 0x1E:
+                {
+                    error_message = "invalid string: control character U+001E (RS) must be escaped to \\u001E";
+                    return false;
+                }
+
+                case 0x1F:
+                {
+                    error_message = "invalid string: control character U+001F (US) must be escaped to \\u001F";
+                    return false;
+                }
+
+                // U+0020..U+007F (except U+0022 (quote) and U+005C (backspace))
+                case 0x20:
+                case 0x21:
+                case 0x23:
+                case 0x24:
+                case 0x25:
+                case 0x26:
+                case 0x27:
+                case 0x28:
+                case 0x29:
+                case 0x2A:
+                case 0x2B:
+                case 0x2C:
+                case 0x2D:
+                case 0x2E:
+                case 0x2F:
+                case 0x30:
+                case 0x31:
+                case 0x32:
+                case 0x33:
+                case 0x34:
+                case 0x35:
+                case 0x36:
+                case 0x37:
+                case 0x38:
+                case 0x39:
+                case 0x3A:
+                case 0x3B:
+                case 0x3C:
+                case 0x3D:
+                case 0x3E:
+                case 0x3F:
+                case 0x40:
+                case 0x41:
+                case 0x42:
+                case 0x43:
+                case 0x44:
+                case 0x45:
+                case 0x46:
+                case 0x47:
+                case 0x48:
+                case 0x49:
+                case 0x4A:
+                case 0x4B:
+                case 0x4C:
+                case 0x4D:
+                case 0x4E:
+                case 0x4F:
+                case 0x50:
+                case 0x51:
+                case 0x52:
+                case 0x53:
+                case 0x54:
+                case 0x55:
+                case 0x56:
+                case 0x57:
+                case 0x58:
+                case 0x59:
+                case 0x5A:
+                case 0x5B:
+                case 0x5D:
+                case 0x5E:
+                case 0x5F:
+                case 0x60:
+                case 0x61:
+                case 0x62:
+                case 0x63:
+                case 0x64:
+                case 0x65:
+                case 0x66:
+                case 0x67:
+                case 0x68:
+                case 0x69:
+                case 0x6A:
+                case 0x6B:
+                case 0x6C:
+                case 0x6D:
+                case 0x6E:
+                case 0x6F:
+                case 0x70:
+                case 0x71:
+                case 0x72:
+                case 0x73:
+                case 0x74:
+                case 0x75:
+                case 0x76:
+                case 0x77:
+                case 0x78:
+                case 0x79:
+                case 0x7A:
+                case 0x7B:
+                case 0x7C:
+                case 0x7D:
+                case 0x7E:
+                case 0x7F:
+                {
+                    add(current);
+                    break;
+                }
+
+                // U+0080..U+07FF: bytes C2..DF 80..BF
+                case 0xC2:
+                case 0xC3:
+                case 0xC4:
+                case 0xC5:
+                case 0xC6:
+                case 0xC7:
+                case 0xC8:
+                case 0xC9:
+                case 0xCA:
+                case 0xCB:
+                case 0xCC:
+                case 0xCD:
+                case 0xCE:
+                case 0xCF:
+                case 0xD0:
+                case 0xD1:
+                case 0xD2:
+                case 0xD3:
+                case 0xD4:
+                case 0xD5:
+                case 0xD6:
+                case 0xD7:
+                case 0xD8:
+                case 0xD9:
+                case 0xDA:
+                case 0xDB:
+                case 0xDC:
+                case 0xDD:
+                case 0xDE:
+                case 0xDF:
+                {
+                    if (JSON_HEDLEY_UNLIKELY(!next_byte_in_range({0x80, 0xBF})))
+                    {
+                        return false;
+                    }
+                    break;
+                }
+
+                // U+0800..U+0FFF: bytes E0 A0..BF 80..BF
+                case 0xE0:
+                {
+                    if (JSON_HEDLEY_UNLIKELY(!(next_byte_in_range({0xA0, 0xBF, 0x80, 0xBF}))))
+                    {
+                        return false;
+                    }
+                    break;
+                }
+
+                // U+1000..U+CFFF: bytes E1..EC 80..BF 80..BF
+                // U+E000..U+FFFF: bytes EE..EF 80..BF 80..BF
+                case 0xE1:
+                case 0xE2:
+                case 0xE3:
+                case 0xE4:
+                case 0xE5:
+                case 0xE6:
+                case 0xE7:
+                case 0xE8:
+                case 0xE9:
+                case 0xEA:
+                case 0xEB:
+                case 0xEC:
+                case 0xEE:
+                case 0xEF:
+                {
+                    if (JSON_HEDLEY_UNLIKELY(!(next_byte_in_range({0x80, 0xBF, 0x80, 0xBF}))))
+                    {
+                        return false;
+                    }
+                    break;
+                }
+
+                // U+D000..U+D7FF: bytes ED 80..9F 80..BF
+                case 0xED:
+                {
+                    if (JSON_HEDLEY_UNLIKELY(!(next_byte_in_range({0x80, 0x9F, 0x80, 0xBF}))))
+                    {
+                        return false;
+                    }
+                    break;
+                }
+
+                // U+10000..U+3FFFF F0 90..BF 80..BF 80..BF
+                case 0xF0:
+                {
+                    if (JSON_HEDLEY_UNLIKELY(!(next_byte_in_range({0x90, 0xBF, 0x80, 0xBF, 0x80, 0xBF}))))
+                    {
+                        return false;
+                    }
+                    break;
+                }
+
+                // U+40000..U+FFFFF F1..F3 80..BF 80..BF 80..BF
+                case 0xF1:
+                case 0xF2:
+                case 0xF3:
+                {
+                    if (JSON_HEDLEY_UNLIKELY(!(next_byte_in_range({0x80, 0xBF, 0x80, 0xBF, 0x80, 0xBF}))))
+                    {
+                        return false;
+                    }
+                    break;
+                }
+
+                // U+100000..U+10FFFF F4 80..8F 80..BF 80..BF
+                case 0xF4:
                 {
-                    error_message = "invalid string: control character U+0001 (SOH) must be escaped to \\u0001";
+                    if (JSON_HEDLEY_UNLIKELY(!(next_byte_in_range({0x80, 0x8F, 0x80, 0xBF, 0x80, 0xBF}))))
+                    {
+                        return false;
+                    }
+                    break;
+                }
+
+                // remaining bytes (80..C1 and F5..FF) are ill-formed
+                default:
+                {
+                    error_message = "invalid string: ill-formed UTF-8 byte";
                     return false;
                 }
+            }
+        }
+
+        error_message = "invalid string: missing closing quote";
+        return false;
+    }
+#endif
+// end json.hpp
+// clang-format on
+
+}  // namespace detail
+
+namespace detail {
+
+double from_chars(const char *p) {
+#if defined(MINIJSON_USE_STRTOD)
+  return strtod(p, nullptr);
+#else
+  return simdjson::internal::from_chars(p);
+#endif
+}
+
+const char *my_strchr(const char *p, int ch) {
+  char c;
+
+  constexpr uint64_t kMaxCount = 1024ull * 1024ull;  // up to 1M chars
+
+  uint64_t cnt{0};
+
+  c = ch;
+  for (;; ++p, cnt++) {
+    if (cnt > kMaxCount) {
+      return nullptr;
+    }
+
+    if (*p == c) {
+      return (p);
+    }
+    if (*p == '\0') {
+      return (nullptr);
+    }
+  }
+}
+
+}  // namespace detail
+}  // namespace minijson
+
+#if !defined(MINIJSON_USE_STRTOD)
+
+#include <cstring>
+#include <limits>
+
+namespace minijson {
+namespace simdjson {
+namespace internal {
+
+/**
+ * The code in the internal::from_chars function is meant to handle the
+ *floating-point number parsing when we have more than 19 digits in the decimal
+ *mantissa. This should only be seen in adversarial scenarios: we do not expect
+ *production systems to even produce such floating-point numbers.
+ *
+ * The parser is based on work by Nigel Tao (at
+ *https://github.com/google/wuffs/) who credits Ken Thompson for the design (via
+ *a reference to the Go source code). See
+ * https://github.com/google/wuffs/blob/aa46859ea40c72516deffa1b146121952d6dfd3b/internal/cgen/base/floatconv-submodule-data.c
+ * https://github.com/google/wuffs/blob/46cd8105f47ca07ae2ba8e6a7818ef9c0df6c152/internal/cgen/base/floatconv-submodule-code.c
+ * It is probably not very fast but it is a fallback that should almost never be
+ * called in real life. Google Wuffs is published under APL 2.0.
+ **/
+
+namespace {
+constexpr uint32_t max_digits = 768;
+constexpr int32_t decimal_point_range = 2047;
+}  // namespace
+
+struct adjusted_mantissa {
+  uint64_t mantissa;
+  int power2;
+  adjusted_mantissa() : mantissa(0), power2(0) {}
+};
+
+struct decimal {
+  uint32_t num_digits;
+  int32_t decimal_point;
+  bool negative;
+  bool truncated;
+  uint8_t digits[max_digits];
+};
+
+template <typename T>
+struct binary_format {
+  static constexpr int mantissa_explicit_bits();
+  static constexpr int minimum_exponent();
+  static constexpr int infinite_power();
+  static constexpr int sign_index();
+};
+
+template <>
+constexpr int binary_format<double>::mantissa_explicit_bits() {
+  return 52;
+}
+
+template <>
+constexpr int binary_format<double>::minimum_exponent() {
+  return -1023;
+}
+template <>
+constexpr int binary_format<double>::infinite_power() {
+  return 0x7FF;
+}
+
+template <>
+constexpr int binary_format<double>::sign_index() {
+  return 63;
+}
+
+inline bool is_integer(char c) noexcept { return (c >= '0' && c <= '9'); }
+
+// This should always succeed since it follows a call to parse_number.
+static decimal parse_decimal(const char *&p) noexcept {
+  decimal answer;
+  answer.num_digits = 0;
+  answer.decimal_point = 0;
+  answer.truncated = false;
+  answer.negative = (*p == '-');
+  if ((*p == '-') || (*p == '+')) {
+    ++p;
+  }
+
+  while (*p == '0') {
+    ++p;
+  }
+  while (is_integer(*p)) {
+    if (answer.num_digits < max_digits) {
+      answer.digits[answer.num_digits] = uint8_t(*p - '0');
+    }
+    answer.num_digits++;
+    ++p;
+  }
+  if (*p == '.') {
+    ++p;
+    const char *first_after_period = p;
+    // if we have not yet encountered a zero, we have to skip it as well
+    if (answer.num_digits == 0) {
+      // skip zeros
+      while (*p == '0') {
+        ++p;
+      }
+    }
+    while (is_integer(*p)) {
+      if (answer.num_digits < max_digits) {
+        answer.digits[answer.num_digits] = uint8_t(*p - '0');
+      }
+      answer.num_digits++;
+      ++p;
+    }
+    answer.decimal_point = int32_t(first_after_period - p);
+  }
+  if (answer.num_digits > 0) {
+    const char *preverse = p - 1;
+    int32_t trailing_zeros = 0;
+    while ((*preverse == '0') || (*preverse == '.')) {
+      if (*preverse == '0') {
+        trailing_zeros++;
+      }
+      --preverse;
+    }
+    answer.decimal_point += int32_t(answer.num_digits);
+    answer.num_digits -= uint32_t(trailing_zeros);
+  }
+  if (answer.num_digits > max_digits) {
+    answer.num_digits = max_digits;
+    answer.truncated = true;
+  }
+  if (('e' == *p) || ('E' == *p)) {
+    ++p;
+    bool neg_exp = false;
+    if ('-' == *p) {
+      neg_exp = true;
+      ++p;
+    } else if ('+' == *p) {
+      ++p;
+    }
+    int32_t exp_number = 0;  // exponential part
+    while (is_integer(*p)) {
+      uint8_t digit = uint8_t(*p - '0');
+      if (exp_number < 0x10000) {
+        exp_number = 10 * exp_number + digit;
+      }
+      ++p;
+    }
+    answer.decimal_point += (neg_exp ? -exp_number : exp_number);
+  }
+  return answer;
+}
+
+// This should always succeed since it follows a call to parse_number.
+// Will not read at or beyond the "end" pointer.
+static decimal parse_decimal(const char *&p, const char *end) noexcept {
+  decimal answer;
+  answer.num_digits = 0;
+  answer.decimal_point = 0;
+  answer.truncated = false;
+  if (p == end) {
+    return answer;
+  }  // should never happen
+  answer.negative = (*p == '-');
+  if ((*p == '-') || (*p == '+')) {
+    ++p;
+  }
+
+  while ((p != end) && (*p == '0')) {
+    ++p;
+  }
+  while ((p != end) && is_integer(*p)) {
+    if (answer.num_digits < max_digits) {
+      answer.digits[answer.num_digits] = uint8_t(*p - '0');
+    }
+    answer.num_digits++;
+    ++p;
+  }
+  if ((p != end) && (*p == '.')) {
+    ++p;
+    if (p == end) {
+      return answer;
+    }  // should never happen
+    const char *first_after_period = p;
+    // if we have not yet encountered a zero, we have to skip it as well
+    if (answer.num_digits == 0) {
+      // skip zeros
+      while (*p == '0') {
+        ++p;
+      }
+    }
+    while ((p != end) && is_integer(*p)) {
+      if (answer.num_digits < max_digits) {
+        answer.digits[answer.num_digits] = uint8_t(*p - '0');
+      }
+      answer.num_digits++;
+      ++p;
+    }
+    answer.decimal_point = int32_t(first_after_period - p);
+  }
+  if (answer.num_digits > 0) {
+    const char *preverse = p - 1;
+    int32_t trailing_zeros = 0;
+    while ((*preverse == '0') || (*preverse == '.')) {
+      if (*preverse == '0') {
+        trailing_zeros++;
+      }
+      --preverse;
+    }
+    answer.decimal_point += int32_t(answer.num_digits);
+    answer.num_digits -= uint32_t(trailing_zeros);
+  }
+  if (answer.num_digits > max_digits) {
+    answer.num_digits = max_digits;
+    answer.truncated = true;
+  }
+  if ((p != end) && (('e' == *p) || ('E' == *p))) {
+    ++p;
+    if (p == end) {
+      return answer;
+    }  // should never happen
+    bool neg_exp = false;
+    if ('-' == *p) {
+      neg_exp = true;
+      ++p;
+    } else if ('+' == *p) {
+      ++p;
+    }
+    int32_t exp_number = 0;  // exponential part
+    while ((p != end) && is_integer(*p)) {
+      uint8_t digit = uint8_t(*p - '0');
+      if (exp_number < 0x10000) {
+        exp_number = 10 * exp_number + digit;
+      }
+      ++p;
+    }
+    answer.decimal_point += (neg_exp ? -exp_number : exp_number);
+  }
+  return answer;
+}
+
+namespace {
+
+// remove all final zeroes
+inline void trim(decimal &h) {
+  while ((h.num_digits > 0) && (h.digits[h.num_digits - 1] == 0)) {
+    h.num_digits--;
+  }
+}
+
+uint32_t number_of_digits_decimal_left_shift(decimal &h, uint32_t shift) {
+  shift &= 63;
+  const static uint16_t number_of_digits_decimal_left_shift_table[65] = {
+      0x0000, 0x0800, 0x0801, 0x0803, 0x1006, 0x1009, 0x100D, 0x1812, 0x1817,
+      0x181D, 0x2024, 0x202B, 0x2033, 0x203C, 0x2846, 0x2850, 0x285B, 0x3067,
+      0x3073, 0x3080, 0x388E, 0x389C, 0x38AB, 0x38BB, 0x40CC, 0x40DD, 0x40EF,
+      0x4902, 0x4915, 0x4929, 0x513E, 0x5153, 0x5169, 0x5180, 0x5998, 0x59B0,
+      0x59C9, 0x61E3, 0x61FD, 0x6218, 0x6A34, 0x6A50, 0x6A6D, 0x6A8B, 0x72AA,
+      0x72C9, 0x72E9, 0x7B0A, 0x7B2B, 0x7B4D, 0x8370, 0x8393, 0x83B7, 0x83DC,
+      0x8C02, 0x8C28, 0x8C4F, 0x9477, 0x949F, 0x94C8, 0x9CF2, 0x051C, 0x051C,
+      0x051C, 0x051C,
+  };
+  uint32_t x_a = number_of_digits_decimal_left_shift_table[shift];
+  uint32_t x_b = number_of_digits_decimal_left_shift_table[shift + 1];
+  uint32_t num_new_digits = x_a >> 11;
+  uint32_t pow5_a = 0x7FF & x_a;
+  uint32_t pow5_b = 0x7FF & x_b;
+  const static uint8_t
+      number_of_digits_decimal_left_shift_table_powers_of_5[0x051C] = {
+          5, 2, 5, 1, 2, 5, 6, 2, 5, 3, 1, 2, 5, 1, 5, 6, 2, 5, 7, 8, 1, 2, 5,
+          3, 9, 0, 6, 2, 5, 1, 9, 5, 3, 1, 2, 5, 9, 7, 6, 5, 6, 2, 5, 4, 8, 8,
+          2, 8, 1, 2, 5, 2, 4, 4, 1, 4, 0, 6, 2, 5, 1, 2, 2, 0, 7, 0, 3, 1, 2,
+          5, 6, 1, 0, 3, 5, 1, 5, 6, 2, 5, 3, 0, 5, 1, 7, 5, 7, 8, 1, 2, 5, 1,
+          5, 2, 5, 8, 7, 8, 9, 0, 6, 2, 5, 7, 6, 2, 9, 3, 9, 4, 5, 3, 1, 2, 5,
+          3, 8, 1, 4, 6, 9, 7, 2, 6, 5, 6, 2, 5, 1, 9, 0, 7, 3, 4, 8, 6, 3, 2,
+          8, 1, 2, 5, 9, 5, 3, 6, 7, 4, 3, 1, 6, 4, 0, 6, 2, 5, 4, 7, 6, 8, 3,
+          7, 1, 5, 8, 2, 0, 3, 1, 2, 5, 2, 3, 8, 4, 1, 8, 5, 7, 9, 1, 0, 1, 5,
+          6, 2, 5, 1, 1, 9, 2, 0, 9, 2, 8, 9, 5, 5, 0, 7, 8, 1, 2, 5, 5, 9, 6,
+          0, 4, 6, 4, 4, 7, 7, 5, 3, 9, 0, 6, 2, 5, 2, 9, 8, 0, 2, 3, 2, 2, 3,
+          8, 7, 6, 9, 5, 3, 1, 2, 5, 1, 4, 9, 0, 1, 1, 6, 1, 1, 9, 3, 8, 4, 7,
+          6, 5, 6, 2, 5, 7, 4, 5, 0, 5, 8, 0, 5, 9, 6, 9, 2, 3, 8, 2, 8, 1, 2,
+          5, 3, 7, 2, 5, 2, 9, 0, 2, 9, 8, 4, 6, 1, 9, 1, 4, 0, 6, 2, 5, 1, 8,
+          6, 2, 6, 4, 5, 1, 4, 9, 2, 3, 0, 9, 5, 7, 0, 3, 1, 2, 5, 9, 3, 1, 3,
+          2, 2, 5, 7, 4, 6, 1, 5, 4, 7, 8, 5, 1, 5, 6, 2, 5, 4, 6, 5, 6, 6, 1,
+          2, 8, 7, 3, 0, 7, 7, 3, 9, 2, 5, 7, 8, 1, 2, 5, 2, 3, 2, 8, 3, 0, 6,
+          4, 3, 6, 5, 3, 8, 6, 9, 6, 2, 8, 9, 0, 6, 2, 5, 1, 1, 6, 4, 1, 5, 3,
+          2, 1, 8, 2, 6, 9, 3, 4, 8, 1, 4, 4, 5, 3, 1, 2, 5, 5, 8, 2, 0, 7, 6,
+          6, 0, 9, 1, 3, 4, 6, 7, 4, 0, 7, 2, 2, 6, 5, 6, 2, 5, 2, 9, 1, 0, 3,
+          8, 3, 0, 4, 5, 6, 7, 3, 3, 7, 0, 3, 6, 1, 3, 2, 8, 1, 2, 5, 1, 4, 5,
+          5, 1, 9, 1, 5, 2, 2, 8, 3, 6, 6, 8, 5, 1, 8, 0, 6, 6, 4, 0, 6, 2, 5,
+          7, 2, 7, 5, 9, 5, 7, 6, 1, 4, 1, 8, 3, 4, 2, 5, 9, 0, 3, 3, 2, 0, 3,
+          1, 2, 5, 3, 6, 3, 7, 9, 7, 8, 8, 0, 7, 0, 9, 1, 7, 1, 2, 9, 5, 1, 6,
+          6, 0, 1, 5, 6, 2, 5, 1, 8, 1, 8, 9, 8, 9, 4, 0, 3, 5, 4, 5, 8, 5, 6,
+          4, 7, 5, 8, 3, 0, 0, 7, 8, 1, 2, 5, 9, 0, 9, 4, 9, 4, 7, 0, 1, 7, 7,
+          2, 9, 2, 8, 2, 3, 7, 9, 1, 5, 0, 3, 9, 0, 6, 2, 5, 4, 5, 4, 7, 4, 7,
+          3, 5, 0, 8, 8, 6, 4, 6, 4, 1, 1, 8, 9, 5, 7, 5, 1, 9, 5, 3, 1, 2, 5,
+          2, 2, 7, 3, 7, 3, 6, 7, 5, 4, 4, 3, 2, 3, 2, 0, 5, 9, 4, 7, 8, 7, 5,
+          9, 7, 6, 5, 6, 2, 5, 1, 1, 3, 6, 8, 6, 8, 3, 7, 7, 2, 1, 6, 1, 6, 0,
+          2, 9, 7, 3, 9, 3, 7, 9, 8, 8, 2, 8, 1, 2, 5, 5, 6, 8, 4, 3, 4, 1, 8,
+          8, 6, 0, 8, 0, 8, 0, 1, 4, 8, 6, 9, 6, 8, 9, 9, 4, 1, 4, 0, 6, 2, 5,
+          2, 8, 4, 2, 1, 7, 0, 9, 4, 3, 0, 4, 0, 4, 0, 0, 7, 4, 3, 4, 8, 4, 4,
+          9, 7, 0, 7, 0, 3, 1, 2, 5, 1, 4, 2, 1, 0, 8, 5, 4, 7, 1, 5, 2, 0, 2,
+          0, 0, 3, 7, 1, 7, 4, 2, 2, 4, 8, 5, 3, 5, 1, 5, 6, 2, 5, 7, 1, 0, 5,
+          4, 2, 7, 3, 5, 7, 6, 0, 1, 0, 0, 1, 8, 5, 8, 7, 1, 1, 2, 4, 2, 6, 7,
+          5, 7, 8, 1, 2, 5, 3, 5, 5, 2, 7, 1, 3, 6, 7, 8, 8, 0, 0, 5, 0, 0, 9,
+          2, 9, 3, 5, 5, 6, 2, 1, 3, 3, 7, 8, 9, 0, 6, 2, 5, 1, 7, 7, 6, 3, 5,
+          6, 8, 3, 9, 4, 0, 0, 2, 5, 0, 4, 6, 4, 6, 7, 7, 8, 1, 0, 6, 6, 8, 9,
+          4, 5, 3, 1, 2, 5, 8, 8, 8, 1, 7, 8, 4, 1, 9, 7, 0, 0, 1, 2, 5, 2, 3,
+          2, 3, 3, 8, 9, 0, 5, 3, 3, 4, 4, 7, 2, 6, 5, 6, 2, 5, 4, 4, 4, 0, 8,
+          9, 2, 0, 9, 8, 5, 0, 0, 6, 2, 6, 1, 6, 1, 6, 9, 4, 5, 2, 6, 6, 7, 2,
+          3, 6, 3, 2, 8, 1, 2, 5, 2, 2, 2, 0, 4, 4, 6, 0, 4, 9, 2, 5, 0, 3, 1,
+          3, 0, 8, 0, 8, 4, 7, 2, 6, 3, 3, 3, 6, 1, 8, 1, 6, 4, 0, 6, 2, 5, 1,
+          1, 1, 0, 2, 2, 3, 0, 2, 4, 6, 2, 5, 1, 5, 6, 5, 4, 0, 4, 2, 3, 6, 3,
+          1, 6, 6, 8, 0, 9, 0, 8, 2, 0, 3, 1, 2, 5, 5, 5, 5, 1, 1, 1, 5, 1, 2,
+          3, 1, 2, 5, 7, 8, 2, 7, 0, 2, 1, 1, 8, 1, 5, 8, 3, 4, 0, 4, 5, 4, 1,
+          0, 1, 5, 6, 2, 5, 2, 7, 7, 5, 5, 5, 7, 5, 6, 1, 5, 6, 2, 8, 9, 1, 3,
+          5, 1, 0, 5, 9, 0, 7, 9, 1, 7, 0, 2, 2, 7, 0, 5, 0, 7, 8, 1, 2, 5, 1,
+          3, 8, 7, 7, 7, 8, 7, 8, 0, 7, 8, 1, 4, 4, 5, 6, 7, 5, 5, 2, 9, 5, 3,
+          9, 5, 8, 5, 1, 1, 3, 5, 2, 5, 3, 9, 0, 6, 2, 5, 6, 9, 3, 8, 8, 9, 3,
+          9, 0, 3, 9, 0, 7, 2, 2, 8, 3, 7, 7, 6, 4, 7, 6, 9, 7, 9, 2, 5, 5, 6,
+          7, 6, 2, 6, 9, 5, 3, 1, 2, 5, 3, 4, 6, 9, 4, 4, 6, 9, 5, 1, 9, 5, 3,
+          6, 1, 4, 1, 8, 8, 8, 2, 3, 8, 4, 8, 9, 6, 2, 7, 8, 3, 8, 1, 3, 4, 7,
+          6, 5, 6, 2, 5, 1, 7, 3, 4, 7, 2, 3, 4, 7, 5, 9, 7, 6, 8, 0, 7, 0, 9,
+          4, 4, 1, 1, 9, 2, 4, 4, 8, 1, 3, 9, 1, 9, 0, 6, 7, 3, 8, 2, 8, 1, 2,
+          5, 8, 6, 7, 3, 6, 1, 7, 3, 7, 9, 8, 8, 4, 0, 3, 5, 4, 7, 2, 0, 5, 9,
+          6, 2, 2, 4, 0, 6, 9, 5, 9, 5, 3, 3, 6, 9, 1, 4, 0, 6, 2, 5,
+      };
+  const uint8_t *pow5 =
+      &number_of_digits_decimal_left_shift_table_powers_of_5[pow5_a];
+  uint32_t i = 0;
+  uint32_t n = pow5_b - pow5_a;
+  for (; i < n; i++) {
+    if (i >= h.num_digits) {
+      return num_new_digits - 1;
+    } else if (h.digits[i] == pow5[i]) {
+      continue;
+    } else if (h.digits[i] < pow5[i]) {
+      return num_new_digits - 1;
+    } else {
+      return num_new_digits;
+    }
+  }
+  return num_new_digits;
+}
+
+}  // end of anonymous namespace
+
+static uint64_t round(decimal &h) {
+  if ((h.num_digits == 0) || (h.decimal_point < 0)) {
+    return 0;
+  } else if (h.decimal_point > 18) {
+    return UINT64_MAX;
+  }
+  // at this point, we know that h.decimal_point >= 0
+  uint32_t dp = uint32_t(h.decimal_point);
+  uint64_t n = 0;
+  for (uint32_t i = 0; i < dp; i++) {
+    n = (10 * n) + ((i < h.num_digits) ? h.digits[i] : 0);
+  }
+  bool round_up = false;
+  if (dp < h.num_digits) {
+    round_up = h.digits[dp] >= 5;  // normally, we round up
+    // but we may need to round to even!
+    if ((h.digits[dp] == 5) && (dp + 1 == h.num_digits)) {
+      round_up = h.truncated || ((dp > 0) && (1 & h.digits[dp - 1]));
+    }
+  }
+  if (round_up) {
+    n++;
+  }
+  return n;
+}
+
+// computes h * 2^-shift
+static void decimal_left_shift(decimal &h, uint32_t shift) {
+  if (h.num_digits == 0) {
+    return;
+  }
+  uint32_t num_new_digits = number_of_digits_decimal_left_shift(h, shift);
+  int32_t read_index = int32_t(h.num_digits - 1);
+  uint32_t write_index = h.num_digits - 1 + num_new_digits;
+  uint64_t n = 0;
+
+  while (read_index >= 0) {
+    n += uint64_t(h.digits[read_index]) << shift;
+    uint64_t quotient = n / 10;
+    uint64_t remainder = n - (10 * quotient);
+    if (write_index < max_digits) {
+      h.digits[write_index] = uint8_t(remainder);
+    } else if (remainder > 0) {
+      h.truncated = true;
+    }
+    n = quotient;
+    write_index--;
+    read_index--;
+  }
+  while (n > 0) {
+    uint64_t quotient = n / 10;
+    uint64_t remainder = n - (10 * quotient);
+    if (write_index < max_digits) {
+      h.digits[write_index] = uint8_t(remainder);
+    } else if (remainder > 0) {
+      h.truncated = true;
+    }
+    n = quotient;
+    write_index--;
+  }
+  h.num_digits += num_new_digits;
+  if (h.num_digits > max_digits) {
+    h.num_digits = max_digits;
+  }
+  h.decimal_point += int32_t(num_new_digits);
+  trim(h);
+}
+
+// computes h * 2^shift
+static void decimal_right_shift(decimal &h, uint32_t shift) {
+  uint32_t read_index = 0;
+  uint32_t write_index = 0;
+
+  uint64_t n = 0;
+
+  while ((n >> shift) == 0) {
+    if (read_index < h.num_digits) {
+      n = (10 * n) + h.digits[read_index++];
+    } else if (n == 0) {
+      return;
+    } else {
+      while ((n >> shift) == 0) {
+        n = 10 * n;
+        read_index++;
+      }
+      break;
+    }
+  }
+  h.decimal_point -= int32_t(read_index - 1);
+  if (h.decimal_point < -decimal_point_range) {  // it is zero
+    h.num_digits = 0;
+    h.decimal_point = 0;
+    h.negative = false;
+    h.truncated = false;
+    return;
+  }
+  uint64_t mask = (uint64_t(1) << shift) - 1;
+  while (read_index < h.num_digits) {
+    uint8_t new_digit = uint8_t(n >> shift);
+    n = (10 * (n & mask)) + h.digits[read_index++];
+    h.digits[write_index++] = new_digit;
+  }
+  while (n > 0) {
+    uint8_t new_digit = uint8_t(n >> shift);
+    n = 10 * (n & mask);
+    if (write_index < max_digits) {
+      h.digits[write_index++] = new_digit;
+    } else if (new_digit > 0) {
+      h.truncated = true;
+    }
+  }
+  h.num_digits = write_index;
+  trim(h);
+}
+
+template <typename binary>
+adjusted_mantissa compute_float(decimal &d) {
+  adjusted_mantissa answer;
+  if (d.num_digits == 0) {
+    // should be zero
+    answer.power2 = 0;
+    answer.mantissa = 0;
+    return answer;
+  }
+  // At this point, going further, we can assume that d.num_digits > 0.
+  // We want to guard against excessive decimal point values because
+  // they can result in long running times. Indeed, we do
+  // shifts by at most 60 bits. We have that log(10**400)/log(2**60) ~= 22
+  // which is fine, but log(10**299995)/log(2**60) ~= 16609 which is not
+  // fine (runs for a long time).
+  //
+  if (d.decimal_point < -324) {
+    // We have something smaller than 1e-324 which is always zero
+    // in binary64 and binary32.
+    // It should be zero.
+    answer.power2 = 0;
+    answer.mantissa = 0;
+    return answer;
+  } else if (d.decimal_point >= 310) {
+    // We have something at least as large as 0.1e310 which is
+    // always infinite.
+    answer.power2 = binary::infinite_power();
+    answer.mantissa = 0;
+    return answer;
+  }
+
+  static const uint32_t max_shift = 60;
+  static const uint32_t num_powers = 19;
+  static const uint8_t powers[19] = {
+      0,  3,  6,  9,  13, 16, 19, 23, 26, 29,  //
+      33, 36, 39, 43, 46, 49, 53, 56, 59,      //
+  };
+  int32_t exp2 = 0;
+  while (d.decimal_point > 0) {
+    uint32_t n = uint32_t(d.decimal_point);
+    uint32_t shift = (n < num_powers) ? powers[n] : max_shift;
+    decimal_right_shift(d, shift);
+    if (d.decimal_point < -decimal_point_range) {
+      // should be zero
+      answer.power2 = 0;
+      answer.mantissa = 0;
+      return answer;
+    }
+    exp2 += int32_t(shift);
+  }
+  // We shift left toward [1/2 ... 1].
+  while (d.decimal_point <= 0) {
+    uint32_t shift;
+    if (d.decimal_point == 0) {
+      if (d.digits[0] >= 5) {
+        break;
+      }
+      shift = (d.digits[0] < 2) ? 2 : 1;
+    } else {
+      uint32_t n = uint32_t(-d.decimal_point);
+      shift = (n < num_powers) ? powers[n] : max_shift;
+    }
+    decimal_left_shift(d, shift);
+    if (d.decimal_point > decimal_point_range) {
+      // we want to get infinity:
+      answer.power2 = 0xFF;
+      answer.mantissa = 0;
+      return answer;
+    }
+    exp2 -= int32_t(shift);
+  }
+  // We are now in the range [1/2 ... 1] but the binary format uses [1 ... 2].
+  exp2--;
+  constexpr int32_t minimum_exponent = binary::minimum_exponent();
+  while ((minimum_exponent + 1) > exp2) {
+    uint32_t n = uint32_t((minimum_exponent + 1) - exp2);
+    if (n > max_shift) {
+      n = max_shift;
+    }
+    decimal_right_shift(d, n);
+    exp2 += int32_t(n);
+  }
+  if ((exp2 - minimum_exponent) >= binary::infinite_power()) {
+    answer.power2 = binary::infinite_power();
+    answer.mantissa = 0;
+    return answer;
+  }
+
+  const int mantissa_size_in_bits = binary::mantissa_explicit_bits() + 1;
+  decimal_left_shift(d, mantissa_size_in_bits);
+
+  uint64_t mantissa = round(d);
+  // It is possible that we have an overflow, in which case we need
+  // to shift back.
+  if (mantissa >= (uint64_t(1) << mantissa_size_in_bits)) {
+    decimal_right_shift(d, 1);
+    exp2 += 1;
+    mantissa = round(d);
+    if ((exp2 - minimum_exponent) >= binary::infinite_power()) {
+      answer.power2 = binary::infinite_power();
+      answer.mantissa = 0;
+      return answer;
+    }
+  }
+  answer.power2 = exp2 - binary::minimum_exponent();
+  if (mantissa < (uint64_t(1) << binary::mantissa_explicit_bits())) {
+    answer.power2--;
+  }
+  answer.mantissa =
+      mantissa & ((uint64_t(1) << binary::mantissa_explicit_bits()) - 1);
+  return answer;
+}
+
+template <typename binary>
+adjusted_mantissa parse_long_mantissa(const char *first) {
+  decimal d = parse_decimal(first);
+  return compute_float<binary>(d);
+}
+
+template <typename binary>
+adjusted_mantissa parse_long_mantissa(const char *first, const char *end) {
+  decimal d = parse_decimal(first, end);
+  return compute_float<binary>(d);
+}
+
+double from_chars(const char *first) noexcept {
+  bool negative = first[0] == '-';
+  if (negative) {
+    first++;
+  }
+  adjusted_mantissa am = parse_long_mantissa<binary_format<double>>(first);
+  uint64_t word = am.mantissa;
+  word |= uint64_t(am.power2)
+          << binary_format<double>::mantissa_explicit_bits();
+  word = negative ? word | (uint64_t(1) << binary_format<double>::sign_index())
+                  : word;
+  double value;
+  std::memcpy(&value, &word, sizeof(double));
+  return value;
+}
+
+double from_chars(const char *first, const char *end) noexcept {
+  bool negative = first[0] == '-';
+  if (negative) {
+    first++;
+  }
+  adjusted_mantissa am = parse_long_mantissa<binary_format<double>>(first, end);
+  uint64_t word = am.mantissa;
+  word |= uint64_t(am.power2)
+          << binary_format<double>::mantissa_explicit_bits();
+  word = negative ? word | (uint64_t(1) << binary_format<double>::sign_index())
+                  : word;
+  double value;
+  std::memcpy(&value, &word, sizeof(double));
+  return value;
+}
+
+}  // namespace internal
+}  // namespace simdjson
+}  // namespace minijson
+
+namespace minijson {
+namespace simdjson {
+namespace internal {
+/*!
+implements the Grisu2 algorithm for binary to decimal floating-point
+conversion.
+Adapted from JSON for Modern C++
+
+This implementation is a slightly modified version of the reference
+implementation which may be obtained from
+http://florian.loitsch.com/publications (bench.tar.gz).
+The code is distributed under the MIT license, Copyright (c) 2009 Florian
+Loitsch. For a detailed description of the algorithm see: [1] Loitsch, "Printing
+Floating-Point Numbers Quickly and Accurately with Integers", Proceedings of the
+ACM SIGPLAN 2010 Conference on Programming Language Design and Implementation,
+PLDI 2010 [2] Burger, Dybvig, "Printing Floating-Point Numbers Quickly and
+Accurately", Proceedings of the ACM SIGPLAN 1996 Conference on Programming
+Language Design and Implementation, PLDI 1996
+*/
+namespace dtoa_impl {
+
+template <typename Target, typename Source>
+Target reinterpret_bits(const Source source) {
+  static_assert(sizeof(Target) == sizeof(Source), "size mismatch");
+
+  Target target;
+  std::memcpy(&target, &source, sizeof(Source));
+  return target;
+}
+
+struct diyfp  // f * 2^e
+{
+  static constexpr int kPrecision = 64;  // = q
+
+  std::uint64_t f = 0;
+  int e = 0;
+
+  constexpr diyfp(std::uint64_t f_, int e_) noexcept : f(f_), e(e_) {}
+
+  /*!
+  @brief returns x - y
+  @pre x.e == y.e and x.f >= y.f
+  */
+  static diyfp sub(const diyfp &x, const diyfp &y) noexcept {
+    return {x.f - y.f, x.e};
+  }
+
+  /*!
+  @brief returns x * y
+  @note The result is rounded. (Only the upper q bits are returned.)
+  */
+  static diyfp mul(const diyfp &x, const diyfp &y) noexcept {
+    static_assert(kPrecision == 64, "internal error");
+
+    // Computes:
+    //  f = round((x.f * y.f) / 2^q)
+    //  e = x.e + y.e + q
+
+    // Emulate the 64-bit * 64-bit multiplication:
+    //
+    // p = u * v
+    //   = (u_lo + 2^32 u_hi) (v_lo + 2^32 v_hi)
+    //   = (u_lo v_lo         ) + 2^32 ((u_lo v_hi         ) + (u_hi v_lo )) +
+    //   2^64 (u_hi v_hi         ) = (p0                ) + 2^32 ((p1 ) + (p2 ))
+    //   + 2^64 (p3                ) = (p0_lo + 2^32 p0_hi) + 2^32 ((p1_lo +
+    //   2^32 p1_hi) + (p2_lo + 2^32 p2_hi)) + 2^64 (p3                ) =
+    //   (p0_lo             ) + 2^32 (p0_hi + p1_lo + p2_lo ) + 2^64 (p1_hi +
+    //   p2_hi + p3) = (p0_lo             ) + 2^32 (Q ) + 2^64 (H ) = (p0_lo ) +
+    //   2^32 (Q_lo + 2^32 Q_hi                           ) + 2^64 (H )
+    //
+    // (Since Q might be larger than 2^32 - 1)
+    //
+    //   = (p0_lo + 2^32 Q_lo) + 2^64 (Q_hi + H)
+    //
+    // (Q_hi + H does not overflow a 64-bit int)
+    //
+    //   = p_lo + 2^64 p_hi
+
+    const std::uint64_t u_lo = x.f & 0xFFFFFFFFu;
+    const std::uint64_t u_hi = x.f >> 32u;
+    const std::uint64_t v_lo = y.f & 0xFFFFFFFFu;
+    const std::uint64_t v_hi = y.f >> 32u;
+
+    const std::uint64_t p0 = u_lo * v_lo;
+    const std::uint64_t p1 = u_lo * v_hi;
+    const std::uint64_t p2 = u_hi * v_lo;
+    const std::uint64_t p3 = u_hi * v_hi;
+
+    const std::uint64_t p0_hi = p0 >> 32u;
+    const std::uint64_t p1_lo = p1 & 0xFFFFFFFFu;
+    const std::uint64_t p1_hi = p1 >> 32u;
+    const std::uint64_t p2_lo = p2 & 0xFFFFFFFFu;
+    const std::uint64_t p2_hi = p2 >> 32u;
+
+    std::uint64_t Q = p0_hi + p1_lo + p2_lo;
+
+    // The full product might now be computed as
+    //
+    // p_hi = p3 + p2_hi + p1_hi + (Q >> 32)
+    // p_lo = p0_lo + (Q << 32)
+    //
+    // But in this particular case here, the full p_lo is not required.
+    // Effectively we only need to add the highest bit in p_lo to p_hi (and
+    // Q_hi + 1 does not overflow).
+
+    Q += std::uint64_t{1} << (64u - 32u - 1u);  // round, ties up
+
+    const std::uint64_t h = p3 + p2_hi + p1_hi + (Q >> 32u);
+
+    return {h, x.e + y.e + 64};
+  }
+
+  /*!
+  @brief normalize x such that the significand is >= 2^(q-1)
+  @pre x.f != 0
+  */
+  static diyfp normalize(diyfp x) noexcept {
+    while ((x.f >> 63u) == 0) {
+      x.f <<= 1u;
+      x.e--;
+    }
+
+    return x;
+  }
+
+  /*!
+  @brief normalize x such that the result has the exponent E
+  @pre e >= x.e and the upper e - x.e bits of x.f must be zero.
+  */
+  static diyfp normalize_to(const diyfp &x,
+                            const int target_exponent) noexcept {
+    const int delta = x.e - target_exponent;
+
+    return {x.f << delta, target_exponent};
+  }
+};
+
+struct boundaries {
+  diyfp w;
+  diyfp minus;
+  diyfp plus;
+};
+
+/*!
+Compute the (normalized) diyfp representing the input number 'value' and its
+boundaries.
+@pre value must be finite and positive
+*/
+template <typename FloatType>
+boundaries compute_boundaries(FloatType value) {
+  // Convert the IEEE representation into a diyfp.
+  //
+  // If v is denormal:
+  //      value = 0.F * 2^(1 - bias) = (          F) * 2^(1 - bias - (p-1))
+  // If v is normalized:
+  //      value = 1.F * 2^(E - bias) = (2^(p-1) + F) * 2^(E - bias - (p-1))
+
+  static_assert(std::numeric_limits<FloatType>::is_iec559,
+                "internal error: dtoa_short requires an IEEE-754 "
+                "floating-point implementation");
+
+  constexpr int kPrecision =
+      std::numeric_limits<FloatType>::digits;  // = p (includes the hidden bit)
+  constexpr int kBias =
+      std::numeric_limits<FloatType>::max_exponent - 1 + (kPrecision - 1);
+  constexpr int kMinExp = 1 - kBias;
+  constexpr std::uint64_t kHiddenBit = std::uint64_t{1}
+                                       << (kPrecision - 1);  // = 2^(p-1)
+
+  using bits_type = typename std::conditional<kPrecision == 24, std::uint32_t,
+                                              std::uint64_t>::type;
+
+  const std::uint64_t bits = reinterpret_bits<bits_type>(value);
+  const std::uint64_t E = bits >> (kPrecision - 1);
+  const std::uint64_t F = bits & (kHiddenBit - 1);
+
+  const bool is_denormal = E == 0;
+  const diyfp v = is_denormal
+                      ? diyfp(F, kMinExp)
+                      : diyfp(F + kHiddenBit, static_cast<int>(E) - kBias);
+
+  // Compute the boundaries m- and m+ of the floating-point value
+  // v = f * 2^e.
+  //
+  // Determine v- and v+, the floating-point predecessor and successor if v,
+  // respectively.
+  //
+  //      v- = v - 2^e        if f != 2^(p-1) or e == e_min                (A)
+  //         = v - 2^(e-1)    if f == 2^(p-1) and e > e_min                (B)
+  //
+  //      v+ = v + 2^e
+  //
+  // Let m- = (v- + v) / 2 and m+ = (v + v+) / 2. All real numbers _strictly_
+  // between m- and m+ round to v, regardless of how the input rounding
+  // algorithm breaks ties.
+  //
+  //      ---+-------------+-------------+-------------+-------------+---  (A)
+  //         v-            m-            v             m+            v+
+  //
+  //      -----------------+------+------+-------------+-------------+---  (B)
+  //                       v-     m-     v             m+            v+
+
+  const bool lower_boundary_is_closer = F == 0 && E > 1;
+  const diyfp m_plus = diyfp(2 * v.f + 1, v.e - 1);
+  const diyfp m_minus = lower_boundary_is_closer
+                            ? diyfp(4 * v.f - 1, v.e - 2)   // (B)
+                            : diyfp(2 * v.f - 1, v.e - 1);  // (A)
+
+  // Determine the normalized w+ = m+.
+  const diyfp w_plus = diyfp::normalize(m_plus);
+
+  // Determine w- = m- such that e_(w-) = e_(w+).
+  const diyfp w_minus = diyfp::normalize_to(m_minus, w_plus.e);
+
+  return {diyfp::normalize(v), w_minus, w_plus};
+}
+
+// Given normalized diyfp w, Grisu needs to find a (normalized) cached
+// power-of-ten c, such that the exponent of the product c * w = f * 2^e lies
+// within a certain range [alpha, gamma] (Definition 3.2 from [1])
+//
+//      alpha <= e = e_c + e_w + q <= gamma
+//
+// or
+//
+//      f_c * f_w * 2^alpha <= f_c 2^(e_c) * f_w 2^(e_w) * 2^q
+//                          <= f_c * f_w * 2^gamma
+//
+// Since c and w are normalized, i.e. 2^(q-1) <= f < 2^q, this implies
+//
+//      2^(q-1) * 2^(q-1) * 2^alpha <= c * w * 2^q < 2^q * 2^q * 2^gamma
+//
+// or
+//
+//      2^(q - 2 + alpha) <= c * w < 2^(q + gamma)
+//
+// The choice of (alpha,gamma) determines the size of the table and the form of
+// the digit generation procedure. Using (alpha,gamma)=(-60,-32) works out well
+// in practice:
+//
+// The idea is to cut the number c * w = f * 2^e into two parts, which can be
+// processed independently: An integral part p1, and a fractional part p2:
+//
+//      f * 2^e = ( (f div 2^-e) * 2^-e + (f mod 2^-e) ) * 2^e
+//              = (f div 2^-e) + (f mod 2^-e) * 2^e
+//              = p1 + p2 * 2^e
+//
+// The conversion of p1 into decimal form requires a series of divisions and
+// modulos by (a power of) 10. These operations are faster for 32-bit than for
+// 64-bit integers, so p1 should ideally fit into a 32-bit integer. This can be
+// achieved by choosing
+//
+//      -e >= 32   or   e <= -32 := gamma
+//
+// In order to convert the fractional part
+//
+//      p2 * 2^e = p2 / 2^-e = d[-1] / 10^1 + d[-2] / 10^2 + ...
+//
+// into decimal form, the fraction is repeatedly multiplied by 10 and the digits
+// d[-i] are extracted in order:
+//
+//      (10 * p2) div 2^-e = d[-1]
+//      (10 * p2) mod 2^-e = d[-2] / 10^1 + ...
+//
+// The multiplication by 10 must not overflow. It is sufficient to choose
+//
+//      10 * p2 < 16 * p2 = 2^4 * p2 <= 2^64.
+//
+// Since p2 = f mod 2^-e < 2^-e,
+//
+//      -e <= 60   or   e >= -60 := alpha
+
+constexpr int kAlpha = -60;
+constexpr int kGamma = -32;
+
+struct cached_power  // c = f * 2^e ~= 10^k
+{
+  std::uint64_t f;
+  int e;
+  int k;
+};
+
+/*!
+For a normalized diyfp w = f * 2^e, this function returns a (normalized) cached
+power-of-ten c = f_c * 2^e_c, such that the exponent of the product w * c
+satisfies (Definition 3.2 from [1])
+     alpha <= e_c + e + q <= gamma.
+*/
+inline cached_power get_cached_power_for_binary_exponent(int e) {
+  // Now
+  //
+  //      alpha <= e_c + e + q <= gamma                                    (1)
+  //      ==> f_c * 2^alpha <= c * 2^e * 2^q
+  //
+  // and since the c's are normalized, 2^(q-1) <= f_c,
+  //
+  //      ==> 2^(q - 1 + alpha) <= c * 2^(e + q)
+  //      ==> 2^(alpha - e - 1) <= c
+  //
+  // If c were an exact power of ten, i.e. c = 10^k, one may determine k as
+  //
+  //      k = ceil( log_10( 2^(alpha - e - 1) ) )
+  //        = ceil( (alpha - e - 1) * log_10(2) )
+  //
+  // From the paper:
+  // "In theory the result of the procedure could be wrong since c is rounded,
+  //  and the computation itself is approximated [...]. In practice, however,
+  //  this simple function is sufficient."
+  //
+  // For IEEE double precision floating-point numbers converted into
+  // normalized diyfp's w = f * 2^e, with q = 64,
+  //
+  //      e >= -1022      (min IEEE exponent)
+  //           -52        (p - 1)
+  //           -52        (p - 1, possibly normalize denormal IEEE numbers)
+  //           -11        (normalize the diyfp)
+  //         = -1137
+  //
+  // and
+  //
+  //      e <= +1023      (max IEEE exponent)
+  //           -52        (p - 1)
+  //           -11        (normalize the diyfp)
+  //         = 960
+  //
+  // This binary exponent range [-1137,960] results in a decimal exponent
+  // range [-307,324]. One does not need to store a cached power for each
+  // k in this range. For each such k it suffices to find a cached power
+  // such that the exponent of the product lies in [alpha,gamma].
+  // This implies that the difference of the decimal exponents of adjacent
+  // table entries must be less than or equal to
+  //
+  //      floor( (gamma - alpha) * log_10(2) ) = 8.
+  //
+  // (A smaller distance gamma-alpha would require a larger table.)
+
+  // NB:
+  // Actually this function returns c, such that -60 <= e_c + e + 64 <= -34.
+
+  constexpr int kCachedPowersMinDecExp = -300;
+  constexpr int kCachedPowersDecStep = 8;
+
+  static constexpr std::array<cached_power, 79> kCachedPowers = {{
+      {0xAB70FE17C79AC6CA, -1060, -300}, {0xFF77B1FCBEBCDC4F, -1034, -292},
+      {0xBE5691EF416BD60C, -1007, -284}, {0x8DD01FAD907FFC3C, -980, -276},
+      {0xD3515C2831559A83, -954, -268},  {0x9D71AC8FADA6C9B5, -927, -260},
+      {0xEA9C227723EE8BCB, -901, -252},  {0xAECC49914078536D, -874, -244},
+      {0x823C12795DB6CE57, -847, -236},  {0xC21094364DFB5637, -821, -228},
+      {0x9096EA6F3848984F, -794, -220},  {0xD77485CB25823AC7, -768, -212},
+      {0xA086CFCD97BF97F4, -741, -204},  {0xEF340A98172AACE5, -715, -196},
+      {0xB23867FB2A35B28E, -688, -188},  {0x84C8D4DFD2C63F3B, -661, -180},
+      {0xC5DD44271AD3CDBA, -635, -172},  {0x936B9FCEBB25C996, -608, -164},
+      {0xDBAC6C247D62A584, -582, -156},  {0xA3AB66580D5FDAF6, -555, -148},
+      {0xF3E2F893DEC3F126, -529, -140},  {0xB5B5ADA8AAFF80B8, -502, -132},
+      {0x87625F056C7C4A8B, -475, -124},  {0xC9BCFF6034C13053, -449, -116},
+      {0x964E858C91BA2655, -422, -108},  {0xDFF9772470297EBD, -396, -100},
+      {0xA6DFBD9FB8E5B88F, -369, -92},   {0xF8A95FCF88747D94, -343, -84},
+      {0xB94470938FA89BCF, -316, -76},   {0x8A08F0F8BF0F156B, -289, -68},
+      {0xCDB02555653131B6, -263, -60},   {0x993FE2C6D07B7FAC, -236, -52},
+      {0xE45C10C42A2B3B06, -210, -44},   {0xAA242499697392D3, -183, -36},
+      {0xFD87B5F28300CA0E, -157, -28},   {0xBCE5086492111AEB, -130, -20},
+      {0x8CBCCC096F5088CC, -103, -12},   {0xD1B71758E219652C, -77, -4},
+      {0x9C40000000000000, -50, 4},      {0xE8D4A51000000000, -24, 12},
+      {0xAD78EBC5AC620000, 3, 20},       {0x813F3978F8940984, 30, 28},
+      {0xC097CE7BC90715B3, 56, 36},      {0x8F7E32CE7BEA5C70, 83, 44},
+      {0xD5D238A4ABE98068, 109, 52},     {0x9F4F2726179A2245, 136, 60},
+      {0xED63A231D4C4FB27, 162, 68},     {0xB0DE65388CC8ADA8, 189, 76},
+      {0x83C7088E1AAB65DB, 216, 84},     {0xC45D1DF942711D9A, 242, 92},
+      {0x924D692CA61BE758, 269, 100},    {0xDA01EE641A708DEA, 295, 108},
+      {0xA26DA3999AEF774A, 322, 116},    {0xF209787BB47D6B85, 348, 124},
+      {0xB454E4A179DD1877, 375, 132},    {0x865B86925B9BC5C2, 402, 140},
+      {0xC83553C5C8965D3D, 428, 148},    {0x952AB45CFA97A0B3, 455, 156},
+      {0xDE469FBD99A05FE3, 481, 164},    {0xA59BC234DB398C25, 508, 172},
+      {0xF6C69A72A3989F5C, 534, 180},    {0xB7DCBF5354E9BECE, 561, 188},
+      {0x88FCF317F22241E2, 588, 196},    {0xCC20CE9BD35C78A5, 614, 204},
+      {0x98165AF37B2153DF, 641, 212},    {0xE2A0B5DC971F303A, 667, 220},
+      {0xA8D9D1535CE3B396, 694, 228},    {0xFB9B7CD9A4A7443C, 720, 236},
+      {0xBB764C4CA7A44410, 747, 244},    {0x8BAB8EEFB6409C1A, 774, 252},
+      {0xD01FEF10A657842C, 800, 260},    {0x9B10A4E5E9913129, 827, 268},
+      {0xE7109BFBA19C0C9D, 853, 276},    {0xAC2820D9623BF429, 880, 284},
+      {0x80444B5E7AA7CF85, 907, 292},    {0xBF21E44003ACDD2D, 933, 300},
+      {0x8E679C2F5E44FF8F, 960, 308},    {0xD433179D9C8CB841, 986, 316},
+      {0x9E19DB92B4E31BA9, 1013, 324},
+  }};
+
+  // This computation gives exactly the same results for k as
+  //      k = ceil((kAlpha - e - 1) * 0.30102999566398114)
+  // for |e| <= 1500, but doesn't require floating-point operations.
+  // NB: log_10(2) ~= 78913 / 2^18
+  const int f = kAlpha - e - 1;
+  const int k = (f * 78913) / (1 << 18) + static_cast<int>(f > 0);
+
+  const int index = (-kCachedPowersMinDecExp + k + (kCachedPowersDecStep - 1)) /
+                    kCachedPowersDecStep;
+
+  const cached_power cached = kCachedPowers[static_cast<std::size_t>(index)];
+
+  return cached;
+}
+
+/*!
+For n != 0, returns k, such that pow10 := 10^(k-1) <= n < 10^k.
+For n == 0, returns 1 and sets pow10 := 1.
+*/
+inline int find_largest_pow10(const std::uint32_t n, std::uint32_t &pow10) {
+  // LCOV_EXCL_START
+  if (n >= 1000000000) {
+    pow10 = 1000000000;
+    return 10;
+  }
+  // LCOV_EXCL_STOP
+  else if (n >= 100000000) {
+    pow10 = 100000000;
+    return 9;
+  } else if (n >= 10000000) {
+    pow10 = 10000000;
+    return 8;
+  } else if (n >= 1000000) {
+    pow10 = 1000000;
+    return 7;
+  } else if (n >= 100000) {
+    pow10 = 100000;
+    return 6;
+  } else if (n >= 10000) {
+    pow10 = 10000;
+    return 5;
+  } else if (n >= 1000) {
+    pow10 = 1000;
+    return 4;
+  } else if (n >= 100) {
+    pow10 = 100;
+    return 3;
+  } else if (n >= 10) {
+    pow10 = 10;
+    return 2;
+  } else {
+    pow10 = 1;
+    return 1;
+  }
+}
+
+inline void grisu2_round(char *buf, int len, std::uint64_t dist,
+                         std::uint64_t delta, std::uint64_t rest,
+                         std::uint64_t ten_k) {
+  //               <--------------------------- delta ---->
+  //                                  <---- dist --------->
+  // --------------[------------------+-------------------]--------------
+  //               M-                 w                   M+
+  //
+  //                                  ten_k
+  //                                <------>
+  //                                       <---- rest ---->
+  // --------------[------------------+----+--------------]--------------
+  //                                  w    V
+  //                                       = buf * 10^k
+  //
+  // ten_k represents a unit-in-the-last-place in the decimal representation
+  // stored in buf.
+  // Decrement buf by ten_k while this takes buf closer to w.
+
+  // The tests are written in this order to avoid overflow in unsigned
+  // integer arithmetic.
+
+  while (rest < dist && delta - rest >= ten_k &&
+         (rest + ten_k < dist || dist - rest > rest + ten_k - dist)) {
+    buf[len - 1]--;
+    rest += ten_k;
+  }
+}
+
+/*!
+Generates V = buffer * 10^decimal_exponent, such that M- <= V <= M+.
+M- and M+ must be normalized and share the same exponent -60 <= e <= -32.
+*/
+inline void grisu2_digit_gen(char *buffer, int &length, int &decimal_exponent,
+                             diyfp M_minus, diyfp w, diyfp M_plus) {
+  static_assert(kAlpha >= -60, "internal error");
+  static_assert(kGamma <= -32, "internal error");
+
+  // Generates the digits (and the exponent) of a decimal floating-point
+  // number V = buffer * 10^decimal_exponent in the range [M-, M+]. The diyfp's
+  // w, M- and M+ share the same exponent e, which satisfies alpha <= e <=
+  // gamma.
+  //
+  //               <--------------------------- delta ---->
+  //                                  <---- dist --------->
+  // --------------[------------------+-------------------]--------------
+  //               M-                 w                   M+
+  //
+  // Grisu2 generates the digits of M+ from left to right and stops as soon as
+  // V is in [M-,M+].
+
+  std::uint64_t delta =
+      diyfp::sub(M_plus, M_minus)
+          .f;  // (significand of (M+ - M-), implicit exponent is e)
+  std::uint64_t dist =
+      diyfp::sub(M_plus, w)
+          .f;  // (significand of (M+ - w ), implicit exponent is e)
+
+  // Split M+ = f * 2^e into two parts p1 and p2 (note: e < 0):
+  //
+  //      M+ = f * 2^e
+  //         = ((f div 2^-e) * 2^-e + (f mod 2^-e)) * 2^e
+  //         = ((p1        ) * 2^-e + (p2        )) * 2^e
+  //         = p1 + p2 * 2^e
+
+  const diyfp one(std::uint64_t{1} << -M_plus.e, M_plus.e);
+
+  auto p1 = static_cast<std::uint32_t>(
+      M_plus.f >>
+      -one.e);  // p1 = f div 2^-e (Since -e >= 32, p1 fits into a 32-bit int.)
+  std::uint64_t p2 = M_plus.f & (one.f - 1);  // p2 = f mod 2^-e
+
+  // 1)
+  //
+  // Generate the digits of the integral part p1 = d[n-1]...d[1]d[0]
+
+  std::uint32_t pow10;
+  const int k = find_largest_pow10(p1, pow10);
+
+  //      10^(k-1) <= p1 < 10^k, pow10 = 10^(k-1)
+  //
+  //      p1 = (p1 div 10^(k-1)) * 10^(k-1) + (p1 mod 10^(k-1))
+  //         = (d[k-1]         ) * 10^(k-1) + (p1 mod 10^(k-1))
+  //
+  //      M+ = p1                                             + p2 * 2^e
+  //         = d[k-1] * 10^(k-1) + (p1 mod 10^(k-1))          + p2 * 2^e
+  //         = d[k-1] * 10^(k-1) + ((p1 mod 10^(k-1)) * 2^-e + p2) * 2^e
+  //         = d[k-1] * 10^(k-1) + (                         rest) * 2^e
+  //
+  // Now generate the digits d[n] of p1 from left to right (n = k-1,...,0)
+  //
+  //      p1 = d[k-1]...d[n] * 10^n + d[n-1]...d[0]
+  //
+  // but stop as soon as
+  //
+  //      rest * 2^e = (d[n-1]...d[0] * 2^-e + p2) * 2^e <= delta * 2^e
+
+  int n = k;
+  while (n > 0) {
+    // Invariants:
+    //      M+ = buffer * 10^n + (p1 + p2 * 2^e)    (buffer = 0 for n = k)
+    //      pow10 = 10^(n-1) <= p1 < 10^n
+    //
+    const std::uint32_t d = p1 / pow10;  // d = p1 div 10^(n-1)
+    const std::uint32_t r = p1 % pow10;  // r = p1 mod 10^(n-1)
+    //
+    //      M+ = buffer * 10^n + (d * 10^(n-1) + r) + p2 * 2^e
+    //         = (buffer * 10 + d) * 10^(n-1) + (r + p2 * 2^e)
+    //
+    buffer[length++] = static_cast<char>('0' + d);  // buffer := buffer * 10 + d
+    //
+    //      M+ = buffer * 10^(n-1) + (r + p2 * 2^e)
+    //
+    p1 = r;
+    n--;
+    //
+    //      M+ = buffer * 10^n + (p1 + p2 * 2^e)
+    //      pow10 = 10^n
+    //
+
+    // Now check if enough digits have been generated.
+    // Compute
+    //
+    //      p1 + p2 * 2^e = (p1 * 2^-e + p2) * 2^e = rest * 2^e
+    //
+    // Note:
+    // Since rest and delta share the same exponent e, it suffices to
+    // compare the significands.
+    const std::uint64_t rest = (std::uint64_t{p1} << -one.e) + p2;
+    if (rest <= delta) {
+      // V = buffer * 10^n, with M- <= V <= M+.
+
+      decimal_exponent += n;
+
+      // We may now just stop. But instead look if the buffer could be
+      // decremented to bring V closer to w.
+      //
+      // pow10 = 10^n is now 1 ulp in the decimal representation V.
+      // The rounding procedure works with diyfp's with an implicit
+      // exponent of e.
+      //
+      //      10^n = (10^n * 2^-e) * 2^e = ulp * 2^e
+      //
+      const std::uint64_t ten_n = std::uint64_t{pow10} << -one.e;
+      grisu2_round(buffer, length, dist, delta, rest, ten_n);
+
+      return;
+    }
+
+    pow10 /= 10;
+    //
+    //      pow10 = 10^(n-1) <= p1 < 10^n
+    // Invariants restored.
+  }
+
+  // 2)
+  //
+  // The digits of the integral part have been generated:
+  //
+  //      M+ = d[k-1]...d[1]d[0] + p2 * 2^e
+  //         = buffer            + p2 * 2^e
+  //
+  // Now generate the digits of the fractional part p2 * 2^e.
+  //
+  // Note:
+  // No decimal point is generated: the exponent is adjusted instead.
+  //
+  // p2 actually represents the fraction
+  //
+  //      p2 * 2^e
+  //          = p2 / 2^-e
+  //          = d[-1] / 10^1 + d[-2] / 10^2 + ...
+  //
+  // Now generate the digits d[-m] of p1 from left to right (m = 1,2,...)
+  //
+  //      p2 * 2^e = d[-1]d[-2]...d[-m] * 10^-m
+  //                      + 10^-m * (d[-m-1] / 10^1 + d[-m-2] / 10^2 + ...)
+  //
+  // using
+  //
+  //      10^m * p2 = ((10^m * p2) div 2^-e) * 2^-e + ((10^m * p2) mod 2^-e)
+  //                = (                   d) * 2^-e + (                   r)
+  //
+  // or
+  //      10^m * p2 * 2^e = d + r * 2^e
+  //
+  // i.e.
+  //
+  //      M+ = buffer + p2 * 2^e
+  //         = buffer + 10^-m * (d + r * 2^e)
+  //         = (buffer * 10^m + d) * 10^-m + 10^-m * r * 2^e
+  //
+  // and stop as soon as 10^-m * r * 2^e <= delta * 2^e
+
+  int m = 0;
+  for (;;) {
+    // Invariant:
+    //      M+ = buffer * 10^-m + 10^-m * (d[-m-1] / 10 + d[-m-2] / 10^2 + ...)
+    //      * 2^e
+    //         = buffer * 10^-m + 10^-m * (p2                                 )
+    //         * 2^e = buffer * 10^-m + 10^-m * (1/10 * (10 * p2) ) * 2^e =
+    //         buffer * 10^-m + 10^-m * (1/10 * ((10*p2 div 2^-e) * 2^-e +
+    //         (10*p2 mod 2^-e)) * 2^e
+    //
+    p2 *= 10;
+    const std::uint64_t d = p2 >> -one.e;      // d = (10 * p2) div 2^-e
+    const std::uint64_t r = p2 & (one.f - 1);  // r = (10 * p2) mod 2^-e
+    //
+    //      M+ = buffer * 10^-m + 10^-m * (1/10 * (d * 2^-e + r) * 2^e
+    //         = buffer * 10^-m + 10^-m * (1/10 * (d + r * 2^e))
+    //         = (buffer * 10 + d) * 10^(-m-1) + 10^(-m-1) * r * 2^e
+    //
+    buffer[length++] = static_cast<char>('0' + d);  // buffer := buffer * 10 + d
+    //
+    //      M+ = buffer * 10^(-m-1) + 10^(-m-1) * r * 2^e
+    //
+    p2 = r;
+    m++;
+    //
+    //      M+ = buffer * 10^-m + 10^-m * p2 * 2^e
+    // Invariant restored.
+
+    // Check if enough digits have been generated.
+    //
+    //      10^-m * p2 * 2^e <= delta * 2^e
+    //              p2 * 2^e <= 10^m * delta * 2^e
+    //                    p2 <= 10^m * delta
+    delta *= 10;
+    dist *= 10;
+    if (p2 <= delta) {
+      break;
+    }
+  }
+
+  // V = buffer * 10^-m, with M- <= V <= M+.
+
+  decimal_exponent -= m;
+
+  // 1 ulp in the decimal representation is now 10^-m.
+  // Since delta and dist are now scaled by 10^m, we need to do the
+  // same with ulp in order to keep the units in sync.
+  //
+  //      10^m * 10^-m = 1 = 2^-e * 2^e = ten_m * 2^e
+  //
+  const std::uint64_t ten_m = one.f;
+  grisu2_round(buffer, length, dist, delta, p2, ten_m);
+
+  // By construction this algorithm generates the shortest possible decimal
+  // number (Loitsch, Theorem 6.2) which rounds back to w.
+  // For an input number of precision p, at least
+  //
+  //      N = 1 + ceil(p * log_10(2))
+  //
+  // decimal digits are sufficient to identify all binary floating-point
+  // numbers (Matula, "In-and-Out conversions").
+  // This implies that the algorithm does not produce more than N decimal
+  // digits.
+  //
+  //      N = 17 for p = 53 (IEEE double precision)
+  //      N = 9  for p = 24 (IEEE single precision)
+}
+
+/*!
+v = buf * 10^decimal_exponent
+len is the length of the buffer (number of decimal digits)
+The buffer must be large enough, i.e. >= max_digits10.
+*/
+inline void grisu2(char *buf, int &len, int &decimal_exponent, diyfp m_minus,
+                   diyfp v, diyfp m_plus) {
+  //  --------(-----------------------+-----------------------)--------    (A)
+  //          m-                      v                       m+
+  //
+  //  --------------------(-----------+-----------------------)--------    (B)
+  //                      m-          v                       m+
+  //
+  // First scale v (and m- and m+) such that the exponent is in the range
+  // [alpha, gamma].
+
+  const cached_power cached = get_cached_power_for_binary_exponent(m_plus.e);
+
+  const diyfp c_minus_k(cached.f, cached.e);  // = c ~= 10^-k
+
+  // The exponent of the products is = v.e + c_minus_k.e + q and is in the range
+  // [alpha,gamma]
+  const diyfp w = diyfp::mul(v, c_minus_k);
+  const diyfp w_minus = diyfp::mul(m_minus, c_minus_k);
+  const diyfp w_plus = diyfp::mul(m_plus, c_minus_k);
+
+  //  ----(---+---)---------------(---+---)---------------(---+---)----
+  //          w-                      w                       w+
+  //          = c*m-                  = c*v                   = c*m+
+  //
+  // diyfp::mul rounds its result and c_minus_k is approximated too. w, w- and
+  // w+ are now off by a small amount.
+  // In fact:
+  //
+  //      w - v * 10^k < 1 ulp
+  //
+  // To account for this inaccuracy, add resp. subtract 1 ulp.
+  //
+  //  --------+---[---------------(---+---)---------------]---+--------
+  //          w-  M-                  w                   M+  w+
+  //
+  // Now any number in [M-, M+] (bounds included) will round to w when input,
+  // regardless of how the input rounding algorithm breaks ties.
+  //
+  // And digit_gen generates the shortest possible such number in [M-, M+].
+  // Note that this does not mean that Grisu2 always generates the shortest
+  // possible number in the interval (m-, m+).
+  const diyfp M_minus(w_minus.f + 1, w_minus.e);
+  const diyfp M_plus(w_plus.f - 1, w_plus.e);
+
+  decimal_exponent = -cached.k;  // = -(-k) = k
+
+  grisu2_digit_gen(buf, len, decimal_exponent, M_minus, w, M_plus);
+}
+
+/*!
+v = buf * 10^decimal_exponent
+len is the length of the buffer (number of decimal digits)
+The buffer must be large enough, i.e. >= max_digits10.
+*/
+template <typename FloatType>
+void grisu2(char *buf, int &len, int &decimal_exponent, FloatType value) {
+  static_assert(diyfp::kPrecision >= std::numeric_limits<FloatType>::digits + 3,
+                "internal error: not enough precision");
+
+  // If the neighbors (and boundaries) of 'value' are always computed for
+  // double-precision numbers, all float's can be recovered using strtod (and
+  // strtof). However, the resulting decimal representations are not exactly
+  // "short".
+  //
+  // The documentation for 'std::to_chars'
+  // (https://en.cppreference.com/w/cpp/utility/to_chars) says "value is
+  // converted to a string as if by std::sprintf in the default ("C") locale"
+  // and since sprintf promotes float's to double's, I think this is exactly
+  // what 'std::to_chars' does. On the other hand, the documentation for
+  // 'std::to_chars' requires that "parsing the representation using the
+  // corresponding std::from_chars function recovers value exactly". That
+  // indicates that single precision floating-point numbers should be recovered
+  // using 'std::strtof'.
+  //
+  // NB: If the neighbors are computed for single-precision numbers, there is a
+  // single float
+  //     (7.0385307e-26f) which can't be recovered using strtod. The resulting
+  //     double precision value is off by 1 ulp.
+#if 0
+    const boundaries w = compute_boundaries(static_cast<double>(value));
+#else
+  const boundaries w = compute_boundaries(value);
+#endif
+
+  grisu2(buf, len, decimal_exponent, w.minus, w.w, w.plus);
+}
+
+/*!
+@brief appends a decimal representation of e to buf
+@return a pointer to the element following the exponent.
+@pre -1000 < e < 1000
+*/
+inline char *append_exponent(char *buf, int e) {
+  if (e < 0) {
+    e = -e;
+    *buf++ = '-';
+  } else {
+    *buf++ = '+';
+  }
+
+  auto k = static_cast<std::uint32_t>(e);
+  if (k < 10) {
+    // Always print at least two digits in the exponent.
+    // This is for compatibility with printf("%g").
+    *buf++ = '0';
+    *buf++ = static_cast<char>('0' + k);
+  } else if (k < 100) {
+    *buf++ = static_cast<char>('0' + k / 10);
+    k %= 10;
+    *buf++ = static_cast<char>('0' + k);
+  } else {
+    *buf++ = static_cast<char>('0' + k / 100);
+    k %= 100;
+    *buf++ = static_cast<char>('0' + k / 10);
+    k %= 10;
+    *buf++ = static_cast<char>('0' + k);
+  }
+
+  return buf;
+}
+
+/*!
+@brief prettify v = buf * 10^decimal_exponent
+If v is in the range [10^min_exp, 10^max_exp) it will be printed in fixed-point
+notation. Otherwise it will be printed in exponential notation.
+@pre min_exp < 0
+@pre max_exp > 0
+*/
+inline char *format_buffer(char *buf, int len, int decimal_exponent,
+                           int min_exp, int max_exp) {
+  const int k = len;
+  const int n = len + decimal_exponent;
+
+  // v = buf * 10^(n-k)
+  // k is the length of the buffer (number of decimal digits)
+  // n is the position of the decimal point relative to the start of the buffer.
+
+  if (k <= n && n <= max_exp) {
+    // digits[000]
+    // len <= max_exp + 2
+
+    std::memset(buf + k, '0', static_cast<size_t>(n) - static_cast<size_t>(k));
+    // Make it look like a floating-point number (#362, #378)
+    buf[n + 0] = '.';
+    buf[n + 1] = '0';
+    return buf + (static_cast<size_t>(n)) + 2;
+  }
+
+  if (0 < n && n <= max_exp) {
+    // dig.its
+    // len <= max_digits10 + 1
+    std::memmove(buf + (static_cast<size_t>(n) + 1), buf + n,
+                 static_cast<size_t>(k) - static_cast<size_t>(n));
+    buf[n] = '.';
+    return buf + (static_cast<size_t>(k) + 1U);
+  }
+
+  if (min_exp < n && n <= 0) {
+    // 0.[000]digits
+    // len <= 2 + (-min_exp - 1) + max_digits10
+
+    std::memmove(buf + (2 + static_cast<size_t>(-n)), buf,
+                 static_cast<size_t>(k));
+    buf[0] = '0';
+    buf[1] = '.';
+    std::memset(buf + 2, '0', static_cast<size_t>(-n));
+    return buf + (2U + static_cast<size_t>(-n) + static_cast<size_t>(k));
+  }
+
+  if (k == 1) {
+    // dE+123
+    // len <= 1 + 5
+
+    buf += 1;
+  } else {
+    // d.igitsE+123
+    // len <= max_digits10 + 1 + 5
+
+    std::memmove(buf + 2, buf + 1, static_cast<size_t>(k) - 1);
+    buf[1] = '.';
+    buf += 1 + static_cast<size_t>(k);
+  }
+
+  *buf++ = 'e';
+  return append_exponent(buf, n - 1);
+}
+
+}  // namespace dtoa_impl
+
+/*!
+The format of the resulting decimal representation is similar to printf's %g
+format. Returns an iterator pointing past-the-end of the decimal representation.
+@note The input number must be finite, i.e. NaN's and Inf's are not supported.
+@note The buffer must be large enough.
+@note The result is NOT null-terminated.
+*/
+char *to_chars(char *first, const char *last, double value) {
+  static_cast<void>(last);  // maybe unused - fix warning
+
+  // bool negative = std::signbit(value);
+  bool negative = (*reinterpret_cast<uint64_t *>(&value)) & (1 << 31ull);
+  if (negative) {
+    value = -value;
+    *first++ = '-';
+  }
+
+#ifdef __clang__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wfloat-equal"
+#endif
+
+  if (value == 0)  // +-0
+  {
+    *first++ = '0';
+    // Make it look like a floating-point number (#362, #378)
+    *first++ = '.';
+    *first++ = '0';
+    return first;
+  }
+
+#ifdef __clang__
+#pragma clang diagnostic pop
+#endif
+
+  // Compute v = buffer * 10^decimal_exponent.
+  // The decimal digits are stored in the buffer, which needs to be interpreted
+  // as an unsigned decimal integer.
+  // len is the length of the buffer, i.e. the number of decimal digits.
+  int len = 0;
+  int decimal_exponent = 0;
+  dtoa_impl::grisu2(first, len, decimal_exponent, value);
+  // Format the buffer like printf("%.*g", prec, value)
+  constexpr int kMinExp = -4;
+  constexpr int kMaxExp = std::numeric_limits<double>::digits10;
+
+  return dtoa_impl::format_buffer(first, len, decimal_exponent, kMinExp,
+                                  kMaxExp);
+}
+}  // namespace internal
+}  // namespace simdjson
+}  // namespace minijson
+
+#endif  // !MINIJSON_USE_STRTOD
+
+#endif  // MINIJSON_IMPLEMENTATION
+
+
+namespace safetensors {
+
+// Max header(JSON) size. 100 MB as done in original safetensors implementation.
+constexpr size_t kMaxJSONSize = 1024ull * 1024ull * 100ull;
+
+namespace detail {
+
+struct atomic_counters {
+  std::atomic<uint64_t> files_opened{0};
+  std::atomic<uint64_t> bytes_mapped{0};
+  std::atomic<uint64_t> bytes_read{0};
+  std::atomic<uint64_t> bytes_written{0};
+  std::atomic<uint64_t> tensors_materialized{0};
+  std::atomic<uint64_t> cache_hits{0};
+  std::atomic<uint64_t> cache_misses{0};
+  std::atomic<uint64_t> cache_evictions{0};
+  std::atomic<uint64_t> prefetch_issued{0};
+  std::atomic<uint64_t> prefetch_used{0};
+  std::atomic<uint64_t> convert_bytes{0};
+};
+
+atomic_counters g_counters;
+
+inline void counter_add(std::atomic<uint64_t> &c, uint64_t n) {
+  c.fetch_add(n, std::memory_order_relaxed);
+}
+
+// For XSI and GNU variants of strerror_r.
+inline const char *strerror_r_result(int ret, const char *buf) {
+  return (ret == 0) ? buf : "Unknown error";
+}
+inline const char *strerror_r_result(const char *ret, const char *) {
+  return ret;
+}
+
+// Thread-safe strerror.
+std::string errno_str(int e) {
+  char buf[256];
+  buf[0] = '\0';
+#if defined(_WIN32)
+  if (strerror_s(buf, sizeof(buf), e) != 0) {
+    return "Unknown error " + std::to_string(e);
+  }
+  return std::string(buf);
+#else
+  return std::string(strerror_r_result(strerror_r(e, buf, sizeof(buf)), buf));
+#endif
+}
+
+// Returns the databuffer address of `st`(mmaped or not).
+const uint8_t *get_databuffer(const safetensors_t &st, size_t *nbytes) {
+  if (st.mmaped) {
+    (*nbytes) = st.databuffer_size;
+    return st.databuffer_addr;
+  }
+  (*nbytes) = st.storage.size();
+  return st.storage.data();
+}
+
+struct progress_scope;
+
+thread_local progress_callback tls_progress_callback = nullptr;
+thread_local void *tls_progress_userdata = nullptr;
+thread_local progress_scope *tls_progress_scope = nullptr;
+
+// Placed at API entry. Only the outermost API call reports progress, and
+// helpers called inside it find the scope through `tls_progress_scope`.
+struct progress_scope {
+  bool active{false};
+  bool cancelled{false};
+  progress_info info;
+
+  // (data offset, tensor index) sorted by offset. To resolve tensor names.
+  const safetensors_t *st{nullptr};
+  std::vector<std::pair<size_t, size_t>> order;
+  size_t cursor{0};
+
+  explicit progress_scope(const char *op) {
+    if (tls_progress_callback && !tls_progress_scope) {
+      active = true;
+      info.operation = op;
+      tls_progress_scope = this;
+    }
+  }
+
+  ~progress_scope() {
+    if (active) {
+      tls_progress_scope = nullptr;
+    }
+  }
+
+  progress_scope(const progress_scope &) = delete;
+  progress_scope &operator=(const progress_scope &) = delete;
+
+  void set_tensors(const safetensors_t *_st) {
+    if (!active) {
+      return;
+    }
+    st = _st;
+    order.clear();
+    cursor = 0;
+    for (size_t i = 0; i < st->tensors.size(); i++) {
+      tensor_t t;
+      st->tensors.at(i, &t);
+      order.push_back(std::make_pair(t.data_offsets[0], i));
+    }
+    std::sort(order.begin(), order.end());
+  }
+
+  // Report `n` more bytes done. `data_offset` is the databuffer offset of the
+  // last processed byte(SIZE_MAX when not in databuffer).
+  // @return false when cancelled.
+  bool advance(uint64_t n, size_t data_offset) {
+    if (!active || cancelled) {
+      return !cancelled;
+    }
+    info.bytes_done += n;
+    info.tensor = "";
+    if (st && (data_offset != (std::numeric_limits<size_t>::max)())) {
+      if ((cursor < order.size()) && (order[cursor].first > data_offset)) {
+        cursor = 0;  // not monotonic. rewind.
+      }
+      while (((cursor + 1) < order.size()) &&
+             (order[cursor + 1].first <= data_offset)) {
+        cursor++;
+      }
+      if ((cursor < order.size()) && (order[cursor].first <= data_offset)) {
+        info.tensor = st->tensors.keys()[order[cursor].second].c_str();
+      }
+    }
+    if (!tls_progress_callback(info, tls_progress_userdata)) {
+      cancelled = true;
+    }
+    return !cancelled;
+  }
+};
+
+// Process [0, n) with `fn(offset, len)` in `kProgressChunkSize` chunks,
+// reporting progress to `ps`. Bytes before `header_bytes` are not tensor
+// data. When `ps` is not active, `fn` is called once.
+//
+// @return false when `fn` failed or the operation was cancelled(`err` is
+// filled for cancellation).
+template <typename F>
+bool process_chunked(progress_scope *ps, size_t n, size_t header_bytes,
+                     std::string *err, F fn) {
+  if (!ps || !ps->active) {
+    return fn(size_t(0), n);
+  }
+
+  size_t offset = 0;
+  while (offset < n) {
+    size_t len = (std::min)(n - offset, kProgressChunkSize);
+    if (!fn(offset, len)) {
+      return false;
+    }
+    offset += len;
+    size_t last = offset - 1;
+    if (!ps->advance(len, (last >= header_bytes)
+                              ? (last - header_bytes)
+                              : (std::numeric_limits<size_t>::max)())) {
+      if (err) {
+        (*err) += "Cancelled by progress callback.\n";
+      }
+      return false;
+    }
+  }
+  return true;
+}
+
+#if defined(SAFETENSORS_CPP_ENABLE_STATS)
+thread_local io_stats *tls_io_stats = nullptr;
+thread_local int tls_io_stats_depth = 0;
+
+void get_page_faults(int64_t *minor, int64_t *major) {
+#if defined(_WIN32)
+  (*minor) = 0;
+  (*major) = 0;
+#else
+  struct rusage ru;
+#if defined(RUSAGE_THREAD)
+  int ret = getrusage(RUSAGE_THREAD, &ru);
+#else
+  int ret = getrusage(RUSAGE_SELF, &ru);
+#endif
+  (*minor) = (ret == 0) ? int64_t(ru.ru_minflt) : 0;
+  (*major) = (ret == 0) ? int64_t(ru.ru_majflt) : 0;
+#endif
+}
+
+// Placed at API entry. Only the outermost API call measures page faults.
+struct stats_entry_scope {
+  io_stats *stats{nullptr};
+  int64_t minor{0};
+  int64_t major{0};
+
+  stats_entry_scope() {
+    if (tls_io_stats && (tls_io_stats_depth == 0)) {
+      stats = tls_io_stats;
+      get_page_faults(&minor, &major);
+    }
+    tls_io_stats_depth++;
+  }
+
+  ~stats_entry_scope() {
+    tls_io_stats_depth--;
+    if (stats) {
+      int64_t minor1, major1;
+      get_page_faults(&minor1, &major1);
+      stats->minor_faults += minor1 - minor;
+      stats->major_faults += major1 - major;
+    }
+  }
+};
+
+// Accumulate elapsed time of the enclosing block to `field`.
+struct stats_phase_timer {
+  double io_stats::*field;
+  std::chrono::steady_clock::time_point t;
+
+  explicit stats_phase_timer(double io_stats::*f)
+      : field(f), t(std::chrono::steady_clock::now()) {}
+
+  ~stats_phase_timer() {
+    if (tls_io_stats) {
+      tls_io_stats->*field += std::chrono::duration<double>(
+                                  std::chrono::steady_clock::now() - t)
+                                  .count();
+    }
+  }
+};
+
+#define SAFETENSORS_CPP_STATS_ENTRY() \
+  ::safetensors::detail::stats_entry_scope _stats_entry_scope
+#define SAFETENSORS_CPP_STATS_PHASE(field)                 \
+  ::safetensors::detail::stats_phase_timer _stats_phase_timer( \
+      &::safetensors::io_stats::field)
+#define SAFETENSORS_CPP_STATS_ADD(field, n)                   \
+  do {                                                        \
+    if (::safetensors::detail::tls_io_stats) {                \
+      ::safetensors::detail::tls_io_stats->field += (n);      \
+    }                                                         \
+  } while (0)
+// For a phase which does not fit in a block.
+#define SAFETENSORS_CPP_STATS_TIMER_START(t) \
+  auto t = std::chrono::steady_clock::now()
+#define SAFETENSORS_CPP_STATS_TIMER_STOP(t, field)                         \
+  SAFETENSORS_CPP_STATS_ADD(                                               \
+      field, std::chrono::duration<double>(                                \
+                 std::chrono::steady_clock::now() - t)                     \
+                 .count())
+#else
+#define SAFETENSORS_CPP_STATS_ENTRY() \
+  do {                                \
+  } while (0)
+#define SAFETENSORS_CPP_STATS_PHASE(field) \
+  do {                                     \
+  } while (0)
+#define SAFETENSORS_CPP_STATS_ADD(field, n) \
+  do {                                      \
+  } while (0)
+#define SAFETENSORS_CPP_STATS_TIMER_START(t) \
+  do {                                       \
+  } while (0)
+#define SAFETENSORS_CPP_STATS_TIMER_STOP(t, field) \
+  do {                                             \
+  } while (0)
+#endif
+
+#ifdef _WIN32
+std::wstring UTF8ToWchar(const std::string &str) {
+  int wstr_size =
+      MultiByteToWideChar(CP_UTF8, 0, str.data(), int(str.size()), nullptr, 0);
+  std::wstring wstr(size_t(wstr_size), 0);
+  MultiByteToWideChar(CP_UTF8, 0, str.data(), int(str.size()), &wstr[0],
+                      int(wstr.size()));
+  return wstr;
+}
+
+std::string WcharToUTF8(const std::wstring &wstr) {
+  int str_size = WideCharToMultiByte(CP_UTF8, 0, wstr.data(), int(wstr.size()),
+                                     nullptr, 0, nullptr, nullptr);
+  std::string str(size_t(str_size), 0);
+  WideCharToMultiByte(CP_UTF8, 0, wstr.data(), int(wstr.size()), &str[0],
+                      int(str.size()), nullptr, nullptr);
+  return str;
+}
+#endif
+
+bool ReadWholeFile(std::vector<unsigned char> *out, std::string *err,
+                   const std::string &filepath, void *) {
+#ifdef SAFETENSORS_CPP_ANDROID_LOAD_FROM_ASSETS
+  if (asset_manager) {
+    AAsset *asset = AAssetManager_open(asset_manager, filepath.c_str(),
+                                       AASSET_MODE_STREAMING);
+    if (!asset) {
+      if (err) {
+        (*err) += "File open error : " + filepath + "\n";
+      }
+      return false;
+    }
+    size_t size = AAsset_getLength(asset);
+    if (size == 0) {
+      if (err) {
+        (*err) += "Invalid file size : " + filepath +
+                  " (does the path point to a directory?)";
+      }
+      return false;
+    }
+    out->resize(size);
+    AAsset_read(asset, reinterpret_cast<char *>(&out->at(0)), size);
+    AAsset_close(asset);
+    return true;
+  } else {
+    if (err) {
+      (*err) += "No asset manager specified : " + filepath + "\n";
+    }
+    return false;
+  }
+#else
+  SAFETENSORS_CPP_STATS_TIMER_START(open_timer);
+#ifdef _WIN32
+#if defined(__GLIBCXX__)  // mingw
+  int file_descriptor =
+      _wopen(UTF8ToWchar(filepath).c_str(), _O_RDONLY | _O_BINARY);
+  __gnu_cxx::stdio_filebuf<char> wfile_buf(file_descriptor, std::ios_base::in);
+  std::istream f(&wfile_buf);
+#elif defined(_MSC_VER) || defined(_LIBCPP_VERSION)
+  // For libcxx, assume _LIBCPP_HAS_OPEN_WITH_WCHAR is defined to accept
+  // `wchar_t *`
+  std::ifstream f(UTF8ToWchar(filepath).c_str(), std::ifstream::binary);
+#else
+  // Unknown compiler/runtime
+  std::ifstream f(filepath.c_str(), std::ifstream::binary);
+#endif
+#else
+  std::ifstream f(filepath.c_str(), std::ifstream::binary);
+#endif
+  if (!f) {
+    if (err) {
+      (*err) += "File open error : " + filepath + "\n";
+    }
+    return false;
+  }
+  SAFETENSORS_CPP_STATS_ADD(syscalls, 1);
+
+  // For directory(and pipe?), peek() will fail(Posix gnustl/libc++ only)
+  f.peek();
+  if (!f) {
+    if (err) {
+      (*err) +=
+          "File read error. Maybe empty file or invalid file : " + filepath +
+          "\n";
+    }
+    return false;
+  }
+
+  f.seekg(0, f.end);
+  size_t sz = static_cast<size_t>(f.tellg());
+
+  // std::cout << "sz = " << sz << "\n";
+  f.seekg(0, f.beg);
+  SAFETENSORS_CPP_STATS_ADD(syscalls, 2);
+  SAFETENSORS_CPP_STATS_TIMER_STOP(open_timer, open_seconds);
+
+  if (int64_t(sz) < 0) {
+    if (err) {
+      (*err) += "Invalid file size : " + filepath +
+                " (does the path point to a directory?)";
+    }
+    return false;
+  } else if (sz == 0) {
+    if (err) {
+      (*err) += "File is empty : " + filepath + "\n";
+    }
+    return false;
+  } else if (sz >= (std::numeric_limits<std::streamoff>::max)()) {
+    if (err) {
+      (*err) += "Invalid file size : " + filepath + "\n";
+    }
+    return false;
+  }
+
+  {
+    SAFETENSORS_CPP_STATS_PHASE(data_seconds);
+    out->resize(sz);
+    if (tls_progress_scope) {
+      tls_progress_scope->info.bytes_total = sz;
+    }
+    bool ok = process_chunked(
+        tls_progress_scope, sz, sz, err, [&](size_t offset, size_t len) {
+          f.read(reinterpret_cast<char *>(out->data() + offset),
+                 static_cast<std::streamsize>(len));
+          return bool(f);
+        });
+    if (!ok) {
+      std::vector<unsigned char>().swap(*out);
+      return false;
+    }
+  }
+  SAFETENSORS_CPP_STATS_ADD(syscalls, 1);
+  SAFETENSORS_CPP_STATS_ADD(bytes_read, sz);
+  counter_add(g_counters.files_opened, 1);
+  counter_add(g_counters.bytes_read, sz);
+
+  return true;
+#endif
+}
+
+bool parse_metadata(const ::minijson::value &v,
+                    ordered_dict<std::string> &dst, std::string *err) {
+  if (auto po = v.as<::minijson::object>()) {
+    for (size_t i = 0; i < po->size(); i++) {
+      ::minijson::value ov;
+      if (!po->at(i, &ov)) {
+          if (err) {
+            (*err) +=
+                "[Internal error] Invalid object found in __metadata__, at index " + std::to_string(i) + ".\n";
+          }
+          return false;
+      }
+
+      if (auto so = ov.as<std::string>()) {
+        if (dst.count(po->keys()[i])) {
+          // This should not be happen though
+          if (err) {
+            (*err) +=
+                "Duplicate key `" + po->keys()[i] + "` found in __metadata__.\n";
+          }
+          return false;
+        }
+
+        dst.insert(po->keys()[i], *so);
+      } else {
+        if (err) {
+          (*err) += "`" + po->keys()[i] + "` must be string value.\n";
+        }
+        return false;
+      }
+    }
+  } else {
+    if (err) {
+      (*err) += "`__metadata__` value must be JSON object.\n";
+    }
+    return false;
+  }
+
+  return true;
+}
+
+bool parse_dtype(const ::minijson::value &v, safetensors::dtype &dtype,
+                 std::string *err) {
+  if (auto so = v.as<std::string>()) {
+    if ((*so) == "BOOL") {
+      dtype = safetensors::dtype::kBOOL;
+    } else if ((*so) == "U8") {
+      dtype = safetensors::dtype::kUINT8;
+    } else if ((*so) == "I8") {
+      dtype = safetensors::dtype::kINT8;
+    } else if ((*so) == "U16") {
+      dtype = safetensors::dtype::kUINT16;
+    } else if ((*so) == "I16") {
+      dtype = safetensors::dtype::kINT16;
+    } else if ((*so) == "U32") {
+      dtype = safetensors::dtype::kUINT32;
+    } else if ((*so) == "I32") {
+      dtype = safetensors::dtype::kINT32;
+    } else if ((*so) == "U64") {
+      dtype = safetensors::dtype::kUINT64;
+    } else if ((*so) == "I64") {
+      dtype = safetensors::dtype::kINT64;
+    } else if ((*so) == "F16") {
+      dtype = safetensors::dtype::kFLOAT16;
+    } else if ((*so) == "BF16") {
+      dtype = safetensors::dtype::kBFLOAT16;
+    } else if ((*so) == "F32") {
+      dtype = safetensors::dtype::kFLOAT32;
+    } else if ((*so) == "F64") {
+      dtype = safetensors::dtype::kFLOAT64;
+    } else {
+      if (err) {
+        (*err) += "Unknown `dtype` string: " + *so + ".\n";
+      }
+      return false;
+    }
+  } else {
+    if (err) {
+      (*err) +=
+          "`dtype` item should be string type but got " + v.type_name() + ".\n";
+    }
+    return false;
+  }
+
+  return true;
+}
+
+bool parse_shape(const ::minijson::value &v, std::vector<size_t> &dst,
+                 std::string *err) {
+  // NOTE:
+  // - Empty tensors (tensors with 1 dimension being 0) are allowed
+  // - [] is allowed(0-Rank tensor = merely a scalar)
+  if (auto pa = v.as<::minijson::array>()) {
+    ::minijson::array::const_iterator i;
+
+    for (i = pa->begin(); i != pa->end(); i++) {
+      if (auto pn = i->as<::minijson::number>()) {
+        if (dst.size() >= kMaxDim) {
+          if (err) {
+            (*err) += "`shape` length must be less than " +
+                      std::to_string(kMaxDim) + " but got " +
+                      std::to_string(dst.size()) + ".\n";
+          }
+          return false;
+        }
+
+        dst.push_back(size_t(*pn));
+
+      } else {
+        if (err) {
+          (*err) += "Array item in `shape` must be number type, but got " +
+                    i->type_name() + ".\n";
+        }
+        return false;
+      }
+    }
+  } else {
+    if (err) {
+      (*err) +=
+          "`shape` value must be JSON array, but got " + v.type_name() + ".\n";
+    }
+    return false;
+  }
+
+  return true;
+}
+
+bool parse_data_offsets(const ::minijson::value &v, std::array<size_t, 2> &dst,
+                        std::string *err) {
+  if (auto pa = v.as<::minijson::array>()) {
+    ::minijson::array::const_iterator i;
+    size_t cnt = 0;
+
+    for (i = pa->begin(); i != pa->end(); i++) {
+      if (auto pn = i->as<::minijson::number>()) {
+        if (cnt >= 2) {
+          if (err) {
+            (*err) += "`data_offsets` length must be 2.\n";
+          }
+          return false;
+        }
+
+        dst[cnt] = size_t(*pn);
+
+        cnt++;
+
+      } else {
+        if (err) {
+          (*err) +=
+              "Array item in `data_offsets` must be number type, but got " +
+              i->type_name() + ".\n";
+        }
+        return false;
+      }
+    }
+
+    if (cnt != 2) {
+      if (err) {
+        (*err) += "`data_offsets` length must be 2.\n";
+      }
+      return false;
+    }
+  } else {
+    if (err) {
+      (*err) += "`data_offsets` value must be JSON array, but got " +
+                v.type_name() + ".\n";
+    }
+    return false;
+  }
+
+  return true;
+}
+
+bool parse_tensor(const std::string &name, const ::minijson::value &v,
+                  tensor_t &tensor, std::string *err) {
+  if (auto po = v.as<::minijson::object>()) {
+
+    bool dtype_found{false};
+    bool shape_found{false};
+    bool data_offsets_found{false};
+
+    dtype dtype;
+    std::vector<size_t> shape;
+    std::array<size_t, 2> data_offsets{};
+
+    for (size_t i = 0; i < po->size(); i++) {
+      std::string key = po->keys()[i];
+
+      if (key == "dtype") {
+        ::minijson::value value;
+        if (!po->at(i, &value)) {
+          if (err) {
+            (*err) += "Internal error. `dtype` has invalid object.\n";
+          }
+          return false;
+        }
+
+        if (!parse_dtype(value, dtype, err)) {
+          return false;
+        }
+
+        dtype_found = true;
+      } else if (key == "shape") {
+        ::minijson::value value;
+        if (!po->at(i, &value)) {
+          if (err) {
+            (*err) += "Internal error. `shape` has invalid object.\n";
+          }
+          return false;
+        }
+
+        if (!parse_shape(value, shape, err)) {
+          return false;
+        }
+
+        shape_found = true;
+      } else if (key == "data_offsets") {
+        ::minijson::value value;
+        if (!po->at(i, &value)) {
+          if (err) {
+            (*err) += "Internal error. `data_offsets` has invalid object.\n";
+          }
+          return false;
+        }
+        if (!parse_data_offsets(value, data_offsets, err)) {
+          return false;
+        }
+
+        data_offsets_found = true;
+      } else {
+        // Unknown key. Report error?
+      }
+    }
+
+    if (!dtype_found) {
+      if (err) {
+        (*err) += "`" + name + "` does not have `dtype` item.\n";
+      }
+      return false;
+    }
+
+    if (!shape_found) {
+      if (err) {
+        (*err) += "`" + name + "` does not have `shape` item.\n";
+      }
+      return false;
+    }
+
+    bool is_empty_tensor{false};
+    if ((shape.size() > 0)) {
+      for (size_t i = 0; i < shape.size(); i++) {
+        if (shape[i] == 0) {
+          is_empty_tensor = true;
+          break;
+        }
+      }
+    }
+
+    if (is_empty_tensor) {
+      // They are not storing any data in the databuffer, yet retaining size in
+      // the header. So ignore data_offsets
+      if (data_offsets_found) {
+        // TODO: make this warn instead of err?
+        if (err) {
+          (*err) +=
+              "`" + name +
+              "` is empty tensors(tensors with 1 dimension being 0), and no "
+              "data in databuffer, but `data_offsets` item is provided.\n";
+        }
+        return false;
+      }
+    } else {
+      if (!data_offsets_found) {
+        if (err) {
+          (*err) += "`" + name + "` does not have `data_offsets` item.\n";
+        }
+        return false;
+      }
+    }
+
+    tensor.dtype = dtype;
+    tensor.shape = shape;
+    tensor.data_offsets = data_offsets;
+
+  } else {
+    if (err) {
+      (*err) += "`" + name + "` value must be JSON object.\n";
+    }
+    return false;
+  }
+
+  return true;
+}
+
+// From llama.cpp
+#if defined(_WIN32)
+static std::string safetensors_format_win_err(DWORD err) {
+  LPSTR buf;
+  size_t size = FormatMessageA(
+      FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM |
+          FORMAT_MESSAGE_IGNORE_INSERTS,
+      NULL, err, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), (LPSTR)&buf, 0,
+      NULL);
+  if (!size) {
+    return "FormatMessageA failed";
+  }
+  std::string ret(buf, size);
+  LocalFree(buf);
+  return ret;
+}
+#endif
+
+// Identity of a file on disk. Changes when the file is replaced or modified.
+struct file_version {
+  uint64_t dev{0};
+  uint64_t ino{0};
+  uint64_t size{0};
+  int64_t mtime_ns{0};
+
+  bool operator==(const file_version &rhs) const {
+    return (dev == rhs.dev) && (ino == rhs.ino) && (size == rhs.size) &&
+           (mtime_ns == rhs.mtime_ns);
+  }
+
+  bool operator<(const file_version &rhs) const {
+    if (dev != rhs.dev) return dev < rhs.dev;
+    if (ino != rhs.ino) return ino < rhs.ino;
+    if (size != rhs.size) return size < rhs.size;
+    return mtime_ns < rhs.mtime_ns;
+  }
+};
+
+template <typename S>
+void to_file_version(const S &sb, file_version *v) {
+  v->dev = uint64_t(sb.st_dev);
+  v->ino = uint64_t(sb.st_ino);
+  v->size = uint64_t(sb.st_size);
+#if defined(_WIN32)
+  v->mtime_ns = int64_t(sb.st_mtime) * 1000000000;
+#elif defined(__APPLE__)
+  v->mtime_ns = int64_t(sb.st_mtimespec.tv_sec) * 1000000000 +
+                int64_t(sb.st_mtimespec.tv_nsec);
+#else
+  v->mtime_ns = int64_t(sb.st_mtim.tv_sec) * 1000000000 +
+                int64_t(sb.st_mtim.tv_nsec);
+#endif
+}
+
+bool stat_file_version(const std::string &filename, file_version *v,
+                       std::string *err) {
+#if defined(_WIN32)
+  struct _stat64 sb;
+  int ret = _wstat64(UTF8ToWchar(filename).c_str(), &sb);
+#else
+  struct stat sb;
+  int ret = stat(filename.c_str(), &sb);
+#endif
+  if (ret != 0) {
+    if (err) {
+      (*err) += "failed to stat " + filename + ":" + errno_str(errno) + "\n";
+    }
+    return false;
+  }
+  to_file_version(sb, v);
+  return true;
+}
+
+bool fstat_file_version(int fd, file_version *v) {
+#if defined(_WIN32)
+  struct _stat64 sb;
+  int ret = _fstat64(fd, &sb);
+#else
+  struct stat sb;
+  int ret = fstat(fd, &sb);
+#endif
+  if (ret != 0) {
+    return false;
+  }
+  to_file_version(sb, v);
+  return true;
+}
+
+//
+// File handle for mmap and positional I/O.
+//
+// Reads are done with pread(ReadFile with an explicit offset on Windows), so
+// there is no shared file position and multiple threads can read different
+// ranges of one opened file concurrently without locking. Offsets are 64-bit.
+//
+struct safetensors_file {
+  int fd{-1};
+  size_t size{0};
+  bool _valid{false};
+  std::string _err;
+
+  //
+  // @param[in] fname Filename. Assume UTF-8.
+  // @param[in] mode "rb"(read only), "r+b"(read/write) or "w+b"(read/write,
+  // create or truncate).
+  //
+  safetensors_file(const char *fname, const char *mode) {
+    std::string m(mode);
+#if defined(_WIN32)
+    int flags = _O_BINARY | _O_NOINHERIT;
+    if (m == "w+b") {
+      flags |= _O_RDWR | _O_CREAT | _O_TRUNC;
+    } else if (m == "r+b") {
+      flags |= _O_RDWR;
+    } else {
+      flags |= _O_RDONLY;
+    }
+    fd = _wopen(UTF8ToWchar(fname).c_str(), flags, _S_IREAD | _S_IWRITE);
+#else
+    int flags = 0;
+    if (m == "w+b") {
+      flags = O_RDWR | O_CREAT | O_TRUNC;
+    } else if (m == "r+b") {
+      flags = O_RDWR;
+    } else {
+      flags = O_RDONLY;
+    }
+#if defined(O_CLOEXEC)
+    flags |= O_CLOEXEC;
+#endif
+    fd = ::open(fname, flags, 0666);
+#endif
+    if (fd < 0) {
+      _err = "failed to open " + std::string(fname) + ":" +
+             errno_str(errno) + "\n";
+      _valid = false;
+      return;
+    }
+
+    uint64_t sz{0};
+    if (!get_file_size(&sz)) {
+      _err = "failed to get the size of " + std::string(fname) + ":" +
+             errno_str(errno) + "\n";
+      close();
+      return;
+    }
+    if (sz > uint64_t((std::numeric_limits<size_t>::max)())) {
+      _err = std::string(fname) + " is too large for this platform.\n";
+      close();
+      return;
+    }
+    size = size_t(sz);
+    _valid = true;
+    counter_add(g_counters.files_opened, 1);
+  }
+
+  //
+  // Take the ownership of an opened file descriptor `_fd`.
+  //
+  explicit safetensors_file(int _fd) : fd(_fd) {
+    uint64_t sz{0};
+    if ((fd < 0) || !get_file_size(&sz)) {
+      _err = "invalid file descriptor:" + errno_str(errno) + "\n";
+      close();
+      return;
+    }
+    if (sz > uint64_t((std::numeric_limits<size_t>::max)())) {
+      _err = "file is too large for this platform.\n";
+      close();
+      return;
+    }
+    size = size_t(sz);
+    _valid = true;
+  }
+
+  ~safetensors_file() { close(); }
+
+  safetensors_file(const safetensors_file &) = delete;
+  safetensors_file &operator=(const safetensors_file &) = delete;
+
+  // @return false when close() failed(e.g. delayed write error).
+  bool close() {
+    bool ok = true;
+    if (fd >= 0) {
+#if defined(_WIN32)
+      ok = (_close(fd) == 0);
+#else
+      ok = (::close(fd) == 0);
+#endif
+      fd = -1;
+    }
+    _valid = false;
+    return ok;
+  }
+
+  bool get_file_size(uint64_t *sz) const {
+#if defined(_WIN32)
+    struct _stat64 sb;
+    if (_fstat64(fd, &sb) != 0) {
+      return false;
+    }
+#else
+    struct stat sb;
+    if (fstat(fd, &sb) != 0) {
+      return false;
+    }
+#endif
+    (*sz) = uint64_t(sb.st_size);
+    return true;
+  }
+
+  //
+  // Read `nbytes` bytes at `offset` to `dst`. Thread-safe.
+  //
+  bool read_at(void *dst, size_t nbytes, uint64_t offset,
+               std::string *err) const {
+    if ((offset > size) || (nbytes > (size - offset))) {
+      if (err) {
+        (*err) += "Read range exceeds the file size.\n";
+      }
+      return false;
+    }
+
+    uint8_t *p = reinterpret_cast<uint8_t *>(dst);
+    while (nbytes > 0) {
+#if defined(_WIN32)
+      HANDLE h = reinterpret_cast<HANDLE>(_get_osfhandle(fd));
+      DWORD len = DWORD((std::min)(nbytes, size_t(1) << 30));
+      OVERLAPPED ov;
+      memset(&ov, 0, sizeof(ov));
+      ov.Offset = DWORD(offset & 0xffffffffu);
+      ov.OffsetHigh = DWORD(offset >> 32);
+      DWORD n = 0;
+      if (!ReadFile(h, p, len, &n, &ov)) {
+        if (err) {
+          (*err) += "ReadFile failed: " +
+                    safetensors_format_win_err(GetLastError()) + "\n";
+        }
+        return false;
+      }
+#else
+      if (offset > uint64_t((std::numeric_limits<off_t>::max)())) {
+        if (err) {
+          (*err) += "File offset exceeds off_t range.\n";
+        }
+        return false;
+      }
+      // Some platforms fail on a single huge read.
+      size_t len = (std::min)(nbytes, size_t(1) << 30);
+      ssize_t n = pread(fd, p, len, off_t(offset));
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        if (err) {
+          (*err) += "pread failed: " + errno_str(errno) + "\n";
+        }
+        return false;
+      }
+#endif
+      if (n == 0) {
+        if (err) {
+          (*err) += "Unexpected end of file.\n";
+        }
+        return false;
+      }
+      p += size_t(n);
+      offset += uint64_t(n);
+      nbytes -= size_t(n);
+    }
+
+    return true;
+  }
+
+  bool is_valid() const { return _valid; }
+
+  const std::string &get_error() const { return _err; }
+};
+
+struct safetensors_mmap {
+  uint8_t *addr{nullptr};
+  size_t size{0};
+
+  bool _valid{false};
+  std::string _warn;
+  std::string _err;
+
+  const bool is_valid() const { return _valid; }
+
+  const std::string &get_error() const { return _err; }
+
+  const std::string &get_warning() const { return _warn; }
+
+  safetensors_mmap(const safetensors_mmap &) = delete;
+
+#ifdef _POSIX_MAPPED_FILES
+  static constexpr bool SUPPORTED = true;
+
+  safetensors_mmap(struct safetensors_file *file,
+                   size_t prefetch = (size_t)-1 /* -1 = max value */,
+                   bool numa = false, mmap_mode mode = kMMAP_READ_ONLY) {
+    size = file->size;
+    int fd = file->fd;
+    int flags = MAP_SHARED;
+    int prot = PROT_READ;
+    if (mode == kMMAP_COPY_ON_WRITE) {
+      flags = MAP_PRIVATE;
+      prot = PROT_READ | PROT_WRITE;
+    } else if (mode == kMMAP_READ_WRITE) {
+      prot = PROT_READ | PROT_WRITE;
+    }
+    // prefetch/readahead impairs performance on NUMA systems
+    if (numa) {
+      prefetch = 0;
+    }
+#ifdef __linux__
+    // MAP_POPULATE write-faults private writable mappings, which duplicates
+    // all pages. Rely on POSIX_MADV_WILLNEED for private mapping.
+    if (prefetch && (flags == MAP_SHARED)) {
+      flags |= MAP_POPULATE;
+    }
+#endif
+    addr = reinterpret_cast<uint8_t *>(
+        mmap(NULL, file->size, prot, flags, fd, 0));
+    if (addr == MAP_FAILED) {
+      _valid = false;
+      _err = "mmap failed: " + errno_str(errno) + "\n";
+
+      size = 0;
+      addr = nullptr;
+
+      return;
+    }
+
+    if (prefetch > 0) {
+      // Advise the kernel to preload the mapped memory
+      int ret = posix_madvise(addr, std::min(file->size, prefetch),
+                              POSIX_MADV_WILLNEED);
+      if (ret) {
+        _warn += "posix_madvise(.., POSIX_MADV_WILLNEED) failed: " +
+                 errno_str(ret) + "\n";
+      }
+    }
+    if (numa) {
+      // advise the kernel not to use readahead
+      // (because the next page might not belong on the same node)
+      int ret = posix_madvise(addr, file->size, POSIX_MADV_RANDOM);
+      if (ret) {
+        _warn += "posix_madvise(.., POSIX_MADV_RANDOM) failed: " +
+                 errno_str(ret) + "\n";
+      }
+    }
+
+    _valid = true;
+  }
+
+  ~safetensors_mmap() {
+    if (_valid) {
+      munmap(addr, size);
+    }
+    size = 0;
+    addr = nullptr;
+    _valid = false;
+  }
+
+#elif defined(_WIN32)
+  static constexpr bool SUPPORTED = true;
+
+  safetensors_mmap(struct safetensors_file *file, bool prefetch = true,
+                   bool numa = false, mmap_mode mode = kMMAP_READ_ONLY) {
+    (void)numa;
+
+    size = file->size;
+
+    HANDLE hFile = (HANDLE)_get_osfhandle(file->fd);
+
+    DWORD protect = PAGE_READONLY;
+    DWORD access = FILE_MAP_READ;
+    if (mode == kMMAP_COPY_ON_WRITE) {
+      protect = PAGE_WRITECOPY;
+      access = FILE_MAP_COPY;
+    } else if (mode == kMMAP_READ_WRITE) {
+      protect = PAGE_READWRITE;
+      access = FILE_MAP_WRITE;
+    }
+
+    HANDLE hMapping =
+        CreateFileMappingA(hFile, NULL, protect, 0, 0, NULL);
+    DWORD error = GetLastError();
+
+    if (hMapping == NULL) {
+      // TODO: get error message
+      _err = "CreateFileMappingA failed: " + safetensors_format_win_err(error) +
+             "\n";
+      _valid = false;
+      size = 0;
+      addr = nullptr;
+      return;
+    }
+
+    addr = reinterpret_cast<uint8_t *>(
+        MapViewOfFile(hMapping, access, 0, 0, 0));
+    error = GetLastError();
+    CloseHandle(hMapping);
+
+    if (addr == NULL) {
+      _err =
+          "MapViewOfFile failed: " + safetensors_format_win_err(error) + "\n";
+    }
+
+    if (prefetch) {
+      // PrefetchVirtualMemory is only present on Windows 8 and above, so we
+      // dynamically load it
+      BOOL(WINAPI * pPrefetchVirtualMemory)
+      (HANDLE, ULONG_PTR, PWIN32_MEMORY_RANGE_ENTRY, ULONG);
+      HMODULE hKernel32 = GetModuleHandleW(L"kernel32.dll");
+
+      // may fail on pre-Windows 8 systems
+      pPrefetchVirtualMemory =
+          reinterpret_cast<decltype(pPrefetchVirtualMemory)>(
+              GetProcAddress(hKernel32, "PrefetchVirtualMemory"));
+
+      if (pPrefetchVirtualMemory) {
+        // advise the kernel to preload the mapped memory
+        WIN32_MEMORY_RANGE_ENTRY range;
+        range.VirtualAddress = addr;
+        range.NumberOfBytes = (SIZE_T)size;
+        if (!pPrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0)) {
+          _warn += "PrefetchVirtualMemory failed: " +
+                   safetensors_format_win_err(GetLastError()) + "\n";
+        }
+      }
+    }
+  }
+  ~safetensors_mmap() {
+    if (!UnmapViewOfFile(addr)) {
+      _warn += "UnmapViewOfFile failed: " +
+               safetensors_format_win_err(GetLastError()) + "\n";
+    }
+  }
+#else
+  static constexpr bool SUPPORTED = false;
+
+  safetensors_mmap(struct safetensors_file *file, bool prefetch = true,
+                   bool numa = false, mmap_mode mode = kMMAP_READ_ONLY) {
+    (void)file;
+    (void)prefetch;
+    (void)numa;
+    (void)mode;
+
+    _valid = false;
+    _err = "mmap not supported\n";
+    addr = nullptr;
+    size = 0;
+  }
+#endif
+};
+
+// Based on MIOPen bfloat16
+// https://github.com/ROCmSoftwarePlatform/MIOpen/blob/master/src/kernels/bfloat16_dev.hpp
+
+/*******************************************************************************
+ *
+ * MIT License
+ *
+ * Copyright (c) 2019 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ *all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ *******************************************************************************/
+
+typedef union cvt_bf16_fp32 {
+  uint32_t u32;
+  uint16_t ushortvec[2];
+
+  float f32;
+} cvt_bf16_fp32_t;
+
+float bfloat16_to_float(uint16_t src_val) {
+  cvt_bf16_fp32_t target_val;
+
+  target_val.ushortvec[0] = 0;
+  target_val.ushortvec[1] = src_val;
+
+  return target_val.f32;
+}
+
+uint16_t float_to_bfloat16(float src_val) {
+  cvt_bf16_fp32_t target_val;
+  target_val.f32 = src_val;
+  // BF16 round and NaN preservation code matches
+  // https://github.com/ROCmSoftwarePlatform/rocBLAS/blob/develop/library/include/rocblas_bfloat16.h
+  if ((~target_val.u32 & 0x7f800000) == 0)  // Inf or NaN
+  {
+    // When all of the exponent bits are 1, the value is Inf or NaN.
+    // Inf is indicated by a zero mantissa. NaN is indicated by any nonzero
+    // mantissa bit. Quiet NaN is indicated by the most significant mantissa
+    // bit being 1. Signaling NaN is indicated by the most significant
+    // mantissa bit being 0 but some other bit(s) being 1. If any of the
+    // lower 16 bits of the mantissa are 1, we set the least significant bit
+    // of the bfloat16 mantissa, in order to preserve signaling NaN in case
+    // the bloat16's mantissa bits are all 0.
+    if ((target_val.u32 & 0xffff) != 0) {
+      target_val.u32 |= 0x10000;  // Preserve signaling NaN
+    }
+  } else {
+#if 1  // MIOPEN_USE_RNE_BFLOAT16
+       // When the exponent bits are not all 1s, then the value is zero, normal,
+       // or subnormal. We round the bfloat16 mantissa up by adding 0x7FFF, plus
+       // 1 if the least significant bit of the bfloat16 mantissa is 1 (odd).
+       // This causes the bfloat16's mantissa to be incremented by 1 if the 16
+       // least significant bits of the float mantissa are greater than 0x8000,
+       // or if they are equal to 0x8000 and the least significant bit of the
+    // bfloat16 mantissa is 1 (odd). This causes it to be rounded to even when
+    // the lower 16 bits are exactly 0x8000. If the bfloat16 mantissa already
+    // has the value 0x7f, then incrementing it causes it to become 0x00 and
+    // the exponent is incremented by one, which is the next higher FP value
+    // to the unrounded bfloat16 value. When the bfloat16 value is subnormal
+    // with an exponent of 0x00 and a mantissa of 0x7F, it may be rounded up
+    // to a normal value with an exponent of 0x01 and a mantissa of 0x00.
+    // When the bfloat16 value has an exponent of 0xFE and a mantissa of 0x7F,
+    // incrementing it causes it to become an exponent of 0xFF and a mantissa
+    // of 0x00, which is Inf, the next higher value to the unrounded value.
+    target_val.u32 += (0x7fff + (target_val.ushortvec[1] & 1));
+#endif  // MIOPEN_USE_RNE_BFLOAT16
+  }
+
+  return target_val.ushortvec[1];
+}
+
+// half <-> float conversion based on: https://gist.github.com/rygorous/2156668
+// (CC0 license)
+//
+
+// Little endian
+union FP32le {
+  unsigned int u;
+  float f;
+  struct {
+    unsigned int Mantissa : 23;
+    unsigned int Exponent : 8;
+    unsigned int Sign : 1;
+  } s;
+};
+
+// Little endian
+union float16le {
+  unsigned short u;
+  struct {
+    unsigned int Mantissa : 10;
+    unsigned int Exponent : 5;
+    unsigned int Sign : 1;
+  } s;
+};
+
+float half_to_float_le(float16le h) {
+  static const FP32le magic = {113 << 23};
+  static const unsigned int shifted_exp = 0x7c00
+                                          << 13;  // exponent mask after shift
+  FP32le o;
+
+  o.u = (h.u & 0x7fffU) << 13U;           // exponent/mantissa bits
+  unsigned int exp_ = shifted_exp & o.u;  // just the exponent
+  o.u += (127 - 15) << 23;                // exponent adjust
+
+  // handle exponent special cases
+  if (exp_ == shifted_exp)    // Inf/NaN?
+    o.u += (128 - 16) << 23;  // extra exp adjust
+  else if (exp_ == 0)         // Zero/Denormal?
+  {
+    o.u += 1 << 23;  // extra exp adjust
+    o.f -= magic.f;  // renormalize
+  }
+
+  o.u |= (h.u & 0x8000U) << 16U;  // sign bit
+  return o.f;
+}
+
+uint16_t float_to_half_full_le(float _f) {
+  FP32le f;
+  f.f = _f;
+  float16le o = {0};
+
+  // Based on ISPC reference code (with minor modifications)
+  if (f.s.Exponent == 0)  // Signed zero/denormal (which will underflow)
+    o.s.Exponent = 0;
+  else if (f.s.Exponent == 255)  // Inf or NaN (all exponent bits set)
+  {
+    o.s.Exponent = 31;
+    o.s.Mantissa = f.s.Mantissa ? 0x200 : 0;  // NaN->qNaN and Inf->Inf
+  } else                                      // Normalized number
+  {
+    // Exponent unbias the single, then bias the halfp
+    int newexp = f.s.Exponent - 127 + 15;
+    if (newexp >= 31)  // Overflow, return signed infinity
+      o.s.Exponent = 31;
+    else if (newexp <= 0)  // Underflow
+    {
+      if ((14 - newexp) <= 24)  // Mantissa might be non-zero
+      {
+        unsigned int mant = f.s.Mantissa | 0x800000;  // Hidden 1 bit
+        o.s.Mantissa = mant >> (14 - newexp);
+        if ((mant >> (13 - newexp)) & 1)  // Check for rounding
+          o.u++;  // Round, might overflow into exp bit, but this is OK
+      }
+    } else {
+      o.s.Exponent = static_cast<unsigned int>(newexp);
+      o.s.Mantissa = f.s.Mantissa >> 13;
+      if (f.s.Mantissa & 0x1000)  // Check for rounding
+        o.u++;                    // Round, might overflow to inf, this is OK
+    }
+  }
+
+  o.s.Sign = f.s.Sign;
+
+  return o.u;
+}
+
+bool parse_safetensors_header(const uint8_t *addr, const size_t nbytes,
+                              const std::string &filename, safetensors_t *st,
+                              std::string *warn, std::string *err) {
+  if (nbytes < 16) {
+    if (err) {
+      (*err) += "Size is too short.\n";
+    }
+    return false;
+  }
+
+  uint64_t header_size{0};
+  memcpy(reinterpret_cast<unsigned char *>(&header_size), addr,
+         sizeof(uint64_t));
+
+  if (header_size < 4) {
+    if (err) {
+      (*err) += "Header size is too short.\n";
+    }
+    return false;
+  }
+
+  if ((8 + header_size) > nbytes) {
+    if (err) {
+      (*err) += "Header size " + std::to_string(header_size) +
+                " + 8 exceeds input size " + std::to_string(nbytes) + " .\n";
+    }
+    return false;
+  }
+
+  if (header_size > kMaxJSONSize) {
+    if (err) {
+      (*err) += "Header JSON size exceeds the limit(" +
+                std::to_string(kMaxJSONSize) + ").\n";
+    }
+    return false;
+  }
+
+  SAFETENSORS_CPP_STATS_TIMER_START(header_timer);
+  // assume JSON data is small enough.
+  std::string json_str(reinterpret_cast<const char *>(&addr[8]), header_size);
+  const char *p = json_str.c_str();
+  SAFETENSORS_CPP_STATS_TIMER_STOP(header_timer, header_read_seconds);
+
+  SAFETENSORS_CPP_STATS_PHASE(parse_seconds);
+
+  ::minijson::value v;
+  ::minijson::error e = ::minijson::parse(p, v);
+
+  if (e != ::minijson::no_error) {
+    if (err) {
+      std::string json_err(::minijson::errstr(e));
+      (*err) += "JSON parse error: " + json_err + "\n";
+    }
+
+    return false;
+  }
+
+  ordered_dict<tensor_t> tensors;
+  ordered_dict<std::string> metadata;
+
+  // root element must be dict.
+  if (auto po = v.as<::minijson::object>()) {
+    for (size_t i = 0; i < po->size(); i++) {
+      std::string key = po->keys()[i];
+
+      if (key == "__metadata__") {
+        ::minijson::value value;
+        if (!po->at(i, &value)) {
+          if (err) {
+            (*err) += "Internal error. Invalid object in __metadata__.\n";
+          }
+          return false;
+        }
+
+        if (!detail::parse_metadata(value, metadata, err)) {
+          return false;
+        }
+      } else {
+        // tensor
+
+        if (tensors.count(key)) {
+          if (err) {
+            (*err) += "Duplicate key `" + key + "` found.\n";
+          }
+          return false;
+        }
+
+        ::minijson::value value;
+        if (!po->at(i, &value)) {
+          if (err) {
+            (*err) += "Internal error. Invalid object in `" + key + "`.\n";
+          }
+          return false;
+        }
+
+        tensor_t tensor;
+        if (!detail::parse_tensor(key, value, tensor, err)) {
+          return false;
+        }
+
+        tensors.insert(key, std::move(tensor));
+      }
+    }
+  } else {
+    if (err) {
+      (*err) += "JSON root elements must be object(dict)\n";
+    }
+  }
+
+  st->tensors = std::move(tensors);
+  st->metadata = std::move(metadata);
+  st->header_size = header_size;
+
+#if 0
+  size_t databuffer_size = nbytes - header_size - 8;
+
+  st->storage.resize(nbytes);
+  memcpy(st->storage.data(), addr + 8 + header_size, nbytes);
+
+  st->mmaped = false;
+  st->mmap_addr = addr + 8 + header_size;
+  st->mmap_size = 0;
+#endif
+
+  return true;
+}
+
+//
+// Process-wide cache of read-only file mappings keyed by file identity.
+// `mmap_from_file` shares the mapping and the parsed header among
+// `safetensors_t` objects opening the same file. Disabled on Windows(no
+// inode number).
+//
+struct shared_mapping {
+  file_version key;
+  safetensors_file *file{nullptr};
+  safetensors_mmap *mmap{nullptr};
+
+  // Parsed header.
+  ordered_dict<tensor_t> tensors;
+  ordered_dict<std::string> metadata;
+  size_t header_size{0};
+
+  size_t refs{0};  // guarded by `mapping_cache::lock`
+
+  ~shared_mapping() {
+    delete mmap;
+    delete file;
+  }
+};
+
+struct mapping_cache {
+#if defined(SAFETENSORS_CPP_USE_THREADS)
+  std::mutex mtx;
+  void lock() { mtx.lock(); }
+  void unlock() { mtx.unlock(); }
+#else
+  // The app may still call `mmap_from_file` from its own threads.
+  std::atomic_flag flag = ATOMIC_FLAG_INIT;
+  void lock() {
+    while (flag.test_and_set(std::memory_order_acquire)) {
+    }
+  }
+  void unlock() { flag.clear(std::memory_order_release); }
+#endif
+
+  std::map<file_version, shared_mapping *> entries;
+};
+
+#if defined(_WIN32)
+std::atomic<bool> g_mapping_cache_enabled{false};
+#else
+std::atomic<bool> g_mapping_cache_enabled{true};
+#endif
+
+mapping_cache &get_mapping_cache() {
+  static mapping_cache *cache = new mapping_cache();  // never destroyed
+  return *cache;
+}
+
+void attach_shared_mapping(shared_mapping *m, safetensors_t *st) {
+  st->tensors = m->tensors;
+  st->metadata = m->metadata;
+  st->header_size = m->header_size;
+
+  st->mmaped = true;
+  st->map_mode = kMMAP_READ_ONLY;
+  st->mmap_addr = m->mmap->addr;
+  st->mmap_size = m->mmap->size;
+  st->databuffer_addr = st->mmap_addr + 8 + st->header_size;
+  st->databuffer_size = st->mmap_size - (8 + st->header_size);
+  st->st_file = nullptr;
+  st->st_mmap = nullptr;
+  st->st_shared = m;
+}
+
+// Attach the cached mapping of `key` to `st`. Returns false on miss.
+bool mapping_cache_acquire(const file_version &key, safetensors_t *st) {
+  mapping_cache &c = get_mapping_cache();
+  c.lock();
+  auto it = c.entries.find(key);
+  shared_mapping *m = (it != c.entries.end()) ? it->second : nullptr;
+  if (m) {
+    m->refs++;
+  }
+  c.unlock();
+
+  if (!m) {
+    return false;
+  }
+  attach_shared_mapping(m, st);
+  return true;
+}
+
+// Move the mapping owned by `st` into the cache. Keeps `st` as is when
+// another thread inserted the same file first.
+void mapping_cache_insert(const file_version &key, safetensors_t *st) {
+  std::unique_ptr<shared_mapping> m(new shared_mapping());
+  m->key = key;
+  m->file = reinterpret_cast<safetensors_file *>(st->st_file);
+  m->mmap = reinterpret_cast<safetensors_mmap *>(st->st_mmap);
+  m->tensors = st->tensors;
+  m->metadata = st->metadata;
+  m->header_size = st->header_size;
+  m->refs = 1;
+
+  mapping_cache &c = get_mapping_cache();
+  c.lock();
+  bool inserted = c.entries.insert(std::make_pair(key, m.get())).second;
+  c.unlock();
+
+  if (!inserted) {
+    m->file = nullptr;
+    m->mmap = nullptr;
+    return;
+  }
+  st->st_file = nullptr;
+  st->st_mmap = nullptr;
+  st->st_shared = m.release();
+}
+
+void mapping_cache_release(shared_mapping *m) {
+  mapping_cache &c = get_mapping_cache();
+  c.lock();
+  bool last = (--m->refs == 0);
+  if (last) {
+    c.entries.erase(m->key);
+  }
+  c.unlock();
+
+  if (last) {
+    delete m;  // unmap
+  }
+}
+
+}  // namespace detail
+
+safetensors_t::~safetensors_t() {
+  if (st_shared) {
+    detail::mapping_cache_release(
+        reinterpret_cast<detail::shared_mapping *>(st_shared));
+    st_shared = nullptr;
+  }
+
+  if (st_mmap) {
+    detail::safetensors_mmap *p =
+        reinterpret_cast<detail::safetensors_mmap *>(st_mmap);
+    delete p;
+    st_mmap = nullptr;
+  }
+
+  if (st_file) {
+    detail::safetensors_file *p =
+        reinterpret_cast<detail::safetensors_file *>(st_file);
+    delete p;
+    st_file = nullptr;
+  }
+}
+
+//
+// - 8byte: header_size
+// - json data(header_size bytes)
+// - tensor data(filesize - header_size)
+//
+
+namespace detail {
+
+// Read and parse the header of opened `file` to `st`. `head` receives the
+// first `8 + header_size` bytes.
+bool read_file_header(safetensors_file &file, const std::string &filename,
+                      std::vector<uint8_t> *head, safetensors_t *st,
+                      std::string *warn, std::string *err) {
+  if (file.size < 16) {
+    if (err) {
+      (*err) += "Size is too short.\n";
+    }
+    return false;
+  }
+
+  uint64_t header_size{0};
+  if (!file.read_at(&header_size, sizeof(uint64_t), 0, err)) {
+    return false;
+  }
+  if ((header_size > kMaxJSONSize) || ((8 + header_size) > file.size)) {
+    if (err) {
+      (*err) += "Invalid header size " + std::to_string(header_size) +
+                ".\n";
+    }
+    return false;
+  }
+
+  head->resize(size_t(8 + header_size));
+  if (!file.read_at(head->data(), head->size(), 0, err)) {
+    return false;
+  }
+  SAFETENSORS_CPP_STATS_ADD(syscalls, 2);
+  SAFETENSORS_CPP_STATS_ADD(bytes_read, head->size());
+
+  return parse_safetensors_header(head->data(), file.size, filename, st,
+                                  warn, err);
+}
+
+// Load a file written by `save_compressed` from `file` or memory. `st` has
+// the parsed header.
+bool load_compressed(safetensors_file &file, size_t head_size,
+                     safetensors_t *st, std::string *err);
+bool load_compressed(const uint8_t *addr, size_t nbytes, safetensors_t *st,
+                     std::string *err);
+
+}  // namespace detail
+
+bool load_from_file(const std::string &filename, safetensors_t *st,
+                    std::string *warn, std::string *err) {
+  SAFETENSORS_CPP_STATS_ENTRY();
+  detail::progress_scope progress("load_from_file");
+
+#if defined(SAFETENSORS_CPP_ANDROID_LOAD_FROM_ASSETS)
+  std::vector<unsigned char> data;
+  if (!detail::ReadWholeFile(&data, err, filename, nullptr)) {
+    return false;
+  }
+
+  return load_from_memory(reinterpret_cast<const uint8_t *>(data.data()),
+                          data.size(), filename, st, warn, err);
+#else
+  if (!st) {
+    return false;
+  }
+
+  // Read the header, then tensor data directly into `storage`(no
+  // intermediate whole-file buffer).
+  SAFETENSORS_CPP_STATS_TIMER_START(open_timer);
+  detail::safetensors_file file(filename.c_str(), "rb");
+  SAFETENSORS_CPP_STATS_TIMER_STOP(open_timer, open_seconds);
+  SAFETENSORS_CPP_STATS_ADD(syscalls, 2);  // open + fstat
+  if (!file.is_valid()) {
+    if (err) {
+      (*err) += file.get_error();
+    }
+    return false;
+  }
+
+  if (file.size < 16) {
+    if (err) {
+      (*err) += "Size is too short.\n";
+    }
+    return false;
+  }
+
+  uint64_t header_size{0};
+  if (!file.read_at(&header_size, sizeof(uint64_t), 0, err)) {
+    return false;
+  }
+  SAFETENSORS_CPP_STATS_ADD(syscalls, 1);
+
+  // Checked again in `parse_safetensors_header`. Here to avoid huge alloc.
+  if ((header_size > kMaxJSONSize) || ((8 + header_size) > file.size)) {
+    if (err) {
+      (*err) += "Invalid header size " + std::to_string(header_size) +
+                ".\n";
+    }
+    return false;
+  }
+
+  std::vector<uint8_t> head(size_t(8 + header_size));
+  if (!file.read_at(head.data(), head.size(), 0, err)) {
+    return false;
+  }
+  SAFETENSORS_CPP_STATS_ADD(syscalls, 1);
+  SAFETENSORS_CPP_STATS_ADD(bytes_read, head.size());
+
+  // Only the first `8 + header_size` bytes are accessed.
+  if (!detail::parse_safetensors_header(head.data(), file.size, filename, st,
+                                        warn, err)) {
+    return false;
+  }
+
+  if (is_compressed(*st)) {
+    return detail::load_compressed(file, head.size(), st, err);
+  }
+
+  size_t databuffer_size = file.size - head.size();
+
+  {
+    SAFETENSORS_CPP_STATS_PHASE(data_seconds);
+    st->storage.resize(databuffer_size);
+    progress.info.bytes_total = databuffer_size;
+    progress.set_tensors(st);
+    bool ok = detail::process_chunked(
+        &progress, databuffer_size, 0, err, [&](size_t offset, size_t len) {
+          SAFETENSORS_CPP_STATS_ADD(syscalls, 1);
+          return file.read_at(st->storage.data() + offset, len,
+                              uint64_t(head.size() + offset), err);
+        });
+    if (!ok) {
+      std::vector<uint8_t>().swap(st->storage);
+      return false;
+    }
+  }
+  SAFETENSORS_CPP_STATS_ADD(bytes_read, databuffer_size);
+  detail::counter_add(detail::g_counters.bytes_read,
+                      head.size() + databuffer_size);
+  detail::counter_add(detail::g_counters.tensors_materialized,
+                      st->tensors.size());
+
+  st->mmaped = false;
+  st->mmap_addr = nullptr;
+  st->mmap_size = 0;
+  st->databuffer_addr = nullptr;
+  st->databuffer_size = 0;
+
+  return true;
+#endif
+}
+
+bool reload_into(safetensors_t *st, const std::string &filename,
+                 std::string *warn, std::string *err) {
+  if (!st) {
+    return false;
+  }
+
+  SAFETENSORS_CPP_STATS_ENTRY();
+  detail::progress_scope progress("reload_into");
+
+  if (st->mmaped) {
+    if (err) {
+      (*err) += "reload_into requires safetensors loaded to `storage`(not "
+                "mmaped).\n";
+    }
+    return false;
+  }
+
+  SAFETENSORS_CPP_STATS_TIMER_START(open_timer);
+  detail::safetensors_file file(filename.c_str(), "rb");
+  SAFETENSORS_CPP_STATS_TIMER_STOP(open_timer, open_seconds);
+  SAFETENSORS_CPP_STATS_ADD(syscalls, 2);  // open + fstat
+  if (!file.is_valid()) {
+    if (err) {
+      (*err) += file.get_error();
+    }
+    return false;
+  }
+
+  std::vector<uint8_t> head;
+  safetensors_t next;
+  if (!detail::read_file_header(file, filename, &head, &next, warn, err)) {
+    return false;
+  }
+
+  // Validate against the existing tensor table.
+  if (next.tensors.size() != st->tensors.size()) {
+    if (err) {
+      (*err) += "The number of tensors differs: " +
+                std::to_string(next.tensors.size()) + " in " + filename +
+                ", " + std::to_string(st->tensors.size()) + " loaded.\n";
+    }
+    return false;
+  }
+
+  size_t databuffer_size = file.size - head.size();
+  bool same_layout = (databuffer_size == st->storage.size());
+  for (size_t i = 0; i < next.tensors.size(); i++) {
+    const std::string &name = next.tensors.keys()[i];
+    tensor_t nt, ot;
+    next.tensors.at(i, &nt);
+    if (!st->tensors.at(name, &ot)) {
+      if (err) {
+        (*err) += "Tensor `" + name + "` is not in the loaded tensors.\n";
+      }
+      return false;
+    }
+    if ((nt.dtype != ot.dtype) || (nt.shape != ot.shape)) {
+      if (err) {
+        (*err) += "dtype or shape of tensor `" + name + "` differs.\n";
+      }
+      return false;
+    }
+    if ((nt.data_offsets[0] > nt.data_offsets[1]) ||
+        (nt.data_offsets[1] > databuffer_size) ||
+        ((nt.data_offsets[1] - nt.data_offsets[0]) !=
+         (ot.data_offsets[1] - ot.data_offsets[0])) ||
+        (ot.data_offsets[1] > st->storage.size())) {
+      if (err) {
+        (*err) += "Tensor `" + name + "` has invalid data_offsets.\n";
+      }
+      return false;
+    }
+    same_layout = same_layout && (nt.data_offsets == ot.data_offsets);
+  }
+
+  {
+    SAFETENSORS_CPP_STATS_PHASE(data_seconds);
+    progress.set_tensors(st);
+    bool ok = true;
+    if (same_layout) {
+      progress.info.bytes_total = databuffer_size;
+      ok = detail::process_chunked(
+          &progress, databuffer_size, 0, err, [&](size_t offset, size_t len) {
+            SAFETENSORS_CPP_STATS_ADD(syscalls, 1);
+            return file.read_at(st->storage.data() + offset, len,
+                                uint64_t(head.size() + offset), err);
+          });
+    } else {
+      uint64_t total = 0;
+      for (size_t i = 0; i < next.tensors.size(); i++) {
+        tensor_t nt;
+        next.tensors.at(i, &nt);
+        total += nt.data_offsets[1] - nt.data_offsets[0];
+      }
+      progress.info.bytes_total = total;
+
+      for (size_t i = 0; ok && (i < next.tensors.size()); i++) {
+        tensor_t nt, ot;
+        next.tensors.at(i, &nt);
+        st->tensors.at(next.tensors.keys()[i], &ot);
+        size_t n = nt.data_offsets[1] - nt.data_offsets[0];
+        for (size_t off = 0; ok && (off < n); off += kProgressChunkSize) {
+          size_t len = (std::min)(n - off, kProgressChunkSize);
+          SAFETENSORS_CPP_STATS_ADD(syscalls, 1);
+          ok = file.read_at(st->storage.data() + ot.data_offsets[0] + off,
+                            len, head.size() + nt.data_offsets[0] + off,
+                            err);
+          if (ok &&
+              !progress.advance(len, ot.data_offsets[0] + off + len - 1)) {
+            if (err) {
+              (*err) += "Cancelled by progress callback.\n";
+            }
+            ok = false;
+          }
+        }
+      }
+    }
+    if (!ok) {
+      return false;
+    }
+  }
+  SAFETENSORS_CPP_STATS_ADD(bytes_read, databuffer_size);
+  detail::counter_add(detail::g_counters.bytes_read,
+                      head.size() + databuffer_size);
+  detail::counter_add(detail::g_counters.tensors_materialized,
+                      st->tensors.size());
+
+  st->metadata = next.metadata;
+  st->header_size = next.header_size;
+
+  return true;
+}
+
+namespace detail {
+
+// Column block of the rank-r update. A block of `A`(rank x 256 floats) stays
+// in L1/L2 while all rows of W are updated.
+constexpr size_t kLoraBlockSize = 256;
+
+// One pending `W += B * A`. `b` is pre-multiplied by the scale.
+struct lora_pair {
+  std::string name;  // base tensor name
+  tensor_t w;
+  size_t rows{0};
+  size_t cols{0};
+  size_t rank{0};
+  std::vector<float> a;  // [rank, cols]
+  std::vector<float> b;  // [rows, rank]
+};
+
+bool is_lora_float_dtype(dtype dt) {
+  return (dt == dtype::kFLOAT32) || (dt == dtype::kFLOAT16) ||
+         (dt == dtype::kBFLOAT16);
+}
+
+// Convert `n` items of F32, F16 or BF16 data to float.
+void lora_to_float(const uint8_t *src, dtype dt, size_t n, float *dst) {
+  if (dt == dtype::kFLOAT32) {
+    memcpy(dst, src, n * sizeof(float));
+    return;
+  }
+  uint16_t tmp[kLoraBlockSize];
+  for (size_t i = 0; i < n; i += kLoraBlockSize) {
+    size_t len = (std::min)(kLoraBlockSize, n - i);
+    memcpy(tmp, src + i * 2, len * 2);
+    if (dt == dtype::kBFLOAT16) {
+      ::safetensors::bfloat16_to_float(tmp, len, dst + i);
+    } else {
+      ::safetensors::fp16_to_float(tmp, len, dst + i);
+    }
+  }
+}
+
+void lora_from_float(const float *src, dtype dt, size_t n, uint8_t *dst) {
+  if (dt == dtype::kFLOAT32) {
+    memcpy(dst, src, n * sizeof(float));
+    return;
+  }
+  uint16_t tmp[kLoraBlockSize];
+  for (size_t i = 0; i < n; i += kLoraBlockSize) {
+    size_t len = (std::min)(kLoraBlockSize, n - i);
+    if (dt == dtype::kBFLOAT16) {
+      ::safetensors::float_to_bfloat16(src + i, len, tmp);
+    } else {
+      ::safetensors::float_to_fp16(src + i, len, tmp);
+    }
+    memcpy(dst + i * 2, tmp, len * 2);
+  }
+}
+
+// W[rows, cols] += B[rows, rank] * A[rank, cols], accumulated in FP32.
+void merge_lora_pair(const lora_pair &p, uint8_t *w) {
+  const size_t itembytes = get_dtype_bytes(p.w.dtype);
+  float acc[kLoraBlockSize];
+  for (size_t j0 = 0; j0 < p.cols; j0 += kLoraBlockSize) {
+    const size_t n = (std::min)(kLoraBlockSize, p.cols - j0);
+    for (size_t i = 0; i < p.rows; i++) {
+      uint8_t *row = w + (i * p.cols + j0) * itembytes;
+      lora_to_float(row, p.w.dtype, n, acc);
+      const float *b = p.b.data() + i * p.rank;
+      for (size_t k = 0; k < p.rank; k++) {
+        const float bk = b[k];
+        const float *a = p.a.data() + k * p.cols + j0;
+        for (size_t j = 0; j < n; j++) {
+          acc[j] += bk * a[j];
+        }
+      }
+      lora_from_float(acc, p.w.dtype, n, row);
+    }
+  }
+}
+
+// Read an adapter tensor as float.
+bool lora_tensor_to_float(const safetensors_t &st, const std::string &name,
+                          const tensor_t &t, std::vector<float> *dst,
+                          std::string *err) {
+  if (!is_lora_float_dtype(t.dtype)) {
+    if (err) {
+      (*err) += "Adapter tensor `" + name + "` must be F32, F16 or BF16.\n";
+    }
+    return false;
+  }
+  const uint8_t *data{nullptr};
+  size_t nbytes{0};
+  if (!get_tensor_data(st, name, &data, &nbytes, err)) {
+    return false;
+  }
+  size_t n = get_shape_size(t);
+  if (nbytes != n * get_dtype_bytes(t.dtype)) {
+    if (err) {
+      (*err) += "Adapter tensor `" + name + "` has invalid data size.\n";
+    }
+    return false;
+  }
+  dst->resize(n);
+  lora_to_float(data, t.dtype, n, dst->data());
+  return true;
+}
+
+bool ends_with(const std::string &s, const std::string &suffix) {
+  return (s.size() >= suffix.size()) &&
+         (s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0);
+}
+
+// Match A/B pairs of `adapter` with tensors of `base` and prepare float
+// copies of A and scaled B. Sorted by the end of W in the databuffer.
+bool build_lora_pairs(const safetensors_t &adapter, const safetensors_t &base,
+                      const lora_options &options,
+                      std::vector<lora_pair> *pairs, std::string *warn,
+                      std::string *err) {
+  for (size_t i = 0; i < adapter.tensors.size(); i++) {
+    const std::string &name = adapter.tensors.keys()[i];
+    if (ends_with(name, options.b_suffix)) {
+      std::string a_name =
+          name.substr(0, name.size() - options.b_suffix.size()) +
+          options.a_suffix;
+      if (!adapter.tensors.count(a_name)) {
+        if (err) {
+          (*err) += "LoRA tensor `" + a_name + "` for `" + name +
+                    "` not found.\n";
+        }
+        return false;
+      }
+      continue;
+    }
+    if (ends_with(name, ".alpha")) {
+      continue;
+    }
+    if (!ends_with(name, options.a_suffix)) {
+      if (warn) {
+        (*warn) += "Adapter tensor `" + name + "` is not LoRA A/B. Ignored.\n";
+      }
+      continue;
+    }
+
+    std::string stem = name.substr(0, name.size() - options.a_suffix.size());
+    std::string b_name = stem + options.b_suffix;
+    std::string alpha_name = stem + ".alpha";
+    if (!options.prefix.empty() &&
+        (stem.compare(0, options.prefix.size(), options.prefix) == 0)) {
+      stem = stem.substr(options.prefix.size());
+    }
+
+    lora_pair p;
+    p.name = stem + options.base_suffix;
+    tensor_t ta, tb;
+    adapter.tensors.at(name, &ta);
+    if (!adapter.tensors.at(b_name, &tb)) {
+      if (err) {
+        (*err) += "LoRA tensor `" + b_name + "` for `" + name +
+                  "` not found.\n";
+      }
+      return false;
+    }
+    if (!base.tensors.at(p.name, &p.w)) {
+      if (err) {
+        (*err) += "Base tensor `" + p.name + "` for `" + name +
+                  "` not found.\n";
+      }
+      return false;
+    }
+    if (!is_lora_float_dtype(p.w.dtype)) {
+      if (err) {
+        (*err) += "Base tensor `" + p.name + "` must be F32, F16 or BF16.\n";
+      }
+      return false;
+    }
+
+    size_t numel = get_shape_size(p.w);
+    p.rows = p.w.shape.empty() ? 0 : p.w.shape[0];
+    p.rank = ta.shape.empty() ? 0 : ta.shape[0];
+    p.cols = p.rows ? (numel / p.rows) : 0;
+    if ((p.w.shape.size() < 2) || (p.rank == 0) || (numel == 0) ||
+        (get_shape_size(ta) != p.rank * p.cols) || tb.shape.empty() ||
+        (tb.shape[0] != p.rows) || (get_shape_size(tb) != p.rows * p.rank)) {
+      if (err) {
+        (*err) += "Shape mismatch between base tensor `" + p.name +
+                  "` and LoRA tensors `" + name + "`, `" + b_name + "`.\n";
+      }
+      return false;
+    }
+
+    if (!lora_tensor_to_float(adapter, name, ta, &p.a, err) ||
+        !lora_tensor_to_float(adapter, b_name, tb, &p.b, err)) {
+      return false;
+    }
+
+    float scale = options.scale;
+    tensor_t talpha;
+    if (adapter.tensors.at(alpha_name, &talpha)) {
+      std::vector<float> alpha;
+      if (!lora_tensor_to_float(adapter, alpha_name, talpha, &alpha, err)) {
+        return false;
+      }
+      if (alpha.size() != 1) {
+        if (err) {
+          (*err) += "LoRA tensor `" + alpha_name + "` must be a scalar.\n";
+        }
+        return false;
+      }
+      scale = scale * alpha[0] / float(p.rank);
+    }
+    for (float &v : p.b) {
+      v *= scale;
+    }
+
+    pairs->push_back(std::move(p));
+  }
+
+  std::sort(pairs->begin(), pairs->end(),
+            [](const lora_pair &x, const lora_pair &y) {
+              return x.w.data_offsets[1] < y.w.data_offsets[1];
+            });
+  for (size_t i = 1; i < pairs->size(); i++) {
+    if ((*pairs)[i].name == (*pairs)[i - 1].name) {
+      if (err) {
+        (*err) += "Base tensor `" + (*pairs)[i].name +
+                  "` has multiple LoRA pairs.\n";
+      }
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace detail
+
+bool load_with_lora(const std::string &base_filename,
+                    const std::string &adapter_filename,
+                    const lora_options &options, safetensors_t *st,
+                    std::string *warn, std::string *err) {
+  if (!st) {
+    return false;
+  }
+
+  SAFETENSORS_CPP_STATS_ENTRY();
+
+  // Adapters are small. Load it as usual.
+  safetensors_t adapter;
+  if (!load_from_file(adapter_filename, &adapter, warn, err)) {
+    return false;
+  }
+
+  detail::progress_scope progress("load_with_lora");
+
+  detail::safetensors_file file(base_filename.c_str(), "rb");
+  SAFETENSORS_CPP_STATS_ADD(syscalls, 2);  // open + fstat
+  if (!file.is_valid()) {
+    if (err) {
+      (*err) += file.get_error();
+    }
+    return false;
+  }
+
+  std::vector<uint8_t> head;
+  if (!detail::read_file_header(file, base_filename, &head, st, warn, err)) {
+    return false;
+  }
+
+  std::vector<detail::lora_pair> pairs;
+  if (!detail::build_lora_pairs(adapter, *st, options, &pairs, warn, err)) {
+    return false;
+  }
+
+  size_t databuffer_size = file.size - head.size();
+  for (const detail::lora_pair &p : pairs) {
+    if ((p.w.data_offsets[0] > p.w.data_offsets[1]) ||
+        (p.w.data_offsets[1] > databuffer_size) ||
+        ((p.w.data_offsets[1] - p.w.data_offsets[0]) !=
+         get_shape_size(p.w) * get_dtype_bytes(p.w.dtype))) {
+      if (err) {
+        (*err) += "Tensor `" + p.name + "` has invalid data_offsets.\n";
+      }
+      return false;
+    }
+  }
+
+  bool ok;
+  {
+    SAFETENSORS_CPP_STATS_PHASE(data_seconds);
+    st->storage.resize(databuffer_size);
+    progress.info.bytes_total = databuffer_size;
+    progress.set_tensors(st);
+
+    // Merge each W as soon as the reads cover it: on a background thread,
+    // or on this thread after each read when `num_threads` is 1.
+    size_t next = 0;
+    auto merge_ready = [&](size_t end) {
+      for (; (next < pairs.size()) && (pairs[next].w.data_offsets[1] <= end);
+           next++) {
+        const detail::lora_pair &p = pairs[next];
+        detail::merge_lora_pair(p, st->storage.data() + p.w.data_offsets[0]);
+      }
+    };
+#if defined(SAFETENSORS_CPP_USE_THREADS)
+    const bool background = (options.num_threads != 1);
+    std::mutex mtx;
+    std::condition_variable cv;
+    size_t ready = 0;
+    bool done = false;
+    std::thread merger;
+    if (background) {
+      merger = std::thread([&]() {
+        for (const detail::lora_pair &p : pairs) {
+          {
+            std::unique_lock<std::mutex> lk(mtx);
+            cv.wait(lk, [&]() {
+              return done || (ready >= p.w.data_offsets[1]);
+            });
+            if (ready < p.w.data_offsets[1]) {
+              return;  // read failed
+            }
+          }
+          detail::merge_lora_pair(p,
+                                  st->storage.data() + p.w.data_offsets[0]);
+        }
+      });
+    }
+#else
+    const bool background = false;
+#endif
+
+    // Always read in `kProgressChunkSize` chunks(not only when progress is
+    // reported) so that merges overlap the following reads.
+    ok = true;
+    for (size_t offset = 0; ok && (offset < databuffer_size);
+         offset += kProgressChunkSize) {
+      size_t len = (std::min)(databuffer_size - offset, kProgressChunkSize);
+      SAFETENSORS_CPP_STATS_ADD(syscalls, 1);
+      ok = file.read_at(st->storage.data() + offset, len,
+                        uint64_t(head.size() + offset), err);
+      if (!ok) {
+        break;
+      }
+      if (background) {
+#if defined(SAFETENSORS_CPP_USE_THREADS)
+        {
+          std::lock_guard<std::mutex> lk(mtx);
+          ready = offset + len;
+        }
+        cv.notify_one();
+#endif
+      } else {
+        merge_ready(offset + len);
+      }
+      if (!progress.advance(len, offset + len - 1)) {
+        if (err) {
+          (*err) += "Cancelled by progress callback.\n";
+        }
+        ok = false;
+      }
+    }
 
-                case 0x02:
-                {
-                    error_message = "invalid string: control character U+0002 (STX) must be escaped to \\u0002";
-                    return false;
-                }
+#if defined(SAFETENSORS_CPP_USE_THREADS)
+    if (background) {
+      {
+        std::lock_guard<std::mutex> lk(mtx);
+        done = true;
+      }
+      cv.notify_one();
+      merger.join();
+    }
+#endif
+  }
+  if (!ok) {
+    std::vector<uint8_t>().swap(st->storage);
+    return false;
+  }
 
-                case 0x03:
-                {
-                    error_message = "invalid string: control character U+0003 (ETX) must be escaped to \\u0003";
-                    return false;
-                }
+  SAFETENSORS_CPP_STATS_ADD(bytes_read, databuffer_size);
+  detail::counter_add(detail::g_counters.bytes_read,
+                      head.size() + databuffer_size);
+  detail::counter_add(detail::g_counters.tensors_materialized,
+                      st->tensors.size());
 
-                case 0x04:
-                {
-                    error_message = "invalid string: control character U+0004 (EOT) must be escaped to \\u0004";
-                    return false;
-                }
+  st->mmaped = false;
+  st->mmap_addr = nullptr;
+  st->mmap_size = 0;
+  st->databuffer_addr = nullptr;
+  st->databuffer_size = 0;
 
-                case 0x05:
-                {
-                    error_message = "invalid string: control character U+0005 (ENQ) must be escaped to \\u0005";
-                    return false;
-                }
+  return true;
+}
 
-                case 0x06:
-                {
-                    error_message = "invalid string: control character U+0006 (ACK) must be escaped to \\u0006";
-                    return false;
-                }
+bool load_from_memory(const uint8_t *addr, const size_t nbytes,
+                      const std::string &filename, safetensors_t *st,
+                      std::string *warn, std::string *err) {
+  SAFETENSORS_CPP_STATS_ENTRY();
+  detail::progress_scope progress("load_from_memory");
 
-                case 0x07:
-                {
-                    error_message = "invalid string: control character U+0007 (BEL) must be escaped to \\u0007";
-                    return false;
-                }
+  if (nbytes < 16) {
+    if (err) {
+      (*err) += "Size is too short.\n";
+    }
+    return false;
+  }
 
-                case 0x08:
-                {
-                    error_message = "invalid string: control character U+0008 (BS) must be escaped to \\u0008 or \\b";
-                    return false;
-                }
+  if (!detail::parse_safetensors_header(addr, nbytes, filename, st, warn,
+                                        err)) {
+    return false;
+  }
 
-                case 0x09:
-                {
-                    error_message = "invalid string: control character U+0009 (HT) must be escaped to \\u0009 or \\t";
-                    return false;
-                }
+  if (is_compressed(*st)) {
+    return detail::load_compressed(addr, nbytes, st, err);
+  }
 
-                case 0x0A:
-                {
-                    error_message = "invalid string: control character U+000A (LF) must be escaped to \\u000A or \\n";
-                    return false;
-                }
+  size_t databuffer_size = nbytes - st->header_size - 8;
 
-                case 0x0B:
-                {
-                    error_message = "invalid string: control character U+000B (VT) must be escaped to \\u000B";
-                    return false;
-                }
+  {
+    SAFETENSORS_CPP_STATS_PHASE(data_seconds);
+    st->storage.resize(databuffer_size);
+    progress.info.bytes_total = databuffer_size;
+    progress.set_tensors(st);
+    const uint8_t *src = addr + 8 + st->header_size;
+    bool ok = detail::process_chunked(
+        &progress, databuffer_size, 0, err, [&](size_t offset, size_t len) {
+          memcpy(st->storage.data() + offset, src + offset, len);
+          return true;
+        });
+    if (!ok) {
+      std::vector<uint8_t>().swap(st->storage);
+      return false;
+    }
+  }
+  SAFETENSORS_CPP_STATS_ADD(bytes_copied, databuffer_size);
+  detail::counter_add(detail::g_counters.tensors_materialized,
+                      st->tensors.size());
 
-                case 0x0C:
-                {
-                    error_message = "invalid string: control character U+000C (FF) must be escaped to \\u000C or \\f";
-                    return false;
-                }
+  st->mmaped = false;
+  st->mmap_addr = nullptr;
+  st->mmap_size = 0;
+  st->databuffer_addr = nullptr;
+  st->databuffer_size = 0;
 
-                case 0x0D:
-                {
-                    error_message = "invalid string: control character U+000D (CR) must be escaped to \\u000D or \\r";
-                    return false;
-                }
+  return true;
+}
 
-                case 0x0E:
-                {
-                    error_message = "invalid string: control character U+000E (SO) must be escaped to \\u000E";
-                    return false;
-                }
+namespace detail {
 
-                case 0x0F:
-                {
-                    error_message = "invalid string: control character U+000F (SI) must be escaped to \\u000F";
-                    return false;
-                }
+//
+// Map the opened file `pf` and parse it into `st`. `st` takes the ownership
+// of `pf`(deleted on failure).
+//
+bool map_opened_file(safetensors_file *pf, const std::string &filename,
+                     safetensors_t *st, std::string *warn, std::string *err,
+                     mmap_mode mode) {
+  // TODO: prefetch, numa
+  SAFETENSORS_CPP_STATS_TIMER_START(mmap_timer);
+  safetensors_mmap *pm = new safetensors_mmap(pf, (size_t)-1, false, mode);
+  SAFETENSORS_CPP_STATS_TIMER_STOP(mmap_timer, mmap_seconds);
+  SAFETENSORS_CPP_STATS_ADD(syscalls, 2);  // mmap + madvise
 
-                case 0x10:
-                {
-                    error_message = "invalid string: control character U+0010 (DLE) must be escaped to \\u0010";
-                    return false;
-                }
+  bool ret = safetensors::mmap_from_memory(pm->addr, pm->size, filename, st,
+                                           warn, err);
 
-                case 0x11:
-                {
-                    error_message = "invalid string: control character U+0011 (DC1) must be escaped to \\u0011";
-                    return false;
-                }
+  if (!ret) {
+    delete pm;
+    delete pf;
 
-                case 0x12:
-                {
-                    error_message = "invalid string: control character U+0012 (DC2) must be escaped to \\u0012";
-                    return false;
-                }
+    return false;
+  }
 
-                case 0x13:
-                {
-                    error_message = "invalid string: control character U+0013 (DC3) must be escaped to \\u0013";
-                    return false;
-                }
+  st->mmap_addr = pm->addr;
+  st->mmap_size = pm->size;
 
-                case 0x14:
-                {
-                    error_message = "invalid string: control character U+0014 (DC4) must be escaped to \\u0014";
-                    return false;
-                }
+  st->databuffer_addr = st->mmap_addr + 8 + st->header_size;
+  st->databuffer_size = st->mmap_size - (8 + st->header_size);
+
+  // retain pointer
+  st->st_file = pf;
+  st->st_mmap = pm;
+
+  st->mmaped = true;
+  st->map_mode = mode;
+
+  counter_add(g_counters.bytes_mapped, pm->size);
+
+  return true;
+}
+
+}  // namespace detail
+
+bool mmap_from_file(const std::string &filename, safetensors_t *st,
+                    std::string *warn, std::string *err, mmap_mode mode) {
+  if (!st) {
+    return false;
+  }
+
+  SAFETENSORS_CPP_STATS_ENTRY();
+
+  bool use_cache = (mode == kMMAP_READ_ONLY) &&
+                   detail::g_mapping_cache_enabled.load(
+                       std::memory_order_relaxed);
+  if (use_cache) {
+    detail::file_version key;
+    SAFETENSORS_CPP_STATS_ADD(syscalls, 1);
+    if (detail::stat_file_version(filename, &key, nullptr) &&
+        detail::mapping_cache_acquire(key, st)) {
+      return true;
+    }
+  }
+
+  SAFETENSORS_CPP_STATS_TIMER_START(open_timer);
+  detail::safetensors_file *pf = new detail::safetensors_file(
+      filename.c_str(), (mode == kMMAP_READ_WRITE) ? "r+b" : "rb");
+  SAFETENSORS_CPP_STATS_TIMER_STOP(open_timer, open_seconds);
+  SAFETENSORS_CPP_STATS_ADD(syscalls, 2);  // open + size query
+  if (!pf->is_valid()) {
+    if (err) {
+      (*err) += pf->get_error();
+    }
+    delete pf;
+    return false;
+  }
+
+  if (!detail::map_opened_file(pf, filename, st, warn, err, mode)) {
+    return false;
+  }
+
+  if (use_cache) {
+    // Key by the opened file, in case the path was replaced meanwhile.
+    detail::file_version key;
+    if (detail::fstat_file_version(pf->fd, &key)) {
+      detail::mapping_cache_insert(key, st);
+    }
+  }
+
+  return true;
+}
+
+bool mmap_from_memory(const uint8_t *addr, const size_t nbytes,
+                      const std::string &filename, safetensors_t *st,
+                      std::string *warn, std::string *err) {
+  if (!addr) {
+    return false;
+  }
+
+  if (nbytes < 16) {
+    return false;
+  }
+
+  if (!st) {
+    return false;
+  }
+
+  SAFETENSORS_CPP_STATS_ENTRY();
+
+  if (!detail::parse_safetensors_header(addr, nbytes, filename, st, warn,
+                                        err)) {
+    return false;
+  }
+
+  size_t databuffer_size = nbytes - st->header_size - 8;
+
+  st->mmaped = true;
+  st->map_mode = kMMAP_READ_ONLY;
+
+  st->mmap_addr = addr;
+  st->mmap_size = nbytes;
+
+  st->databuffer_addr = st->mmap_addr + 8 + st->header_size;
+  st->databuffer_size = st->mmap_size - (8 + st->header_size);
+
+  return true;
+}
+
+namespace detail {
+
+// Run `fn(i)` for i in [0, n) on a pool of `num_threads` threads(the calling
+// thread included), handing out indices with an atomic counter. See
+// "Concurrency model" for `num_threads`.
+template <typename F>
+void parallel_for(size_t n, size_t num_threads, const F &fn) {
+#if defined(SAFETENSORS_CPP_USE_THREADS)
+  if (num_threads == 0) {
+    num_threads = (std::max)(1u, std::thread::hardware_concurrency());
+  }
+  num_threads = (std::min)(num_threads, n);
+
+  std::atomic<size_t> next{0};
+  auto worker = [&]() {
+    size_t i;
+    while ((i = next.fetch_add(1, std::memory_order_relaxed)) < n) {
+      fn(i);
+    }
+  };
+  std::vector<std::thread> workers;
+  for (size_t t = 1; t < num_threads; t++) {
+    workers.emplace_back(worker);
+  }
+  worker();
+  for (std::thread &t : workers) {
+    t.join();
+  }
+#else
+  (void)num_threads;
+  for (size_t i = 0; i < n; i++) {
+    fn(i);
+  }
+#endif
+}
+
+// Load `paths[i]` into `arena + offsets[i]`.
+bool load_one_into_arena(const std::string &path, uint8_t *dst,
+                         uint64_t expected_size, safetensors_t *st,
+                         std::string *warn, std::string *err) {
+  safetensors_file f(path.c_str(), "rb");
+  if (!f.is_valid()) {
+    (*err) += f.get_error();
+    return false;
+  }
+  if (uint64_t(f.size) != expected_size) {
+    (*err) += "File size of " + path + " changed during load.\n";
+    return false;
+  }
+  if (!f.read_at(dst, f.size, 0, err)) {
+    return false;
+  }
+  counter_add(g_counters.bytes_read, f.size);
+
+  return mmap_from_memory(dst, f.size, path, st, warn, err);
+}
+
+}  // namespace detail
+
+bool load_many(const std::vector<std::string> &paths,
+               const load_many_options &options, load_many_result *result,
+               std::string *warn, std::string *err) {
+  if (!result) {
+    return false;
+  }
+
+  SAFETENSORS_CPP_STATS_ENTRY();
+  auto start = std::chrono::steady_clock::now();
+
+  const size_t n = paths.size();
+  const uint64_t kAlign = 64;
 
-                case 0x15:
-                {
-                    error_message = "invalid string: control character U+0015 (NAK) must be escaped to \\u0015";
-                    return false;
-                }
+  load_many_result &r = *result;
+  std::unique_ptr<uint8_t[]> arena = std::move(r.arena);
+  size_t arena_capacity = r.arena_capacity;
+  r = load_many_result();
+  r.files.resize(n);
+  r.errors.resize(n);
+  std::vector<std::string> warns(n);
 
-                case 0x16:
-                {
-                    error_message = "invalid string: control character U+0016 (SYN) must be escaped to \\u0016";
-                    return false;
-                }
+  // Pass 1: sizes and arena offsets.
+  std::vector<uint64_t> sizes(n, 0);
+  std::vector<uint64_t> offsets(n, 0);
+  uint64_t total = 0;
+  for (size_t i = 0; i < n; i++) {
+    detail::file_version v;
+    if (!detail::stat_file_version(paths[i], &v, &r.errors[i])) {
+      continue;
+    }
+    sizes[i] = v.size;
+    offsets[i] = total;
+    total += (v.size + kAlign - 1) / kAlign * kAlign;
+  }
+  SAFETENSORS_CPP_STATS_ADD(syscalls, n);
 
-                case 0x17:
-                {
-                    error_message = "invalid string: control character U+0017 (ETB) must be escaped to \\u0017";
-                    return false;
-                }
+  if (total > uint64_t((std::numeric_limits<size_t>::max)())) {
+    if (err) {
+      (*err) += "Total size of files is too large for this platform.\n";
+    }
+    return false;
+  }
+  if (!arena || (arena_capacity < total)) {
+    arena.reset();
+    arena_capacity = (std::max)(size_t(total), size_t(1));
+    arena.reset(new uint8_t[arena_capacity]);
+  }
+  r.arena = std::move(arena);
+  r.arena_capacity = arena_capacity;
+  r.arena_size = size_t(total);
 
-                case 0x18:
-                {
-                    error_message = "invalid string: control character U+0018 (CAN) must be escaped to \\u0018";
-                    return false;
-                }
+  // Pass 2: read and parse.
+  auto load_one = [&](size_t i) {
+    if (!r.errors[i].empty()) {
+      return;
+    }
+    if (!detail::load_one_into_arena(paths[i], r.arena.get() + offsets[i],
+                                     sizes[i], &r.files[i], &warns[i],
+                                     &r.errors[i]) &&
+        r.errors[i].empty()) {
+      r.errors[i] = "Failed to load " + paths[i] + "\n";
+    }
+  };
 
-                case 0x19:
-                {
-                    error_message = "invalid string: control character U+0019 (EM) must be escaped to \\u0019";
-                    return false;
-                }
+  detail::parallel_for(n, options.num_threads, load_one);
+  SAFETENSORS_CPP_STATS_ADD(syscalls, 4 * n);  // open + fstat + pread + close
 
-                case 0x1A:
-                {
-                    error_message = "invalid string: control character U+001A (SUB) must be escaped to \\u001A";
-                    return false;
-                }
+  for (size_t i = 0; i < n; i++) {
+    if (warn && !warns[i].empty()) {
+      (*warn) += warns[i];
+    }
+    if (r.errors[i].empty()) {
+      r.bytes_read += sizes[i];
+    } else {
+      r.num_failed++;
+      if (err) {
+        (*err) += r.errors[i];
+      }
+    }
+  }
+  SAFETENSORS_CPP_STATS_ADD(bytes_read, r.bytes_read);
 
-                case 0x1B:
-                {
-                    error_message = "invalid string: control character U+001B (ESC) must be escaped to \\u001B";
-                    return false;
-                }
+  r.seconds = std::chrono::duration<double>(
+                  std::chrono::steady_clock::now() - start)
+                  .count();
+  r.files_per_second =
+      (r.seconds > 0.0) ? (double(n - r.num_failed) / r.seconds) : 0.0;
 
-                case 0x1C:
-                {
-                    error_message = "invalid string: control character U+001C (FS) must be escaped to \\u001C";
-                    return false;
-                }
+  return r.num_failed == 0;
+}
 
-                case 0x1D:
-                {
-                    error_message = "invalid string: control character U+001D (GS) must be escaped to \\u001D";
-                    return false;
-                }
+void set_mapping_cache_enabled(bool enabled) {
+#if defined(_WIN32)
+  (void)enabled;
+#else
+  detail::g_mapping_cache_enabled.store(enabled, std::memory_order_relaxed);
+#endif
+}
 
-                case 0x1E:
-                {
-                    error_message = "invalid string: control character U+001E (RS) must be escaped to \\u001E";
-                    return false;
-                }
+size_t mapping_cache_size() {
+  detail::mapping_cache &c = detail::get_mapping_cache();
+  c.lock();
+  size_t n = c.entries.size();
+  c.unlock();
+  return n;
+}
 
-                case 0x1F:
-                {
-                    error_message = "invalid string: control character U+001F (US) must be escaped to \\u001F";
-                    return false;
-                }
+void set_thread_progress_callback(progress_callback callback,
+                                  void *userdata) {
+  detail::tls_progress_callback = callback;
+  detail::tls_progress_userdata = userdata;
+}
 
-                // U+0020..U+007F (except U+0022 (quote) and U+005C (backspace))
-                case 0x20:
-                case 0x21:
-                case 0x23:
-                case 0x24:
-                case 0x25:
-                case 0x26:
-                case 0x27:
-                case 0x28:
-                case 0x29:
-                case 0x2A:
-                case 0x2B:
-                case 0x2C:
-                case 0x2D:
-                case 0x2E:
-                case 0x2F:
-                case 0x30:
-                case 0x31:
-                case 0x32:
-                case 0x33:
-                case 0x34:
-                case 0x35:
-                case 0x36:
-                case 0x37:
-                case 0x38:
-                case 0x39:
-                case 0x3A:
-                case 0x3B:
-                case 0x3C:
-                case 0x3D:
-                case 0x3E:
-                case 0x3F:
-                case 0x40:
-                case 0x41:
-                case 0x42:
-                case 0x43:
-                case 0x44:
-                case 0x45:
-                case 0x46:
-                case 0x47:
-                case 0x48:
-                case 0x49:
-                case 0x4A:
-                case 0x4B:
-                case 0x4C:
-                case 0x4D:
-                case 0x4E:
-                case 0x4F:
-                case 0x50:
-                case 0x51:
-                case 0x52:
-                case 0x53:
-                case 0x54:
-                case 0x55:
-                case 0x56:
-                case 0x57:
-                case 0x58:
-                case 0x59:
-                case 0x5A:
-                case 0x5B:
-                case 0x5D:
-                case 0x5E:
-                case 0x5F:
-                case 0x60:
-                case 0x61:
-                case 0x62:
-                case 0x63:
-                case 0x64:
-                case 0x65:
-                case 0x66:
-                case 0x67:
-                case 0x68:
-                case 0x69:
-                case 0x6A:
-                case 0x6B:
-                case 0x6C:
-                case 0x6D:
-                case 0x6E:
-                case 0x6F:
-                case 0x70:
-                case 0x71:
-                case 0x72:
-                case 0x73:
-                case 0x74:
-                case 0x75:
-                case 0x76:
-                case 0x77:
-                case 0x78:
-                case 0x79:
-                case 0x7A:
-                case 0x7B:
-                case 0x7C:
-                case 0x7D:
-                case 0x7E:
-                case 0x7F:
-                {
-                    add(current);
-                    break;
-                }
+void set_thread_io_stats(io_stats *stats) {
+#if defined(SAFETENSORS_CPP_ENABLE_STATS)
+  detail::tls_io_stats = stats;
+#else
+  (void)stats;
+#endif
+}
 
-                // U+0080..U+07FF: bytes C2..DF 80..BF
-                case 0xC2:
-                case 0xC3:
-                case 0xC4:
-                case 0xC5:
-                case 0xC6:
-                case 0xC7:
-                case 0xC8:
-                case 0xC9:
-                case 0xCA:
-                case 0xCB:
-                case 0xCC:
-                case 0xCD:
-                case 0xCE:
-                case 0xCF:
-                case 0xD0:
-                case 0xD1:
-                case 0xD2:
-                case 0xD3:
-                case 0xD4:
-                case 0xD5:
-                case 0xD6:
-                case 0xD7:
-                case 0xD8:
-                case 0xD9:
-                case 0xDA:
-                case 0xDB:
-                case 0xDC:
-                case 0xDD:
-                case 0xDE:
-                case 0xDF:
-                {
-                    if (JSON_HEDLEY_UNLIKELY(!next_byte_in_range({0x80, 0xBF})))
-                    {
-                        return false;
-                    }
-                    break;
-                }
+global_counters get_global_counters() {
+  const detail::atomic_counters &c = detail::g_counters;
+  const std::memory_order o = std::memory_order_relaxed;
+
+  global_counters r;
+  r.files_opened = c.files_opened.load(o);
+  r.bytes_mapped = c.bytes_mapped.load(o);
+  r.bytes_read = c.bytes_read.load(o);
+  r.bytes_written = c.bytes_written.load(o);
+  r.tensors_materialized = c.tensors_materialized.load(o);
+  r.cache_hits = c.cache_hits.load(o);
+  r.cache_misses = c.cache_misses.load(o);
+  r.cache_evictions = c.cache_evictions.load(o);
+  r.prefetch_issued = c.prefetch_issued.load(o);
+  r.prefetch_used = c.prefetch_used.load(o);
+  r.convert_bytes = c.convert_bytes.load(o);
+  return r;
+}
 
-                // U+0800..U+0FFF: bytes E0 A0..BF 80..BF
-                case 0xE0:
-                {
-                    if (JSON_HEDLEY_UNLIKELY(!(next_byte_in_range({0xA0, 0xBF, 0x80, 0xBF}))))
-                    {
-                        return false;
-                    }
-                    break;
-                }
+void reset_global_counters() {
+  detail::atomic_counters &c = detail::g_counters;
+  const std::memory_order o = std::memory_order_relaxed;
+
+  c.files_opened.store(0, o);
+  c.bytes_mapped.store(0, o);
+  c.bytes_read.store(0, o);
+  c.bytes_written.store(0, o);
+  c.tensors_materialized.store(0, o);
+  c.cache_hits.store(0, o);
+  c.cache_misses.store(0, o);
+  c.cache_evictions.store(0, o);
+  c.prefetch_issued.store(0, o);
+  c.prefetch_used.store(0, o);
+  c.convert_bytes.store(0, o);
+}
 
-                // U+1000..U+CFFF: bytes E1..EC 80..BF 80..BF
-                // U+E000..U+FFFF: bytes EE..EF 80..BF 80..BF
-                case 0xE1:
-                case 0xE2:
-                case 0xE3:
-                case 0xE4:
-                case 0xE5:
-                case 0xE6:
-                case 0xE7:
-                case 0xE8:
-                case 0xE9:
-                case 0xEA:
-                case 0xEB:
-                case 0xEC:
-                case 0xEE:
-                case 0xEF:
-                {
-                    if (JSON_HEDLEY_UNLIKELY(!(next_byte_in_range({0x80, 0xBF, 0x80, 0xBF}))))
-                    {
-                        return false;
-                    }
-                    break;
-                }
+std::string format_global_counters(const global_counters &c,
+                                   const std::string &prefix) {
+  struct item {
+    const char *name;
+    const char *help;
+    uint64_t value;
+  };
 
-                // U+D000..U+D7FF: bytes ED 80..9F 80..BF
-                case 0xED:
-                {
-                    if (JSON_HEDLEY_UNLIKELY(!(next_byte_in_range({0x80, 0x9F, 0x80, 0xBF}))))
-                    {
-                        return false;
-                    }
-                    break;
-                }
+  const item items[] = {
+      {"files_opened", "Files opened.", c.files_opened},
+      {"mapped_bytes", "Bytes memory-mapped.", c.bytes_mapped},
+      {"read_bytes", "Bytes read from files.", c.bytes_read},
+      {"written_bytes", "Bytes written to files.", c.bytes_written},
+      {"tensors_materialized", "Tensors copied or accessed.",
+       c.tensors_materialized},
+      {"cache_hits", "Accesses to resident data.", c.cache_hits},
+      {"cache_misses", "Accesses which waited for I/O.", c.cache_misses},
+      {"cache_evictions", "Data dropped from memory.", c.cache_evictions},
+      {"prefetch_issued", "Speculative loads issued.", c.prefetch_issued},
+      {"prefetch_used", "Speculative loads consumed.", c.prefetch_used},
+      {"converted_bytes", "Source bytes of dtype conversion.", c.convert_bytes},
+  };
 
-                // U+10000..U+3FFFF F0 90..BF 80..BF 80..BF
-                case 0xF0:
-                {
-                    if (JSON_HEDLEY_UNLIKELY(!(next_byte_in_range({0x90, 0xBF, 0x80, 0xBF, 0x80, 0xBF}))))
-                    {
-                        return false;
-                    }
-                    break;
-                }
+  std::stringstream ss;
+  for (const item &it : items) {
+    std::string name = prefix + "_" + it.name + "_total";
+    ss << "# HELP " << name << " " << it.help << "\n";
+    ss << "# TYPE " << name << " counter\n";
+    ss << name << " " << it.value << "\n";
+  }
+  return ss.str();
+}
 
-                // U+40000..U+FFFFF F1..F3 80..BF 80..BF 80..BF
-                case 0xF1:
-                case 0xF2:
-                case 0xF3:
-                {
-                    if (JSON_HEDLEY_UNLIKELY(!(next_byte_in_range({0x80, 0xBF, 0x80, 0xBF, 0x80, 0xBF}))))
-                    {
-                        return false;
-                    }
-                    break;
-                }
+float bfloat16_to_float(uint16_t x) { return detail::bfloat16_to_float(x); }
 
-                // U+100000..U+10FFFF F4 80..8F 80..BF 80..BF
-                case 0xF4:
-                {
-                    if (JSON_HEDLEY_UNLIKELY(!(next_byte_in_range({0x80, 0x8F, 0x80, 0xBF, 0x80, 0xBF}))))
-                    {
-                        return false;
-                    }
-                    break;
-                }
+uint16_t float_to_bfloat16(float x) { return detail::float_to_bfloat16(x); }
 
-                // remaining bytes (80..C1 and F5..FF) are ill-formed
-                default:
-                {
-                    error_message = "invalid string: ill-formed UTF-8 byte";
-                    return false;
-                }
-            }
-        }
+float fp16_to_float(uint16_t x) {
+  detail::float16le src;
+  src.u = x;
+  return detail::half_to_float_le(src);
+}
 
-        error_message = "invalid string: missing closing quote";
-        return false;
-    }
-#endif
-// end json.hpp
-// clang-format on
+uint16_t float_to_fp16(float x) { return detail::float_to_half_full_le(x); }
+
+namespace detail {
+
+// Elements per block of the bulk conversions. The inner loop over a block has
+// a fixed trip count and works on local arrays, so compilers vectorize it
+// even at -O2(no aliasing check and no remainder loop).
+constexpr size_t kConvertBlockSize = 64;
+
+// dst[i] = fn(src[i]) for `n` elements of type S(src) and D(dst).
+template <typename S, typename D, typename F>
+void convert_blocks(const void *src, size_t n, void *dst, F fn) {
+  const uint8_t *s = reinterpret_cast<const uint8_t *>(src);
+  uint8_t *d = reinterpret_cast<uint8_t *>(dst);
+  size_t i = 0;
+  for (; (i + kConvertBlockSize) <= n; i += kConvertBlockSize) {
+    S in[kConvertBlockSize];
+    D out[kConvertBlockSize];
+    memcpy(in, s + i * sizeof(S), sizeof(in));
+    for (size_t k = 0; k < kConvertBlockSize; k++) {
+      out[k] = fn(in[k]);
+    }
+    memcpy(d + i * sizeof(D), out, sizeof(out));
+  }
+  for (; i < n; i++) {
+    S in;
+    memcpy(&in, s + i * sizeof(S), sizeof(S));
+    D out = fn(in);
+    memcpy(d + i * sizeof(D), &out, sizeof(D));
+  }
+}
+
+// Same as bfloat16_to_float. Float bits.
+inline uint32_t bfloat16_to_float_bits(uint16_t h) {
+  return uint32_t(h) << 16;
+}
+
+// Same rounding(RNE) and NaN preservation as float_to_bfloat16.
+inline uint16_t float_bits_to_bfloat16(uint32_t u) {
+  uint32_t rounded = u + 0x7fffu + ((u >> 16) & 1u);
+  uint32_t naninf = u | (((u & 0xffffu) != 0) ? 0x10000u : 0u);
+  uint32_t r = ((~u & 0x7f800000u) == 0) ? naninf : rounded;
+  return uint16_t(r >> 16);
+}
+
+// Same as half_to_float_le. Float bits.
+inline uint32_t half_to_float_bits(uint16_t x) {
+  const uint32_t shifted_exp = 0x7c00u << 13;
+  const uint32_t magic_u = 113u << 23;
+  float magic;
+  memcpy(&magic, &magic_u, 4);
+
+  uint32_t h = x;
+  uint32_t o = (h & 0x7fffu) << 13;
+  uint32_t e = o & shifted_exp;
+  o += (127u - 15u) << 23;
+
+  // Inf/NaN
+  uint32_t o_inf = o + ((128u - 16u) << 23);
+
+  // Zero/Denormal
+  uint32_t od = o + (1u << 23);
+  float fd;
+  memcpy(&fd, &od, 4);
+  fd -= magic;
+  uint32_t o_den;
+  memcpy(&o_den, &fd, 4);
+
+  // Select with bit masks(no branch).
+  uint32_t m_inf = 0u - uint32_t(e == shifted_exp);
+  uint32_t m_den = 0u - uint32_t(e == 0);
+  uint32_t r = (o_inf & m_inf) | (o_den & m_den) | (o & ~(m_inf | m_den));
+  return r | ((h & 0x8000u) << 16);
+}
+
+// Same as float_to_half_full_le, without branches.
+inline uint16_t float_bits_to_half(uint32_t u) {
+  uint32_t sign = (u >> 16) & 0x8000u;
+  uint32_t e = (u >> 23) & 0xffu;
+  uint32_t m = u & 0x7fffffu;
+  int32_t newexp = int32_t(e) - 127 + 15;
+
+  // Select with bit masks(no branch).
+  uint32_t m_sub = 0u - uint32_t(newexp <= 0);
+  uint32_t m_ovf = 0u - uint32_t(newexp >= 31);
+  uint32_t m_nan = 0u - uint32_t(e == 255);
+  uint32_t m_zero = 0u - uint32_t(e == 0);
+
+  // Normalized number
+  uint32_t o_norm = ((uint32_t(newexp) << 10) | (m >> 13)) + ((m >> 12) & 1u);
+
+  // Underflow: `mant >> (14 - newexp)` rounded half up, without a
+  // per-element shift. y = |x| / 2^-24(the fp16 subnormal step) is exact
+  // and < 1024. Adding and subtracting 2^23 rounds it to nearest even, and
+  // a tie rounded down(y - r == 0.5) is bumped up. Other inputs are masked
+  // to 0(this also keeps float denormals out of the arithmetic).
+  uint32_t a = u & 0x7fffffffu & m_sub & ~m_zero;
+  float y;
+  memcpy(&y, &a, 4);
+  y *= 16777216.0f;
+  float r = (y + 8388608.0f) - 8388608.0f;
+  uint32_t o_sub = uint32_t(int32_t(r)) + uint32_t((y - r) == 0.5f);
+
+  // NaN->qNaN and Inf->Inf
+  uint32_t o_nan = 0x7c00u | (uint32_t(m != 0) << 9);
+
+  uint32_t o = (o_sub & m_sub) | (o_norm & ~m_sub);
+  o = (0x7c00u & m_ovf) | (o & ~m_ovf);
+  o = (o_nan & m_nan) | (o & ~m_nan);
+  o = o & ~m_zero;
+  return uint16_t(o | sign);
+}
 
 }  // namespace detail
 
+void bfloat16_to_float(const uint16_t *src, size_t n, float *dst) {
+  detail::counter_add(detail::g_counters.convert_bytes, uint64_t(n) * 2);
+  detail::convert_blocks<uint16_t, uint32_t>(
+      src, n, dst,
+      [](uint16_t x) { return detail::bfloat16_to_float_bits(x); });
+}
+
+void float_to_bfloat16(const float *src, size_t n, uint16_t *dst) {
+  detail::counter_add(detail::g_counters.convert_bytes, uint64_t(n) * 4);
+  detail::convert_blocks<uint32_t, uint16_t>(
+      src, n, dst,
+      [](uint32_t x) { return detail::float_bits_to_bfloat16(x); });
+}
+
+void fp16_to_float(const uint16_t *src, size_t n, float *dst) {
+  detail::counter_add(detail::g_counters.convert_bytes, uint64_t(n) * 2);
+  detail::convert_blocks<uint16_t, uint32_t>(
+      src, n, dst, [](uint16_t x) { return detail::half_to_float_bits(x); });
+}
+
+void float_to_fp16(const float *src, size_t n, uint16_t *dst) {
+  detail::counter_add(detail::g_counters.convert_bytes, uint64_t(n) * 4);
+  detail::convert_blocks<uint32_t, uint16_t>(
+      src, n, dst, [](uint32_t x) { return detail::float_bits_to_half(x); });
+}
+
 namespace detail {
 
-double from_chars(const char *p) {
-#if defined(MINIJSON_USE_STRTOD)
-  return strtod(p, nullptr);
-#else
-  return simdjson::internal::from_chars(p);
-#endif
+const uint64_t kXXH64Prime1 = 11400714785074694791ull;
+const uint64_t kXXH64Prime2 = 14029467366897019727ull;
+const uint64_t kXXH64Prime3 = 1609587929392839161ull;
+const uint64_t kXXH64Prime4 = 9650029242287828579ull;
+const uint64_t kXXH64Prime5 = 2870177450012600261ull;
+
+inline uint64_t rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+inline uint64_t read_u64le(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return v;
 }
 
-const char *my_strchr(const char *p, int ch) {
-  char c;
+inline uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+  acc += input * kXXH64Prime2;
+  return rotl64(acc, 31) * kXXH64Prime1;
+}
 
-  constexpr uint64_t kMaxCount = 1024ull * 1024ull;  // up to 1M chars
+inline uint64_t xxh64_merge_round(uint64_t acc, uint64_t val) {
+  acc ^= xxh64_round(0, val);
+  return acc * kXXH64Prime1 + kXXH64Prime4;
+}
 
-  uint64_t cnt{0};
+}  // namespace detail
 
-  c = ch;
-  for (;; ++p, cnt++) {
-    if (cnt > kMaxCount) {
-      return nullptr;
-    }
+uint64_t hash_bytes(const uint8_t *data, size_t n, uint64_t seed) {
+  const uint8_t *p = data;
+  const uint8_t *end = data + n;
+  uint64_t h;
+
+  if (n >= 32) {
+    uint64_t v1 = seed + detail::kXXH64Prime1 + detail::kXXH64Prime2;
+    uint64_t v2 = seed + detail::kXXH64Prime2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - detail::kXXH64Prime1;
+    for (; p + 32 <= end; p += 32) {
+      v1 = detail::xxh64_round(v1, detail::read_u64le(p));
+      v2 = detail::xxh64_round(v2, detail::read_u64le(p + 8));
+      v3 = detail::xxh64_round(v3, detail::read_u64le(p + 16));
+      v4 = detail::xxh64_round(v4, detail::read_u64le(p + 24));
+    }
+    h = detail::rotl64(v1, 1) + detail::rotl64(v2, 7) +
+        detail::rotl64(v3, 12) + detail::rotl64(v4, 18);
+    h = detail::xxh64_merge_round(h, v1);
+    h = detail::xxh64_merge_round(h, v2);
+    h = detail::xxh64_merge_round(h, v3);
+    h = detail::xxh64_merge_round(h, v4);
+  } else {
+    h = seed + detail::kXXH64Prime5;
+  }
 
-    if (*p == c) {
-      return (p);
-    }
-    if (*p == '\0') {
-      return (nullptr);
-    }
+  h += uint64_t(n);
+
+  for (; p + 8 <= end; p += 8) {
+    h ^= detail::xxh64_round(0, detail::read_u64le(p));
+    h = detail::rotl64(h, 27) * detail::kXXH64Prime1 + detail::kXXH64Prime4;
   }
+  if (p + 4 <= end) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    h ^= uint64_t(v) * detail::kXXH64Prime1;
+    h = detail::rotl64(h, 23) * detail::kXXH64Prime2 + detail::kXXH64Prime3;
+    p += 4;
+  }
+  for (; p < end; p++) {
+    h ^= uint64_t(*p) * detail::kXXH64Prime5;
+    h = detail::rotl64(h, 11) * detail::kXXH64Prime1;
+  }
+
+  h ^= h >> 33;
+  h *= detail::kXXH64Prime2;
+  h ^= h >> 29;
+  h *= detail::kXXH64Prime3;
+  h ^= h >> 32;
+  return h;
+}
+
+namespace detail {
+
+std::string to_hex64(uint64_t v) {
+  char buf[17];
+  snprintf(buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(v));
+  return buf;
 }
 
 }  // namespace detail
-}  // namespace minijson
 
-#if !defined(MINIJSON_USE_STRTOD)
+size_t get_dtype_bytes(const safetensors::dtype dtype) {
+  size_t sz = 0;
 
-#include <cstring>
-#include <limits>
+  switch (dtype) {
+    case safetensors::dtype::kBOOL:
+      // Original Rust implementaion uses 1.
+      sz = 1;
+      break;
+    case safetensors::dtype::kUINT8:
+      sz = 1;
+      break;
+    case safetensors::dtype::kINT8:
+      sz = 1;
+      break;
+    case safetensors::dtype::kUINT16:
+      sz = 2;
+      break;
+    case safetensors::dtype::kINT16:
+      sz = 2;
+      break;
+    case safetensors::dtype::kINT32:
+      sz = 4;
+      break;
+    case safetensors::dtype::kUINT32:
+      sz = 4;
+      break;
+    case safetensors::dtype::kFLOAT16:
+      sz = 2;
+      break;
+    case safetensors::dtype::kBFLOAT16:
+      sz = 2;
+      break;
+    case safetensors::dtype::kFLOAT32:
+      sz = 4;
+      break;
+    case safetensors::dtype::kFLOAT64:
+      sz = 8;
+      break;
+    case safetensors::dtype::kINT64:
+      sz = 8;
+      break;
+    case safetensors::dtype::kUINT64:
+      sz = 8;
+      break;
+  }
 
-namespace minijson {
-namespace simdjson {
-namespace internal {
+  return sz;
+}
 
-/**
- * The code in the internal::from_chars function is meant to handle the
- *floating-point number parsing when we have more than 19 digits in the decimal
- *mantissa. This should only be seen in adversarial scenarios: we do not expect
- *production systems to even produce such floating-point numbers.
- *
- * The parser is based on work by Nigel Tao (at
- *https://github.com/google/wuffs/) who credits Ken Thompson for the design (via
- *a reference to the Go source code). See
- * https://github.com/google/wuffs/blob/aa46859ea40c72516deffa1b146121952d6dfd3b/internal/cgen/base/floatconv-submodule-data.c
- * https://github.com/google/wuffs/blob/46cd8105f47ca07ae2ba8e6a7818ef9c0df6c152/internal/cgen/base/floatconv-submodule-code.c
- * It is probably not very fast but it is a fallback that should almost never be
- * called in real life. Google Wuffs is published under APL 2.0.
- **/
+std::string get_dtype_str(const safetensors::dtype dtype) {
+  switch (dtype) {
+    case safetensors::dtype::kBOOL:
+      return "BOOL";
+    case safetensors::dtype::kUINT8:
+      return "U8";
+    case safetensors::dtype::kINT8:
+      return "I8";
+    case safetensors::dtype::kUINT16:
+      return "U16";
+    case safetensors::dtype::kINT16:
+      return "I16";
+    case safetensors::dtype::kINT32:
+      return "I32";
+    case safetensors::dtype::kUINT32:
+      return "U32";
+    case safetensors::dtype::kFLOAT16:
+      return "F16";
+    case safetensors::dtype::kBFLOAT16:
+      return "BF16";
+    case safetensors::dtype::kFLOAT32:
+      return "F32";
+    case safetensors::dtype::kFLOAT64:
+      return "F64";
+    case safetensors::dtype::kINT64:
+      return "I64";
+    case safetensors::dtype::kUINT64:
+      return "U64";
+  }
+  return "???";
+}
 
-namespace {
-constexpr uint32_t max_digits = 768;
-constexpr int32_t decimal_point_range = 2047;
-}  // namespace
+// Empty Tensor returns 0.
+// Zero-rank Tensor reuturns 1(scalar)
+size_t get_shape_size(const tensor_t &t) {
+  if (t.shape.empty()) {
+    return 1;
+  }
 
-struct adjusted_mantissa {
-  uint64_t mantissa;
-  int power2;
-  adjusted_mantissa() : mantissa(0), power2(0) {}
-};
+  if (t.shape.size() >= kMaxDim) {  // invalid ndim
+    return 0;
+  }
 
-struct decimal {
-  uint32_t num_digits;
-  int32_t decimal_point;
-  bool negative;
-  bool truncated;
-  uint8_t digits[max_digits];
-};
+  size_t sz = 1;
 
-template <typename T>
-struct binary_format {
-  static constexpr int mantissa_explicit_bits();
-  static constexpr int minimum_exponent();
-  static constexpr int infinite_power();
-  static constexpr int sign_index();
-};
+  for (size_t i = 0; i < t.shape.size(); i++) {
+    sz *= t.shape[i];
+  }
 
-template <>
-constexpr int binary_format<double>::mantissa_explicit_bits() {
-  return 52;
+  return sz;
 }
 
-template <>
-constexpr int binary_format<double>::minimum_exponent() {
-  return -1023;
-}
-template <>
-constexpr int binary_format<double>::infinite_power() {
-  return 0x7FF;
-}
+bool validate_data_offsets(const safetensors_t &st, std::string &err) {
+  SAFETENSORS_CPP_STATS_ENTRY();
+  SAFETENSORS_CPP_STATS_PHASE(validate_seconds);
 
-template <>
-constexpr int binary_format<double>::sign_index() {
-  return 63;
-}
+  bool valid{true};
 
-inline bool is_integer(char c) noexcept { return (c >= '0' && c <= '9'); }
+  std::stringstream ss;
 
-// This should always succeed since it follows a call to parse_number.
-static decimal parse_decimal(const char *&p) noexcept {
-  decimal answer;
-  answer.num_digits = 0;
-  answer.decimal_point = 0;
-  answer.truncated = false;
-  answer.negative = (*p == '-');
-  if ((*p == '-') || (*p == '+')) {
-    ++p;
+  size_t databuffersize;
+  if (st.mmaped) {
+    databuffersize = st.databuffer_size;
+  } else {
+    databuffersize = st.storage.size();
   }
 
-  while (*p == '0') {
-    ++p;
-  }
-  while (is_integer(*p)) {
-    if (answer.num_digits < max_digits) {
-      answer.digits[answer.num_digits] = uint8_t(*p - '0');
+  size_t ntensors{0};
+  // Iterate with key insertion order.
+  for (size_t i =0 ;i < st.tensors.size(); i++) {
+
+    std::string key = st.tensors.keys()[i];
+
+    tensor_t tensor;
+    if (!st.tensors.at(i, &tensor)) {
+      ss << "Internal error: Failed to get tensor at [" << i << "]\n";
+      valid = false;
+      continue;
     }
-    answer.num_digits++;
-    ++p;
-  }
-  if (*p == '.') {
-    ++p;
-    const char *first_after_period = p;
-    // if we have not yet encountered a zero, we have to skip it as well
-    if (answer.num_digits == 0) {
-      // skip zeros
-      while (*p == '0') {
-        ++p;
-      }
+
+    if (tensor.data_offsets[0] > tensor.data_offsets[1]) {
+      ss << key << ".data_offsets.BEGIN " << tensor.data_offsets[0]
+         << " must be less than or equal to data_offsets.END "
+         << tensor.data_offsets[1] << "\n";
+      valid = false;
     }
-    while (is_integer(*p)) {
-      if (answer.num_digits < max_digits) {
-        answer.digits[answer.num_digits] = uint8_t(*p - '0');
-      }
-      answer.num_digits++;
-      ++p;
+
+    size_t tensor_size = get_dtype_bytes(tensor.dtype) * get_shape_size(tensor);
+
+    if (tensor_size == 0) {
+      // OK
+      continue;
     }
-    answer.decimal_point = int32_t(first_after_period - p);
-  }
-  if (answer.num_digits > 0) {
-    const char *preverse = p - 1;
-    int32_t trailing_zeros = 0;
-    while ((*preverse == '0') || (*preverse == '.')) {
-      if (*preverse == '0') {
-        trailing_zeros++;
-      }
-      --preverse;
+
+    // data_offsets are absolute offset from the databuffer(file)
+    if (tensor.data_offsets[0] > databuffersize) {
+      ss << "Tensor `" << key << "`.data_offset.BEGIN "
+         << tensor.data_offsets[0] << " exceeds databuffer size "
+         << databuffersize << ".\n";
+      valid = false;
     }
-    answer.decimal_point += int32_t(answer.num_digits);
-    answer.num_digits -= uint32_t(trailing_zeros);
-  }
-  if (answer.num_digits > max_digits) {
-    answer.num_digits = max_digits;
-    answer.truncated = true;
-  }
-  if (('e' == *p) || ('E' == *p)) {
-    ++p;
-    bool neg_exp = false;
-    if ('-' == *p) {
-      neg_exp = true;
-      ++p;
-    } else if ('+' == *p) {
-      ++p;
+
+    if (tensor.data_offsets[1] > databuffersize) {
+      ss << "Tensor `" << key << "`.data_offset.END "
+         << tensor.data_offsets[1] << " exceeds databuffer size "
+         << databuffersize << ".\n";
+      valid = false;
     }
-    int32_t exp_number = 0;  // exponential part
-    while (is_integer(*p)) {
-      uint8_t digit = uint8_t(*p - '0');
-      if (exp_number < 0x10000) {
-        exp_number = 10 * exp_number + digit;
+
+    size_t data_size = tensor.data_offsets[1] - tensor.data_offsets[0];
+
+    if (tensor_size != data_size) {
+      ss << "Data size mismatch. The size in Tensor `" << key << "` is "
+         << tensor_size << ", but the size from data_offsets is " << data_size
+         << "\n";
+      valid = false;
+    }
+
+    ntensors++;
+    if (ntensors == st.tensors.size()) {
+      // Last element's data_offsets[1] must be equal to databuffer size.
+      if (tensor.data_offsets[1] != databuffersize) {
+        ss << "The last tensor's data_offset.END(" << tensor.data_offsets[1]
+           << ") must be equal to databufer size " << databuffersize << ".\n";
+        valid = false;
       }
-      ++p;
     }
-    answer.decimal_point += (neg_exp ? -exp_number : exp_number);
   }
-  return answer;
-}
 
-// This should always succeed since it follows a call to parse_number.
-// Will not read at or beyond the "end" pointer.
-static decimal parse_decimal(const char *&p, const char *end) noexcept {
-  decimal answer;
-  answer.num_digits = 0;
-  answer.decimal_point = 0;
-  answer.truncated = false;
-  if (p == end) {
-    return answer;
-  }  // should never happen
-  answer.negative = (*p == '-');
-  if ((*p == '-') || (*p == '+')) {
-    ++p;
+  if (!valid) {
+    err = ss.str();
   }
 
-  while ((p != end) && (*p == '0')) {
-    ++p;
-  }
-  while ((p != end) && is_integer(*p)) {
-    if (answer.num_digits < max_digits) {
-      answer.digits[answer.num_digits] = uint8_t(*p - '0');
-    }
-    answer.num_digits++;
-    ++p;
-  }
-  if ((p != end) && (*p == '.')) {
-    ++p;
-    if (p == end) {
-      return answer;
-    }  // should never happen
-    const char *first_after_period = p;
-    // if we have not yet encountered a zero, we have to skip it as well
-    if (answer.num_digits == 0) {
-      // skip zeros
-      while (*p == '0') {
-        ++p;
-      }
-    }
-    while ((p != end) && is_integer(*p)) {
-      if (answer.num_digits < max_digits) {
-        answer.digits[answer.num_digits] = uint8_t(*p - '0');
+  return valid;
+}
+
+namespace detail {
+
+//
+// Serialize header JSON of `st`(without trailing padding).
+//
+bool serialize_header(const safetensors_t &st, std::string *header_str,
+                      std::string *err) {
+  SAFETENSORS_CPP_STATS_PHASE(serialize_seconds);
+
+  // directly serialize JSON string.
+  std::stringstream ss;
+
+  // NOTE: The last offset **must** be the end of the file,
+  // so write __metadata__ first(if metadata part exists)
+
+  ss << "{";
+  if (st.metadata.size()) {
+    ss << "\"__metadata__\": {";
+    size_t nmeta = 0;
+    for (size_t i = 0; i < st.metadata.size(); i++) {
+      std::string key = st.metadata.keys()[i];
+      std::string value;
+      st.metadata.at(i, &value);
+
+      if (nmeta > 0) {
+        ss << ", ";
       }
-      answer.num_digits++;
-      ++p;
+      ss << "\"" + key + "\": \"" << value << "\"";
+      nmeta++;
     }
-    answer.decimal_point = int32_t(first_after_period - p);
-  }
-  if (answer.num_digits > 0) {
-    const char *preverse = p - 1;
-    int32_t trailing_zeros = 0;
-    while ((*preverse == '0') || (*preverse == '.')) {
-      if (*preverse == '0') {
-        trailing_zeros++;
-      }
-      --preverse;
+    ss << "}";
+
+    if (st.tensors.size()) {
+      ss << ", ";
     }
-    answer.decimal_point += int32_t(answer.num_digits);
-    answer.num_digits -= uint32_t(trailing_zeros);
-  }
-  if (answer.num_digits > max_digits) {
-    answer.num_digits = max_digits;
-    answer.truncated = true;
   }
-  if ((p != end) && (('e' == *p) || ('E' == *p))) {
-    ++p;
-    if (p == end) {
-      return answer;
-    }  // should never happen
-    bool neg_exp = false;
-    if ('-' == *p) {
-      neg_exp = true;
-      ++p;
-    } else if ('+' == *p) {
-      ++p;
-    }
-    int32_t exp_number = 0;  // exponential part
-    while ((p != end) && is_integer(*p)) {
-      uint8_t digit = uint8_t(*p - '0');
-      if (exp_number < 0x10000) {
-        exp_number = 10 * exp_number + digit;
+
+  size_t ntensors = 0;
+  {
+    for (size_t i = 0; i < st.tensors.size(); i++) {
+
+      std::string key = st.tensors.keys()[i];
+      safetensors::tensor_t tensor;
+      st.tensors.at(i, &tensor);
+
+      if (tensor.shape.size() > safetensors::kMaxDim) {
+        if (err) {
+          (*err) += key + ".shape is too large.\n";
+        }
+        return false;
       }
-      ++p;
+
+      if (ntensors > 0) {
+        ss << ", ";
+      }
+      ss << "\"" << key << "\": {";
+      ss << "\"dtype\": \"" << safetensors::get_dtype_str(tensor.dtype)
+         << "\", ";
+      ss << "\"shape\": [";
+      for (size_t i = 0; i < tensor.shape.size(); i++) {
+        if (i > 0) {
+          ss << ", ";
+        }
+        ss << tensor.shape[i];
+      }
+      ss << "]";
+      ss << ", \"data_offsets\": [" << tensor.data_offsets[0] << ", "
+         << tensor.data_offsets[1] << "]";
+      ss << "}";
+      ntensors++;
     }
-    answer.decimal_point += (neg_exp ? -exp_number : exp_number);
   }
-  return answer;
-}
+  ss << "}";
 
-namespace {
+  (*header_str) = ss.str();
 
-// remove all final zeroes
-inline void trim(decimal &h) {
-  while ((h.num_digits > 0) && (h.digits[h.num_digits - 1] == 0)) {
-    h.num_digits--;
-  }
+  return true;
 }
 
-uint32_t number_of_digits_decimal_left_shift(decimal &h, uint32_t shift) {
-  shift &= 63;
-  const static uint16_t number_of_digits_decimal_left_shift_table[65] = {
-      0x0000, 0x0800, 0x0801, 0x0803, 0x1006, 0x1009, 0x100D, 0x1812, 0x1817,
-      0x181D, 0x2024, 0x202B, 0x2033, 0x203C, 0x2846, 0x2850, 0x285B, 0x3067,
-      0x3073, 0x3080, 0x388E, 0x389C, 0x38AB, 0x38BB, 0x40CC, 0x40DD, 0x40EF,
-      0x4902, 0x4915, 0x4929, 0x513E, 0x5153, 0x5169, 0x5180, 0x5998, 0x59B0,
-      0x59C9, 0x61E3, 0x61FD, 0x6218, 0x6A34, 0x6A50, 0x6A6D, 0x6A8B, 0x72AA,
-      0x72C9, 0x72E9, 0x7B0A, 0x7B2B, 0x7B4D, 0x8370, 0x8393, 0x83B7, 0x83DC,
-      0x8C02, 0x8C28, 0x8C4F, 0x9477, 0x949F, 0x94C8, 0x9CF2, 0x051C, 0x051C,
-      0x051C, 0x051C,
-  };
-  uint32_t x_a = number_of_digits_decimal_left_shift_table[shift];
-  uint32_t x_b = number_of_digits_decimal_left_shift_table[shift + 1];
-  uint32_t num_new_digits = x_a >> 11;
-  uint32_t pow5_a = 0x7FF & x_a;
-  uint32_t pow5_b = 0x7FF & x_b;
-  const static uint8_t
-      number_of_digits_decimal_left_shift_table_powers_of_5[0x051C] = {
-          5, 2, 5, 1, 2, 5, 6, 2, 5, 3, 1, 2, 5, 1, 5, 6, 2, 5, 7, 8, 1, 2, 5,
-          3, 9, 0, 6, 2, 5, 1, 9, 5, 3, 1, 2, 5, 9, 7, 6, 5, 6, 2, 5, 4, 8, 8,
-          2, 8, 1, 2, 5, 2, 4, 4, 1, 4, 0, 6, 2, 5, 1, 2, 2, 0, 7, 0, 3, 1, 2,
-          5, 6, 1, 0, 3, 5, 1, 5, 6, 2, 5, 3, 0, 5, 1, 7, 5, 7, 8, 1, 2, 5, 1,
-          5, 2, 5, 8, 7, 8, 9, 0, 6, 2, 5, 7, 6, 2, 9, 3, 9, 4, 5, 3, 1, 2, 5,
-          3, 8, 1, 4, 6, 9, 7, 2, 6, 5, 6, 2, 5, 1, 9, 0, 7, 3, 4, 8, 6, 3, 2,
-          8, 1, 2, 5, 9, 5, 3, 6, 7, 4, 3, 1, 6, 4, 0, 6, 2, 5, 4, 7, 6, 8, 3,
-          7, 1, 5, 8, 2, 0, 3, 1, 2, 5, 2, 3, 8, 4, 1, 8, 5, 7, 9, 1, 0, 1, 5,
-          6, 2, 5, 1, 1, 9, 2, 0, 9, 2, 8, 9, 5, 5, 0, 7, 8, 1, 2, 5, 5, 9, 6,
-          0, 4, 6, 4, 4, 7, 7, 5, 3, 9, 0, 6, 2, 5, 2, 9, 8, 0, 2, 3, 2, 2, 3,
-          8, 7, 6, 9, 5, 3, 1, 2, 5, 1, 4, 9, 0, 1, 1, 6, 1, 1, 9, 3, 8, 4, 7,
-          6, 5, 6, 2, 5, 7, 4, 5, 0, 5, 8, 0, 5, 9, 6, 9, 2, 3, 8, 2, 8, 1, 2,
-          5, 3, 7, 2, 5, 2, 9, 0, 2, 9, 8, 4, 6, 1, 9, 1, 4, 0, 6, 2, 5, 1, 8,
-          6, 2, 6, 4, 5, 1, 4, 9, 2, 3, 0, 9, 5, 7, 0, 3, 1, 2, 5, 9, 3, 1, 3,
-          2, 2, 5, 7, 4, 6, 1, 5, 4, 7, 8, 5, 1, 5, 6, 2, 5, 4, 6, 5, 6, 6, 1,
-          2, 8, 7, 3, 0, 7, 7, 3, 9, 2, 5, 7, 8, 1, 2, 5, 2, 3, 2, 8, 3, 0, 6,
-          4, 3, 6, 5, 3, 8, 6, 9, 6, 2, 8, 9, 0, 6, 2, 5, 1, 1, 6, 4, 1, 5, 3,
-          2, 1, 8, 2, 6, 9, 3, 4, 8, 1, 4, 4, 5, 3, 1, 2, 5, 5, 8, 2, 0, 7, 6,
-          6, 0, 9, 1, 3, 4, 6, 7, 4, 0, 7, 2, 2, 6, 5, 6, 2, 5, 2, 9, 1, 0, 3,
-          8, 3, 0, 4, 5, 6, 7, 3, 3, 7, 0, 3, 6, 1, 3, 2, 8, 1, 2, 5, 1, 4, 5,
-          5, 1, 9, 1, 5, 2, 2, 8, 3, 6, 6, 8, 5, 1, 8, 0, 6, 6, 4, 0, 6, 2, 5,
-          7, 2, 7, 5, 9, 5, 7, 6, 1, 4, 1, 8, 3, 4, 2, 5, 9, 0, 3, 3, 2, 0, 3,
-          1, 2, 5, 3, 6, 3, 7, 9, 7, 8, 8, 0, 7, 0, 9, 1, 7, 1, 2, 9, 5, 1, 6,
-          6, 0, 1, 5, 6, 2, 5, 1, 8, 1, 8, 9, 8, 9, 4, 0, 3, 5, 4, 5, 8, 5, 6,
-          4, 7, 5, 8, 3, 0, 0, 7, 8, 1, 2, 5, 9, 0, 9, 4, 9, 4, 7, 0, 1, 7, 7,
-          2, 9, 2, 8, 2, 3, 7, 9, 1, 5, 0, 3, 9, 0, 6, 2, 5, 4, 5, 4, 7, 4, 7,
-          3, 5, 0, 8, 8, 6, 4, 6, 4, 1, 1, 8, 9, 5, 7, 5, 1, 9, 5, 3, 1, 2, 5,
-          2, 2, 7, 3, 7, 3, 6, 7, 5, 4, 4, 3, 2, 3, 2, 0, 5, 9, 4, 7, 8, 7, 5,
-          9, 7, 6, 5, 6, 2, 5, 1, 1, 3, 6, 8, 6, 8, 3, 7, 7, 2, 1, 6, 1, 6, 0,
-          2, 9, 7, 3, 9, 3, 7, 9, 8, 8, 2, 8, 1, 2, 5, 5, 6, 8, 4, 3, 4, 1, 8,
-          8, 6, 0, 8, 0, 8, 0, 1, 4, 8, 6, 9, 6, 8, 9, 9, 4, 1, 4, 0, 6, 2, 5,
-          2, 8, 4, 2, 1, 7, 0, 9, 4, 3, 0, 4, 0, 4, 0, 0, 7, 4, 3, 4, 8, 4, 4,
-          9, 7, 0, 7, 0, 3, 1, 2, 5, 1, 4, 2, 1, 0, 8, 5, 4, 7, 1, 5, 2, 0, 2,
-          0, 0, 3, 7, 1, 7, 4, 2, 2, 4, 8, 5, 3, 5, 1, 5, 6, 2, 5, 7, 1, 0, 5,
-          4, 2, 7, 3, 5, 7, 6, 0, 1, 0, 0, 1, 8, 5, 8, 7, 1, 1, 2, 4, 2, 6, 7,
-          5, 7, 8, 1, 2, 5, 3, 5, 5, 2, 7, 1, 3, 6, 7, 8, 8, 0, 0, 5, 0, 0, 9,
-          2, 9, 3, 5, 5, 6, 2, 1, 3, 3, 7, 8, 9, 0, 6, 2, 5, 1, 7, 7, 6, 3, 5,
-          6, 8, 3, 9, 4, 0, 0, 2, 5, 0, 4, 6, 4, 6, 7, 7, 8, 1, 0, 6, 6, 8, 9,
-          4, 5, 3, 1, 2, 5, 8, 8, 8, 1, 7, 8, 4, 1, 9, 7, 0, 0, 1, 2, 5, 2, 3,
-          2, 3, 3, 8, 9, 0, 5, 3, 3, 4, 4, 7, 2, 6, 5, 6, 2, 5, 4, 4, 4, 0, 8,
-          9, 2, 0, 9, 8, 5, 0, 0, 6, 2, 6, 1, 6, 1, 6, 9, 4, 5, 2, 6, 6, 7, 2,
-          3, 6, 3, 2, 8, 1, 2, 5, 2, 2, 2, 0, 4, 4, 6, 0, 4, 9, 2, 5, 0, 3, 1,
-          3, 0, 8, 0, 8, 4, 7, 2, 6, 3, 3, 3, 6, 1, 8, 1, 6, 4, 0, 6, 2, 5, 1,
-          1, 1, 0, 2, 2, 3, 0, 2, 4, 6, 2, 5, 1, 5, 6, 5, 4, 0, 4, 2, 3, 6, 3,
-          1, 6, 6, 8, 0, 9, 0, 8, 2, 0, 3, 1, 2, 5, 5, 5, 5, 1, 1, 1, 5, 1, 2,
-          3, 1, 2, 5, 7, 8, 2, 7, 0, 2, 1, 1, 8, 1, 5, 8, 3, 4, 0, 4, 5, 4, 1,
-          0, 1, 5, 6, 2, 5, 2, 7, 7, 5, 5, 5, 7, 5, 6, 1, 5, 6, 2, 8, 9, 1, 3,
-          5, 1, 0, 5, 9, 0, 7, 9, 1, 7, 0, 2, 2, 7, 0, 5, 0, 7, 8, 1, 2, 5, 1,
-          3, 8, 7, 7, 7, 8, 7, 8, 0, 7, 8, 1, 4, 4, 5, 6, 7, 5, 5, 2, 9, 5, 3,
-          9, 5, 8, 5, 1, 1, 3, 5, 2, 5, 3, 9, 0, 6, 2, 5, 6, 9, 3, 8, 8, 9, 3,
-          9, 0, 3, 9, 0, 7, 2, 2, 8, 3, 7, 7, 6, 4, 7, 6, 9, 7, 9, 2, 5, 5, 6,
-          7, 6, 2, 6, 9, 5, 3, 1, 2, 5, 3, 4, 6, 9, 4, 4, 6, 9, 5, 1, 9, 5, 3,
-          6, 1, 4, 1, 8, 8, 8, 2, 3, 8, 4, 8, 9, 6, 2, 7, 8, 3, 8, 1, 3, 4, 7,
-          6, 5, 6, 2, 5, 1, 7, 3, 4, 7, 2, 3, 4, 7, 5, 9, 7, 6, 8, 0, 7, 0, 9,
-          4, 4, 1, 1, 9, 2, 4, 4, 8, 1, 3, 9, 1, 9, 0, 6, 7, 3, 8, 2, 8, 1, 2,
-          5, 8, 6, 7, 3, 6, 1, 7, 3, 7, 9, 8, 8, 4, 0, 3, 5, 4, 7, 2, 0, 5, 9,
-          6, 2, 2, 4, 0, 6, 9, 5, 9, 5, 3, 3, 6, 9, 1, 4, 0, 6, 2, 5,
-      };
-  const uint8_t *pow5 =
-      &number_of_digits_decimal_left_shift_table_powers_of_5[pow5_a];
-  uint32_t i = 0;
-  uint32_t n = pow5_b - pow5_a;
-  for (; i < n; i++) {
-    if (i >= h.num_digits) {
-      return num_new_digits - 1;
-    } else if (h.digits[i] == pow5[i]) {
-      continue;
-    } else if (h.digits[i] < pow5[i]) {
-      return num_new_digits - 1;
-    } else {
-      return num_new_digits;
-    }
+// Header size padded so that databuffer starts from the multiple of 8.
+size_t get_padded_header_size(size_t header_size) {
+  size_t pad_bytes = 0;
+  if ((header_size % 8) != 0) {
+    pad_bytes = 8 - (header_size % 8);
   }
-  return num_new_digits;
+  return header_size + pad_bytes;
 }
 
-}  // end of anonymous namespace
+// Write 8byte header_size + header JSON + padding to `dst`.
+// `dst` must have `8 + get_padded_header_size(header_str.size())` bytes.
+void write_header(const std::string &header_str, uint8_t *dst) {
+  uint64_t header_size = header_str.size();  // do not include '\n'
+  uint64_t padded_header_size = get_padded_header_size(header_size);
 
-static uint64_t round(decimal &h) {
-  if ((h.num_digits == 0) || (h.decimal_point < 0)) {
-    return 0;
-  } else if (h.decimal_point > 18) {
-    return UINT64_MAX;
+  // write padded header_size
+  memcpy(dst, &padded_header_size, 8);
+
+  // write header
+  memcpy(dst + 8, header_str.data(), header_size);
+
+  // Use whitespace for trailing padding.
+  memset(dst + 8 + header_size, 0x20, padded_header_size - header_size);
+}
+
+}  // namespace detail
+
+bool save_to_memory(const safetensors_t &st, std::vector<uint8_t> *dst,
+                    std::string *warn, std::string *err) {
+  SAFETENSORS_CPP_STATS_ENTRY();
+  detail::progress_scope progress("save_to_memory");
+
+  std::string _err;
+  if (!validate_data_offsets(st, _err)) {
+    if (err) {
+      (*err) += "Invalid safensors is provided.\n";
+      (*err) += _err;
+    }
+    return false;
   }
-  // at this point, we know that h.decimal_point >= 0
-  uint32_t dp = uint32_t(h.decimal_point);
-  uint64_t n = 0;
-  for (uint32_t i = 0; i < dp; i++) {
-    n = (10 * n) + ((i < h.num_digits) ? h.digits[i] : 0);
+
+  std::string header_str;
+  if (!detail::serialize_header(st, &header_str, err)) {
+    return false;
   }
-  bool round_up = false;
-  if (dp < h.num_digits) {
-    round_up = h.digits[dp] >= 5;  // normally, we round up
-    // but we may need to round to even!
-    if ((h.digits[dp] == 5) && (dp + 1 == h.num_digits)) {
-      round_up = h.truncated || ((dp > 0) && (1 & h.digits[dp - 1]));
-    }
+
+  const void *databuffer_addr{nullptr};
+  size_t databuffer_size{0};
+  if (st.mmaped) {
+    databuffer_size = st.databuffer_size;
+    databuffer_addr = st.databuffer_addr;
+  } else {
+    databuffer_size = st.storage.size();
+    databuffer_addr = reinterpret_cast<const void *>(st.storage.data());
   }
-  if (round_up) {
-    n++;
+
+  SAFETENSORS_CPP_STATS_PHASE(data_seconds);
+
+  // make databuffer addr start from the multiple of 8.
+  size_t padded_header_size = detail::get_padded_header_size(header_str.size());
+  dst->resize(8 + padded_header_size + databuffer_size);
+
+  detail::write_header(header_str, dst->data());
+
+  progress.info.bytes_total = databuffer_size;
+  progress.set_tensors(&st);
+  uint8_t *data_dst = dst->data() + 8 + padded_header_size;
+  bool ok = detail::process_chunked(
+      &progress, databuffer_size, 0, err, [&](size_t offset, size_t len) {
+        memcpy(data_dst + offset,
+               reinterpret_cast<const uint8_t *>(databuffer_addr) + offset,
+               len);
+        return true;
+      });
+  if (!ok) {
+    std::vector<uint8_t>().swap(*dst);
+    return false;
   }
-  return n;
+  SAFETENSORS_CPP_STATS_ADD(bytes_copied, dst->size());
+
+  return true;
 }
 
-// computes h * 2^-shift
-static void decimal_left_shift(decimal &h, uint32_t shift) {
-  if (h.num_digits == 0) {
-    return;
-  }
-  uint32_t num_new_digits = number_of_digits_decimal_left_shift(h, shift);
-  int32_t read_index = int32_t(h.num_digits - 1);
-  uint32_t write_index = h.num_digits - 1 + num_new_digits;
-  uint64_t n = 0;
+bool save_to_file(const safetensors_t &st, const std::string &filename,
+                  std::string *warn, std::string *err) {
+  SAFETENSORS_CPP_STATS_ENTRY();
+  detail::progress_scope progress("save_to_file");
 
-  while (read_index >= 0) {
-    n += uint64_t(h.digits[read_index]) << shift;
-    uint64_t quotient = n / 10;
-    uint64_t remainder = n - (10 * quotient);
-    if (write_index < max_digits) {
-      h.digits[write_index] = uint8_t(remainder);
-    } else if (remainder > 0) {
-      h.truncated = true;
+  // TODO: Use more reliable io.
+  SAFETENSORS_CPP_STATS_TIMER_START(open_timer);
+  std::ofstream ofs(filename, std::ios::binary);
+  SAFETENSORS_CPP_STATS_TIMER_STOP(open_timer, open_seconds);
+  SAFETENSORS_CPP_STATS_ADD(syscalls, 1);
+
+  if (!ofs) {
+    if (err) {
+      (*err) += "Failed to open `" + filename +
+                "` to write. File is either existing directory or "
+                "write-protected, or disk is full?\n";
     }
-    n = quotient;
-    write_index--;
-    read_index--;
+    return false;
   }
-  while (n > 0) {
-    uint64_t quotient = n / 10;
-    uint64_t remainder = n - (10 * quotient);
-    if (write_index < max_digits) {
-      h.digits[write_index] = uint8_t(remainder);
-    } else if (remainder > 0) {
-      h.truncated = true;
+
+  std::vector<uint8_t> buf;
+  if (!save_to_memory(st, &buf, warn, err)) {
+    return false;
+  }
+
+  {
+    SAFETENSORS_CPP_STATS_PHASE(write_seconds);
+    size_t databuffer_size{0};
+    detail::get_databuffer(st, &databuffer_size);
+    progress.info.bytes_total = buf.size();
+    progress.set_tensors(&st);
+    bool ok = detail::process_chunked(
+        &progress, buf.size(), buf.size() - databuffer_size, err,
+        [&](size_t offset, size_t len) {
+          ofs.write(reinterpret_cast<const char *>(buf.data() + offset),
+                    std::streamsize(len));
+          return bool(ofs);
+        });
+    ofs.flush();
+    if (!ok && progress.cancelled) {
+      ofs.close();
+      std::remove(filename.c_str());
+      return false;
     }
-    n = quotient;
-    write_index--;
   }
-  h.num_digits += num_new_digits;
-  if (h.num_digits > max_digits) {
-    h.num_digits = max_digits;
+  SAFETENSORS_CPP_STATS_ADD(syscalls, 1);
+  SAFETENSORS_CPP_STATS_ADD(bytes_written, buf.size());
+  detail::counter_add(detail::g_counters.files_opened, 1);
+  detail::counter_add(detail::g_counters.bytes_written, buf.size());
+  if (!ofs) {
+    if (err) {
+      (*err) += "Failed to write safetensor data to `" + filename +
+                "`. Maybe no disk space available?(Required bytes : " +
+                std::to_string(buf.size()) + "\n";
+    }
+    return false;
   }
-  h.decimal_point += int32_t(num_new_digits);
-  trim(h);
+
+  return true;
 }
 
-// computes h * 2^shift
-static void decimal_right_shift(decimal &h, uint32_t shift) {
-  uint32_t read_index = 0;
-  uint32_t write_index = 0;
+#if defined(__linux__) && defined(MFD_ALLOW_SEALING) && defined(F_ADD_SEALS)
+#define SAFETENSORS_CPP_HAS_MEMFD
+#endif
 
-  uint64_t n = 0;
+bool export_to_memfd(const safetensors_t &st, const std::string &name,
+                     int *fd, std::string *warn, std::string *err) {
+#if defined(SAFETENSORS_CPP_HAS_MEMFD)
+  (void)warn;
+  if (!fd) {
+    return false;
+  }
 
-  while ((n >> shift) == 0) {
-    if (read_index < h.num_digits) {
-      n = (10 * n) + h.digits[read_index++];
-    } else if (n == 0) {
-      return;
-    } else {
-      while ((n >> shift) == 0) {
-        n = 10 * n;
-        read_index++;
-      }
-      break;
+  SAFETENSORS_CPP_STATS_ENTRY();
+  detail::progress_scope progress("export_to_memfd");
+
+  std::string _err;
+  if (!validate_data_offsets(st, _err)) {
+    if (err) {
+      (*err) += "Invalid safensors is provided.\n";
+      (*err) += _err;
     }
+    return false;
   }
-  h.decimal_point -= int32_t(read_index - 1);
-  if (h.decimal_point < -decimal_point_range) {  // it is zero
-    h.num_digits = 0;
-    h.decimal_point = 0;
-    h.negative = false;
-    h.truncated = false;
-    return;
+
+  std::string header_str;
+  if (!detail::serialize_header(st, &header_str, err)) {
+    return false;
   }
-  uint64_t mask = (uint64_t(1) << shift) - 1;
-  while (read_index < h.num_digits) {
-    uint8_t new_digit = uint8_t(n >> shift);
-    n = (10 * (n & mask)) + h.digits[read_index++];
-    h.digits[write_index++] = new_digit;
+
+  size_t databuffer_size{0};
+  const uint8_t *databuffer = detail::get_databuffer(st, &databuffer_size);
+  size_t header_bytes = 8 + detail::get_padded_header_size(header_str.size());
+  size_t total = header_bytes + databuffer_size;
+
+  int mfd = memfd_create(name.c_str(), MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (mfd < 0) {
+    if (err) {
+      (*err) += "memfd_create failed: " + detail::errno_str(errno) + "\n";
+    }
+    return false;
   }
-  while (n > 0) {
-    uint8_t new_digit = uint8_t(n >> shift);
-    n = 10 * (n & mask);
-    if (write_index < max_digits) {
-      h.digits[write_index++] = new_digit;
-    } else if (new_digit > 0) {
-      h.truncated = true;
+
+  if (ftruncate(mfd, off_t(total)) != 0) {
+    if (err) {
+      (*err) += "ftruncate failed: " + detail::errno_str(errno) + "\n";
     }
+    ::close(mfd);
+    return false;
   }
-  h.num_digits = write_index;
-  trim(h);
-}
 
-template <typename binary>
-adjusted_mantissa compute_float(decimal &d) {
-  adjusted_mantissa answer;
-  if (d.num_digits == 0) {
-    // should be zero
-    answer.power2 = 0;
-    answer.mantissa = 0;
-    return answer;
+  void *addr =
+      mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED, mfd, 0);
+  if (addr == MAP_FAILED) {
+    if (err) {
+      (*err) += "mmap failed: " + detail::errno_str(errno) + "\n";
+    }
+    ::close(mfd);
+    return false;
   }
-  // At this point, going further, we can assume that d.num_digits > 0.
-  // We want to guard against excessive decimal point values because
-  // they can result in long running times. Indeed, we do
-  // shifts by at most 60 bits. We have that log(10**400)/log(2**60) ~= 22
-  // which is fine, but log(10**299995)/log(2**60) ~= 16609 which is not
-  // fine (runs for a long time).
-  //
-  if (d.decimal_point < -324) {
-    // We have something smaller than 1e-324 which is always zero
-    // in binary64 and binary32.
-    // It should be zero.
-    answer.power2 = 0;
-    answer.mantissa = 0;
-    return answer;
-  } else if (d.decimal_point >= 310) {
-    // We have something at least as large as 0.1e310 which is
-    // always infinite.
-    answer.power2 = binary::infinite_power();
-    answer.mantissa = 0;
-    return answer;
+  SAFETENSORS_CPP_STATS_ADD(syscalls, 4);  // memfd_create + ftruncate + mmap
+                                           // + munmap
+
+  uint8_t *dst = reinterpret_cast<uint8_t *>(addr);
+  detail::write_header(header_str, dst);
+
+  bool ok;
+  {
+    SAFETENSORS_CPP_STATS_PHASE(data_seconds);
+    progress.info.bytes_total = databuffer_size;
+    progress.set_tensors(&st);
+    ok = detail::process_chunked(
+        &progress, databuffer_size, 0, err, [&](size_t offset, size_t len) {
+          memcpy(dst + header_bytes + offset, databuffer + offset, len);
+          return true;
+        });
+  }
+  munmap(addr, total);
+  if (!ok) {
+    ::close(mfd);
+    return false;
   }
+  SAFETENSORS_CPP_STATS_ADD(bytes_copied, databuffer_size);
 
-  static const uint32_t max_shift = 60;
-  static const uint32_t num_powers = 19;
-  static const uint8_t powers[19] = {
-      0,  3,  6,  9,  13, 16, 19, 23, 26, 29,  //
-      33, 36, 39, 43, 46, 49, 53, 56, 59,      //
-  };
-  int32_t exp2 = 0;
-  while (d.decimal_point > 0) {
-    uint32_t n = uint32_t(d.decimal_point);
-    uint32_t shift = (n < num_powers) ? powers[n] : max_shift;
-    decimal_right_shift(d, shift);
-    if (d.decimal_point < -decimal_point_range) {
-      // should be zero
-      answer.power2 = 0;
-      answer.mantissa = 0;
-      return answer;
+  // F_SEAL_WRITE requires that no writable shared mapping exists.
+  if (fcntl(mfd, F_ADD_SEALS,
+            F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0) {
+    if (err) {
+      (*err) += "Failed to seal memfd: " + detail::errno_str(errno) + "\n";
     }
-    exp2 += int32_t(shift);
+    ::close(mfd);
+    return false;
   }
-  // We shift left toward [1/2 ... 1].
-  while (d.decimal_point <= 0) {
-    uint32_t shift;
-    if (d.decimal_point == 0) {
-      if (d.digits[0] >= 5) {
-        break;
-      }
-      shift = (d.digits[0] < 2) ? 2 : 1;
-    } else {
-      uint32_t n = uint32_t(-d.decimal_point);
-      shift = (n < num_powers) ? powers[n] : max_shift;
+
+  detail::counter_add(detail::g_counters.bytes_written, total);
+
+  (*fd) = mfd;
+  return true;
+#else
+  (void)st;
+  (void)name;
+  (void)fd;
+  (void)warn;
+  if (err) {
+    (*err) += "memfd is not supported on this platform.\n";
+  }
+  return false;
+#endif
+}
+
+bool open_shared(int fd, safetensors_t *st, std::string *warn,
+                 std::string *err) {
+#if defined(SAFETENSORS_CPP_HAS_MEMFD)
+  if (!st) {
+    return false;
+  }
+
+  SAFETENSORS_CPP_STATS_ENTRY();
+
+  const int required = F_SEAL_SHRINK | F_SEAL_WRITE;
+  int seals = fcntl(fd, F_GET_SEALS);
+  if ((seals < 0) || ((seals & required) != required)) {
+    if (err) {
+      (*err) += "fd is not a memfd sealed against write and shrink.\n";
     }
-    decimal_left_shift(d, shift);
-    if (d.decimal_point > decimal_point_range) {
-      // we want to get infinity:
-      answer.power2 = 0xFF;
-      answer.mantissa = 0;
-      return answer;
+    return false;
+  }
+
+  int dupfd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  if (dupfd < 0) {
+    if (err) {
+      (*err) += "Failed to duplicate fd: " + detail::errno_str(errno) + "\n";
     }
-    exp2 -= int32_t(shift);
+    return false;
   }
-  // We are now in the range [1/2 ... 1] but the binary format uses [1 ... 2].
-  exp2--;
-  constexpr int32_t minimum_exponent = binary::minimum_exponent();
-  while ((minimum_exponent + 1) > exp2) {
-    uint32_t n = uint32_t((minimum_exponent + 1) - exp2);
-    if (n > max_shift) {
-      n = max_shift;
+
+  detail::safetensors_file *pf = new detail::safetensors_file(dupfd);
+  if (!pf->is_valid()) {
+    if (err) {
+      (*err) += pf->get_error();
     }
-    decimal_right_shift(d, n);
-    exp2 += int32_t(n);
+    delete pf;
+    return false;
   }
-  if ((exp2 - minimum_exponent) >= binary::infinite_power()) {
-    answer.power2 = binary::infinite_power();
-    answer.mantissa = 0;
-    return answer;
+
+  return detail::map_opened_file(pf, "memfd", st, warn, err,
+                                 kMMAP_READ_ONLY);
+#else
+  (void)fd;
+  (void)st;
+  (void)warn;
+  if (err) {
+    (*err) += "memfd is not supported on this platform.\n";
   }
+  return false;
+#endif
+}
 
-  const int mantissa_size_in_bits = binary::mantissa_explicit_bits() + 1;
-  decimal_left_shift(d, mantissa_size_in_bits);
+#if defined(__linux__)
+namespace detail {
 
-  uint64_t mantissa = round(d);
-  // It is possible that we have an overflow, in which case we need
-  // to shift back.
-  if (mantissa >= (uint64_t(1) << mantissa_size_in_bits)) {
-    decimal_right_shift(d, 1);
-    exp2 += 1;
-    mantissa = round(d);
-    if ((exp2 - minimum_exponent) >= binary::infinite_power()) {
-      answer.power2 = binary::infinite_power();
-      answer.mantissa = 0;
-      return answer;
+// Payload sent along with the fd.
+static const char kSendFdMagic[4] = {'S', 'T', 'F', 'D'};
+
+}  // namespace detail
+#endif
+
+bool send_fd(int sock, int fd, std::string *err) {
+#if defined(__linux__)
+  char payload[sizeof(detail::kSendFdMagic)];
+  memcpy(payload, detail::kSendFdMagic, sizeof(payload));
+
+  struct iovec iov;
+  iov.iov_base = payload;
+  iov.iov_len = sizeof(payload);
+
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  memset(&control, 0, sizeof(control));
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+  c->cmsg_level = SOL_SOCKET;
+  c->cmsg_type = SCM_RIGHTS;
+  c->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(c), &fd, sizeof(int));
+
+  ssize_t n;
+  do {
+    n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+  } while ((n < 0) && (errno == EINTR));
+  if (n != ssize_t(sizeof(payload))) {
+    if (err) {
+      (*err) += "sendmsg failed: " +
+                ((n < 0) ? detail::errno_str(errno) : "short write") + "\n";
     }
+    return false;
   }
-  answer.power2 = exp2 - binary::minimum_exponent();
-  if (mantissa < (uint64_t(1) << binary::mantissa_explicit_bits())) {
-    answer.power2--;
+  return true;
+#else
+  (void)sock;
+  (void)fd;
+  if (err) {
+    (*err) += "fd passing is not supported on this platform.\n";
   }
-  answer.mantissa =
-      mantissa & ((uint64_t(1) << binary::mantissa_explicit_bits()) - 1);
-  return answer;
+  return false;
+#endif
 }
 
-template <typename binary>
-adjusted_mantissa parse_long_mantissa(const char *first) {
-  decimal d = parse_decimal(first);
-  return compute_float<binary>(d);
-}
+bool recv_fd(int sock, int *fd, std::string *err) {
+#if defined(__linux__)
+  if (!fd) {
+    return false;
+  }
 
-template <typename binary>
-adjusted_mantissa parse_long_mantissa(const char *first, const char *end) {
-  decimal d = parse_decimal(first, end);
-  return compute_float<binary>(d);
-}
+  char payload[sizeof(detail::kSendFdMagic)];
+  struct iovec iov;
+  iov.iov_base = payload;
+  iov.iov_len = sizeof(payload);
 
-double from_chars(const char *first) noexcept {
-  bool negative = first[0] == '-';
-  if (negative) {
-    first++;
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  memset(&control, 0, sizeof(control));
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  ssize_t n;
+  do {
+    n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  } while ((n < 0) && (errno == EINTR));
+  if (n < 0) {
+    if (err) {
+      (*err) += "recvmsg failed: " + detail::errno_str(errno) + "\n";
+    }
+    return false;
   }
-  adjusted_mantissa am = parse_long_mantissa<binary_format<double>>(first);
-  uint64_t word = am.mantissa;
-  word |= uint64_t(am.power2)
-          << binary_format<double>::mantissa_explicit_bits();
-  word = negative ? word | (uint64_t(1) << binary_format<double>::sign_index())
-                  : word;
-  double value;
-  std::memcpy(&value, &word, sizeof(double));
-  return value;
-}
 
-double from_chars(const char *first, const char *end) noexcept {
-  bool negative = first[0] == '-';
-  if (negative) {
-    first++;
+  int received = -1;
+  for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+    if ((c->cmsg_level == SOL_SOCKET) && (c->cmsg_type == SCM_RIGHTS) &&
+        (c->cmsg_len == CMSG_LEN(sizeof(int)))) {
+      memcpy(&received, CMSG_DATA(c), sizeof(int));
+    }
+  }
+
+  if ((n != ssize_t(sizeof(payload))) ||
+      (memcmp(payload, detail::kSendFdMagic, sizeof(payload)) != 0) ||
+      (msg.msg_flags & MSG_CTRUNC) || (received < 0)) {
+    if (received >= 0) {
+      ::close(received);
+    }
+    if (err) {
+      (*err) += "No fd was received(peer closed or not sent by send_fd).\n";
+    }
+    return false;
+  }
+
+  (*fd) = received;
+  return true;
+#else
+  (void)sock;
+  (void)fd;
+  if (err) {
+    (*err) += "fd passing is not supported on this platform.\n";
   }
-  adjusted_mantissa am = parse_long_mantissa<binary_format<double>>(first, end);
-  uint64_t word = am.mantissa;
-  word |= uint64_t(am.power2)
-          << binary_format<double>::mantissa_explicit_bits();
-  word = negative ? word | (uint64_t(1) << binary_format<double>::sign_index())
-                  : word;
-  double value;
-  std::memcpy(&value, &word, sizeof(double));
-  return value;
+  return false;
+#endif
 }
 
-}  // namespace internal
-}  // namespace simdjson
-}  // namespace minijson
+namespace detail {
 
-namespace minijson {
-namespace simdjson {
-namespace internal {
-/*!
-implements the Grisu2 algorithm for binary to decimal floating-point
-conversion.
-Adapted from JSON for Modern C++
+size_t get_page_size() {
+#if defined(_WIN32)
+  SYSTEM_INFO si;
+  GetSystemInfo(&si);
+  return size_t(si.dwPageSize);
+#elif defined(_POSIX_MAPPED_FILES)
+  long sz = sysconf(_SC_PAGESIZE);
+  return (sz > 0) ? size_t(sz) : size_t(4096);
+#else
+  return size_t(4096);
+#endif
+}
 
-This implementation is a slightly modified version of the reference
-implementation which may be obtained from
-http://florian.loitsch.com/publications (bench.tar.gz).
-The code is distributed under the MIT license, Copyright (c) 2009 Florian
-Loitsch. For a detailed description of the algorithm see: [1] Loitsch, "Printing
-Floating-Point Numbers Quickly and Accurately with Integers", Proceedings of the
-ACM SIGPLAN 2010 Conference on Programming Language Design and Implementation,
-PLDI 2010 [2] Burger, Dybvig, "Printing Floating-Point Numbers Quickly and
-Accurately", Proceedings of the ACM SIGPLAN 1996 Conference on Programming
-Language Design and Implementation, PLDI 1996
-*/
-namespace dtoa_impl {
+// [begin, end) region of tensor data in memory.
+struct byte_range {
+  const uint8_t *begin{nullptr};
+  const uint8_t *end{nullptr};
+};
 
-template <typename Target, typename Source>
-Target reinterpret_bits(const Source source) {
-  static_assert(sizeof(Target) == sizeof(Source), "size mismatch");
+// Fault in pages of `r` by touching one byte per page.
+uint64_t touch_pages(const byte_range &r, size_t page_size) {
+  volatile uint8_t sink = 0;
+  for (const uint8_t *p = r.begin; p < r.end; p += page_size) {
+    sink = sink ^ (*p);
+  }
+  if (r.end > r.begin) {
+    sink = sink ^ (*(r.end - 1));
+  }
+  (void)sink;
+  return uint64_t(r.end - r.begin);
+}
 
-  Target target;
-  std::memcpy(&target, &source, sizeof(Source));
-  return target;
+void advise_willneed(const byte_range &r, size_t page_size) {
+#if defined(_POSIX_MAPPED_FILES)
+  uintptr_t b = uintptr_t(r.begin) & ~(uintptr_t(page_size) - 1);
+  uintptr_t e = uintptr_t(r.end);
+  if (e > b) {
+    posix_madvise(reinterpret_cast<void *>(b), size_t(e - b),
+                  POSIX_MADV_WILLNEED);
+  }
+#else
+  (void)r;
+  (void)page_size;
+#endif
 }
 
-struct diyfp  // f * 2^e
-{
-  static constexpr int kPrecision = 64;  // = q
+void advise_dontneed(const byte_range &r, size_t page_size) {
+  // Only drop pages fully covered by `r`, so pages shared with neighboring
+  // tensors are kept.
+  uintptr_t mask = ~(uintptr_t(page_size) - 1);
+  uintptr_t b = (uintptr_t(r.begin) + page_size - 1) & mask;
+  uintptr_t e = uintptr_t(r.end) & mask;
+  if (e <= b) {
+    return;
+  }
+#if defined(__linux__)
+  // NOTE: posix_madvise(POSIX_MADV_DONTNEED) is no-op in glibc.
+  madvise(reinterpret_cast<void *>(b), size_t(e - b), MADV_DONTNEED);
+#elif defined(_POSIX_MAPPED_FILES)
+  posix_madvise(reinterpret_cast<void *>(b), size_t(e - b),
+                POSIX_MADV_DONTNEED);
+#endif
+}
 
-  std::uint64_t f = 0;
-  int e = 0;
+double seconds_since(const std::chrono::steady_clock::time_point &t) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - t)
+      .count();
+}
 
-  constexpr diyfp(std::uint64_t f_, int e_) noexcept : f(f_), e(e_) {}
+enum prefetch_group_state {
+  kGroupIdle,
+  kGroupLoading,
+  kGroupReady,
+};
 
-  /*!
-  @brief returns x - y
-  @pre x.e == y.e and x.f >= y.f
-  */
-  static diyfp sub(const diyfp &x, const diyfp &y) noexcept {
-    return {x.f - y.f, x.e};
+struct prefetcher_impl {
+  std::vector<std::vector<byte_range>> groups;
+  std::vector<prefetch_group_state> state;
+  std::vector<uint8_t> speculative;  // loaded/hinted ahead of the consumer
+  size_t lookahead{1};
+  size_t page_size{4096};
+  bool needs_io{false};     // false when data is in `storage`
+  bool can_release{false};  // true only for file mappings owned by us.
+
+  size_t base{0};  // the group most recently acquired.
+  size_t next{0};  // the group to be loaded next.
+
+  prefetch_stats stats;
+
+#if defined(SAFETENSORS_CPP_USE_THREADS)
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::thread worker;
+  bool stop{false};
+#endif
+
+  uint64_t load_group(size_t g) {
+    uint64_t n = 0;
+    for (const byte_range &r : groups[g]) {
+      advise_willneed(r, page_size);
+    }
+    for (const byte_range &r : groups[g]) {
+      n += touch_pages(r, page_size);
+    }
+    return n;
   }
 
-  /*!
-  @brief returns x * y
-  @note The result is rounded. (Only the upper q bits are returned.)
-  */
-  static diyfp mul(const diyfp &x, const diyfp &y) noexcept {
-    static_assert(kPrecision == 64, "internal error");
+#if defined(SAFETENSORS_CPP_USE_THREADS)
+  void worker_loop() {
+    std::unique_lock<std::mutex> lk(mtx);
+    while (true) {
+      cv.wait(lk, [this] {
+        return stop || ((next < groups.size()) && (next < base + lookahead));
+      });
+      if (stop) {
+        break;
+      }
 
-    // Computes:
-    //  f = round((x.f * y.f) / 2^q)
-    //  e = x.e + y.e + q
+      size_t g = next++;
+      if (state[g] != kGroupIdle) {
+        continue;
+      }
+      state[g] = kGroupLoading;
+      if (g != base) {
+        speculative[g] = 1;
+        counter_add(g_counters.prefetch_issued, 1);
+      }
 
-    // Emulate the 64-bit * 64-bit multiplication:
-    //
-    // p = u * v
-    //   = (u_lo + 2^32 u_hi) (v_lo + 2^32 v_hi)
-    //   = (u_lo v_lo         ) + 2^32 ((u_lo v_hi         ) + (u_hi v_lo )) +
-    //   2^64 (u_hi v_hi         ) = (p0                ) + 2^32 ((p1 ) + (p2 ))
-    //   + 2^64 (p3                ) = (p0_lo + 2^32 p0_hi) + 2^32 ((p1_lo +
-    //   2^32 p1_hi) + (p2_lo + 2^32 p2_hi)) + 2^64 (p3                ) =
-    //   (p0_lo             ) + 2^32 (p0_hi + p1_lo + p2_lo ) + 2^64 (p1_hi +
-    //   p2_hi + p3) = (p0_lo             ) + 2^32 (Q ) + 2^64 (H ) = (p0_lo ) +
-    //   2^32 (Q_lo + 2^32 Q_hi                           ) + 2^64 (H )
-    //
-    // (Since Q might be larger than 2^32 - 1)
-    //
-    //   = (p0_lo + 2^32 Q_lo) + 2^64 (Q_hi + H)
-    //
-    // (Q_hi + H does not overflow a 64-bit int)
-    //
-    //   = p_lo + 2^64 p_hi
+      lk.unlock();
+      uint64_t n = load_group(g);
+      lk.lock();
 
-    const std::uint64_t u_lo = x.f & 0xFFFFFFFFu;
-    const std::uint64_t u_hi = x.f >> 32u;
-    const std::uint64_t v_lo = y.f & 0xFFFFFFFFu;
-    const std::uint64_t v_hi = y.f >> 32u;
+      state[g] = kGroupReady;
+      stats.groups_loaded++;
+      stats.bytes_loaded += n;
+      cv.notify_all();
+    }
+  }
+#endif
+};
 
-    const std::uint64_t p0 = u_lo * v_lo;
-    const std::uint64_t p1 = u_lo * v_hi;
-    const std::uint64_t p2 = u_hi * v_lo;
-    const std::uint64_t p3 = u_hi * v_hi;
+void destroy_prefetcher_impl(prefetcher_impl *p) {
+  if (!p) {
+    return;
+  }
+#if defined(SAFETENSORS_CPP_USE_THREADS)
+  {
+    std::lock_guard<std::mutex> lk(p->mtx);
+    p->stop = true;
+  }
+  p->cv.notify_all();
+  if (p->worker.joinable()) {
+    p->worker.join();
+  }
+#endif
+  delete p;
+}
 
-    const std::uint64_t p0_hi = p0 >> 32u;
-    const std::uint64_t p1_lo = p1 & 0xFFFFFFFFu;
-    const std::uint64_t p1_hi = p1 >> 32u;
-    const std::uint64_t p2_lo = p2 & 0xFFFFFFFFu;
-    const std::uint64_t p2_hi = p2 >> 32u;
+}  // namespace detail
 
-    std::uint64_t Q = p0_hi + p1_lo + p2_lo;
+prefetcher::~prefetcher() {
+  detail::destroy_prefetcher_impl(
+      reinterpret_cast<detail::prefetcher_impl *>(_impl));
+  _impl = nullptr;
+}
 
-    // The full product might now be computed as
-    //
-    // p_hi = p3 + p2_hi + p1_hi + (Q >> 32)
-    // p_lo = p0_lo + (Q << 32)
-    //
-    // But in this particular case here, the full p_lo is not required.
-    // Effectively we only need to add the highest bit in p_lo to p_hi (and
-    // Q_hi + 1 does not overflow).
+bool prefetcher::init(const safetensors_t &st,
+                      const std::vector<std::vector<std::string>> &groups,
+                      size_t lookahead, std::string *err) {
+  detail::destroy_prefetcher_impl(
+      reinterpret_cast<detail::prefetcher_impl *>(_impl));
+  _impl = nullptr;
 
-    Q += std::uint64_t{1} << (64u - 32u - 1u);  // round, ties up
+  if (lookahead < 1) {
+    if (err) {
+      (*err) += "`lookahead` must be 1 or greater.\n";
+    }
+    return false;
+  }
 
-    const std::uint64_t h = p3 + p2_hi + p1_hi + (Q >> 32u);
+  size_t databuffer_size{0};
+  const uint8_t *databuffer = detail::get_databuffer(st, &databuffer_size);
+
+  std::unique_ptr<detail::prefetcher_impl> p(new detail::prefetcher_impl());
+  p->groups.resize(groups.size());
+  p->state.assign(groups.size(), detail::kGroupIdle);
+  p->speculative.assign(groups.size(), 0);
+  p->lookahead = lookahead;
+  p->page_size = detail::get_page_size();
+  p->needs_io = st.mmaped;
+  // Do not drop pages of a memory region given by the app
+  // (`mmap_from_memory`). It may be anonymous memory.
+  // Also dropping pages of private writable mapping discards modification.
+  // Pages of a mapping shared through the mapping cache are read-only file
+  // pages, so other users just fault them in again.
+  p->can_release = st.mmaped &&
+                   ((st.st_mmap != nullptr) || (st.st_shared != nullptr)) &&
+                   (st.map_mode != kMMAP_COPY_ON_WRITE);
+
+  for (size_t g = 0; g < groups.size(); g++) {
+    std::vector<detail::byte_range> ranges;
+    for (const std::string &name : groups[g]) {
+      tensor_t tensor;
+      if (!st.tensors.at(name, &tensor)) {
+        if (err) {
+          (*err) += "Tensor `" + name + "` in group " + std::to_string(g) +
+                    " not found.\n";
+        }
+        return false;
+      }
 
-    return {h, x.e + y.e + 64};
-  }
+      if ((tensor.data_offsets[0] > tensor.data_offsets[1]) ||
+          (tensor.data_offsets[1] > databuffer_size)) {
+        if (err) {
+          (*err) += "Tensor `" + name + "` has invalid data_offsets.\n";
+        }
+        return false;
+      }
 
-  /*!
-  @brief normalize x such that the significand is >= 2^(q-1)
-  @pre x.f != 0
-  */
-  static diyfp normalize(diyfp x) noexcept {
-    while ((x.f >> 63u) == 0) {
-      x.f <<= 1u;
-      x.e--;
+      if (tensor.data_offsets[0] == tensor.data_offsets[1]) {
+        continue;
+      }
+
+      detail::byte_range r;
+      r.begin = databuffer + tensor.data_offsets[0];
+      r.end = databuffer + tensor.data_offsets[1];
+      ranges.push_back(r);
     }
 
-    return x;
+    // Sort and merge adjacent ranges.
+    std::sort(ranges.begin(), ranges.end(),
+              [](const detail::byte_range &a, const detail::byte_range &b) {
+                return a.begin < b.begin;
+              });
+    for (const detail::byte_range &r : ranges) {
+      if (p->groups[g].size() && (p->groups[g].back().end >= r.begin)) {
+        p->groups[g].back().end = (std::max)(p->groups[g].back().end, r.end);
+      } else {
+        p->groups[g].push_back(r);
+      }
+    }
   }
 
-  /*!
-  @brief normalize x such that the result has the exponent E
-  @pre e >= x.e and the upper e - x.e bits of x.f must be zero.
-  */
-  static diyfp normalize_to(const diyfp &x,
-                            const int target_exponent) noexcept {
-    const int delta = x.e - target_exponent;
-
-    return {x.f << delta, target_exponent};
+#if defined(SAFETENSORS_CPP_USE_THREADS)
+  if (p->needs_io) {
+    detail::prefetcher_impl *pp = p.get();
+    p->worker = std::thread([pp] { pp->worker_loop(); });
   }
-};
-
-struct boundaries {
-  diyfp w;
-  diyfp minus;
-  diyfp plus;
-};
-
-/*!
-Compute the (normalized) diyfp representing the input number 'value' and its
-boundaries.
-@pre value must be finite and positive
-*/
-template <typename FloatType>
-boundaries compute_boundaries(FloatType value) {
-  // Convert the IEEE representation into a diyfp.
-  //
-  // If v is denormal:
-  //      value = 0.F * 2^(1 - bias) = (          F) * 2^(1 - bias - (p-1))
-  // If v is normalized:
-  //      value = 1.F * 2^(E - bias) = (2^(p-1) + F) * 2^(E - bias - (p-1))
+#endif
 
-  static_assert(std::numeric_limits<FloatType>::is_iec559,
-                "internal error: dtoa_short requires an IEEE-754 "
-                "floating-point implementation");
+  _impl = p.release();
 
-  constexpr int kPrecision =
-      std::numeric_limits<FloatType>::digits;  // = p (includes the hidden bit)
-  constexpr int kBias =
-      std::numeric_limits<FloatType>::max_exponent - 1 + (kPrecision - 1);
-  constexpr int kMinExp = 1 - kBias;
-  constexpr std::uint64_t kHiddenBit = std::uint64_t{1}
-                                       << (kPrecision - 1);  // = 2^(p-1)
+  return true;
+}
 
-  using bits_type = typename std::conditional<kPrecision == 24, std::uint32_t,
-                                              std::uint64_t>::type;
+bool prefetcher::acquire(size_t group) {
+  detail::prefetcher_impl *p =
+      reinterpret_cast<detail::prefetcher_impl *>(_impl);
+  if (!p || (group >= p->groups.size())) {
+    return false;
+  }
 
-  const std::uint64_t bits = reinterpret_bits<bits_type>(value);
-  const std::uint64_t E = bits >> (kPrecision - 1);
-  const std::uint64_t F = bits & (kHiddenBit - 1);
+#if defined(SAFETENSORS_CPP_USE_THREADS)
+  std::unique_lock<std::mutex> lk(p->mtx);
+  p->stats.acquires++;
+  if (!p->needs_io) {
+    return true;
+  }
 
-  const bool is_denormal = E == 0;
-  const diyfp v = is_denormal
-                      ? diyfp(F, kMinExp)
-                      : diyfp(F + kHiddenBit, static_cast<int>(E) - kBias);
+  p->base = group;
+  if (p->state[group] == detail::kGroupIdle) {
+    // Consumer jumped(or came back to a released group). Restart loading from
+    // here.
+    p->next = group;
+  }
+  p->cv.notify_all();
 
-  // Compute the boundaries m- and m+ of the floating-point value
-  // v = f * 2^e.
-  //
-  // Determine v- and v+, the floating-point predecessor and successor if v,
-  // respectively.
-  //
-  //      v- = v - 2^e        if f != 2^(p-1) or e == e_min                (A)
-  //         = v - 2^(e-1)    if f == 2^(p-1) and e > e_min                (B)
-  //
-  //      v+ = v + 2^e
-  //
-  // Let m- = (v- + v) / 2 and m+ = (v + v+) / 2. All real numbers _strictly_
-  // between m- and m+ round to v, regardless of how the input rounding
-  // algorithm breaks ties.
-  //
-  //      ---+-------------+-------------+-------------+-------------+---  (A)
-  //         v-            m-            v             m+            v+
-  //
-  //      -----------------+------+------+-------------+-------------+---  (B)
-  //                       v-     m-     v             m+            v+
+  if (p->speculative[group]) {
+    p->speculative[group] = 0;
+    detail::counter_add(detail::g_counters.prefetch_used, 1);
+  }
 
-  const bool lower_boundary_is_closer = F == 0 && E > 1;
-  const diyfp m_plus = diyfp(2 * v.f + 1, v.e - 1);
-  const diyfp m_minus = lower_boundary_is_closer
-                            ? diyfp(4 * v.f - 1, v.e - 2)   // (B)
-                            : diyfp(2 * v.f - 1, v.e - 1);  // (A)
+  if (p->state[group] == detail::kGroupReady) {
+    detail::counter_add(detail::g_counters.cache_hits, 1);
+  } else {
+    detail::counter_add(detail::g_counters.cache_misses, 1);
+    auto t = std::chrono::steady_clock::now();
+    p->cv.wait(lk, [p, group] {
+      return p->stop || (p->state[group] == detail::kGroupReady);
+    });
+    double s = detail::seconds_since(t);
+    p->stats.stalls++;
+    p->stats.stall_seconds += s;
+    p->stats.max_stall_seconds = (std::max)(p->stats.max_stall_seconds, s);
+  }
+#else
+  p->stats.acquires++;
+  if (!p->needs_io) {
+    return true;
+  }
 
-  // Determine the normalized w+ = m+.
-  const diyfp w_plus = diyfp::normalize(m_plus);
+  p->base = group;
+  if (p->speculative[group]) {
+    p->speculative[group] = 0;
+    detail::counter_add(detail::g_counters.prefetch_used, 1);
+  }
 
-  // Determine w- = m- such that e_(w-) = e_(w+).
-  const diyfp w_minus = diyfp::normalize_to(m_minus, w_plus.e);
+  if (p->state[group] == detail::kGroupReady) {
+    detail::counter_add(detail::g_counters.cache_hits, 1);
+  } else {
+    detail::counter_add(detail::g_counters.cache_misses, 1);
+    auto t = std::chrono::steady_clock::now();
+    uint64_t n = p->load_group(group);
+    double s = detail::seconds_since(t);
+    p->state[group] = detail::kGroupReady;
+    p->stats.groups_loaded++;
+    p->stats.bytes_loaded += n;
+    p->stats.stalls++;
+    p->stats.stall_seconds += s;
+    p->stats.max_stall_seconds = (std::max)(p->stats.max_stall_seconds, s);
+  }
+
+  // No background thread. Let the kernel read ahead the rest of the window.
+  size_t end = (std::min)(p->groups.size(), group + p->lookahead);
+  for (size_t g = group + 1; g < end; g++) {
+    if (p->state[g] != detail::kGroupReady) {
+      for (const detail::byte_range &r : p->groups[g]) {
+        detail::advise_willneed(r, p->page_size);
+      }
+      if (!p->speculative[g]) {
+        p->speculative[g] = 1;
+        detail::counter_add(detail::g_counters.prefetch_issued, 1);
+      }
+    }
+  }
+#endif
 
-  return {diyfp::normalize(v), w_minus, w_plus};
+  return true;
 }
 
-// Given normalized diyfp w, Grisu needs to find a (normalized) cached
-// power-of-ten c, such that the exponent of the product c * w = f * 2^e lies
-// within a certain range [alpha, gamma] (Definition 3.2 from [1])
-//
-//      alpha <= e = e_c + e_w + q <= gamma
-//
-// or
-//
-//      f_c * f_w * 2^alpha <= f_c 2^(e_c) * f_w 2^(e_w) * 2^q
-//                          <= f_c * f_w * 2^gamma
-//
-// Since c and w are normalized, i.e. 2^(q-1) <= f < 2^q, this implies
-//
-//      2^(q-1) * 2^(q-1) * 2^alpha <= c * w * 2^q < 2^q * 2^q * 2^gamma
-//
-// or
-//
-//      2^(q - 2 + alpha) <= c * w < 2^(q + gamma)
-//
-// The choice of (alpha,gamma) determines the size of the table and the form of
-// the digit generation procedure. Using (alpha,gamma)=(-60,-32) works out well
-// in practice:
-//
-// The idea is to cut the number c * w = f * 2^e into two parts, which can be
-// processed independently: An integral part p1, and a fractional part p2:
-//
-//      f * 2^e = ( (f div 2^-e) * 2^-e + (f mod 2^-e) ) * 2^e
-//              = (f div 2^-e) + (f mod 2^-e) * 2^e
-//              = p1 + p2 * 2^e
-//
-// The conversion of p1 into decimal form requires a series of divisions and
-// modulos by (a power of) 10. These operations are faster for 32-bit than for
-// 64-bit integers, so p1 should ideally fit into a 32-bit integer. This can be
-// achieved by choosing
-//
-//      -e >= 32   or   e <= -32 := gamma
-//
-// In order to convert the fractional part
-//
-//      p2 * 2^e = p2 / 2^-e = d[-1] / 10^1 + d[-2] / 10^2 + ...
-//
-// into decimal form, the fraction is repeatedly multiplied by 10 and the digits
-// d[-i] are extracted in order:
-//
-//      (10 * p2) div 2^-e = d[-1]
-//      (10 * p2) mod 2^-e = d[-2] / 10^1 + ...
-//
-// The multiplication by 10 must not overflow. It is sufficient to choose
-//
-//      10 * p2 < 16 * p2 = 2^4 * p2 <= 2^64.
-//
-// Since p2 = f mod 2^-e < 2^-e,
-//
-//      -e <= 60   or   e >= -60 := alpha
+void prefetcher::release(size_t group) {
+  detail::prefetcher_impl *p =
+      reinterpret_cast<detail::prefetcher_impl *>(_impl);
+  if (!p || (group >= p->groups.size())) {
+    return;
+  }
 
-constexpr int kAlpha = -60;
-constexpr int kGamma = -32;
+#if defined(SAFETENSORS_CPP_USE_THREADS)
+  std::lock_guard<std::mutex> lk(p->mtx);
+#endif
 
-struct cached_power  // c = f * 2^e ~= 10^k
-{
-  std::uint64_t f;
-  int e;
-  int k;
-};
+  if (p->state[group] != detail::kGroupReady) {
+    return;
+  }
 
-/*!
-For a normalized diyfp w = f * 2^e, this function returns a (normalized) cached
-power-of-ten c = f_c * 2^e_c, such that the exponent of the product w * c
-satisfies (Definition 3.2 from [1])
-     alpha <= e_c + e + q <= gamma.
-*/
-inline cached_power get_cached_power_for_binary_exponent(int e) {
-  // Now
-  //
-  //      alpha <= e_c + e + q <= gamma                                    (1)
-  //      ==> f_c * 2^alpha <= c * 2^e * 2^q
-  //
-  // and since the c's are normalized, 2^(q-1) <= f_c,
-  //
-  //      ==> 2^(q - 1 + alpha) <= c * 2^(e + q)
-  //      ==> 2^(alpha - e - 1) <= c
-  //
-  // If c were an exact power of ten, i.e. c = 10^k, one may determine k as
-  //
-  //      k = ceil( log_10( 2^(alpha - e - 1) ) )
-  //        = ceil( (alpha - e - 1) * log_10(2) )
-  //
-  // From the paper:
-  // "In theory the result of the procedure could be wrong since c is rounded,
-  //  and the computation itself is approximated [...]. In practice, however,
-  //  this simple function is sufficient."
-  //
-  // For IEEE double precision floating-point numbers converted into
-  // normalized diyfp's w = f * 2^e, with q = 64,
-  //
-  //      e >= -1022      (min IEEE exponent)
-  //           -52        (p - 1)
-  //           -52        (p - 1, possibly normalize denormal IEEE numbers)
-  //           -11        (normalize the diyfp)
-  //         = -1137
-  //
-  // and
-  //
-  //      e <= +1023      (max IEEE exponent)
-  //           -52        (p - 1)
-  //           -11        (normalize the diyfp)
-  //         = 960
-  //
-  // This binary exponent range [-1137,960] results in a decimal exponent
-  // range [-307,324]. One does not need to store a cached power for each
-  // k in this range. For each such k it suffices to find a cached power
-  // such that the exponent of the product lies in [alpha,gamma].
-  // This implies that the difference of the decimal exponents of adjacent
-  // table entries must be less than or equal to
-  //
-  //      floor( (gamma - alpha) * log_10(2) ) = 8.
-  //
-  // (A smaller distance gamma-alpha would require a larger table.)
+  p->state[group] = detail::kGroupIdle;
+  p->stats.groups_released++;
+  detail::counter_add(detail::g_counters.cache_evictions, 1);
 
-  // NB:
-  // Actually this function returns c, such that -60 <= e_c + e + 64 <= -34.
+  if (p->can_release) {
+    for (const detail::byte_range &r : p->groups[group]) {
+      detail::advise_dontneed(r, p->page_size);
+    }
+  }
+}
 
-  constexpr int kCachedPowersMinDecExp = -300;
-  constexpr int kCachedPowersDecStep = 8;
+size_t prefetcher::num_groups() const {
+  const detail::prefetcher_impl *p =
+      reinterpret_cast<const detail::prefetcher_impl *>(_impl);
+  return p ? p->groups.size() : 0;
+}
 
-  static constexpr std::array<cached_power, 79> kCachedPowers = {{
-      {0xAB70FE17C79AC6CA, -1060, -300}, {0xFF77B1FCBEBCDC4F, -1034, -292},
-      {0xBE5691EF416BD60C, -1007, -284}, {0x8DD01FAD907FFC3C, -980, -276},
-      {0xD3515C2831559A83, -954, -268},  {0x9D71AC8FADA6C9B5, -927, -260},
-      {0xEA9C227723EE8BCB, -901, -252},  {0xAECC49914078536D, -874, -244},
-      {0x823C12795DB6CE57, -847, -236},  {0xC21094364DFB5637, -821, -228},
-      {0x9096EA6F3848984F, -794, -220},  {0xD77485CB25823AC7, -768, -212},
-      {0xA086CFCD97BF97F4, -741, -204},  {0xEF340A98172AACE5, -715, -196},
-      {0xB23867FB2A35B28E, -688, -188},  {0x84C8D4DFD2C63F3B, -661, -180},
-      {0xC5DD44271AD3CDBA, -635, -172},  {0x936B9FCEBB25C996, -608, -164},
-      {0xDBAC6C247D62A584, -582, -156},  {0xA3AB66580D5FDAF6, -555, -148},
-      {0xF3E2F893DEC3F126, -529, -140},  {0xB5B5ADA8AAFF80B8, -502, -132},
-      {0x87625F056C7C4A8B, -475, -124},  {0xC9BCFF6034C13053, -449, -116},
-      {0x964E858C91BA2655, -422, -108},  {0xDFF9772470297EBD, -396, -100},
-      {0xA6DFBD9FB8E5B88F, -369, -92},   {0xF8A95FCF88747D94, -343, -84},
-      {0xB94470938FA89BCF, -316, -76},   {0x8A08F0F8BF0F156B, -289, -68},
-      {0xCDB02555653131B6, -263, -60},   {0x993FE2C6D07B7FAC, -236, -52},
-      {0xE45C10C42A2B3B06, -210, -44},   {0xAA242499697392D3, -183, -36},
-      {0xFD87B5F28300CA0E, -157, -28},   {0xBCE5086492111AEB, -130, -20},
-      {0x8CBCCC096F5088CC, -103, -12},   {0xD1B71758E219652C, -77, -4},
-      {0x9C40000000000000, -50, 4},      {0xE8D4A51000000000, -24, 12},
-      {0xAD78EBC5AC620000, 3, 20},       {0x813F3978F8940984, 30, 28},
-      {0xC097CE7BC90715B3, 56, 36},      {0x8F7E32CE7BEA5C70, 83, 44},
-      {0xD5D238A4ABE98068, 109, 52},     {0x9F4F2726179A2245, 136, 60},
-      {0xED63A231D4C4FB27, 162, 68},     {0xB0DE65388CC8ADA8, 189, 76},
-      {0x83C7088E1AAB65DB, 216, 84},     {0xC45D1DF942711D9A, 242, 92},
-      {0x924D692CA61BE758, 269, 100},    {0xDA01EE641A708DEA, 295, 108},
-      {0xA26DA3999AEF774A, 322, 116},    {0xF209787BB47D6B85, 348, 124},
-      {0xB454E4A179DD1877, 375, 132},    {0x865B86925B9BC5C2, 402, 140},
-      {0xC83553C5C8965D3D, 428, 148},    {0x952AB45CFA97A0B3, 455, 156},
-      {0xDE469FBD99A05FE3, 481, 164},    {0xA59BC234DB398C25, 508, 172},
-      {0xF6C69A72A3989F5C, 534, 180},    {0xB7DCBF5354E9BECE, 561, 188},
-      {0x88FCF317F22241E2, 588, 196},    {0xCC20CE9BD35C78A5, 614, 204},
-      {0x98165AF37B2153DF, 641, 212},    {0xE2A0B5DC971F303A, 667, 220},
-      {0xA8D9D1535CE3B396, 694, 228},    {0xFB9B7CD9A4A7443C, 720, 236},
-      {0xBB764C4CA7A44410, 747, 244},    {0x8BAB8EEFB6409C1A, 774, 252},
-      {0xD01FEF10A657842C, 800, 260},    {0x9B10A4E5E9913129, 827, 268},
-      {0xE7109BFBA19C0C9D, 853, 276},    {0xAC2820D9623BF429, 880, 284},
-      {0x80444B5E7AA7CF85, 907, 292},    {0xBF21E44003ACDD2D, 933, 300},
-      {0x8E679C2F5E44FF8F, 960, 308},    {0xD433179D9C8CB841, 986, 316},
-      {0x9E19DB92B4E31BA9, 1013, 324},
-  }};
+prefetch_stats prefetcher::stats() const {
+  detail::prefetcher_impl *p =
+      reinterpret_cast<detail::prefetcher_impl *>(_impl);
+  if (!p) {
+    return prefetch_stats();
+  }
+#if defined(SAFETENSORS_CPP_USE_THREADS)
+  std::lock_guard<std::mutex> lk(p->mtx);
+#endif
+  return p->stats;
+}
 
-  // This computation gives exactly the same results for k as
-  //      k = ceil((kAlpha - e - 1) * 0.30102999566398114)
-  // for |e| <= 1500, but doesn't require floating-point operations.
-  // NB: log_10(2) ~= 78913 / 2^18
-  const int f = kAlpha - e - 1;
-  const int k = (f * 78913) / (1 << 18) + static_cast<int>(f > 0);
+namespace detail {
 
-  const int index = (-kCachedPowersMinDecExp + k + (kCachedPowersDecStep - 1)) /
-                    kCachedPowersDecStep;
+#if defined(SAFETENSORS_CPP_USE_THREADS)
+// Serializes `access_trace` updates from concurrent readers. Tracing is for
+// profiling runs, so one lock for all traces is enough.
+std::mutex g_trace_mtx;
+#endif
 
-  const cached_power cached = kCachedPowers[static_cast<std::size_t>(index)];
+}  // namespace detail
 
-  return cached;
+void access_trace::record(const std::string &name, size_t begin, size_t end) {
+#if defined(SAFETENSORS_CPP_USE_THREADS)
+  std::lock_guard<std::mutex> lk(detail::g_trace_mtx);
+#endif
+  if (records.size()) {
+    access_record &last = records.back();
+    if ((last.name == name) && (begin <= last.end) && (end >= last.begin)) {
+      // overlapping or contiguous. merge.
+      last.begin = (std::min)(last.begin, begin);
+      last.end = (std::max)(last.end, end);
+      return;
+    }
+  }
+
+  access_record r;
+  r.name = name;
+  r.begin = begin;
+  r.end = end;
+  records.emplace_back(std::move(r));
 }
 
-/*!
-For n != 0, returns k, such that pow10 := 10^(k-1) <= n < 10^k.
-For n == 0, returns 1 and sets pow10 := 1.
-*/
-inline int find_largest_pow10(const std::uint32_t n, std::uint32_t &pow10) {
-  // LCOV_EXCL_START
-  if (n >= 1000000000) {
-    pow10 = 1000000000;
-    return 10;
+void access_trace::clear() {
+#if defined(SAFETENSORS_CPP_USE_THREADS)
+  std::lock_guard<std::mutex> lk(detail::g_trace_mtx);
+#endif
+  records.clear();
+}
+
+namespace detail {
+
+// Address and size of tensor `name` in `st`, without recording the access.
+bool find_tensor_data(const safetensors_t &st, const std::string &name,
+                      const uint8_t **data, size_t *nbytes,
+                      std::string *err) {
+  tensor_t tensor;
+  if (!st.tensors.at(name, &tensor)) {
+    if (err) {
+      (*err) += "Tensor `" + name + "` not found.\n";
+    }
+    return false;
   }
-  // LCOV_EXCL_STOP
-  else if (n >= 100000000) {
-    pow10 = 100000000;
-    return 9;
-  } else if (n >= 10000000) {
-    pow10 = 10000000;
-    return 8;
-  } else if (n >= 1000000) {
-    pow10 = 1000000;
-    return 7;
-  } else if (n >= 100000) {
-    pow10 = 100000;
-    return 6;
-  } else if (n >= 10000) {
-    pow10 = 10000;
-    return 5;
-  } else if (n >= 1000) {
-    pow10 = 1000;
-    return 4;
-  } else if (n >= 100) {
-    pow10 = 100;
-    return 3;
-  } else if (n >= 10) {
-    pow10 = 10;
-    return 2;
-  } else {
-    pow10 = 1;
-    return 1;
+
+  size_t databuffer_size{0};
+  const uint8_t *databuffer = get_databuffer(st, &databuffer_size);
+
+  if ((tensor.data_offsets[0] > tensor.data_offsets[1]) ||
+      (tensor.data_offsets[1] > databuffer_size)) {
+    if (err) {
+      (*err) += "Tensor `" + name + "` has invalid data_offsets.\n";
+    }
+    return false;
   }
+
+  (*data) = databuffer + tensor.data_offsets[0];
+  (*nbytes) = tensor.data_offsets[1] - tensor.data_offsets[0];
+  return true;
 }
 
-inline void grisu2_round(char *buf, int len, std::uint64_t dist,
-                         std::uint64_t delta, std::uint64_t rest,
-                         std::uint64_t ten_k) {
-  //               <--------------------------- delta ---->
-  //                                  <---- dist --------->
-  // --------------[------------------+-------------------]--------------
-  //               M-                 w                   M+
-  //
-  //                                  ten_k
-  //                                <------>
-  //                                       <---- rest ---->
-  // --------------[------------------+----+--------------]--------------
-  //                                  w    V
-  //                                       = buf * 10^k
-  //
-  // ten_k represents a unit-in-the-last-place in the decimal representation
-  // stored in buf.
-  // Decrement buf by ten_k while this takes buf closer to w.
+}  // namespace detail
 
-  // The tests are written in this order to avoid overflow in unsigned
-  // integer arithmetic.
+bool get_tensor_data(const safetensors_t &st, const std::string &name,
+                     const uint8_t **data, size_t *nbytes, std::string *err) {
+  if (!data || !nbytes) {
+    return false;
+  }
 
-  while (rest < dist && delta - rest >= ten_k &&
-         (rest + ten_k < dist || dist - rest > rest + ten_k - dist)) {
-    buf[len - 1]--;
-    rest += ten_k;
+  if (!detail::find_tensor_data(st, name, data, nbytes, err)) {
+    return false;
   }
+
+  if (st.trace) {
+    st.trace->record(name, 0, *nbytes);
+  }
+
+  if (st.mmaped) {
+    detail::counter_add(detail::g_counters.tensors_materialized, 1);
+  }
+
+  return true;
 }
 
-/*!
-Generates V = buffer * 10^decimal_exponent, such that M- <= V <= M+.
-M- and M+ must be normalized and share the same exponent -60 <= e <= -32.
-*/
-inline void grisu2_digit_gen(char *buffer, int &length, int &decimal_exponent,
-                             diyfp M_minus, diyfp w, diyfp M_plus) {
-  static_assert(kAlpha >= -60, "internal error");
-  static_assert(kGamma <= -32, "internal error");
+bool get_mutable_tensor_data(safetensors_t *st, const std::string &name,
+                             uint8_t **data, size_t *nbytes, std::string *err) {
+  if (!st || !data || !nbytes) {
+    return false;
+  }
 
-  // Generates the digits (and the exponent) of a decimal floating-point
-  // number V = buffer * 10^decimal_exponent in the range [M-, M+]. The diyfp's
-  // w, M- and M+ share the same exponent e, which satisfies alpha <= e <=
-  // gamma.
-  //
-  //               <--------------------------- delta ---->
-  //                                  <---- dist --------->
-  // --------------[------------------+-------------------]--------------
-  //               M-                 w                   M+
-  //
-  // Grisu2 generates the digits of M+ from left to right and stops as soon as
-  // V is in [M-,M+].
+  if (st->mmaped &&
+      ((st->st_mmap == nullptr) || (st->map_mode == kMMAP_READ_ONLY))) {
+    if (err) {
+      (*err) += "Tensor data is read-only. mmap with writable mode.\n";
+    }
+    return false;
+  }
 
-  std::uint64_t delta =
-      diyfp::sub(M_plus, M_minus)
-          .f;  // (significand of (M+ - M-), implicit exponent is e)
-  std::uint64_t dist =
-      diyfp::sub(M_plus, w)
-          .f;  // (significand of (M+ - w ), implicit exponent is e)
+  const uint8_t *p{nullptr};
+  if (!get_tensor_data(*st, name, &p, nbytes, err)) {
+    return false;
+  }
 
-  // Split M+ = f * 2^e into two parts p1 and p2 (note: e < 0):
-  //
-  //      M+ = f * 2^e
-  //         = ((f div 2^-e) * 2^-e + (f mod 2^-e)) * 2^e
-  //         = ((p1        ) * 2^-e + (p2        )) * 2^e
-  //         = p1 + p2 * 2^e
+  // The mapping is writable.
+  (*data) = const_cast<uint8_t *>(p);
 
-  const diyfp one(std::uint64_t{1} << -M_plus.e, M_plus.e);
+  return true;
+}
 
-  auto p1 = static_cast<std::uint32_t>(
-      M_plus.f >>
-      -one.e);  // p1 = f div 2^-e (Since -e >= 32, p1 fits into a 32-bit int.)
-  std::uint64_t p2 = M_plus.f & (one.f - 1);  // p2 = f mod 2^-e
+namespace detail {
 
-  // 1)
-  //
-  // Generate the digits of the integral part p1 = d[n-1]...d[1]d[0]
+bool flush_range(const uint8_t *addr, size_t nbytes, std::string *err) {
+  SAFETENSORS_CPP_STATS_PHASE(flush_seconds);
+  SAFETENSORS_CPP_STATS_ADD(syscalls, 1);
+  SAFETENSORS_CPP_STATS_ADD(bytes_written, nbytes);
+  counter_add(g_counters.bytes_written, nbytes);
+#if defined(_POSIX_MAPPED_FILES)
+  if (msync(const_cast<uint8_t *>(addr), nbytes, MS_SYNC) != 0) {
+    if (err) {
+      (*err) += "msync failed: " + errno_str(errno) + "\n";
+    }
+    return false;
+  }
+  return true;
+#elif defined(_WIN32)
+  if (!FlushViewOfFile(addr, nbytes)) {
+    if (err) {
+      (*err) += "FlushViewOfFile failed: " +
+                safetensors_format_win_err(GetLastError()) + "\n";
+    }
+    return false;
+  }
+  return true;
+#else
+  (void)addr;
+  (void)nbytes;
+  if (err) {
+    (*err) += "mmap not supported\n";
+  }
+  return false;
+#endif
+}
 
-  std::uint32_t pow10;
-  const int k = find_largest_pow10(p1, pow10);
+}  // namespace detail
 
-  //      10^(k-1) <= p1 < 10^k, pow10 = 10^(k-1)
-  //
-  //      p1 = (p1 div 10^(k-1)) * 10^(k-1) + (p1 mod 10^(k-1))
-  //         = (d[k-1]         ) * 10^(k-1) + (p1 mod 10^(k-1))
-  //
-  //      M+ = p1                                             + p2 * 2^e
-  //         = d[k-1] * 10^(k-1) + (p1 mod 10^(k-1))          + p2 * 2^e
-  //         = d[k-1] * 10^(k-1) + ((p1 mod 10^(k-1)) * 2^-e + p2) * 2^e
-  //         = d[k-1] * 10^(k-1) + (                         rest) * 2^e
-  //
-  // Now generate the digits d[n] of p1 from left to right (n = k-1,...,0)
-  //
-  //      p1 = d[k-1]...d[n] * 10^n + d[n-1]...d[0]
-  //
-  // but stop as soon as
-  //
-  //      rest * 2^e = (d[n-1]...d[0] * 2^-e + p2) * 2^e <= delta * 2^e
+bool flush_tensors(const safetensors_t &st,
+                   const std::vector<std::string> &names, std::string *err) {
+  SAFETENSORS_CPP_STATS_ENTRY();
 
-  int n = k;
-  while (n > 0) {
-    // Invariants:
-    //      M+ = buffer * 10^n + (p1 + p2 * 2^e)    (buffer = 0 for n = k)
-    //      pow10 = 10^(n-1) <= p1 < 10^n
-    //
-    const std::uint32_t d = p1 / pow10;  // d = p1 div 10^(n-1)
-    const std::uint32_t r = p1 % pow10;  // r = p1 mod 10^(n-1)
-    //
-    //      M+ = buffer * 10^n + (d * 10^(n-1) + r) + p2 * 2^e
-    //         = (buffer * 10 + d) * 10^(n-1) + (r + p2 * 2^e)
-    //
-    buffer[length++] = static_cast<char>('0' + d);  // buffer := buffer * 10 + d
-    //
-    //      M+ = buffer * 10^(n-1) + (r + p2 * 2^e)
-    //
-    p1 = r;
-    n--;
-    //
-    //      M+ = buffer * 10^n + (p1 + p2 * 2^e)
-    //      pow10 = 10^n
-    //
+  if (!st.mmaped || !st.st_mmap || (st.map_mode != kMMAP_READ_WRITE)) {
+    if (err) {
+      (*err) += "safetensors must be mmaped with `kMMAP_READ_WRITE`.\n";
+    }
+    return false;
+  }
 
-    // Now check if enough digits have been generated.
-    // Compute
-    //
-    //      p1 + p2 * 2^e = (p1 * 2^-e + p2) * 2^e = rest * 2^e
-    //
-    // Note:
-    // Since rest and delta share the same exponent e, it suffices to
-    // compare the significands.
-    const std::uint64_t rest = (std::uint64_t{p1} << -one.e) + p2;
-    if (rest <= delta) {
-      // V = buffer * 10^n, with M- <= V <= M+.
+  size_t page_size = detail::get_page_size();
+  uintptr_t mask = ~(uintptr_t(page_size) - 1);
 
-      decimal_exponent += n;
+  // page-aligned [begin, end) ranges relative to `mmap_addr`.
+  std::vector<std::array<size_t, 2>> ranges;
+  for (const std::string &name : names) {
+    const uint8_t *data{nullptr};
+    size_t nbytes{0};
+    // Not an access to the data: no trace record nor counter.
+    if (!detail::find_tensor_data(st, name, &data, &nbytes, err)) {
+      return false;
+    }
+    if (nbytes == 0) {
+      continue;
+    }
 
-      // We may now just stop. But instead look if the buffer could be
-      // decremented to bring V closer to w.
-      //
-      // pow10 = 10^n is now 1 ulp in the decimal representation V.
-      // The rounding procedure works with diyfp's with an implicit
-      // exponent of e.
-      //
-      //      10^n = (10^n * 2^-e) * 2^e = ulp * 2^e
-      //
-      const std::uint64_t ten_n = std::uint64_t{pow10} << -one.e;
-      grisu2_round(buffer, length, dist, delta, rest, ten_n);
+    // mmap_addr is page-aligned.
+    size_t b = size_t(uintptr_t(data - st.mmap_addr) & mask);
+    size_t e = size_t(data - st.mmap_addr) + nbytes;
+    ranges.push_back({{b, e}});
+  }
 
-      return;
+  std::sort(ranges.begin(), ranges.end());
+
+  size_t i = 0;
+  while (i < ranges.size()) {
+    size_t b = ranges[i][0];
+    size_t e = ranges[i][1];
+    // merge overlapping(or page-adjacent) ranges.
+    while (((i + 1) < ranges.size()) && (ranges[i + 1][0] <= e)) {
+      i++;
+      e = (std::max)(e, ranges[i][1]);
+    }
+    if (!detail::flush_range(st.mmap_addr + b, e - b, err)) {
+      return false;
     }
+    i++;
+  }
 
-    pow10 /= 10;
-    //
-    //      pow10 = 10^(n-1) <= p1 < 10^n
-    // Invariants restored.
+  return true;
+}
+
+bool residency_report(const safetensors_t &st,
+                      const std::vector<std::string> &used,
+                      page_residency *report, std::string *err) {
+  if (!report) {
+    return false;
   }
 
-  // 2)
-  //
-  // The digits of the integral part have been generated:
-  //
-  //      M+ = d[k-1]...d[1]d[0] + p2 * 2^e
-  //         = buffer            + p2 * 2^e
-  //
-  // Now generate the digits of the fractional part p2 * 2^e.
-  //
-  // Note:
-  // No decimal point is generated: the exponent is adjusted instead.
-  //
-  // p2 actually represents the fraction
-  //
-  //      p2 * 2^e
-  //          = p2 / 2^-e
-  //          = d[-1] / 10^1 + d[-2] / 10^2 + ...
-  //
-  // Now generate the digits d[-m] of p1 from left to right (m = 1,2,...)
-  //
-  //      p2 * 2^e = d[-1]d[-2]...d[-m] * 10^-m
-  //                      + 10^-m * (d[-m-1] / 10^1 + d[-m-2] / 10^2 + ...)
-  //
-  // using
-  //
-  //      10^m * p2 = ((10^m * p2) div 2^-e) * 2^-e + ((10^m * p2) mod 2^-e)
-  //                = (                   d) * 2^-e + (                   r)
-  //
-  // or
-  //      10^m * p2 * 2^e = d + r * 2^e
-  //
-  // i.e.
-  //
-  //      M+ = buffer + p2 * 2^e
-  //         = buffer + 10^-m * (d + r * 2^e)
-  //         = (buffer * 10^m + d) * 10^-m + 10^-m * r * 2^e
-  //
-  // and stop as soon as 10^-m * r * 2^e <= delta * 2^e
+#if defined(_POSIX_MAPPED_FILES)
+  size_t databuffer_size{0};
+  const uint8_t *databuffer = detail::get_databuffer(st, &databuffer_size);
+
+  size_t page_size = detail::get_page_size();
+  uintptr_t mask = ~(uintptr_t(page_size) - 1);
+
+  // Page index is relative to the page containing the databuffer start.
+  uintptr_t base = uintptr_t(databuffer) & mask;
+  size_t head = size_t(uintptr_t(databuffer) - base);
+  size_t npages = (head + databuffer_size + page_size - 1) / page_size;
+
+#if defined(__APPLE__)
+  std::vector<char> vec(npages);
+#else
+  std::vector<unsigned char> vec(npages);
+#endif
+  if (npages &&
+      (mincore(reinterpret_cast<void *>(base), npages * page_size,
+               vec.data()) != 0)) {
+    if (err) {
+      (*err) += "mincore failed: " + detail::errno_str(errno) + "\n";
+    }
+    return false;
+  }
+
+  page_residency r;
+  r.page_size = page_size;
+  r.pages = npages;
+  for (size_t i = 0; i < npages; i++) {
+    r.resident_pages += (vec[i] & 1) ? 1 : 0;
+  }
+
+  // [first, last) page of tensor. Empty for zero-sized tensor.
+  auto page_span = [&](const tensor_t &t, size_t *first, size_t *last) {
+    if (t.data_offsets[0] >= t.data_offsets[1]) {
+      (*first) = (*last) = 0;
+      return;
+    }
+    (*first) = (head + t.data_offsets[0]) / page_size;
+    (*last) = (head + t.data_offsets[1] + page_size - 1) / page_size;
+  };
+
+  r.tensors.resize(st.tensors.size());
+  for (size_t i = 0; i < st.tensors.size(); i++) {
+    tensor_residency &tr = r.tensors[i];
+    tr.name = st.tensors.keys()[i];
+    tensor_t t;
+    st.tensors.at(i, &t);
+    if ((t.data_offsets[0] > t.data_offsets[1]) ||
+        (t.data_offsets[1] > databuffer_size)) {
+      if (err) {
+        (*err) += "Tensor `" + tr.name + "` has invalid data_offsets.\n";
+      }
+      return false;
+    }
+    tr.nbytes = t.data_offsets[1] - t.data_offsets[0];
+
+    size_t first, last;
+    page_span(t, &first, &last);
+    tr.pages = last - first;
+    for (size_t p = first; p < last; p++) {
+      tr.resident_pages += (vec[p] & 1) ? 1 : 0;
+    }
+  }
 
-  int m = 0;
-  for (;;) {
-    // Invariant:
-    //      M+ = buffer * 10^-m + 10^-m * (d[-m-1] / 10 + d[-m-2] / 10^2 + ...)
-    //      * 2^e
-    //         = buffer * 10^-m + 10^-m * (p2                                 )
-    //         * 2^e = buffer * 10^-m + 10^-m * (1/10 * (10 * p2) ) * 2^e =
-    //         buffer * 10^-m + 10^-m * (1/10 * ((10*p2 div 2^-e) * 2^-e +
-    //         (10*p2 mod 2^-e)) * 2^e
-    //
-    p2 *= 10;
-    const std::uint64_t d = p2 >> -one.e;      // d = (10 * p2) div 2^-e
-    const std::uint64_t r = p2 & (one.f - 1);  // r = (10 * p2) mod 2^-e
-    //
-    //      M+ = buffer * 10^-m + 10^-m * (1/10 * (d * 2^-e + r) * 2^e
-    //         = buffer * 10^-m + 10^-m * (1/10 * (d + r * 2^e))
-    //         = (buffer * 10 + d) * 10^(-m-1) + 10^(-m-1) * r * 2^e
-    //
-    buffer[length++] = static_cast<char>('0' + d);  // buffer := buffer * 10 + d
-    //
-    //      M+ = buffer * 10^(-m-1) + 10^(-m-1) * r * 2^e
-    //
-    p2 = r;
-    m++;
-    //
-    //      M+ = buffer * 10^-m + 10^-m * p2 * 2^e
-    // Invariant restored.
+  if (used.size()) {
+    std::vector<uint8_t> used_page(npages, 0);
+    for (const std::string &name : used) {
+      tensor_t t;
+      if (!st.tensors.at(name, &t)) {
+        if (err) {
+          (*err) += "Tensor `" + name + "` not found.\n";
+        }
+        return false;
+      }
+      r.used_bytes += t.data_offsets[1] - t.data_offsets[0];
 
-    // Check if enough digits have been generated.
-    //
-    //      10^-m * p2 * 2^e <= delta * 2^e
-    //              p2 * 2^e <= 10^m * delta * 2^e
-    //                    p2 <= 10^m * delta
-    delta *= 10;
-    dist *= 10;
-    if (p2 <= delta) {
-      break;
+      size_t first, last;
+      page_span(t, &first, &last);
+      for (size_t p = first; p < last; p++) {
+        used_page[p] = 1;
+      }
+    }
+
+    for (size_t p = 0; p < npages; p++) {
+      bool resident = (vec[p] & 1);
+      if (used_page[p]) {
+        r.used_pages++;
+        r.used_resident_pages += resident ? 1 : 0;
+      } else {
+        r.unused_resident_pages += resident ? 1 : 0;
+      }
+    }
+
+    if (r.used_bytes) {
+      r.layout_amplification =
+          double(r.used_pages * page_size) / double(r.used_bytes);
+      r.read_amplification =
+          double(r.resident_pages * page_size) / double(r.used_bytes);
     }
   }
 
-  // V = buffer * 10^-m, with M- <= V <= M+.
+  (*report) = std::move(r);
 
-  decimal_exponent -= m;
+  return true;
+#else
+  (void)st;
+  (void)used;
+  if (err) {
+    (*err) += "residency_report is not supported on this platform.\n";
+  }
+  return false;
+#endif
+}
 
-  // 1 ulp in the decimal representation is now 10^-m.
-  // Since delta and dist are now scaled by 10^m, we need to do the
-  // same with ulp in order to keep the units in sync.
-  //
-  //      10^m * 10^-m = 1 = 2^-e * 2^e = ten_m * 2^e
-  //
-  const std::uint64_t ten_m = one.f;
-  grisu2_round(buffer, length, dist, delta, p2, ten_m);
+namespace detail {
 
-  // By construction this algorithm generates the shortest possible decimal
-  // number (Loitsch, Theorem 6.2) which rounds back to w.
-  // For an input number of precision p, at least
-  //
-  //      N = 1 + ceil(p * log_10(2))
-  //
-  // decimal digits are sufficient to identify all binary floating-point
-  // numbers (Matula, "In-and-Out conversions").
-  // This implies that the algorithm does not produce more than N decimal
-  // digits.
-  //
-  //      N = 17 for p = 53 (IEEE double precision)
-  //      N = 9  for p = 24 (IEEE single precision)
+// Hash of the tensor table(names, dtypes, shapes and data_offsets in order)
+// identifying the file an access trace is recorded for.
+std::string tensor_table_hash(const safetensors_t &st) {
+  std::string s;
+  for (size_t i = 0; i < st.tensors.size(); i++) {
+    tensor_t t;
+    st.tensors.at(i, &t);
+    s += st.tensors.keys()[i];
+    s += '\0';
+    s += get_dtype_str(t.dtype);
+    for (size_t d : t.shape) {
+      s += "," + std::to_string(d);
+    }
+    s += ";" + std::to_string(t.data_offsets[0]) + "," +
+         std::to_string(t.data_offsets[1]) + '\0';
+  }
+  return to_hex64(
+      hash_bytes(reinterpret_cast<const uint8_t *>(s.data()), s.size()));
 }
 
-/*!
-v = buf * 10^decimal_exponent
-len is the length of the buffer (number of decimal digits)
-The buffer must be large enough, i.e. >= max_digits10.
-*/
-inline void grisu2(char *buf, int &len, int &decimal_exponent, diyfp m_minus,
-                   diyfp v, diyfp m_plus) {
-  //  --------(-----------------------+-----------------------)--------    (A)
-  //          m-                      v                       m+
-  //
-  //  --------------------(-----------+-----------------------)--------    (B)
-  //                      m-          v                       m+
-  //
-  // First scale v (and m- and m+) such that the exponent is in the range
-  // [alpha, gamma].
+// Parse decimal number. Advances `p`.
+bool parse_trace_number(const char *&p, const char *end, size_t *v) {
+  const char *s = p;
+  size_t n = 0;
+  while ((p < end) && (*p >= '0') && (*p <= '9')) {
+    size_t d = size_t(*p - '0');
+    if (n > ((std::numeric_limits<size_t>::max)() - d) / 10) {
+      return false;  // overflow
+    }
+    n = n * 10 + d;
+    p++;
+  }
+  (*v) = n;
+  return p != s;
+}
 
-  const cached_power cached = get_cached_power_for_binary_exponent(m_plus.e);
+}  // namespace detail
 
-  const diyfp c_minus_k(cached.f, cached.e);  // = c ~= 10^-k
+bool serialize_access_trace(const safetensors_t &st, const access_trace &trace,
+                            std::string *out, std::string *err) {
+  if (!out) {
+    return false;
+  }
 
-  // The exponent of the products is = v.e + c_minus_k.e + q and is in the range
-  // [alpha,gamma]
-  const diyfp w = diyfp::mul(v, c_minus_k);
-  const diyfp w_minus = diyfp::mul(m_minus, c_minus_k);
-  const diyfp w_plus = diyfp::mul(m_plus, c_minus_k);
+  std::map<std::string, size_t> indices;
+  for (size_t i = 0; i < st.tensors.keys().size(); i++) {
+    indices[st.tensors.keys()[i]] = i;
+  }
 
-  //  ----(---+---)---------------(---+---)---------------(---+---)----
-  //          w-                      w                       w+
-  //          = c*m-                  = c*v                   = c*m+
-  //
-  // diyfp::mul rounds its result and c_minus_k is approximated too. w, w- and
-  // w+ are now off by a small amount.
-  // In fact:
-  //
-  //      w - v * 10^k < 1 ulp
-  //
-  // To account for this inaccuracy, add resp. subtract 1 ulp.
-  //
-  //  --------+---[---------------(---+---)---------------]---+--------
-  //          w-  M-                  w                   M+  w+
-  //
-  // Now any number in [M-, M+] (bounds included) will round to w when input,
-  // regardless of how the input rounding algorithm breaks ties.
-  //
-  // And digit_gen generates the shortest possible such number in [M-, M+].
-  // Note that this does not mean that Grisu2 always generates the shortest
-  // possible number in the interval (m-, m+).
-  const diyfp M_minus(w_minus.f + 1, w_minus.e);
-  const diyfp M_plus(w_plus.f - 1, w_plus.e);
+  std::stringstream ss;
+  ss << "v1/" << st.tensors.size() << "/" << detail::tensor_table_hash(st);
 
-  decimal_exponent = -cached.k;  // = -(-k) = k
+  // Only the first access of the same range is meaningful to replay.
+  std::map<std::string, std::vector<std::array<size_t, 2>>> seen;
 
-  grisu2_digit_gen(buf, len, decimal_exponent, M_minus, w, M_plus);
-}
+  for (const access_record &r : trace.records) {
+    auto it = indices.find(r.name);
+    if (it == indices.end()) {
+      if (err) {
+        (*err) += "Tensor `" + r.name + "` in trace not found.\n";
+      }
+      return false;
+    }
 
-/*!
-v = buf * 10^decimal_exponent
-len is the length of the buffer (number of decimal digits)
-The buffer must be large enough, i.e. >= max_digits10.
-*/
-template <typename FloatType>
-void grisu2(char *buf, int &len, int &decimal_exponent, FloatType value) {
-  static_assert(diyfp::kPrecision >= std::numeric_limits<FloatType>::digits + 3,
-                "internal error: not enough precision");
+    tensor_t tensor;
+    st.tensors.at(it->second, &tensor);
+    if (tensor.data_offsets[0] > tensor.data_offsets[1]) {
+      if (err) {
+        (*err) += "Tensor `" + r.name + "` has invalid data_offsets.\n";
+      }
+      return false;
+    }
+    size_t tensor_bytes = tensor.data_offsets[1] - tensor.data_offsets[0];
 
-  // If the neighbors (and boundaries) of 'value' are always computed for
-  // double-precision numbers, all float's can be recovered using strtod (and
-  // strtof). However, the resulting decimal representations are not exactly
-  // "short".
-  //
-  // The documentation for 'std::to_chars'
-  // (https://en.cppreference.com/w/cpp/utility/to_chars) says "value is
-  // converted to a string as if by std::sprintf in the default ("C") locale"
-  // and since sprintf promotes float's to double's, I think this is exactly
-  // what 'std::to_chars' does. On the other hand, the documentation for
-  // 'std::to_chars' requires that "parsing the representation using the
-  // corresponding std::from_chars function recovers value exactly". That
-  // indicates that single precision floating-point numbers should be recovered
-  // using 'std::strtof'.
-  //
-  // NB: If the neighbors are computed for single-precision numbers, there is a
-  // single float
-  //     (7.0385307e-26f) which can't be recovered using strtod. The resulting
-  //     double precision value is off by 1 ulp.
-#if 0
-    const boundaries w = compute_boundaries(static_cast<double>(value));
-#else
-  const boundaries w = compute_boundaries(value);
-#endif
+    if ((r.begin > r.end) || (r.end > tensor_bytes)) {
+      if (err) {
+        (*err) += "Invalid byte range for tensor `" + r.name + "` in trace.\n";
+      }
+      return false;
+    }
 
-  grisu2(buf, len, decimal_exponent, w.minus, w.w, w.plus);
+    std::vector<std::array<size_t, 2>> &ranges = seen[r.name];
+    bool covered = false;
+    for (const std::array<size_t, 2> &c : ranges) {
+      if ((c[0] <= r.begin) && (r.end <= c[1])) {
+        covered = true;
+        break;
+      }
+    }
+    if (covered) {
+      continue;
+    }
+    ranges.push_back({{r.begin, r.end}});
+
+    ss << ";" << it->second;
+    if ((r.begin != 0) || (r.end != tensor_bytes)) {
+      ss << ":" << r.begin << ":" << r.end;
+    }
+  }
+
+  (*out) = ss.str();
+
+  return true;
 }
 
-/*!
-@brief appends a decimal representation of e to buf
-@return a pointer to the element following the exponent.
-@pre -1000 < e < 1000
-*/
-inline char *append_exponent(char *buf, int e) {
-  if (e < 0) {
-    e = -e;
-    *buf++ = '-';
-  } else {
-    *buf++ = '+';
+bool parse_access_trace(const safetensors_t &st, const std::string &s,
+                        access_trace *trace, std::string *err) {
+  if (!trace) {
+    return false;
   }
 
-  auto k = static_cast<std::uint32_t>(e);
-  if (k < 10) {
-    // Always print at least two digits in the exponent.
-    // This is for compatibility with printf("%g").
-    *buf++ = '0';
-    *buf++ = static_cast<char>('0' + k);
-  } else if (k < 100) {
-    *buf++ = static_cast<char>('0' + k / 10);
-    k %= 10;
-    *buf++ = static_cast<char>('0' + k);
-  } else {
-    *buf++ = static_cast<char>('0' + k / 100);
-    k %= 100;
-    *buf++ = static_cast<char>('0' + k / 10);
-    k %= 10;
-    *buf++ = static_cast<char>('0' + k);
+  const char *p = s.c_str();
+  const char *end = p + s.size();
+
+  if ((s.size() < 3) || (s.compare(0, 3, "v1/") != 0)) {
+    if (err) {
+      (*err) += "Unknown access trace format.\n";
+    }
+    return false;
+  }
+  p += 3;
+
+  size_t ntensors{0};
+  if (!detail::parse_trace_number(p, end, &ntensors)) {
+    if (err) {
+      (*err) += "Failed to parse the number of tensors in access trace.\n";
+    }
+    return false;
+  }
+
+  if (ntensors != st.tensors.size()) {
+    if (err) {
+      (*err) += "Access trace is recorded for " + std::to_string(ntensors) +
+                " tensors, but safetensors has " +
+                std::to_string(st.tensors.size()) + " tensors.\n";
+    }
+    return false;
+  }
+
+  const std::string table_hash = detail::tensor_table_hash(st);
+  if ((size_t(end - p) < (1 + table_hash.size())) || (*p != '/') ||
+      (s.compare(size_t(p + 1 - s.c_str()), table_hash.size(), table_hash) !=
+       0)) {
+    if (err) {
+      (*err) += "Access trace is recorded for other tensors(names, dtypes, "
+                "shapes or data_offsets differ).\n";
+    }
+    return false;
+  }
+  p += 1 + table_hash.size();
+
+  std::vector<access_record> records;
+
+  while (p < end) {
+    if (*p != ';') {
+      if (err) {
+        (*err) += "Access trace is corrupted at offset " +
+                  std::to_string(p - s.c_str()) + ".\n";
+      }
+      return false;
+    }
+    p++;
+
+    size_t idx{0};
+    if (!detail::parse_trace_number(p, end, &idx) || (idx >= ntensors)) {
+      if (err) {
+        (*err) += "Invalid tensor index in access trace.\n";
+      }
+      return false;
+    }
+
+    tensor_t tensor;
+    st.tensors.at(idx, &tensor);
+    if (tensor.data_offsets[0] > tensor.data_offsets[1]) {
+      if (err) {
+        (*err) += "Tensor `" + st.tensors.keys()[idx] +
+                  "` has invalid data_offsets.\n";
+      }
+      return false;
+    }
+
+    access_record r;
+    r.name = st.tensors.keys()[idx];
+    r.begin = 0;
+    r.end = tensor.data_offsets[1] - tensor.data_offsets[0];
+
+    if ((p < end) && (*p == ':')) {
+      p++;
+      size_t b{0}, e{0};
+      bool ok = detail::parse_trace_number(p, end, &b);
+      ok = ok && (p < end) && (*p == ':');
+      if (ok) {
+        p++;
+        ok = detail::parse_trace_number(p, end, &e);
+      }
+      if (!ok || (b > e) || (e > r.end)) {
+        if (err) {
+          (*err) += "Invalid byte range for tensor `" + r.name +
+                    "` in access trace.\n";
+        }
+        return false;
+      }
+      r.begin = b;
+      r.end = e;
+    }
+
+    records.emplace_back(std::move(r));
   }
 
-  return buf;
+  trace->records = std::move(records);
+
+  return true;
 }
 
-/*!
-@brief prettify v = buf * 10^decimal_exponent
-If v is in the range [10^min_exp, 10^max_exp) it will be printed in fixed-point
-notation. Otherwise it will be printed in exponential notation.
-@pre min_exp < 0
-@pre max_exp > 0
-*/
-inline char *format_buffer(char *buf, int len, int decimal_exponent,
-                           int min_exp, int max_exp) {
-  const int k = len;
-  const int n = len + decimal_exponent;
+bool save_access_trace(const safetensors_t &st, const access_trace &trace,
+                       const std::string &filename, std::string *err) {
+  std::string s;
+  if (!serialize_access_trace(st, trace, &s, err)) {
+    return false;
+  }
 
-  // v = buf * 10^(n-k)
-  // k is the length of the buffer (number of decimal digits)
-  // n is the position of the decimal point relative to the start of the buffer.
+  std::ofstream ofs(filename, std::ios::binary);
+  if (!ofs) {
+    if (err) {
+      (*err) += "Failed to open `" + filename + "` to write.\n";
+    }
+    return false;
+  }
 
-  if (k <= n && n <= max_exp) {
-    // digits[000]
-    // len <= max_exp + 2
+  ofs.write(s.data(), std::streamsize(s.size()));
+  if (!ofs) {
+    if (err) {
+      (*err) += "Failed to write access trace to `" + filename + "`.\n";
+    }
+    return false;
+  }
 
-    std::memset(buf + k, '0', static_cast<size_t>(n) - static_cast<size_t>(k));
-    // Make it look like a floating-point number (#362, #378)
-    buf[n + 0] = '.';
-    buf[n + 1] = '0';
-    return buf + (static_cast<size_t>(n)) + 2;
+  return true;
+}
+
+bool load_access_trace(const safetensors_t &st, const std::string &filename,
+                       access_trace *trace, std::string *err) {
+  std::vector<unsigned char> data;
+  if (!detail::ReadWholeFile(&data, err, filename, nullptr)) {
+    return false;
   }
 
-  if (0 < n && n <= max_exp) {
-    // dig.its
-    // len <= max_digits10 + 1
-    std::memmove(buf + (static_cast<size_t>(n) + 1), buf + n,
-                 static_cast<size_t>(k) - static_cast<size_t>(n));
-    buf[n] = '.';
-    return buf + (static_cast<size_t>(k) + 1U);
+  std::string s(reinterpret_cast<const char *>(data.data()), data.size());
+  // allow trailing newline
+  while (s.size() && ((s.back() == '\n') || (s.back() == '\r'))) {
+    s.pop_back();
   }
 
-  if (min_exp < n && n <= 0) {
-    // 0.[000]digits
-    // len <= 2 + (-min_exp - 1) + max_digits10
+  return parse_access_trace(st, s, trace, err);
+}
 
-    std::memmove(buf + (2 + static_cast<size_t>(-n)), buf,
-                 static_cast<size_t>(k));
-    buf[0] = '0';
-    buf[1] = '.';
-    std::memset(buf + 2, '0', static_cast<size_t>(-n));
-    return buf + (2U + static_cast<size_t>(-n) + static_cast<size_t>(k));
+bool replay_access_trace(const safetensors_t &st, const access_trace &trace,
+                         std::string *err) {
+  if (!st.mmaped) {
+    return true;
   }
 
-  if (k == 1) {
-    // dE+123
-    // len <= 1 + 5
+  size_t page_size = detail::get_page_size();
 
-    buf += 1;
-  } else {
-    // d.igitsE+123
-    // len <= max_digits10 + 1 + 5
+  for (const access_record &r : trace.records) {
+    tensor_t tensor;
+    if (!st.tensors.at(r.name, &tensor)) {
+      if (err) {
+        (*err) += "Tensor `" + r.name + "` in trace not found.\n";
+      }
+      return false;
+    }
 
-    std::memmove(buf + 2, buf + 1, static_cast<size_t>(k) - 1);
-    buf[1] = '.';
-    buf += 1 + static_cast<size_t>(k);
+    if ((tensor.data_offsets[0] > tensor.data_offsets[1]) ||
+        (tensor.data_offsets[1] > st.databuffer_size) || (r.begin > r.end) ||
+        (r.end > (tensor.data_offsets[1] - tensor.data_offsets[0]))) {
+      if (err) {
+        (*err) += "Invalid byte range for tensor `" + r.name + "` in trace.\n";
+      }
+      return false;
+    }
+
+    detail::byte_range range;
+    range.begin = st.databuffer_addr + tensor.data_offsets[0] + r.begin;
+    range.end = st.databuffer_addr + tensor.data_offsets[0] + r.end;
+    detail::advise_willneed(range, page_size);
   }
 
-  *buf++ = 'e';
-  return append_exponent(buf, n - 1);
+  return true;
 }
 
-}  // namespace dtoa_impl
+namespace detail {
 
-/*!
-The format of the resulting decimal representation is similar to printf's %g
-format. Returns an iterator pointing past-the-end of the decimal representation.
-@note The input number must be finite, i.e. NaN's and Inf's are not supported.
-@note The buffer must be large enough.
-@note The result is NOT null-terminated.
-*/
-char *to_chars(char *first, const char *last, double value) {
-  static_cast<void>(last);  // maybe unused - fix warning
+struct mmap_writer_impl {
+  std::string filename;
+  safetensors_t layout;  // tensors with computed data_offsets.
+  size_t header_bytes{0};  // 8 + padded header size
+  size_t total_bytes{0};
+  safetensors_file *file{nullptr};
+  safetensors_mmap *mapping{nullptr};
+  bool finalized{false};
 
-  // bool negative = std::signbit(value);
-  bool negative = (*reinterpret_cast<uint64_t *>(&value)) & (1 << 31ull);
-  if (negative) {
-    value = -value;
-    *first++ = '-';
+  // Unmap and close. Returns false when closing the file failed.
+  bool close() {
+    delete mapping;
+    mapping = nullptr;
+    bool ok = true;
+    if (file) {
+      ok = file->close();
+      delete file;
+      file = nullptr;
+    }
+    return ok;
   }
 
-#ifdef __clang__
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wfloat-equal"
-#endif
-
-  if (value == 0)  // +-0
-  {
-    *first++ = '0';
-    // Make it look like a floating-point number (#362, #378)
-    *first++ = '.';
-    *first++ = '0';
-    return first;
+  ~mmap_writer_impl() {
+    bool opened = (file != nullptr);
+    close();
+    if (opened && !finalized) {
+      // Remove incomplete output.
+      std::remove(filename.c_str());
+    }
   }
+};
 
-#ifdef __clang__
-#pragma clang diagnostic pop
+bool resize_file(safetensors_file *file, size_t size, std::string *err) {
+#if defined(_WIN32)
+  errno_t ret = _chsize_s(file->fd, __int64(size));
+  if (ret != 0) {
+    if (err) {
+      (*err) += "Failed to resize file: " + errno_str(ret) + "\n";
+    }
+    return false;
+  }
+#else
+  if (ftruncate(file->fd, off_t(size)) != 0) {
+    if (err) {
+      (*err) += "ftruncate failed: " + errno_str(errno) + "\n";
+    }
+    return false;
+  }
 #endif
-
-  // Compute v = buffer * 10^decimal_exponent.
-  // The decimal digits are stored in the buffer, which needs to be interpreted
-  // as an unsigned decimal integer.
-  // len is the length of the buffer, i.e. the number of decimal digits.
-  int len = 0;
-  int decimal_exponent = 0;
-  dtoa_impl::grisu2(first, len, decimal_exponent, value);
-  // Format the buffer like printf("%.*g", prec, value)
-  constexpr int kMinExp = -4;
-  constexpr int kMaxExp = std::numeric_limits<double>::digits10;
-
-  return dtoa_impl::format_buffer(first, len, decimal_exponent, kMinExp,
-                                  kMaxExp);
+  file->size = size;
+  return true;
 }
-}  // namespace internal
-}  // namespace simdjson
-}  // namespace minijson
-
-#endif  // !MINIJSON_USE_STRTOD
-
-#endif  // MINIJSON_IMPLEMENTATION
 
+}  // namespace detail
 
-namespace safetensors {
+mmap_writer::~mmap_writer() {
+  delete reinterpret_cast<detail::mmap_writer_impl *>(_impl);
+  _impl = nullptr;
+}
 
-// Max header(JSON) size. 100 MB as done in original safetensors implementation.
-constexpr size_t kMaxJSONSize = 1024ull * 1024ull * 100ull;
+bool mmap_writer::open(const std::string &filename, const safetensors_t &layout,
+                       std::string *warn, std::string *err) {
+  SAFETENSORS_CPP_STATS_ENTRY();
 
-namespace detail {
+  delete reinterpret_cast<detail::mmap_writer_impl *>(_impl);
+  _impl = nullptr;
 
-#ifdef _WIN32
-std::wstring UTF8ToWchar(const std::string &str) {
-  int wstr_size =
-      MultiByteToWideChar(CP_UTF8, 0, str.data(), int(str.size()), nullptr, 0);
-  std::wstring wstr(size_t(wstr_size), 0);
-  MultiByteToWideChar(CP_UTF8, 0, str.data(), int(str.size()), &wstr[0],
-                      int(wstr.size()));
-  return wstr;
-}
+  std::unique_ptr<detail::mmap_writer_impl> p(new detail::mmap_writer_impl());
+  p->filename = filename;
+  p->layout.metadata = layout.metadata;
 
-std::string WcharToUTF8(const std::wstring &wstr) {
-  int str_size = WideCharToMultiByte(CP_UTF8, 0, wstr.data(), int(wstr.size()),
-                                     nullptr, 0, nullptr, nullptr);
-  std::string str(size_t(str_size), 0);
-  WideCharToMultiByte(CP_UTF8, 0, wstr.data(), int(wstr.size()), &str[0],
-                      int(str.size()), nullptr, nullptr);
-  return str;
-}
-#endif
+  // Plan data layout.
+  size_t offset = 0;
+  for (size_t i = 0; i < layout.tensors.size(); i++) {
+    const std::string &key = layout.tensors.keys()[i];
+    tensor_t tensor;
+    layout.tensors.at(i, &tensor);
 
-bool ReadWholeFile(std::vector<unsigned char> *out, std::string *err,
-                   const std::string &filepath, void *) {
-#ifdef SAFETENSORS_CPP_ANDROID_LOAD_FROM_ASSETS
-  if (asset_manager) {
-    AAsset *asset = AAssetManager_open(asset_manager, filepath.c_str(),
-                                       AASSET_MODE_STREAMING);
-    if (!asset) {
+    size_t nitems = get_shape_size(tensor);
+    size_t itembytes = get_dtype_bytes(tensor.dtype);
+    if ((itembytes != 0) && (nitems > ((std::numeric_limits<size_t>::max)() -
+                                       offset) / itembytes)) {
       if (err) {
-        (*err) += "File open error : " + filepath + "\n";
+        (*err) += "Tensor `" + key + "` is too large.\n";
       }
       return false;
     }
-    size_t size = AAsset_getLength(asset);
-    if (size == 0) {
-      if (err) {
-        (*err) += "Invalid file size : " + filepath +
-                  " (does the path point to a directory?)";
-      }
-      return false;
+
+    size_t sz = nitems * itembytes;
+    tensor.data_offsets[0] = offset;
+    tensor.data_offsets[1] = offset + sz;
+    offset += sz;
+
+    p->layout.tensors.insert(key, std::move(tensor));
+  }
+
+  std::string header_str;
+  if (!detail::serialize_header(p->layout, &header_str, err)) {
+    return false;
+  }
+
+  p->header_bytes = 8 + detail::get_padded_header_size(header_str.size());
+  size_t total = p->header_bytes + offset;
+  p->total_bytes = total;
+
+  SAFETENSORS_CPP_STATS_TIMER_START(open_timer);
+  p->file = new detail::safetensors_file(filename.c_str(), "w+b");
+  SAFETENSORS_CPP_STATS_TIMER_STOP(open_timer, open_seconds);
+  SAFETENSORS_CPP_STATS_ADD(syscalls, 2);
+  if (!p->file->is_valid()) {
+    if (err) {
+      (*err) += p->file->get_error();
     }
-    out->resize(size);
-    AAsset_read(asset, reinterpret_cast<char *>(&out->at(0)), size);
-    AAsset_close(asset);
-    return true;
-  } else {
+    delete p->file;
+    p->file = nullptr;
+    return false;
+  }
+
+  if (!detail::resize_file(p->file, total, err)) {
+    return false;
+  }
+  SAFETENSORS_CPP_STATS_ADD(syscalls, 1);
+
+  // No prefetch: all pages are going to be written.
+  SAFETENSORS_CPP_STATS_TIMER_START(mmap_timer);
+  p->mapping = new detail::safetensors_mmap(p->file, 0, false, kMMAP_READ_WRITE);
+  SAFETENSORS_CPP_STATS_TIMER_STOP(mmap_timer, mmap_seconds);
+  SAFETENSORS_CPP_STATS_ADD(syscalls, 1);
+  if (!p->mapping->addr) {
     if (err) {
-      (*err) += "No asset manager specified : " + filepath + "\n";
+      (*err) += p->mapping->get_error();
     }
     return false;
   }
-#else
-#ifdef _WIN32
-#if defined(__GLIBCXX__)  // mingw
-  int file_descriptor =
-      _wopen(UTF8ToWchar(filepath).c_str(), _O_RDONLY | _O_BINARY);
-  __gnu_cxx::stdio_filebuf<char> wfile_buf(file_descriptor, std::ios_base::in);
-  std::istream f(&wfile_buf);
-#elif defined(_MSC_VER) || defined(_LIBCPP_VERSION)
-  // For libcxx, assume _LIBCPP_HAS_OPEN_WITH_WCHAR is defined to accept
-  // `wchar_t *`
-  std::ifstream f(UTF8ToWchar(filepath).c_str(), std::ifstream::binary);
-#else
-  // Unknown compiler/runtime
-  std::ifstream f(filepath.c_str(), std::ifstream::binary);
-#endif
-#else
-  std::ifstream f(filepath.c_str(), std::ifstream::binary);
-#endif
-  if (!f) {
+
+  if (warn && p->mapping->get_warning().size()) {
+    (*warn) += p->mapping->get_warning();
+  }
+  detail::counter_add(detail::g_counters.bytes_mapped, p->mapping->size);
+
+  detail::write_header(header_str, p->mapping->addr);
+
+  _impl = p.release();
+
+  return true;
+}
+
+bool mmap_writer::get_tensor_data(const std::string &name, uint8_t **data,
+                                  size_t *nbytes, std::string *err) {
+  detail::mmap_writer_impl *p =
+      reinterpret_cast<detail::mmap_writer_impl *>(_impl);
+  if (!p || !p->mapping || !data || !nbytes) {
     if (err) {
-      (*err) += "File open error : " + filepath + "\n";
+      (*err) += "mmap_writer is not opened.\n";
     }
     return false;
   }
 
-  // For directory(and pipe?), peek() will fail(Posix gnustl/libc++ only)
-  f.peek();
-  if (!f) {
+  tensor_t tensor;
+  if (!p->layout.tensors.at(name, &tensor)) {
     if (err) {
-      (*err) +=
-          "File read error. Maybe empty file or invalid file : " + filepath +
-          "\n";
+      (*err) += "Tensor `" + name + "` not found.\n";
     }
     return false;
   }
 
-  f.seekg(0, f.end);
-  size_t sz = static_cast<size_t>(f.tellg());
+  (*data) = p->mapping->addr + p->header_bytes + tensor.data_offsets[0];
+  (*nbytes) = tensor.data_offsets[1] - tensor.data_offsets[0];
 
-  // std::cout << "sz = " << sz << "\n";
-  f.seekg(0, f.beg);
+  return true;
+}
 
-  if (int64_t(sz) < 0) {
+bool mmap_writer::finalize(std::string *err) {
+  SAFETENSORS_CPP_STATS_ENTRY();
+
+  detail::mmap_writer_impl *p =
+      reinterpret_cast<detail::mmap_writer_impl *>(_impl);
+  if (!p || !p->mapping) {
     if (err) {
-      (*err) += "Invalid file size : " + filepath +
-                " (does the path point to a directory?)";
+      (*err) += "mmap_writer is not opened.\n";
     }
     return false;
-  } else if (sz == 0) {
-    if (err) {
-      (*err) += "File is empty : " + filepath + "\n";
-    }
+  }
+
+  detail::progress_scope progress("mmap_writer::finalize");
+  progress.info.bytes_total = p->mapping->size;
+  progress.set_tensors(&p->layout);
+  uint8_t *addr = p->mapping->addr;
+  // msync requires page-aligned address. `kProgressChunkSize` is a multiple
+  // of the page size.
+  bool ok = detail::process_chunked(
+      &progress, p->mapping->size, p->header_bytes, err,
+      [&](size_t offset, size_t len) {
+        return detail::flush_range(addr + offset, len, err);
+      });
+  if (!ok) {
+    // The output file is removed when the writer is destroyed.
     return false;
-  } else if (sz >= (std::numeric_limits<std::streamoff>::max)()) {
+  }
+
+  if (!p->close()) {
     if (err) {
-      (*err) += "Invalid file size : " + filepath + "\n";
+      (*err) += "Failed to close `" + p->filename + "`.\n";
     }
     return false;
   }
 
-  out->resize(sz);
-  f.read(reinterpret_cast<char *>(&out->at(0)),
-         static_cast<std::streamsize>(sz));
+  p->finalized = true;
 
   return true;
+}
+
+size_t mmap_writer::file_size() const {
+  const detail::mmap_writer_impl *p =
+      reinterpret_cast<const detail::mmap_writer_impl *>(_impl);
+  if (!p) {
+    return 0;
+  }
+  return p->total_bytes;
+}
+
+namespace detail {
+
+struct lazy_slot {
+  std::atomic<uint8_t *> data{nullptr};
+#if defined(SAFETENSORS_CPP_USE_THREADS)
+  std::mutex mtx;  // serializes reads. Not held once `data` is published.
 #endif
+};
+
+struct lazy_loader_impl {
+  safetensors_t header;
+  safetensors_file *file{nullptr};
+  uint64_t data_offset{0};  // file offset of the databuffer
+
+  // Immutable after `open()`.
+  std::map<std::string, size_t> index;
+  std::vector<tensor_t> tensors;
+  std::unique_ptr<lazy_slot[]> slots;
+
+  std::atomic<size_t> materialized_bytes{0};
+  std::atomic<size_t> num_reads{0};
+
+  ~lazy_loader_impl() {
+    for (size_t i = 0; i < tensors.size(); i++) {
+      delete[] slots[i].data.load(std::memory_order_relaxed);
+    }
+    delete file;
+  }
+
+  // Read tensor `i` and publish it. Returns nullptr on failure.
+  uint8_t *materialize(size_t i, std::string *err) {
+    const tensor_t &t = tensors[i];
+    size_t n = t.data_offsets[1] - t.data_offsets[0];
+    // Allocate at least 1 byte so that empty tensor has non-null address.
+    uint8_t *buf = new uint8_t[(std::max)(n, size_t(1))];
+    num_reads.fetch_add(1, std::memory_order_relaxed);
+    if (!file->read_at(buf, n, data_offset + t.data_offsets[0], err)) {
+      delete[] buf;
+      return nullptr;
+    }
+
+    uint8_t *expected = nullptr;
+    if (!slots[i].data.compare_exchange_strong(expected, buf,
+                                               std::memory_order_acq_rel,
+                                               std::memory_order_acquire)) {
+      // Another thread published first.
+      delete[] buf;
+      return expected;
+    }
+    materialized_bytes.fetch_add(n, std::memory_order_relaxed);
+    counter_add(g_counters.bytes_read, n);
+    counter_add(g_counters.tensors_materialized, 1);
+    return buf;
+  }
+};
+
+}  // namespace detail
+
+lazy_loader::~lazy_loader() {
+  delete reinterpret_cast<detail::lazy_loader_impl *>(_impl);
+  _impl = nullptr;
 }
 
-bool parse_metadata(const ::minijson::value &v,
-                    ordered_dict<std::string> &dst, std::string *err) {
-  if (auto po = v.as<::minijson::object>()) {
-    for (size_t i = 0; i < po->size(); i++) {
-      ::minijson::value ov;
-      if (!po->at(i, &ov)) {
-          if (err) {
-            (*err) +=
-                "[Internal error] Invalid object found in __metadata__, at index " + std::to_string(i) + ".\n";
-          }
-          return false;
-      }
+bool lazy_loader::open(const std::string &filename, std::string *warn,
+                       std::string *err) {
+  SAFETENSORS_CPP_STATS_ENTRY();
 
-      if (auto so = ov.as<std::string>()) {
-        if (dst.count(po->keys()[i])) {
-          // This should not be happen though
-          if (err) {
-            (*err) +=
-                "Duplicate key `" + po->keys()[i] + "` found in __metadata__.\n";
-          }
-          return false;
-        }
+  delete reinterpret_cast<detail::lazy_loader_impl *>(_impl);
+  _impl = nullptr;
 
-        dst.insert(po->keys()[i], *so);
-      } else {
-        if (err) {
-          (*err) += "`" + po->keys()[i] + "` must be string value.\n";
-        }
-        return false;
-      }
+  std::unique_ptr<detail::lazy_loader_impl> p(new detail::lazy_loader_impl());
+
+  p->file = new detail::safetensors_file(filename.c_str(), "rb");
+  if (!p->file->is_valid()) {
+    if (err) {
+      (*err) += p->file->get_error();
     }
-  } else {
+    return false;
+  }
+
+  if (p->file->size < 16) {
     if (err) {
-      (*err) += "`__metadata__` value must be JSON object.\n";
+      (*err) += "Size is too short.\n";
     }
     return false;
   }
 
-  return true;
-}
+  uint64_t header_size{0};
+  if (!p->file->read_at(&header_size, sizeof(uint64_t), 0, err)) {
+    return false;
+  }
 
-bool parse_dtype(const ::minijson::value &v, safetensors::dtype &dtype,
-                 std::string *err) {
-  if (auto so = v.as<std::string>()) {
-    if ((*so) == "BOOL") {
-      dtype = safetensors::dtype::kBOOL;
-    } else if ((*so) == "U8") {
-      dtype = safetensors::dtype::kUINT8;
-    } else if ((*so) == "I8") {
-      dtype = safetensors::dtype::kINT8;
-    } else if ((*so) == "U16") {
-      dtype = safetensors::dtype::kUINT16;
-    } else if ((*so) == "I16") {
-      dtype = safetensors::dtype::kINT16;
-    } else if ((*so) == "U32") {
-      dtype = safetensors::dtype::kUINT32;
-    } else if ((*so) == "I32") {
-      dtype = safetensors::dtype::kINT32;
-    } else if ((*so) == "U64") {
-      dtype = safetensors::dtype::kUINT64;
-    } else if ((*so) == "I64") {
-      dtype = safetensors::dtype::kINT64;
-    } else if ((*so) == "F16") {
-      dtype = safetensors::dtype::kFLOAT16;
-    } else if ((*so) == "BF16") {
-      dtype = safetensors::dtype::kBFLOAT16;
-    } else if ((*so) == "F32") {
-      dtype = safetensors::dtype::kFLOAT32;
-    } else if ((*so) == "F64") {
-      dtype = safetensors::dtype::kFLOAT64;
-    } else {
+  if ((header_size > kMaxJSONSize) || ((8 + header_size) > p->file->size)) {
+    if (err) {
+      (*err) += "Invalid header size " + std::to_string(header_size) +
+                ".\n";
+    }
+    return false;
+  }
+
+  std::vector<uint8_t> head(size_t(8 + header_size));
+  if (!p->file->read_at(head.data(), head.size(), 0, err)) {
+    return false;
+  }
+
+  // Only the first `8 + header_size` bytes are accessed.
+  if (!detail::parse_safetensors_header(head.data(), p->file->size, filename,
+                                        &p->header, warn, err)) {
+    return false;
+  }
+
+  p->data_offset = head.size();
+  size_t databuffer_size = p->file->size - head.size();
+
+  p->tensors.resize(p->header.tensors.size());
+  p->slots.reset(new detail::lazy_slot[p->tensors.size()]);
+  for (size_t i = 0; i < p->tensors.size(); i++) {
+    const std::string &name = p->header.tensors.keys()[i];
+    p->header.tensors.at(i, &p->tensors[i]);
+    const tensor_t &t = p->tensors[i];
+    if ((t.data_offsets[0] > t.data_offsets[1]) ||
+        (t.data_offsets[1] > databuffer_size)) {
       if (err) {
-        (*err) += "Unknown `dtype` string: " + *so + ".\n";
+        (*err) += "Tensor `" + name + "` has invalid data_offsets.\n";
       }
       return false;
     }
-  } else {
-    if (err) {
-      (*err) +=
-          "`dtype` item should be string type but got " + v.type_name() + ".\n";
-    }
-    return false;
+    p->index[name] = i;
   }
 
+  _impl = p.release();
+
   return true;
 }
 
-bool parse_shape(const ::minijson::value &v, std::vector<size_t> &dst,
-                 std::string *err) {
-  // NOTE:
-  // - Empty tensors (tensors with 1 dimension being 0) are allowed
-  // - [] is allowed(0-Rank tensor = merely a scalar)
-  if (auto pa = v.as<::minijson::array>()) {
-    ::minijson::array::const_iterator i;
+const safetensors_t &lazy_loader::header() const {
+  static const safetensors_t empty;
+  const detail::lazy_loader_impl *p =
+      reinterpret_cast<const detail::lazy_loader_impl *>(_impl);
+  return p ? p->header : empty;
+}
 
-    for (i = pa->begin(); i != pa->end(); i++) {
-      if (auto pn = i->as<::minijson::number>()) {
-        if (dst.size() >= kMaxDim) {
-          if (err) {
-            (*err) += "`shape` length must be less than " +
-                      std::to_string(kMaxDim) + " but got " +
-                      std::to_string(dst.size()) + ".\n";
-          }
-          return false;
-        }
+bool lazy_loader::get_tensor_data(const std::string &name,
+                                  const uint8_t **data, size_t *nbytes,
+                                  std::string *err) {
+  detail::lazy_loader_impl *p =
+      reinterpret_cast<detail::lazy_loader_impl *>(_impl);
+  if (!p || !data || !nbytes) {
+    return false;
+  }
 
-        dst.push_back(size_t(*pn));
+  auto it = p->index.find(name);
+  if (it == p->index.end()) {
+    if (err) {
+      (*err) += "Tensor `" + name + "` not found.\n";
+    }
+    return false;
+  }
+  size_t i = it->second;
+  const tensor_t &t = p->tensors[i];
 
-      } else {
-        if (err) {
-          (*err) += "Array item in `shape` must be number type, but got " +
-                    i->type_name() + ".\n";
-        }
+  uint8_t *ptr = p->slots[i].data.load(std::memory_order_acquire);
+  if (ptr) {
+    detail::counter_add(detail::g_counters.cache_hits, 1);
+  } else {
+    detail::counter_add(detail::g_counters.cache_misses, 1);
+#if defined(SAFETENSORS_CPP_USE_THREADS)
+    // A failed read publishes nothing, so the next caller retries it.
+    std::lock_guard<std::mutex> lk(p->slots[i].mtx);
+    ptr = p->slots[i].data.load(std::memory_order_acquire);
+    if (!ptr) {
+      ptr = p->materialize(i, err);
+      if (!ptr) {
         return false;
       }
     }
-  } else {
-    if (err) {
-      (*err) +=
-          "`shape` value must be JSON array, but got " + v.type_name() + ".\n";
+#else
+    ptr = p->materialize(i, err);
+    if (!ptr) {
+      return false;
     }
-    return false;
+#endif
   }
 
+  (*data) = ptr;
+  (*nbytes) = t.data_offsets[1] - t.data_offsets[0];
+
   return true;
 }
 
-bool parse_data_offsets(const ::minijson::value &v, std::array<size_t, 2> &dst,
-                        std::string *err) {
-  if (auto pa = v.as<::minijson::array>()) {
-    ::minijson::array::const_iterator i;
-    size_t cnt = 0;
+size_t lazy_loader::materialized_bytes() const {
+  const detail::lazy_loader_impl *p =
+      reinterpret_cast<const detail::lazy_loader_impl *>(_impl);
+  return p ? p->materialized_bytes.load(std::memory_order_relaxed) : 0;
+}
 
-    for (i = pa->begin(); i != pa->end(); i++) {
-      if (auto pn = i->as<::minijson::number>()) {
-        if (cnt >= 2) {
-          if (err) {
-            (*err) += "`data_offsets` length must be 2.\n";
-          }
-          return false;
-        }
+size_t lazy_loader::num_reads() const {
+  const detail::lazy_loader_impl *p =
+      reinterpret_cast<const detail::lazy_loader_impl *>(_impl);
+  return p ? p->num_reads.load(std::memory_order_relaxed) : 0;
+}
 
-        dst[cnt] = size_t(*pn);
 
-        cnt++;
+namespace detail {
 
-      } else {
-        if (err) {
-          (*err) +=
-              "Array item in `data_offsets` must be number type, but got " +
-              i->type_name() + ".\n";
-        }
-        return false;
-      }
-    }
+struct registry_snapshot {
+  safetensors_t st;
+  uint64_t version{0};
+  std::atomic<size_t> refs{0};  // `model_snapshot` handles
+};
 
-    if (cnt != 2) {
-      if (err) {
-        (*err) += "`data_offsets` length must be 2.\n";
+struct registry_entry {
+  std::string path;
+  std::atomic<registry_snapshot *> current{nullptr};
+  file_version file;  // of `current`
+};
+
+typedef std::map<std::string, registry_entry *> registry_table;
+
+//
+// Readers pin `pins[epoch & 1]` while they load `table`/`current` and take
+// a reference. Writers are serialized. A writer replaces the published
+// pointer, flips `epoch` and waits until the readers pinned in the previous
+// epoch leave(grace period). After that, retired objects are unreachable
+// and freed once no handle references them.
+//
+struct model_registry_impl {
+  std::atomic<const registry_table *> table{nullptr};
+  std::atomic<uint64_t> epoch{0};
+  mutable std::atomic<size_t> pins[2];
+
+  // Writer state.
+  std::vector<registry_snapshot *> retired;
+  std::vector<registry_entry *> retired_entries;
+  std::vector<const registry_table *> retired_tables;
+  uint64_t table_generation{0};
+  std::string last_error;
+
+#if defined(SAFETENSORS_CPP_USE_THREADS)
+  std::mutex mtx;  // serializes writers
+
+  std::thread watcher;
+  std::mutex watch_mtx;
+  std::condition_variable watch_cv;
+  bool stop{false};
+  int wake_fd{-1};
+#endif
+
+  model_registry_impl() {
+    pins[0] = 0;
+    pins[1] = 0;
+  }
+
+  ~model_registry_impl() {
+    const registry_table *t = table.load(std::memory_order_relaxed);
+    if (t) {
+      for (const auto &it : *t) {
+        delete it.second->current.load(std::memory_order_relaxed);
+        delete it.second;
       }
-      return false;
+      delete t;
     }
-  } else {
-    if (err) {
-      (*err) += "`data_offsets` value must be JSON array, but got " +
-                v.type_name() + ".\n";
+    for (registry_snapshot *s : retired) {
+      delete s;
+    }
+    for (registry_entry *e : retired_entries) {
+      delete e;
+    }
+    for (const registry_table *r : retired_tables) {
+      delete r;
     }
-    return false;
   }
 
-  return true;
-}
-
-bool parse_tensor(const std::string &name, const ::minijson::value &v,
-                  tensor_t &tensor, std::string *err) {
-  if (auto po = v.as<::minijson::object>()) {
-
-    bool dtype_found{false};
-    bool shape_found{false};
-    bool data_offsets_found{false};
-
-    dtype dtype;
-    std::vector<size_t> shape;
-    std::array<size_t, 2> data_offsets{};
+  // Returns the pinned epoch. Lock-free: retries only when a writer flipped
+  // the epoch in between.
+  uint64_t pin() const {
+    while (true) {
+      uint64_t e = epoch.load(std::memory_order_seq_cst);
+      pins[e & 1].fetch_add(1, std::memory_order_seq_cst);
+      if (epoch.load(std::memory_order_seq_cst) == e) {
+        return e;
+      }
+      pins[e & 1].fetch_sub(1, std::memory_order_seq_cst);
+    }
+  }
 
-    for (size_t i = 0; i < po->size(); i++) {
-      std::string key = po->keys()[i];
+  void unpin(uint64_t e) const {
+    pins[e & 1].fetch_sub(1, std::memory_order_release);
+  }
 
-      if (key == "dtype") {
-        ::minijson::value value;
-        if (!po->at(i, &value)) {
-          if (err) {
-            (*err) += "Internal error. `dtype` has invalid object.\n";
-          }
-          return false;
-        }
+  void synchronize() {
+    uint64_t e = epoch.fetch_add(1, std::memory_order_seq_cst);
+    while (pins[e & 1].load(std::memory_order_seq_cst) != 0) {
+#if defined(SAFETENSORS_CPP_USE_THREADS)
+      std::this_thread::yield();
+#endif
+    }
+  }
 
-        if (!parse_dtype(value, dtype, err)) {
-          return false;
-        }
+  void publish_table(const registry_table *t) {
+    const registry_table *old = table.exchange(t, std::memory_order_seq_cst);
+    if (old) {
+      retired_tables.push_back(old);
+    }
+    table_generation++;
+  }
 
-        dtype_found = true;
-      } else if (key == "shape") {
-        ::minijson::value value;
-        if (!po->at(i, &value)) {
-          if (err) {
-            (*err) += "Internal error. `shape` has invalid object.\n";
-          }
-          return false;
-        }
+  void publish(registry_entry *e, registry_snapshot *s) {
+    registry_snapshot *old = e->current.exchange(s, std::memory_order_seq_cst);
+    if (old) {
+      retired.push_back(old);
+    }
+  }
 
-        if (!parse_shape(value, shape, err)) {
-          return false;
-        }
+  size_t reclaim() {
+    if (retired.empty() && retired_entries.empty() && retired_tables.empty()) {
+      return 0;
+    }
 
-        shape_found = true;
-      } else if (key == "data_offsets") {
-        ::minijson::value value;
-        if (!po->at(i, &value)) {
-          if (err) {
-            (*err) += "Internal error. `data_offsets` has invalid object.\n";
-          }
-          return false;
-        }
-        if (!parse_data_offsets(value, data_offsets, err)) {
-          return false;
-        }
+    synchronize();
 
-        data_offsets_found = true;
+    for (const registry_table *t : retired_tables) {
+      delete t;
+    }
+    retired_tables.clear();
+    for (registry_entry *e : retired_entries) {
+      delete e;
+    }
+    retired_entries.clear();
+
+    size_t n = 0;
+    size_t k = 0;
+    for (size_t i = 0; i < retired.size(); i++) {
+      if (retired[i]->refs.load(std::memory_order_acquire) == 0) {
+        delete retired[i];
+        n++;
       } else {
-        // Unknown key. Report error?
+        retired[k++] = retired[i];
       }
     }
+    retired.resize(k);
+    return n;
+  }
 
-    if (!dtype_found) {
-      if (err) {
-        (*err) += "`" + name + "` does not have `dtype` item.\n";
-      }
+  // Map the file and publish it when it changed(or `force`).
+  bool reload_entry(registry_entry *e, bool force, bool *reloaded,
+                    std::string *warn, std::string *err) {
+    (*reloaded) = false;
+
+    file_version v;
+    if (!stat_file_version(e->path, &v, err)) {
       return false;
     }
+    registry_snapshot *cur = e->current.load(std::memory_order_relaxed);
+    if (!force && cur && (v == e->file)) {
+      return true;
+    }
 
-    if (!shape_found) {
-      if (err) {
-        (*err) += "`" + name + "` does not have `shape` item.\n";
-      }
+    std::unique_ptr<registry_snapshot> s(new registry_snapshot());
+    if (!mmap_from_file(e->path, &s->st, warn, err)) {
       return false;
     }
+    s->version = cur ? (cur->version + 1) : 1;
+    e->file = v;
+    publish(e, s.release());
+    (*reloaded) = true;
+    return true;
+  }
 
-    bool is_empty_tensor{false};
-    if ((shape.size() > 0)) {
-      for (size_t i = 0; i < shape.size(); i++) {
-        if (shape[i] == 0) {
-          is_empty_tensor = true;
-          break;
+  size_t poll_changes(std::string *warn, std::string *err) {
+    size_t n = 0;
+    const registry_table *t = table.load(std::memory_order_relaxed);
+    if (t) {
+      for (const auto &it : *t) {
+        bool reloaded{false};
+        if (reload_entry(it.second, false, &reloaded, warn, err) &&
+            reloaded) {
+          n++;
         }
       }
     }
+    reclaim();
+    return n;
+  }
 
-    if (is_empty_tensor) {
-      // They are not storing any data in the databuffer, yet retaining size in
-      // the header. So ignore data_offsets
-      if (data_offsets_found) {
-        // TODO: make this warn instead of err?
-        if (err) {
-          (*err) +=
-              "`" + name +
-              "` is empty tensors(tensors with 1 dimension being 0), and no "
-              "data in databuffer, but `data_offsets` item is provided.\n";
+#if defined(SAFETENSORS_CPP_USE_THREADS)
+  void watch_loop(uint32_t interval_ms) {
+#if defined(__linux__)
+    int ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    uint64_t watched_generation = 0;
+#endif
+
+    while (true) {
+#if defined(__linux__)
+      if ((ifd >= 0) && (wake_fd >= 0)) {
+        {
+          std::lock_guard<std::mutex> lk(mtx);
+          if (watched_generation != table_generation) {
+            // Watch parent directories to see files replaced by `rename`.
+            const registry_table *t = table.load(std::memory_order_relaxed);
+            for (const auto &it : *t) {
+              size_t pos = it.first.find_last_of('/');
+              std::string dir = (pos == std::string::npos)
+                                    ? std::string(".")
+                                    : it.first.substr(0, (std::max)(pos,
+                                                                    size_t(1)));
+              inotify_add_watch(ifd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+            }
+            watched_generation = table_generation;
+          }
         }
-        return false;
+
+        struct pollfd fds[2];
+        fds[0].fd = ifd;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        fds[1].fd = wake_fd;
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
+        ::poll(fds, 2, int(interval_ms));
+
+        char buf[4096];
+        while (::read(ifd, buf, sizeof(buf)) > 0) {
+        }
+      } else
+#endif
+      {
+        std::unique_lock<std::mutex> lk(watch_mtx);
+        watch_cv.wait_for(lk, std::chrono::milliseconds(interval_ms),
+                          [this] { return stop; });
       }
-    } else {
-      if (!data_offsets_found) {
-        if (err) {
-          (*err) += "`" + name + "` does not have `data_offsets` item.\n";
+
+      {
+        std::lock_guard<std::mutex> lk(watch_mtx);
+        if (stop) {
+          break;
         }
-        return false;
+      }
+
+      std::string warn, err;
+      std::lock_guard<std::mutex> lk(mtx);
+      poll_changes(&warn, &err);
+      if (!err.empty()) {
+        last_error = err;
       }
     }
 
-    tensor.dtype = dtype;
-    tensor.shape = shape;
-    tensor.data_offsets = data_offsets;
+#if defined(__linux__)
+    if (ifd >= 0) {
+      ::close(ifd);
+    }
+#endif
+  }
+#endif
+};
 
-  } else {
-    if (err) {
-      (*err) += "`" + name + "` value must be JSON object.\n";
+// Serializes `model_registry` writers.
+struct registry_lock {
+#if defined(SAFETENSORS_CPP_USE_THREADS)
+  std::lock_guard<std::mutex> lk;
+  explicit registry_lock(model_registry_impl *p) : lk(p->mtx) {}
+#else
+  explicit registry_lock(model_registry_impl *) {}
+#endif
+};
+
+}  // namespace detail
+
+model_snapshot::~model_snapshot() { reset(); }
+
+model_snapshot::model_snapshot(const model_snapshot &rhs) {
+  if (rhs._impl) {
+    reinterpret_cast<detail::registry_snapshot *>(rhs._impl)
+        ->refs.fetch_add(1, std::memory_order_relaxed);
+  }
+  _impl = rhs._impl;
+}
+
+model_snapshot &model_snapshot::operator=(const model_snapshot &rhs) {
+  if (this != &rhs) {
+    model_snapshot tmp(rhs);
+    reset();
+    _impl = tmp._impl;
+    tmp._impl = nullptr;
+  }
+  return *this;
+}
+
+model_snapshot::model_snapshot(model_snapshot &&rhs) noexcept {
+  _impl = rhs._impl;
+  rhs._impl = nullptr;
+}
+
+model_snapshot &model_snapshot::operator=(model_snapshot &&rhs) noexcept {
+  if (this != &rhs) {
+    reset();
+    _impl = rhs._impl;
+    rhs._impl = nullptr;
+  }
+  return *this;
+}
+
+const safetensors_t &model_snapshot::get() const {
+  static const safetensors_t empty;
+  const detail::registry_snapshot *p =
+      reinterpret_cast<const detail::registry_snapshot *>(_impl);
+  return p ? p->st : empty;
+}
+
+uint64_t model_snapshot::version() const {
+  const detail::registry_snapshot *p =
+      reinterpret_cast<const detail::registry_snapshot *>(_impl);
+  return p ? p->version : 0;
+}
+
+void model_snapshot::reset() {
+  if (_impl) {
+    // The registry frees it on the next `collect()` after the count drops to
+    // zero.
+    reinterpret_cast<detail::registry_snapshot *>(_impl)
+        ->refs.fetch_sub(1, std::memory_order_release);
+    _impl = nullptr;
+  }
+}
+
+model_registry::model_registry() { _impl = new detail::model_registry_impl(); }
+
+model_registry::~model_registry() {
+  stop_watching();
+  delete reinterpret_cast<detail::model_registry_impl *>(_impl);
+  _impl = nullptr;
+}
+
+bool model_registry::add(const std::string &filename, std::string *warn,
+                         std::string *err) {
+  detail::model_registry_impl *p =
+      reinterpret_cast<detail::model_registry_impl *>(_impl);
+  detail::registry_lock lk(p);
+
+  bool reloaded{false};
+  const detail::registry_table *t = p->table.load(std::memory_order_relaxed);
+  if (t) {
+    auto it = t->find(filename);
+    if (it != t->end()) {
+      bool ret = p->reload_entry(it->second, false, &reloaded, warn, err);
+      p->reclaim();
+      return ret;
     }
+  }
+
+  std::unique_ptr<detail::registry_entry> e(new detail::registry_entry());
+  e->path = filename;
+  if (!p->reload_entry(e.get(), true, &reloaded, warn, err)) {
     return false;
   }
 
+  detail::registry_table *nt =
+      t ? new detail::registry_table(*t) : new detail::registry_table();
+  (*nt)[filename] = e.release();
+  p->publish_table(nt);
+  p->reclaim();
+
   return true;
 }
 
-// From llama.cpp
-#if defined(_WIN32)
-static std::string safetensors_format_win_err(DWORD err) {
-  LPSTR buf;
-  size_t size = FormatMessageA(
-      FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM |
-          FORMAT_MESSAGE_IGNORE_INSERTS,
-      NULL, err, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), (LPSTR)&buf, 0,
-      NULL);
-  if (!size) {
-    return "FormatMessageA failed";
+bool model_registry::remove(const std::string &filename) {
+  detail::model_registry_impl *p =
+      reinterpret_cast<detail::model_registry_impl *>(_impl);
+  detail::registry_lock lk(p);
+
+  const detail::registry_table *t = p->table.load(std::memory_order_relaxed);
+  if (!t) {
+    return false;
   }
-  std::string ret(buf, size);
-  LocalFree(buf);
-  return ret;
+  auto it = t->find(filename);
+  if (it == t->end()) {
+    return false;
+  }
+
+  detail::registry_entry *e = it->second;
+  detail::registry_table *nt = new detail::registry_table(*t);
+  nt->erase(filename);
+  p->publish_table(nt);
+  p->publish(e, nullptr);
+  p->retired_entries.push_back(e);
+  p->reclaim();
+
+  return true;
 }
-#endif
 
-struct safetensors_file {
-  // use FILE * so we don't have to re-open the file to mmap
-  FILE *fp{nullptr};
-  size_t size{0};
-  mutable bool _valid{false};
-  std::string _err;
+bool model_registry::acquire(const std::string &filename,
+                             model_snapshot *snapshot) const {
+  const detail::model_registry_impl *p =
+      reinterpret_cast<const detail::model_registry_impl *>(_impl);
+  if (!snapshot) {
+    return false;
+  }
+  snapshot->reset();
+
+  detail::registry_snapshot *s = nullptr;
+  uint64_t e = p->pin();
+  const detail::registry_table *t = p->table.load(std::memory_order_seq_cst);
+  if (t) {
+    auto it = t->find(filename);
+    if (it != t->end()) {
+      s = it->second->current.load(std::memory_order_seq_cst);
+      if (s) {
+        s->refs.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+  }
+  p->unpin(e);
 
-  safetensors_file(const char *fname, const char *mode) {
-    fp = std::fopen(fname, mode);
-    if (fp == nullptr) {
-      _err = "failed to open " + std::string(fname) + ":" +
-             std::string(strerror(errno)) + "\n";
-      _valid = false;
-    } else {
-      seek(0, SEEK_END);
-      size = tell();
-      seek(0, SEEK_SET);
-      _valid = true;
+  snapshot->_impl = s;
+  return s != nullptr;
+}
+
+bool model_registry::reload(const std::string &filename, bool force,
+                            std::string *warn, std::string *err) {
+  detail::model_registry_impl *p =
+      reinterpret_cast<detail::model_registry_impl *>(_impl);
+  detail::registry_lock lk(p);
+
+  const detail::registry_table *t = p->table.load(std::memory_order_relaxed);
+  auto it = t ? t->find(filename) : detail::registry_table::const_iterator();
+  if (!t || (it == t->end())) {
+    if (err) {
+      (*err) += "`" + filename + "` is not registered.\n";
     }
+    return false;
   }
 
-  ~safetensors_file() {
-    if (fp) {
-      std::fclose(fp);
-      fp = nullptr;
+  bool reloaded{false};
+  bool ret = p->reload_entry(it->second, force, &reloaded, warn, err);
+  p->reclaim();
+  return ret;
+}
+
+size_t model_registry::poll(std::string *warn, std::string *err) {
+  detail::model_registry_impl *p =
+      reinterpret_cast<detail::model_registry_impl *>(_impl);
+  detail::registry_lock lk(p);
+  return p->poll_changes(warn, err);
+}
+
+size_t model_registry::collect() {
+  detail::model_registry_impl *p =
+      reinterpret_cast<detail::model_registry_impl *>(_impl);
+  detail::registry_lock lk(p);
+  return p->reclaim();
+}
+
+bool model_registry::start_watching(uint32_t interval_ms, std::string *err) {
+#if defined(SAFETENSORS_CPP_USE_THREADS)
+  detail::model_registry_impl *p =
+      reinterpret_cast<detail::model_registry_impl *>(_impl);
+  if (p->watcher.joinable()) {
+    if (err) {
+      (*err) += "Already watching.\n";
     }
+    return false;
+  }
+  if (interval_ms == 0) {
+    interval_ms = 1;
   }
 
-  size_t tell() const {
-#ifdef _WIN32
-    __int64 ret = _ftelli64(fp);
+  p->stop = false;
+#if defined(__linux__)
+  p->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+#endif
+  p->watcher = std::thread([p, interval_ms] { p->watch_loop(interval_ms); });
+  return true;
 #else
-    long ret = std::ftell(fp);
+  (void)interval_ms;
+  if (err) {
+    (*err) +=
+        "start_watching requires SAFETENSORS_CPP_USE_THREADS. Call poll() "
+        "periodically instead.\n";
+  }
+  return false;
 #endif
-    if (ret == -1) {
-      // this really shouldn't fail
-      _valid = false;
-      return 0;
-    }
+}
 
-    return (size_t)ret;
+void model_registry::stop_watching() {
+#if defined(SAFETENSORS_CPP_USE_THREADS)
+  detail::model_registry_impl *p =
+      reinterpret_cast<detail::model_registry_impl *>(_impl);
+  if (!p || !p->watcher.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lk(p->watch_mtx);
+    p->stop = true;
+  }
+  p->watch_cv.notify_all();
+#if defined(__linux__)
+  if (p->wake_fd >= 0) {
+    uint64_t one = 1;
+    ssize_t ret = ::write(p->wake_fd, &one, sizeof(one));
+    (void)ret;
   }
-
-  void seek(size_t offset, int whence) const {
-#ifdef _WIN32
-    int ret = _fseeki64(fp, (__int64)offset, whence);
-#else
-    int ret = std::fseek(fp, (long)offset, whence);
 #endif
-    if (ret == 0) {
-      _valid = false;
-    }
+  p->watcher.join();
+#if defined(__linux__)
+  if (p->wake_fd >= 0) {
+    ::close(p->wake_fd);
+    p->wake_fd = -1;
   }
+#endif
+#endif
+}
 
-  bool &is_valid() const { return _valid; }
+std::string model_registry::last_error() const {
+  detail::model_registry_impl *p =
+      reinterpret_cast<detail::model_registry_impl *>(_impl);
+  detail::registry_lock lk(p);
+  return p->last_error;
+}
 
-  const std::string &get_error() const { return _err; }
-};
+namespace detail {
 
-struct safetensors_mmap {
-  uint8_t *addr{nullptr};
-  size_t size{0};
+const char *kDeltaPrefix = "__delta__.";
+const char *kDeltaBase = "__delta__.base";
+const char *kDeltaBaseHash = "__delta__.base_hash";
+const char *kDeltaRemoved = "__delta__.removed.";
+const char *kDeltaTensorHash = "__delta__.hash.";
 
-  bool _valid{false};
-  std::string _warn;
-  std::string _err;
+// Guard against cyclic chains.
+constexpr size_t kMaxDeltaChainLength = 64;
 
-  const bool is_valid() const { return _valid; }
+bool starts_with(const std::string &s, const std::string &prefix) {
+  return s.compare(0, prefix.size(), prefix) == 0;
+}
 
-  const std::string &get_error() const { return _err; }
+// Hash of the header(8 bytes size + JSON) of a mmaped file.
+uint64_t mmaped_header_hash(const safetensors_t &st) {
+  return hash_bytes(st.mmap_addr, 8 + st.header_size);
+}
 
-  const std::string &get_warning() const { return _warn; }
+bool is_absolute_path(const std::string &path) {
+  return (!path.empty() && ((path[0] == '/') || (path[0] == '\\'))) ||
+         ((path.size() >= 2) && (path[1] == ':'));
+}
 
-  safetensors_mmap(const safetensors_mmap &) = delete;
+// Directory part including the trailing separator. Empty when none.
+std::string dirname_of(const std::string &path) {
+  size_t pos = path.find_last_of("/\\");
+  return (pos == std::string::npos) ? std::string() : path.substr(0, pos + 1);
+}
 
-#ifdef _POSIX_MAPPED_FILES
-  static constexpr bool SUPPORTED = true;
+// Components of a relative path with `.` removed and `x/..` folded(lexical).
+// Leading `..` are kept.
+std::vector<std::string> split_path(const std::string &path) {
+  std::vector<std::string> parts;
+  size_t begin = 0;
+  while (begin <= path.size()) {
+    size_t end = path.find_first_of("/\\", begin);
+    if (end == std::string::npos) {
+      end = path.size();
+    }
+    std::string part = path.substr(begin, end - begin);
+    if (part == "..") {
+      if (!parts.empty() && (parts.back() != "..")) {
+        parts.pop_back();
+      } else {
+        parts.push_back(part);
+      }
+    } else if (!part.empty() && (part != ".")) {
+      parts.push_back(part);
+    }
+    begin = end + 1;
+  }
+  return parts;
+}
 
-  safetensors_mmap(struct safetensors_file *file,
-                   size_t prefetch = (size_t)-1 /* -1 = max value */,
-                   bool numa = false) {
-    size = file->size;
-    int fd = fileno(file->fp);
-    int flags = MAP_SHARED;
-    // prefetch/readahead impairs performance on NUMA systems
-    if (numa) {
-      prefetch = 0;
+// Path of `target` relative to the directory of `from`. Both are relative to
+// the working directory. Fails when the directory of `from` goes above the
+// common part with `target`(its name is unknown without the working
+// directory).
+bool relative_path(const std::string &target, const std::string &from,
+                   std::string *out) {
+  std::vector<std::string> t = split_path(target);
+  std::vector<std::string> d = split_path(dirname_of(from));
+  size_t k = 0;
+  while ((k < d.size()) && ((k + 1) < t.size()) && (d[k] == t[k])) {
+    k++;
+  }
+  std::string rel;
+  for (size_t i = k; i < d.size(); i++) {
+    if (d[i] == "..") {
+      return false;
     }
-#ifdef __linux__
-    if (prefetch) {
-      flags |= MAP_POPULATE;
+    rel += "../";
+  }
+  for (size_t i = k; i < t.size(); i++) {
+    rel += t[i];
+    if ((i + 1) < t.size()) {
+      rel += "/";
     }
-#endif
-    addr = reinterpret_cast<uint8_t *>(
-        mmap(NULL, file->size, PROT_READ, flags, fd, 0));
-    if (addr == MAP_FAILED) {
-      _valid = false;
-      _err = "mmap failed: " + std::string(strerror(errno)) + "\n";
+  }
+  (*out) = rel;
+  return !t.empty();
+}
+
+struct delta_view_impl {
+  std::vector<std::unique_ptr<safetensors_t>> files;  // newest first
+  ordered_dict<tensor_t> tensors;
+  ordered_dict<std::string> metadata;
+  std::map<std::string, size_t> owner;  // tensor name -> index in `files`
+};
+
+}  // namespace detail
+
+delta_view::~delta_view() {
+  delete reinterpret_cast<detail::delta_view_impl *>(_impl);
+  _impl = nullptr;
+}
+
+bool delta_view::open(const std::string &filename, std::string *warn,
+                      std::string *err) {
+  delete reinterpret_cast<detail::delta_view_impl *>(_impl);
+  _impl = nullptr;
 
-      size = 0;
-      addr = nullptr;
+  std::unique_ptr<detail::delta_view_impl> p(new detail::delta_view_impl());
 
-      return;
+  std::string path = filename;
+  std::string expected_hash;
+  std::vector<std::string> paths;  // of `p->files`
+  for (;;) {
+    if (p->files.size() >= detail::kMaxDeltaChainLength) {
+      if (err) {
+        (*err) += "Delta chain of " + filename + " is too long(cyclic?).\n";
+      }
+      return false;
     }
 
-    if (prefetch > 0) {
-      // Advise the kernel to preload the mapped memory
-      if (posix_madvise(addr, std::min(file->size, prefetch),
-                        POSIX_MADV_WILLNEED)) {
-        _warn += "posix_madvise(.., POSIX_MADV_WILLNEED) failed: " +
-                 std::string(strerror(errno)) + "\n";
-      }
+    std::unique_ptr<safetensors_t> f(new safetensors_t());
+    if (!mmap_from_file(path, f.get(), warn, err)) {
+      return false;
     }
-    if (numa) {
-      // advise the kernel not to use readahead
-      // (because the next page might not belong on the same node)
-      if (posix_madvise(addr, file->size, POSIX_MADV_RANDOM)) {
-        _warn += "posix_madvise(.., POSIX_MADV_RANDOM) failed: " +
-                 std::string(strerror(errno)) + "\n";
+    if (!expected_hash.empty() &&
+        (detail::to_hex64(detail::mmaped_header_hash(*f)) != expected_hash)) {
+      if (err) {
+        (*err) += "Base file " + path +
+                  " does not match the hash recorded in the delta.\n";
       }
+      return false;
     }
 
-    _valid = true;
+    std::string base;
+    bool has_base = f->metadata.at(detail::kDeltaBase, &base);
+    expected_hash.clear();
+    f->metadata.at(detail::kDeltaBaseHash, &expected_hash);
+    p->files.push_back(std::move(f));
+    paths.push_back(path);
+    if (!has_base) {
+      break;
+    }
+    path = detail::is_absolute_path(base) ? base
+                                          : detail::dirname_of(path) + base;
   }
 
-  ~safetensors_mmap() {
-    if (_valid) {
-      munmap(addr, size);
+  // Apply from the root base to the newest delta.
+  for (size_t k = p->files.size(); k-- > 0;) {
+    const safetensors_t &f = *p->files[k];
+    // Base tensors relied on by the delta(the view merged so far).
+    for (size_t i = 0; i < f.metadata.size(); i++) {
+      const std::string &key = f.metadata.keys()[i];
+      if (!detail::starts_with(key, detail::kDeltaTensorHash)) {
+        continue;
+      }
+      std::string name = key.substr(strlen(detail::kDeltaTensorHash));
+      std::string expected;
+      f.metadata.at(i, &expected);
+      auto it = p->owner.find(name);
+      const uint8_t *data{nullptr};
+      size_t nbytes{0};
+      if ((it == p->owner.end()) ||
+          !safetensors::get_tensor_data(*p->files[it->second], name, &data,
+                                        &nbytes, err) ||
+          (detail::to_hex64(hash_bytes(data, nbytes)) != expected)) {
+        if (err) {
+          (*err) += "Base tensor `" + name +
+                    "` does not match the hash recorded in " + paths[k] +
+                    ".\n";
+        }
+        return false;
+      }
+    }
+    for (size_t i = 0; i < f.metadata.size(); i++) {
+      const std::string &key = f.metadata.keys()[i];
+      if (detail::starts_with(key, detail::kDeltaRemoved)) {
+        std::string name = key.substr(strlen(detail::kDeltaRemoved));
+        p->tensors.erase(name);
+        p->owner.erase(name);
+      }
+    }
+    for (size_t i = 0; i < f.tensors.size(); i++) {
+      tensor_t t;
+      f.tensors.at(i, &t);
+      p->tensors.insert(f.tensors.keys()[i], t);
+      p->owner[f.tensors.keys()[i]] = k;
     }
-    size = 0;
-    addr = nullptr;
-    _valid = false;
   }
 
-#elif defined(_WIN32)
-  static constexpr bool SUPPORTED = true;
+  const safetensors_t &newest = *p->files[0];
+  for (size_t i = 0; i < newest.metadata.size(); i++) {
+    const std::string &key = newest.metadata.keys()[i];
+    if (!detail::starts_with(key, detail::kDeltaPrefix)) {
+      std::string value;
+      newest.metadata.at(i, &value);
+      p->metadata.insert(key, value);
+    }
+  }
 
-  safetensors_mmap(struct safetensors_file *file, bool prefetch = true,
-                   bool numa = false) {
-    (void)numa;
+  _impl = p.release();
 
-    size = file->size;
+  return true;
+}
 
-    HANDLE hFile = (HANDLE)_get_osfhandle(_fileno(file->fp));
+const ordered_dict<tensor_t> &delta_view::tensors() const {
+  static const ordered_dict<tensor_t> empty;
+  const detail::delta_view_impl *p =
+      reinterpret_cast<const detail::delta_view_impl *>(_impl);
+  return p ? p->tensors : empty;
+}
 
-    HANDLE hMapping =
-        CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
-    DWORD error = GetLastError();
+const ordered_dict<std::string> &delta_view::metadata() const {
+  static const ordered_dict<std::string> empty;
+  const detail::delta_view_impl *p =
+      reinterpret_cast<const detail::delta_view_impl *>(_impl);
+  return p ? p->metadata : empty;
+}
 
-    if (hMapping == NULL) {
-      // TODO: get error message
-      _err = "CreateFileMappingA failed: " + safetensors_format_win_err(error) +
-             "\n";
-      _valid = false;
-      size = 0;
-      addr = nullptr;
-      return;
-    }
+size_t delta_view::num_files() const {
+  const detail::delta_view_impl *p =
+      reinterpret_cast<const detail::delta_view_impl *>(_impl);
+  return p ? p->files.size() : 0;
+}
 
-    addr = reinterpret_cast<uint8_t *>(
-        MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0));
-    error = GetLastError();
-    CloseHandle(hMapping);
+size_t delta_view::file_index(const std::string &name) const {
+  const detail::delta_view_impl *p =
+      reinterpret_cast<const detail::delta_view_impl *>(_impl);
+  if (!p) {
+    return (std::numeric_limits<size_t>::max)();
+  }
+  auto it = p->owner.find(name);
+  return (it == p->owner.end()) ? (std::numeric_limits<size_t>::max)()
+                                : it->second;
+}
 
-    if (addr == NULL) {
-      _err =
-          "MapViewOfFile failed: " + safetensors_format_win_err(error) + "\n";
+bool delta_view::get_tensor_data(const std::string &name,
+                                 const uint8_t **data, size_t *nbytes,
+                                 std::string *err) const {
+  const detail::delta_view_impl *p =
+      reinterpret_cast<const detail::delta_view_impl *>(_impl);
+  if (!p) {
+    return false;
+  }
+  auto it = p->owner.find(name);
+  if (it == p->owner.end()) {
+    if (err) {
+      (*err) += "Tensor `" + name + "` not found.\n";
     }
+    return false;
+  }
+  return safetensors::get_tensor_data(*p->files[it->second], name, data,
+                                      nbytes, err);
+}
 
-    if (prefetch) {
-      // PrefetchVirtualMemory is only present on Windows 8 and above, so we
-      // dynamically load it
-      BOOL(WINAPI * pPrefetchVirtualMemory)
-      (HANDLE, ULONG_PTR, PWIN32_MEMORY_RANGE_ENTRY, ULONG);
-      HMODULE hKernel32 = GetModuleHandleW(L"kernel32.dll");
-
-      // may fail on pre-Windows 8 systems
-      pPrefetchVirtualMemory =
-          reinterpret_cast<decltype(pPrefetchVirtualMemory)>(
-              GetProcAddress(hKernel32, "PrefetchVirtualMemory"));
+bool delta_view::to_safetensors(safetensors_t *st, std::string *err) const {
+  const detail::delta_view_impl *p =
+      reinterpret_cast<const detail::delta_view_impl *>(_impl);
+  if (!p || !st) {
+    return false;
+  }
 
-      if (pPrefetchVirtualMemory) {
-        // advise the kernel to preload the mapped memory
-        WIN32_MEMORY_RANGE_ENTRY range;
-        range.VirtualAddress = addr;
-        range.NumberOfBytes = (SIZE_T)size;
-        if (!pPrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0)) {
-          _warn += "PrefetchVirtualMemory failed: " +
-                   safetensors_format_win_err(GetLastError()) + "\n";
-        }
-      }
-    }
+  size_t total = 0;
+  for (size_t i = 0; i < p->tensors.size(); i++) {
+    tensor_t t;
+    p->tensors.at(i, &t);
+    total += t.data_offsets[1] - t.data_offsets[0];
   }
-  ~safetensors_mmap() {
-    if (!UnmapViewOfFile(addr)) {
-      _warn += "UnmapViewOfFile failed: " +
-               safetensors_format_win_err(GetLastError()) + "\n";
+
+  ordered_dict<tensor_t> tensors;
+  std::vector<uint8_t> storage(total);
+  size_t offset = 0;
+  for (size_t i = 0; i < p->tensors.size(); i++) {
+    const std::string &name = p->tensors.keys()[i];
+    const uint8_t *data{nullptr};
+    size_t nbytes{0};
+    if (!get_tensor_data(name, &data, &nbytes, err)) {
+      return false;
     }
+    tensor_t t;
+    p->tensors.at(i, &t);
+    memcpy(storage.data() + offset, data, nbytes);
+    t.data_offsets = {{offset, offset + nbytes}};
+    offset += nbytes;
+    tensors.insert(name, t);
   }
-#else
-  static constexpr bool SUPPORTED = false;
-
-  safetensors_mmap(struct safetensors_file *file, bool prefetch = true,
-                   bool numa = false) {
-    (void)file;
-    (void)prefetch;
-    (void)numa;
 
-    _valid = false;
-    _err = "mmap not supported\n";
-    addr = nullptr;
-    size = 0;
-  }
-#endif
-};
+  st->tensors = std::move(tensors);
+  st->metadata = p->metadata;
+  st->storage.swap(storage);
+  st->mmaped = false;
+  st->mmap_addr = nullptr;
+  st->mmap_size = 0;
+  st->databuffer_addr = nullptr;
+  st->databuffer_size = 0;
 
-// Based on MIOPen bfloat16
-// https://github.com/ROCmSoftwarePlatform/MIOpen/blob/master/src/kernels/bfloat16_dev.hpp
+  return true;
+}
 
-/*******************************************************************************
- *
- * MIT License
- *
- * Copyright (c) 2019 Advanced Micro Devices, Inc.
- *
- * Permission is hereby granted, free of charge, to any person obtaining a copy
- * of this software and associated documentation files (the "Software"), to deal
- * in the Software without restriction, including without limitation the rights
- * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
- * copies of the Software, and to permit persons to whom the Software is
- * furnished to do so, subject to the following conditions:
- *
- * The above copyright notice and this permission notice shall be included in
- *all copies or substantial portions of the Software.
- *
- * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
- * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
- * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
- * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
- * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
- * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
- * SOFTWARE.
- *
- *******************************************************************************/
+bool save_delta(const safetensors_t &st, const std::string &base_filename,
+                const std::string &filename, size_t *num_stored,
+                std::string *warn, std::string *err) {
+  SAFETENSORS_CPP_STATS_ENTRY();
 
-typedef union cvt_bf16_fp32 {
-  uint32_t u32;
-  uint16_t ushortvec[2];
+  if (filename == base_filename) {
+    if (err) {
+      (*err) += "Delta file must differ from the base file.\n";
+    }
+    return false;
+  }
 
-  float f32;
-} cvt_bf16_fp32_t;
+  delta_view base;
+  if (!base.open(base_filename, warn, err)) {
+    return false;
+  }
+  const detail::delta_view_impl *bp =
+      reinterpret_cast<const detail::delta_view_impl *>(base._impl);
 
-float bfloat16_to_float(uint16_t src_val) {
-  cvt_bf16_fp32_t target_val;
+  safetensors_t layout;
+  for (size_t i = 0; i < st.metadata.size(); i++) {
+    const std::string &key = st.metadata.keys()[i];
+    if (!detail::starts_with(key, detail::kDeltaPrefix)) {
+      std::string value;
+      st.metadata.at(i, &value);
+      layout.metadata.insert(key, value);
+    }
+  }
 
-  target_val.ushortvec[0] = 0;
-  target_val.ushortvec[1] = src_val;
+  // `delta_view` resolves a relative base path against the directory of the
+  // delta, so record it relative to that directory.
+  std::string base_path = base_filename;
+  if (!detail::is_absolute_path(base_filename) &&
+      (detail::is_absolute_path(filename) ||
+       !detail::relative_path(base_filename, filename, &base_path))) {
+    if (err) {
+      (*err) += "Cannot express base path " + base_filename +
+                " relative to the directory of " + filename +
+                ". Use an absolute base path.\n";
+    }
+    return false;
+  }
+  layout.metadata.insert(detail::kDeltaBase, base_path);
+  layout.metadata.insert(
+      detail::kDeltaBaseHash,
+      detail::to_hex64(detail::mmaped_header_hash(*bp->files[0])));
+
+  for (size_t i = 0; i < st.tensors.size(); i++) {
+    const std::string &name = st.tensors.keys()[i];
+    tensor_t t, bt;
+    st.tensors.at(i, &t);
+    if (base.tensors().at(name, &bt) && (bt.dtype == t.dtype) &&
+        (bt.shape == t.shape)) {
+      const uint8_t *data{nullptr}, *base_data{nullptr};
+      size_t nbytes{0}, base_nbytes{0};
+      if (!get_tensor_data(st, name, &data, &nbytes, err) ||
+          !base.get_tensor_data(name, &base_data, &base_nbytes, err)) {
+        return false;
+      }
+      if ((nbytes == base_nbytes) && (memcmp(data, base_data, nbytes) == 0)) {
+        // Unchanged. Served from the base, so record its content.
+        layout.metadata.insert(
+            detail::kDeltaTensorHash + name,
+            detail::to_hex64(hash_bytes(base_data, base_nbytes)));
+        continue;
+      }
+    }
+    t.data_offsets = {{0, 0}};  // computed by writer
+    layout.tensors.insert(name, t);
+  }
 
-  return target_val.f32;
-}
+  for (size_t i = 0; i < base.tensors().size(); i++) {
+    const std::string &name = base.tensors().keys()[i];
+    if (!st.tensors.count(name)) {
+      layout.metadata.insert(detail::kDeltaRemoved + name, "");
+    }
+  }
 
-uint16_t float_to_bfloat16(float src_val) {
-  cvt_bf16_fp32_t target_val;
-  target_val.f32 = src_val;
-  // BF16 round and NaN preservation code matches
-  // https://github.com/ROCmSoftwarePlatform/rocBLAS/blob/develop/library/include/rocblas_bfloat16.h
-  if ((~target_val.u32 & 0x7f800000) == 0)  // Inf or NaN
-  {
-    // When all of the exponent bits are 1, the value is Inf or NaN.
-    // Inf is indicated by a zero mantissa. NaN is indicated by any nonzero
-    // mantissa bit. Quiet NaN is indicated by the most significant mantissa
-    // bit being 1. Signaling NaN is indicated by the most significant
-    // mantissa bit being 0 but some other bit(s) being 1. If any of the
-    // lower 16 bits of the mantissa are 1, we set the least significant bit
-    // of the bfloat16 mantissa, in order to preserve signaling NaN in case
-    // the bloat16's mantissa bits are all 0.
-    if ((target_val.u32 & 0xffff) != 0) {
-      target_val.u32 |= 0x10000;  // Preserve signaling NaN
+  mmap_writer writer;
+  if (!writer.open(filename, layout, warn, err)) {
+    return false;
+  }
+  for (size_t i = 0; i < layout.tensors.size(); i++) {
+    const std::string &name = layout.tensors.keys()[i];
+    const uint8_t *src{nullptr};
+    uint8_t *dst{nullptr};
+    size_t src_nbytes{0}, dst_nbytes{0};
+    if (!get_tensor_data(st, name, &src, &src_nbytes, err) ||
+        !writer.get_tensor_data(name, &dst, &dst_nbytes, err)) {
+      return false;
     }
-  } else {
-#if 1  // MIOPEN_USE_RNE_BFLOAT16
-       // When the exponent bits are not all 1s, then the value is zero, normal,
-       // or subnormal. We round the bfloat16 mantissa up by adding 0x7FFF, plus
-       // 1 if the least significant bit of the bfloat16 mantissa is 1 (odd).
-       // This causes the bfloat16's mantissa to be incremented by 1 if the 16
-       // least significant bits of the float mantissa are greater than 0x8000,
-       // or if they are equal to 0x8000 and the least significant bit of the
-    // bfloat16 mantissa is 1 (odd). This causes it to be rounded to even when
-    // the lower 16 bits are exactly 0x8000. If the bfloat16 mantissa already
-    // has the value 0x7f, then incrementing it causes it to become 0x00 and
-    // the exponent is incremented by one, which is the next higher FP value
-    // to the unrounded bfloat16 value. When the bfloat16 value is subnormal
-    // with an exponent of 0x00 and a mantissa of 0x7F, it may be rounded up
-    // to a normal value with an exponent of 0x01 and a mantissa of 0x00.
-    // When the bfloat16 value has an exponent of 0xFE and a mantissa of 0x7F,
-    // incrementing it causes it to become an exponent of 0xFF and a mantissa
-    // of 0x00, which is Inf, the next higher value to the unrounded value.
-    target_val.u32 += (0x7fff + (target_val.ushortvec[1] & 1));
-#endif  // MIOPEN_USE_RNE_BFLOAT16
+    if (src_nbytes != dst_nbytes) {
+      if (err) {
+        (*err) += "Tensor `" + name + "` has invalid data size.\n";
+      }
+      return false;
+    }
+    memcpy(dst, src, src_nbytes);
+  }
+  if (!writer.finalize(err)) {
+    return false;
   }
 
-  return target_val.ushortvec[1];
+  if (num_stored) {
+    (*num_stored) = layout.tensors.size();
+  }
+  return true;
 }
 
-// half <-> float conversion based on: https://gist.github.com/rygorous/2156668
-// (CC0 license)
-//
+namespace detail {
 
-// Little endian
-union FP32le {
-  unsigned int u;
-  float f;
-  struct {
-    unsigned int Mantissa : 23;
-    unsigned int Exponent : 8;
-    unsigned int Sign : 1;
-  } s;
-};
+// (file version, data_offsets) of a tensor.
+typedef std::pair<file_version, std::pair<size_t, size_t>> dedup_cache_key;
 
-// Little endian
-union float16le {
-  unsigned short u;
-  struct {
-    unsigned int Mantissa : 10;
-    unsigned int Exponent : 5;
-    unsigned int Sign : 1;
-  } s;
+// `hash_cache` entries kept per buffer. Older file versions are dropped
+// first.
+constexpr size_t kMaxDedupCacheKeys = 16;
+
+struct dedup_buffer {
+  uint64_t hash{0};
+  size_t size{0};
+  std::unique_ptr<uint8_t[]> data;
+  size_t refs{0};
+  std::vector<dedup_cache_key> cache_keys;  // `hash_cache` entries
 };
 
-float half_to_float_le(float16le h) {
-  static const FP32le magic = {113 << 23};
-  static const unsigned int shifted_exp = 0x7c00
-                                          << 13;  // exponent mask after shift
-  FP32le o;
+struct dedup_model {
+  safetensors_t header;
+  std::map<std::string, dedup_buffer *> buffers;  // by tensor name
+};
 
-  o.u = (h.u & 0x7fffU) << 13U;           // exponent/mantissa bits
-  unsigned int exp_ = shifted_exp & o.u;  // just the exponent
-  o.u += (127 - 15) << 23;                // exponent adjust
+struct dedup_pool_impl {
+  dedup_options options;
 
-  // handle exponent special cases
-  if (exp_ == shifted_exp)    // Inf/NaN?
-    o.u += (128 - 16) << 23;  // extra exp adjust
-  else if (exp_ == 0)         // Zero/Denormal?
-  {
-    o.u += 1 << 23;  // extra exp adjust
-    o.f -= magic.f;  // renormalize
+#if defined(SAFETENSORS_CPP_USE_THREADS)
+  mutable std::mutex mtx;
+#endif
+  // Guarded by `mtx`.
+  std::multimap<std::pair<uint64_t, size_t>, dedup_buffer *> index;
+  // Tensor range of a file version -> the buffer its bytes were stored in
+  // or verified against. Entries live only while the buffer is resident.
+  std::map<dedup_cache_key, dedup_buffer *> hash_cache;
+  std::map<size_t, std::unique_ptr<dedup_model>> models;
+  size_t next_id{1};
+  uint64_t hash_cache_hits{0};
+
+  ~dedup_pool_impl() {
+    for (auto &it : index) {
+      delete it.second;
+    }
+  }
+
+  // Find a resident buffer with `hash` and `size`. When `verify` is set, the
+  // bytes must also match `data`.
+  dedup_buffer *find(uint64_t hash, size_t size, const uint8_t *data) {
+    auto range = index.equal_range(std::make_pair(hash, size));
+    for (auto it = range.first; it != range.second; ++it) {
+      if (!options.verify ||
+          (memcmp(it->second->data.get(), data, size) == 0)) {
+        return it->second;
+      }
+    }
+    return nullptr;
   }
 
-  o.u |= (h.u & 0x8000U) << 16U;  // sign bit
-  return o.f;
-}
-
-uint16_t float_to_half_full_le(float _f) {
-  FP32le f;
-  f.f = _f;
-  float16le o = {0};
+  void add_cache_key(const dedup_cache_key &key, dedup_buffer *b) {
+    if (!hash_cache.insert(std::make_pair(key, b)).second) {
+      return;  // e.g. the same range loaded concurrently
+    }
+    b->cache_keys.push_back(key);
+    if (b->cache_keys.size() > kMaxDedupCacheKeys) {
+      hash_cache.erase(b->cache_keys.front());
+      b->cache_keys.erase(b->cache_keys.begin());
+    }
+  }
 
-  // Based on ISPC reference code (with minor modifications)
-  if (f.s.Exponent == 0)  // Signed zero/denormal (which will underflow)
-    o.s.Exponent = 0;
-  else if (f.s.Exponent == 255)  // Inf or NaN (all exponent bits set)
-  {
-    o.s.Exponent = 31;
-    o.s.Mantissa = f.s.Mantissa ? 0x200 : 0;  // NaN->qNaN and Inf->Inf
-  } else                                      // Normalized number
-  {
-    // Exponent unbias the single, then bias the halfp
-    int newexp = f.s.Exponent - 127 + 15;
-    if (newexp >= 31)  // Overflow, return signed infinity
-      o.s.Exponent = 31;
-    else if (newexp <= 0)  // Underflow
-    {
-      if ((14 - newexp) <= 24)  // Mantissa might be non-zero
-      {
-        unsigned int mant = f.s.Mantissa | 0x800000;  // Hidden 1 bit
-        o.s.Mantissa = mant >> (14 - newexp);
-        if ((mant >> (13 - newexp)) & 1)  // Check for rounding
-          o.u++;  // Round, might overflow into exp bit, but this is OK
+  void release(dedup_buffer *b) {
+    if (--b->refs > 0) {
+      return;
+    }
+    for (const dedup_cache_key &key : b->cache_keys) {
+      hash_cache.erase(key);
+    }
+    auto range = index.equal_range(std::make_pair(b->hash, b->size));
+    for (auto it = range.first; it != range.second; ++it) {
+      if (it->second == b) {
+        index.erase(it);
+        break;
       }
-    } else {
-      o.s.Exponent = static_cast<unsigned int>(newexp);
-      o.s.Mantissa = f.s.Mantissa >> 13;
-      if (f.s.Mantissa & 0x1000)  // Check for rounding
-        o.u++;                    // Round, might overflow to inf, this is OK
     }
+    delete b;
   }
+};
 
-  o.s.Sign = f.s.Sign;
+struct dedup_lock {
+#if defined(SAFETENSORS_CPP_USE_THREADS)
+  std::lock_guard<std::mutex> lk;
+  explicit dedup_lock(const dedup_pool_impl *p) : lk(p->mtx) {}
+#else
+  explicit dedup_lock(const dedup_pool_impl *) {}
+#endif
+};
 
-  return o.u;
+}  // namespace detail
+
+dedup_pool::dedup_pool(const dedup_options &options) {
+  detail::dedup_pool_impl *p = new detail::dedup_pool_impl();
+  p->options = options;
+  _impl = p;
 }
 
-bool parse_safetensors_header(const uint8_t *addr, const size_t nbytes,
-                              const std::string &filename, safetensors_t *st,
-                              std::string *warn, std::string *err) {
-  if (nbytes < 16) {
-    if (err) {
-      (*err) += "Size is too short.\n";
-    }
+dedup_pool::~dedup_pool() {
+  delete reinterpret_cast<detail::dedup_pool_impl *>(_impl);
+  _impl = nullptr;
+}
+
+bool dedup_pool::load(const std::string &filename, size_t *id,
+                      std::string *warn, std::string *err) {
+  detail::dedup_pool_impl *p =
+      reinterpret_cast<detail::dedup_pool_impl *>(_impl);
+  if (!id) {
     return false;
   }
 
-  uint64_t header_size{0};
-  memcpy(reinterpret_cast<unsigned char *>(&header_size), addr,
-         sizeof(uint64_t));
+  SAFETENSORS_CPP_STATS_ENTRY();
 
-  if (header_size < 4) {
+  detail::safetensors_file file(filename.c_str(), "rb");
+  if (!file.is_valid()) {
     if (err) {
-      (*err) += "Header size is too short.\n";
+      (*err) += file.get_error();
     }
     return false;
   }
 
-  if ((8 + header_size) > nbytes) {
-    if (err) {
-      (*err) += "Header size " + std::to_string(header_size) +
-                " + 8 exceeds input size " + std::to_string(nbytes) + " .\n";
-    }
+  // The version of the opened file, so that a file replaced after `stat`
+  // is not cached under the old version.
+  detail::file_version version;
+  bool cacheable = detail::fstat_file_version(file.fd, &version);
+
+  std::unique_ptr<detail::dedup_model> model(new detail::dedup_model());
+  std::vector<uint8_t> head;
+  if (!detail::read_file_header(file, filename, &head, &model->header, warn,
+                                err)) {
     return false;
   }
 
-  if (header_size > kMaxJSONSize) {
-    if (err) {
-      (*err) += "Header JSON size exceeds the limit(" +
-                std::to_string(kMaxJSONSize) + ").\n";
+  const safetensors_t &header = model->header;
+  const size_t n = header.tensors.size();
+  const size_t databuffer_size = file.size - head.size();
+  std::vector<tensor_t> tensors(n);
+  for (size_t i = 0; i < n; i++) {
+    header.tensors.at(i, &tensors[i]);
+    if ((tensors[i].data_offsets[0] > tensors[i].data_offsets[1]) ||
+        (tensors[i].data_offsets[1] > databuffer_size)) {
+      if (err) {
+        (*err) += "Tensor `" + header.tensors.keys()[i] +
+                  "` has invalid data_offsets.\n";
+      }
+      return false;
     }
-    return false;
   }
 
-  // assume JSON data is small enough.
-  std::string json_str(reinterpret_cast<const char *>(&addr[8]), header_size);
-  const char *p = json_str.c_str();
+  std::vector<detail::dedup_buffer *> buffers(n, nullptr);
+  std::vector<std::string> errors(n);
+  std::atomic<uint64_t> bytes_read{0};
+
+  auto load_one = [&](size_t i) {
+    const tensor_t &t = tensors[i];
+    const size_t size = t.data_offsets[1] - t.data_offsets[0];
+    const detail::dedup_cache_key key =
+        std::make_pair(version, std::make_pair(t.data_offsets[0],
+                                               t.data_offsets[1]));
+    if (cacheable) {
+      detail::dedup_lock lk(p);
+      auto it = p->hash_cache.find(key);
+      if (it != p->hash_cache.end()) {
+        it->second->refs++;
+        p->hash_cache_hits++;
+        buffers[i] = it->second;
+        return;
+      }
+    }
 
-  ::minijson::value v;
-  ::minijson::error e = ::minijson::parse(p, v);
+    // Allocate at least 1 byte so that empty tensor has non-null address.
+    std::unique_ptr<uint8_t[]> data(new uint8_t[(std::max)(size, size_t(1))]);
+    if (!file.read_at(data.get(), size,
+                      uint64_t(head.size() + t.data_offsets[0]),
+                      &errors[i])) {
+      return;
+    }
+    bytes_read.fetch_add(size, std::memory_order_relaxed);
+    uint64_t hash = hash_bytes(data.get(), size);
 
-  if (e != ::minijson::no_error) {
-    if (err) {
-      std::string json_err(::minijson::errstr(e));
-      (*err) += "JSON parse error: " + json_err + "\n";
+    detail::dedup_lock lk(p);
+    detail::dedup_buffer *b = p->find(hash, size, data.get());
+    if (!b) {
+      b = new detail::dedup_buffer();
+      b->hash = hash;
+      b->size = size;
+      b->data = std::move(data);
+      p->index.insert(std::make_pair(std::make_pair(hash, size), b));
+    }
+    b->refs++;
+    if (cacheable) {
+      p->add_cache_key(key, b);
     }
+    buffers[i] = b;
+  };
+
+  detail::parallel_for(n, p->options.num_threads, load_one);
+  SAFETENSORS_CPP_STATS_ADD(bytes_read, bytes_read.load());
+  detail::counter_add(detail::g_counters.bytes_read,
+                      head.size() + bytes_read.load());
 
+  detail::dedup_lock lk(p);
+  bool ok = true;
+  for (size_t i = 0; i < n; i++) {
+    if (!errors[i].empty()) {
+      ok = false;
+      if (err) {
+        (*err) += errors[i];
+      }
+    }
+  }
+  if (!ok) {
+    for (detail::dedup_buffer *b : buffers) {
+      if (b) {
+        p->release(b);
+      }
+    }
     return false;
   }
 
-  ordered_dict<tensor_t> tensors;
-  ordered_dict<std::string> metadata;
-
-  // root element must be dict.
-  if (auto po = v.as<::minijson::object>()) {
-    for (size_t i = 0; i < po->size(); i++) {
-      std::string key = po->keys()[i];
-
-      if (key == "__metadata__") {
-        ::minijson::value value;
-        if (!po->at(i, &value)) {
-          if (err) {
-            (*err) += "Internal error. Invalid object in __metadata__.\n";
-          }
-          return false;
-        }
-
-        if (!detail::parse_metadata(value, metadata, err)) {
-          return false;
-        }
-      } else {
-        // tensor
+  for (size_t i = 0; i < n; i++) {
+    model->buffers[header.tensors.keys()[i]] = buffers[i];
+  }
+  (*id) = p->next_id++;
+  p->models[*id] = std::move(model);
 
-        if (tensors.count(key)) {
-          if (err) {
-            (*err) += "Duplicate key `" + key + "` found.\n";
-          }
-          return false;
-        }
+  return true;
+}
 
-        ::minijson::value value;
-        if (!po->at(i, &value)) {
-          if (err) {
-            (*err) += "Internal error. Invalid object in `" + key + "`.\n";
-          }
-          return false;
-        }
+bool dedup_pool::unload(size_t id) {
+  detail::dedup_pool_impl *p =
+      reinterpret_cast<detail::dedup_pool_impl *>(_impl);
+  detail::dedup_lock lk(p);
+  auto it = p->models.find(id);
+  if (it == p->models.end()) {
+    return false;
+  }
+  for (auto &b : it->second->buffers) {
+    p->release(b.second);
+  }
+  p->models.erase(it);
+  return true;
+}
 
-        tensor_t tensor;
-        if (!detail::parse_tensor(key, value, tensor, err)) {
-          return false;
-        }
+const safetensors_t *dedup_pool::header(size_t id) const {
+  const detail::dedup_pool_impl *p =
+      reinterpret_cast<const detail::dedup_pool_impl *>(_impl);
+  detail::dedup_lock lk(p);
+  auto it = p->models.find(id);
+  return (it == p->models.end()) ? nullptr : &it->second->header;
+}
 
-        tensors.insert(key, std::move(tensor));
-      }
+bool dedup_pool::get_tensor_data(size_t id, const std::string &name,
+                                 const uint8_t **data, size_t *nbytes,
+                                 std::string *err) const {
+  const detail::dedup_pool_impl *p =
+      reinterpret_cast<const detail::dedup_pool_impl *>(_impl);
+  if (!data || !nbytes) {
+    return false;
+  }
+  detail::dedup_lock lk(p);
+  auto it = p->models.find(id);
+  if (it == p->models.end()) {
+    if (err) {
+      (*err) += "Model " + std::to_string(id) + " not found.\n";
     }
-  } else {
+    return false;
+  }
+  auto bit = it->second->buffers.find(name);
+  if (bit == it->second->buffers.end()) {
     if (err) {
-      (*err) += "JSON root elements must be object(dict)\n";
+      (*err) += "Tensor `" + name + "` not found.\n";
     }
+    return false;
   }
+  (*data) = bit->second->data.get();
+  (*nbytes) = bit->second->size;
+  return true;
+}
 
-  st->tensors = std::move(tensors);
-  st->metadata = std::move(metadata);
-  st->header_size = header_size;
+dedup_stats dedup_pool::stats() const {
+  const detail::dedup_pool_impl *p =
+      reinterpret_cast<const detail::dedup_pool_impl *>(_impl);
+  detail::dedup_lock lk(p);
+  dedup_stats s;
+  s.models = p->models.size();
+  for (const auto &m : p->models) {
+    s.tensors += m.second->buffers.size();
+    for (const auto &b : m.second->buffers) {
+      s.logical_bytes += b.second->size;
+    }
+  }
+  s.buffers = p->index.size();
+  for (const auto &b : p->index) {
+    s.resident_bytes += b.second->size;
+  }
+  s.bytes_saved = s.logical_bytes - s.resident_bytes;
+  s.hash_cache_hits = p->hash_cache_hits;
+  s.hash_cache_entries = p->hash_cache.size();
+  return s;
+}
 
-#if 0
-  size_t databuffer_size = nbytes - header_size - 8;
+namespace detail {
 
-  st->storage.resize(nbytes);
-  memcpy(st->storage.data(), addr + 8 + header_size, nbytes);
+// Elements per widened block and per work item.
+constexpr size_t kCompareBlockSize = 1024;
+constexpr size_t kCompareChunkSize = 1024 * 1024;
 
-  st->mmaped = false;
-  st->mmap_addr = addr + 8 + header_size;
-  st->mmap_size = 0;
-#endif
+template <typename T>
+void widen_items(const uint8_t *src, size_t n, double *dst) {
+  for (size_t i = 0; i < n; i++) {
+    T v;
+    memcpy(&v, src + i * sizeof(T), sizeof(T));
+    dst[i] = double(v);
+  }
+}
 
-  return true;
+// Convert `n`(<= kCompareBlockSize) items to double.
+void widen_to_double(const uint8_t *src, dtype dt, size_t n, double *dst) {
+  switch (dt) {
+    case dtype::kBOOL:
+    case dtype::kUINT8:
+      widen_items<uint8_t>(src, n, dst);
+      break;
+    case dtype::kINT8:
+      widen_items<int8_t>(src, n, dst);
+      break;
+    case dtype::kUINT16:
+      widen_items<uint16_t>(src, n, dst);
+      break;
+    case dtype::kINT16:
+      widen_items<int16_t>(src, n, dst);
+      break;
+    case dtype::kUINT32:
+      widen_items<uint32_t>(src, n, dst);
+      break;
+    case dtype::kINT32:
+      widen_items<int32_t>(src, n, dst);
+      break;
+    case dtype::kUINT64:
+      widen_items<uint64_t>(src, n, dst);
+      break;
+    case dtype::kINT64:
+      widen_items<int64_t>(src, n, dst);
+      break;
+    case dtype::kFLOAT32:
+      widen_items<float>(src, n, dst);
+      break;
+    case dtype::kFLOAT64:
+      widen_items<double>(src, n, dst);
+      break;
+    case dtype::kFLOAT16:
+    case dtype::kBFLOAT16: {
+      // Value-initialized: `n`(<= kCompareBlockSize) is opaque to the
+      // compiler, which would warn on the conversion reading `h`/`f`.
+      uint16_t h[kCompareBlockSize] = {};
+      float f[kCompareBlockSize] = {};
+      memcpy(h, src, n * 2);
+      if (dt == dtype::kFLOAT16) {
+        ::safetensors::fp16_to_float(h, n, f);
+      } else {
+        ::safetensors::bfloat16_to_float(h, n, f);
+      }
+      for (size_t i = 0; i < n; i++) {
+        dst[i] = double(f[i]);
+      }
+      break;
+    }
+  }
 }
 
-}  // namespace detail
+bool is_float_dtype(dtype dt) {
+  return (dt == dtype::kFLOAT16) || (dt == dtype::kBFLOAT16) ||
+         (dt == dtype::kFLOAT32) || (dt == dtype::kFLOAT64);
+}
 
-safetensors_t::~safetensors_t() {
-  if (st_mmap) {
-    detail::safetensors_mmap *p =
-        reinterpret_cast<detail::safetensors_mmap *>(st_mmap);
-    delete p;
-    st_mmap = nullptr;
+// Mantissa bits, to pick the coarser float dtype for ULP distance.
+int mantissa_bits(dtype dt) {
+  switch (dt) {
+    case dtype::kBFLOAT16:
+      return 7;
+    case dtype::kFLOAT16:
+      return 10;
+    case dtype::kFLOAT32:
+      return 23;
+    case dtype::kFLOAT64:
+      return 52;
+    default:
+      return 64;
   }
+}
 
-  if (st_file) {
-    detail::safetensors_file *p =
-        reinterpret_cast<detail::safetensors_file *>(st_file);
-    delete p;
-    st_file = nullptr;
+// Sign and magnitude bits to an unsigned integer centered at 2^63, monotonic
+// in the value(-0 and +0 map to the same integer).
+uint64_t ordered_from_sign_magnitude(bool negative, uint64_t mag) {
+  const uint64_t center = uint64_t(1) << 63;
+  return negative ? (center - mag) : (center + mag);
+}
+
+// Map values rounded to float dtype `dt` to unsigned integers which are
+// monotonic in the value, so that the difference of two(taken in uint64_t,
+// larger minus smaller) is the ULP distance.
+void to_ordered_bits(const double *src, dtype dt, size_t n, uint64_t *dst) {
+  if (dt == dtype::kFLOAT64) {
+    for (size_t i = 0; i < n; i++) {
+      uint64_t b;
+      memcpy(&b, &src[i], 8);
+      dst[i] = ordered_from_sign_magnitude((b >> 63) != 0,
+                                           b & ~(uint64_t(1) << 63));
+    }
+  } else if (dt == dtype::kFLOAT32) {
+    for (size_t i = 0; i < n; i++) {
+      float f = float(src[i]);
+      uint32_t b;
+      memcpy(&b, &f, 4);
+      dst[i] = ordered_from_sign_magnitude((b >> 31) != 0, b & 0x7fffffffu);
+    }
+  } else {
+    // Value-initialized, see widen_to_double.
+    float f[kCompareBlockSize] = {};
+    uint16_t h[kCompareBlockSize] = {};
+    for (size_t i = 0; i < n; i++) {
+      f[i] = float(src[i]);
+    }
+    if (dt == dtype::kFLOAT16) {
+      ::safetensors::float_to_fp16(f, n, h);
+    } else {
+      ::safetensors::float_to_bfloat16(f, n, h);
+    }
+    for (size_t i = 0; i < n; i++) {
+      dst[i] = ordered_from_sign_magnitude((h[i] & 0x8000u) != 0,
+                                           h[i] & 0x7fffu);
+    }
+  }
+}
+
+struct compare_partial {
+  size_t mismatches{0};
+  size_t first_mismatch{(std::numeric_limits<size_t>::max)()};
+  double max_abs_error{0.0};
+  double max_rel_error{0.0};
+  uint64_t max_ulp_error{0};
+};
+
+struct compare_task {
+  size_t result_index;
+  const uint8_t *a;
+  const uint8_t *b;
+  dtype dtype_a;
+  dtype dtype_b;
+  size_t begin;  // element range
+  size_t end;
+};
+
+// Compare elements [task.begin, task.end).
+//
+// Each block is widened to double, then errors and the mismatch flags are
+// computed in branch-free loops(auto-vectorized). Only flagged elements are
+// revisited for NaN handling.
+void compare_range(const compare_task &task, const compare_options &options,
+                   compare_partial *r) {
+  const size_t ia = get_dtype_bytes(task.dtype_a);
+  const size_t ib = get_dtype_bytes(task.dtype_b);
+  const bool same_dtype = (task.dtype_a == task.dtype_b);
+  const bool floats =
+      is_float_dtype(task.dtype_a) && is_float_dtype(task.dtype_b);
+  const dtype ulp_dtype =
+      (mantissa_bits(task.dtype_a) <= mantissa_bits(task.dtype_b))
+          ? task.dtype_a
+          : task.dtype_b;
+  const bool bitwise = (options.mode == kCOMPARE_BITWISE);
+  const bool ulp_mode = (options.mode == kCOMPARE_ULP);
+
+  double da[kCompareBlockSize], db[kCompareBlockSize], d[kCompareBlockSize];
+  uint64_t oa[kCompareBlockSize], ob[kCompareBlockSize];
+  uint64_t ulp[kCompareBlockSize];
+  uint8_t bad[kCompareBlockSize];
+  for (size_t i0 = task.begin; i0 < task.end; i0 += kCompareBlockSize) {
+    const size_t n = (std::min)(kCompareBlockSize, task.end - i0);
+    const uint8_t *pa = task.a + i0 * ia;
+    const uint8_t *pb = task.b + i0 * ib;
+    if (same_dtype && (memcmp(pa, pb, n * ia) == 0)) {
+      continue;  // identical block
+    }
+
+    widen_to_double(pa, task.dtype_a, n, da);
+    widen_to_double(pb, task.dtype_b, n, db);
+
+    // NaN in either gives NaN in `d`. inf == inf gives 0.
+    double max_abs = r->max_abs_error, max_rel = r->max_rel_error;
+    for (size_t j = 0; j < n; j++) {
+      d[j] = (da[j] == db[j]) ? 0.0 : std::fabs(da[j] - db[j]);
+      double ay = std::fabs(db[j]);
+      double rel = (ay > 0.0) ? (d[j] / ay) : 0.0;
+      max_abs = (std::max)(max_abs, d[j]);  // NaN is ignored
+      max_rel = (std::max)(max_rel, rel);
+    }
+    r->max_abs_error = max_abs;
+    r->max_rel_error = max_rel;
+
+    if (ulp_mode) {
+      if (floats) {
+        to_ordered_bits(da, ulp_dtype, n, oa);
+        to_ordered_bits(db, ulp_dtype, n, ob);
+        for (size_t j = 0; j < n; j++) {
+          ulp[j] = (oa[j] > ob[j]) ? (oa[j] - ob[j]) : (ob[j] - oa[j]);
+        }
+      } else {
+        for (size_t j = 0; j < n; j++) {
+          ulp[j] = (d[j] < 1.8e19) ? uint64_t(d[j])
+                                   : (std::numeric_limits<uint64_t>::max)();
+        }
+      }
+      uint64_t max_ulp = r->max_ulp_error;
+      for (size_t j = 0; j < n; j++) {
+        bool nan = (d[j] != d[j]);
+        max_ulp = nan ? max_ulp : (std::max)(max_ulp, ulp[j]);
+        bad[j] = uint8_t(nan | (ulp[j] > options.max_ulp));
+      }
+      r->max_ulp_error = max_ulp;
+    } else if (bitwise) {
+      for (size_t j = 0; j < n; j++) {
+        bad[j] = uint8_t(memcmp(pa + j * ia, pb + j * ib, ia) != 0);
+      }
+    } else {
+      for (size_t j = 0; j < n; j++) {
+        bad[j] = uint8_t(
+            !(d[j] <= options.atol + options.rtol * std::fabs(db[j])));
+      }
+    }
+
+    for (size_t j = 0; j < n; j++) {
+      if (!bad[j]) {
+        continue;
+      }
+      if (!bitwise && std::isnan(da[j]) && std::isnan(db[j]) &&
+          options.nan_equal) {
+        continue;
+      }
+      if (r->mismatches == 0) {
+        r->first_mismatch = i0 + j;
+      }
+      r->mismatches++;
+      if (options.early_exit) {
+        return;
+      }
+    }
   }
 }
 
-//
-// - 8byte: header_size
-// - json data(header_size bytes)
-// - tensor data(filesize - header_size)
-//
+}  // namespace detail
 
-bool load_from_file(const std::string &filename, safetensors_t *st,
-                    std::string *warn, std::string *err) {
-  std::vector<unsigned char> data;
-  if (!detail::ReadWholeFile(&data, err, filename, nullptr)) {
+bool compare(const safetensors_t &a, const safetensors_t &b,
+             const compare_options &options, compare_result *result,
+             std::string *err) {
+  if (!result) {
     return false;
   }
 
-  return load_from_memory(reinterpret_cast<const uint8_t *>(data.data()),
-                          data.size(), filename, st, warn, err);
-}
+  auto start = std::chrono::steady_clock::now();
+  compare_result &r = *result;
+  r = compare_result();
+
+  // Match tensors and split elements into tasks.
+  std::vector<detail::compare_task> tasks;
+  for (size_t i = 0; i < a.tensors.size(); i++) {
+    tensor_compare_result tr;
+    tr.name = a.tensors.keys()[i];
+    tensor_t ta, tb;
+    a.tensors.at(i, &ta);
+    if (!b.tensors.at(tr.name, &tb)) {
+      tr.only_in_a = true;
+      r.tensors.push_back(tr);
+      continue;
+    }
+    tr.dtype_differs = (ta.dtype != tb.dtype);
+    tr.shape_differs = (ta.shape != tb.shape);
+    tr.match = !tr.shape_differs &&
+               !(tr.dtype_differs && (options.mode == kCOMPARE_BITWISE));
 
-bool load_from_memory(const uint8_t *addr, const size_t nbytes,
-                      const std::string &filename, safetensors_t *st,
-                      std::string *warn, std::string *err) {
-  if (nbytes < 16) {
-    if (err) {
-      (*err) += "Size is too short.\n";
+    const uint8_t *da{nullptr}, *db{nullptr};
+    size_t na{0}, nb{0};
+    if (!get_tensor_data(a, tr.name, &da, &na, err) ||
+        !get_tensor_data(b, tr.name, &db, &nb, err)) {
+      return false;
     }
-    return false;
+    size_t count = get_shape_size(ta);
+    if (tr.match && ((na != count * get_dtype_bytes(ta.dtype)) ||
+                     (nb != count * get_dtype_bytes(tb.dtype)))) {
+      if (err) {
+        (*err) += "Tensor `" + tr.name + "` has invalid data size.\n";
+      }
+      return false;
+    }
+    if (tr.match) {
+      for (size_t e = 0; e < count; e += detail::kCompareChunkSize) {
+        detail::compare_task task;
+        task.result_index = r.tensors.size();
+        task.a = da;
+        task.b = db;
+        task.dtype_a = ta.dtype;
+        task.dtype_b = tb.dtype;
+        task.begin = e;
+        task.end = (std::min)(count, e + detail::kCompareChunkSize);
+        tasks.push_back(task);
+      }
+    }
+    r.tensors.push_back(tr);
   }
-
-  if (!detail::parse_safetensors_header(addr, nbytes, filename, st, warn,
-                                        err)) {
-    return false;
+  for (size_t i = 0; i < b.tensors.size(); i++) {
+    if (!a.tensors.count(b.tensors.keys()[i])) {
+      tensor_compare_result tr;
+      tr.name = b.tensors.keys()[i];
+      tr.only_in_b = true;
+      r.tensors.push_back(tr);
+    }
   }
 
-  size_t databuffer_size = nbytes - st->header_size - 8;
-
-  st->storage.resize(databuffer_size);
-  memcpy(st->storage.data(), addr + 8 + st->header_size, databuffer_size);
-
-  st->mmaped = false;
-  st->mmap_addr = nullptr;
-  st->mmap_size = 0;
-  st->databuffer_addr = nullptr;
-  st->databuffer_size = 0;
+  // With `early_exit`, only tasks after the first mismatching task are
+  // skipped, so the first mismatch index stays exact.
+  const size_t n = tasks.size();
+  std::vector<detail::compare_partial> partials(n);
+  std::vector<uint8_t> done(n, 0);
+  std::atomic<size_t> stop_index{(std::numeric_limits<size_t>::max)()};
+  auto run_one = [&](size_t i) {
+    if (options.early_exit &&
+        (i > stop_index.load(std::memory_order_relaxed))) {
+      return;
+    }
+    detail::compare_range(tasks[i], options, &partials[i]);
+    done[i] = 1;
+    if (partials[i].mismatches) {
+      size_t cur = stop_index.load(std::memory_order_relaxed);
+      while ((i < cur) && !stop_index.compare_exchange_weak(
+                              cur, i, std::memory_order_relaxed)) {
+      }
+    }
+  };
 
-  return true;
-}
+  detail::parallel_for(n, options.num_threads, run_one);
 
-bool mmap_from_file(const std::string &filename, safetensors_t *st,
-                    std::string *warn, std::string *err) {
-  if (!st) {
-    return false;
+  // Reduce per tensor. Tasks of a tensor are contiguous and in order.
+  for (size_t i = 0; i < n; i++) {
+    tensor_compare_result &tr = r.tensors[tasks[i].result_index];
+    if (!done[i]) {
+      tr.skipped = true;
+      continue;
+    }
+    const detail::compare_partial &p = partials[i];
+    if (p.mismatches && (tr.mismatches == 0)) {
+      tr.first_mismatch = p.first_mismatch;
+    }
+    tr.mismatches += p.mismatches;
+    tr.max_abs_error = (std::max)(tr.max_abs_error, p.max_abs_error);
+    tr.max_rel_error = (std::max)(tr.max_rel_error, p.max_rel_error);
+    tr.max_ulp_error = (std::max)(tr.max_ulp_error, p.max_ulp_error);
   }
 
-  detail::safetensors_file *pf =
-      new detail::safetensors_file(filename.c_str(), "rb");
-  if (!pf->is_valid()) {
-    if (err) {
-      (*err) += pf->get_error();
+  // A skipped tensor without a mismatch found so far is neither a match nor
+  // a mismatch.
+  for (tensor_compare_result &tr : r.tensors) {
+    const bool unknown = tr.match && tr.skipped && (tr.mismatches == 0);
+    tr.match = tr.match && !tr.skipped && (tr.mismatches == 0);
+    if (unknown) {
+      r.num_skipped++;
+    } else if (!tr.match) {
+      r.num_mismatched++;
     }
-    delete pf;
-    return false;
   }
+  r.match = (r.num_mismatched == 0) && (r.num_skipped == 0);
+  r.seconds = std::chrono::duration<double>(
+                  std::chrono::steady_clock::now() - start)
+                  .count();
 
-  // TODO: prefetch, numa
-  detail::safetensors_mmap *pm = new detail::safetensors_mmap(pf);
-
-  bool ret = mmap_from_memory(pm->addr, pm->size, filename, st, warn, err);
-
-  if (!ret) {
-    delete pm;
-    delete pf;
+  return true;
+}
 
+bool compare_files(const std::string &filename_a,
+                   const std::string &filename_b,
+                   const compare_options &options, compare_result *result,
+                   std::string *warn, std::string *err) {
+  safetensors_t a, b;
+  if (!mmap_from_file(filename_a, &a, warn, err) ||
+      !mmap_from_file(filename_b, &b, warn, err)) {
     return false;
   }
+  return compare(a, b, options, result, err);
+}
 
-  st->mmap_addr = pm->addr;
-  st->mmap_size = pm->size;
+namespace detail {
 
-  st->databuffer_addr = st->mmap_addr + 8 + st->header_size;
-  st->databuffer_size = st->mmap_size - (8 + st->header_size);
+const char *kCompressionPrefix = "__compression__.";
+const char *kCompressionFormat = "__compression__.format";
+const char *kCompressionChunkSize = "__compression__.chunk_size";
+const char *kCompressionShuffle = "__compression__.shuffle";
+const char *kCompressionChunks = "__compression__.chunks";
+const char *kCompressionTensor = "__compression__.tensor.";
+const char *kCompressedTensorName = "__compressed__";
+const char *kCompressionFormatName = "st-lz/1";
 
-  // retain pointer
-  st->st_file = pf;
-  st->st_mmap = pm;
+// Upper bound of `chunk_size`, also checked when reading.
+constexpr size_t kMaxCompressionChunkSize = size_t(1) << 30;
 
-  st->mmaped = true;
+//
+// LZ77-class block codec(LZ4-like block format).
+//
+// Sequence: token(4 bits literal length, 4 bits match length - 4), extended
+// literal length, literals, 2 bytes little-endian offset, extended match
+// length. A length nibble of 15 is followed by bytes added to it until a
+// byte != 255. The last sequence may have literals only.
+//
+constexpr int kLZHashLog = 14;
+constexpr size_t kLZMinMatch = 4;
+constexpr size_t kLZMaxOffset = 65535;
 
-  return true;
+size_t lz_compress_bound(size_t n) { return n + n / 255 + 16; }
+
+inline uint32_t lz_read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
 }
 
-bool mmap_from_memory(const uint8_t *addr, const size_t nbytes,
-                      const std::string &filename, safetensors_t *st,
-                      std::string *warn, std::string *err) {
-  if (!addr) {
-    return false;
+inline uint8_t *lz_write_length(uint8_t *op, size_t len) {
+  for (; len >= 255; len -= 255) {
+    *op++ = 255;
   }
+  *op++ = uint8_t(len);
+  return op;
+}
 
-  if (nbytes < 16) {
-    return false;
-  }
+inline uint8_t *lz_write_sequence(uint8_t *op, const uint8_t *literals,
+                                  size_t num_literals, size_t offset,
+                                  size_t match_len) {
+  uint8_t *token = op++;
+  size_t lit_nibble = (std::min)(num_literals, size_t(15));
+  size_t match_nibble =
+      match_len ? (std::min)(match_len - kLZMinMatch, size_t(15)) : 0;
+  *token = uint8_t((lit_nibble << 4) | match_nibble);
+  if (lit_nibble == 15) {
+    op = lz_write_length(op, num_literals - 15);
+  }
+  memcpy(op, literals, num_literals);
+  op += num_literals;
+  if (match_len) {
+    *op++ = uint8_t(offset & 0xff);
+    *op++ = uint8_t(offset >> 8);
+    if (match_nibble == 15) {
+      op = lz_write_length(op, match_len - kLZMinMatch - 15);
+    }
+  }
+  return op;
+}
 
-  if (!st) {
-    return false;
+// Compress `n` bytes to `dst`(at least `lz_compress_bound(n)` bytes).
+// Returns the compressed size.
+size_t lz_compress(const uint8_t *src, size_t n, uint8_t *dst) {
+  std::vector<uint32_t> table(size_t(1) << kLZHashLog, 0);
+  uint8_t *op = dst;
+  size_t anchor = 0;
+  size_t ip = 1;  // position 0 is the "empty" value of `table`
+  size_t misses = 0;
+  while (ip + kLZMinMatch <= n) {
+    uint32_t v = lz_read32(src + ip);
+    uint32_t h = (v * 2654435761u) >> (32 - kLZHashLog);
+    size_t ref = table[h];
+    table[h] = uint32_t(ip);
+    if (ref && ((ip - ref) <= kLZMaxOffset) && (lz_read32(src + ref) == v)) {
+      size_t len = kLZMinMatch;
+      while (((ip + len) < n) && (src[ref + len] == src[ip + len])) {
+        len++;
+      }
+      op = lz_write_sequence(op, src + anchor, ip - anchor, ip - ref, len);
+      ip += len;
+      anchor = ip;
+      misses = 0;
+    } else {
+      // Skip faster over incompressible data.
+      ip += 1 + (misses++ >> 5);
+    }
   }
-
-  if (!detail::parse_safetensors_header(addr, nbytes, filename, st, warn,
-                                        err)) {
-    return false;
+  if (anchor < n) {
+    op = lz_write_sequence(op, src + anchor, n - anchor, 0, 0);
   }
+  return size_t(op - dst);
+}
 
-  size_t databuffer_size = nbytes - st->header_size - 8;
-
-  st->mmaped = true;
-
-  st->mmap_addr = addr;
-  st->mmap_size = nbytes;
-
-  st->databuffer_addr = st->mmap_addr + 8 + st->header_size;
-  st->databuffer_size = st->mmap_size - (8 + st->header_size);
-
+inline bool lz_read_length(const uint8_t *src, size_t n, size_t *ip,
+                           size_t *len) {
+  uint8_t b;
+  do {
+    if (*ip >= n) {
+      return false;
+    }
+    b = src[(*ip)++];
+    (*len) += b;
+  } while (b == 255);
   return true;
 }
 
-float bfloat16_to_float(uint16_t x) { return detail::bfloat16_to_float(x); }
-
-uint16_t float_to_bfloat16(float x) { return detail::float_to_bfloat16(x); }
+// Decompress to exactly `dst_size` bytes. Returns false on malformed input.
+bool lz_decompress(const uint8_t *src, size_t n, uint8_t *dst,
+                   size_t dst_size) {
+  size_t ip = 0, op = 0;
+  while (ip < n) {
+    uint8_t token = src[ip++];
+    size_t lit = token >> 4;
+    if ((lit == 15) && !lz_read_length(src, n, &ip, &lit)) {
+      return false;
+    }
+    if ((lit > (n - ip)) || (lit > (dst_size - op))) {
+      return false;
+    }
+    memcpy(dst + op, src + ip, lit);
+    ip += lit;
+    op += lit;
+    if (ip == n) {
+      break;
+    }
 
-float fp16_to_float(uint16_t x) {
-  detail::float16le src;
-  src.u = x;
-  return detail::half_to_float_le(src);
+    if ((n - ip) < 2) {
+      return false;
+    }
+    size_t offset = size_t(src[ip]) | (size_t(src[ip + 1]) << 8);
+    ip += 2;
+    size_t len = (token & 15);
+    if ((len == 15) && !lz_read_length(src, n, &ip, &len)) {
+      return false;
+    }
+    len += kLZMinMatch;
+    if ((offset == 0) || (offset > op) || (len > (dst_size - op))) {
+      return false;
+    }
+    uint8_t *d = dst + op;
+    const uint8_t *m = d - offset;
+    // An overlapping match repeats the last `offset` bytes. Copy in blocks
+    // of at most `offset` bytes so that each memcpy does not overlap.
+    for (size_t i = 0; i < len; i += offset) {
+      memcpy(d + i, m + i, (std::min)(offset, len - i));
+    }
+    op += len;
+  }
+  return op == dst_size;
 }
 
-uint16_t float_to_fp16(float x) { return detail::float_to_half_full_le(x); }
-
-size_t get_dtype_bytes(const safetensors::dtype dtype) {
-  size_t sz = 0;
-
-  switch (dtype) {
-    case safetensors::dtype::kBOOL:
-      // Original Rust implementaion uses 1.
-      sz = 1;
-      break;
-    case safetensors::dtype::kUINT8:
-      sz = 1;
-      break;
-    case safetensors::dtype::kINT8:
-      sz = 1;
-      break;
-    case safetensors::dtype::kUINT16:
-      sz = 2;
-      break;
-    case safetensors::dtype::kINT16:
-      sz = 2;
-      break;
-    case safetensors::dtype::kINT32:
-      sz = 4;
-      break;
-    case safetensors::dtype::kUINT32:
-      sz = 4;
-      break;
-    case safetensors::dtype::kFLOAT16:
-      sz = 2;
-      break;
-    case safetensors::dtype::kBFLOAT16:
-      sz = 2;
-      break;
-    case safetensors::dtype::kFLOAT32:
-      sz = 4;
-      break;
-    case safetensors::dtype::kFLOAT64:
-      sz = 8;
-      break;
-    case safetensors::dtype::kINT64:
-      sz = 8;
-      break;
-    case safetensors::dtype::kUINT64:
-      sz = 8;
-      break;
+// Byte-plane shuffle: byte `b` of element `i` goes to `dst[b * count + i]`.
+// Trailing bytes(n % itemsize) are copied as is.
+void shuffle_bytes(const uint8_t *src, size_t n, size_t itemsize,
+                   uint8_t *dst) {
+  size_t count = n / itemsize;
+  for (size_t b = 0; b < itemsize; b++) {
+    for (size_t i = 0; i < count; i++) {
+      dst[b * count + i] = src[i * itemsize + b];
+    }
   }
-
-  return sz;
+  memcpy(dst + count * itemsize, src + count * itemsize, n % itemsize);
 }
 
-std::string get_dtype_str(const safetensors::dtype dtype) {
-  switch (dtype) {
-    case safetensors::dtype::kBOOL:
-      return "BOOL";
-    case safetensors::dtype::kUINT8:
-      return "U8";
-    case safetensors::dtype::kINT8:
-      return "I8";
-    case safetensors::dtype::kUINT16:
-      return "U16";
-    case safetensors::dtype::kINT16:
-      return "I16";
-    case safetensors::dtype::kINT32:
-      return "I32";
-    case safetensors::dtype::kUINT32:
-      return "U32";
-    case safetensors::dtype::kFLOAT16:
-      return "F16";
-    case safetensors::dtype::kBFLOAT16:
-      return "BF16";
-    case safetensors::dtype::kFLOAT32:
-      return "F32";
-    case safetensors::dtype::kFLOAT64:
-      return "F64";
-    case safetensors::dtype::kINT64:
-      return "I64";
-    case safetensors::dtype::kUINT64:
-      return "U64";
+void unshuffle_bytes(const uint8_t *src, size_t n, size_t itemsize,
+                     uint8_t *dst) {
+  size_t count = n / itemsize;
+  for (size_t b = 0; b < itemsize; b++) {
+    for (size_t i = 0; i < count; i++) {
+      dst[i * itemsize + b] = src[b * count + i];
+    }
   }
-  return "???";
+  memcpy(dst + count * itemsize, src + count * itemsize, n % itemsize);
 }
 
-// Empty Tensor returns 0.
-// Zero-rank Tensor reuturns 1(scalar)
-size_t get_shape_size(const tensor_t &t) {
-  if (t.shape.empty()) {
-    return 1;
-  }
+size_t shuffle_itemsize(dtype dt) {
+  return is_float_dtype(dt) ? get_dtype_bytes(dt) : 0;
+}
 
-  if (t.shape.size() >= kMaxDim) {  // invalid ndim
-    return 0;
+bool dtype_from_str(const std::string &s, dtype *dt) {
+  for (int i = int(dtype::kBOOL); i <= int(dtype::kUINT64); i++) {
+    if (get_dtype_str(dtype(i)) == s) {
+      (*dt) = dtype(i);
+      return true;
+    }
   }
+  return false;
+}
 
-  size_t sz = 1;
+struct compressed_chunk {
+  uint64_t offset;  // in the compressed data
+  size_t size;      // compressed size
+  size_t raw_size;
+};
 
-  for (size_t i = 0; i < t.shape.size(); i++) {
-    sz *= t.shape[i];
-  }
+struct compressed_layout {
+  size_t chunk_size{0};
+  bool shuffle{false};
+  safetensors_t header;  // tensors with uncompressed data_offsets, metadata
+  std::vector<size_t> first_chunk;  // per tensor, plus the end
+  std::vector<compressed_chunk> chunks;
+  uint64_t data_offset{0};  // `__compressed__` in the databuffer
+  uint64_t data_size{0};
+};
 
-  return sz;
+// Parse a comma separated list of decimal numbers(empty string = no
+// numbers).
+bool parse_size_list(const std::string &s, std::vector<size_t> *v) {
+  const char *p = s.c_str();
+  const char *end = p + s.size();
+  while (p < end) {
+    size_t n;
+    if (!parse_trace_number(p, end, &n)) {
+      return false;
+    }
+    v->push_back(n);
+    if ((p < end) && ((*p++ != ',') || (p == end))) {
+      return false;
+    }
+  }
+  return true;
 }
 
-bool validate_data_offsets(const safetensors_t &st, std::string &err) {
-  bool valid{true};
-
-  std::stringstream ss;
-
-  size_t databuffersize;
-  if (st.mmaped) {
-    databuffersize = st.databuffer_size;
-  } else {
-    databuffersize = st.storage.size();
+// `a * b` and `a + b` which fail instead of wrapping around.
+bool checked_mul(size_t a, size_t b, size_t *r) {
+  if (a && (b > (std::numeric_limits<size_t>::max)() / a)) {
+    return false;
   }
+  (*r) = a * b;
+  return true;
+}
 
-  size_t ntensors{0};
-  // Iterate with key insertion order.
-  for (size_t i =0 ;i < st.tensors.size(); i++) {
-
-    std::string key = st.tensors.keys()[i];
+bool checked_add(size_t a, size_t b, size_t *r) {
+  if (b > (std::numeric_limits<size_t>::max)() - a) {
+    return false;
+  }
+  (*r) = a + b;
+  return true;
+}
 
-    tensor_t tensor;
-    if (!st.tensors.at(i, &tensor)) {
-      ss << "Internal error: Failed to get tensor at [" << i << "]\n";
-      valid = false;
-      continue;
+// Build the layout from the header of a compressed file. Every size in the
+// header is untrusted: tensor sizes and offsets are computed without
+// wrap-around, and each chunk must lie within `__compressed__` and decode to
+// at most 255 bytes per compressed byte(the maximum of the codec), which
+// also bounds the size of the decompressed storage.
+bool parse_compressed_layout(const safetensors_t &st,
+                             compressed_layout *layout, std::string *err) {
+  std::string format, chunk_size, shuffle, chunks;
+  tensor_t data;
+  std::vector<size_t> chunk_size_v;
+  if (!st.metadata.at(kCompressionFormat, &format) ||
+      (format != kCompressionFormatName) ||
+      !st.metadata.at(kCompressionChunkSize, &chunk_size) ||
+      !st.metadata.at(kCompressionChunks, &chunks) ||
+      !st.tensors.at(kCompressedTensorName, &data)) {
+    if (err) {
+      (*err) += "Unsupported or broken compressed file.\n";
     }
-
-    if (tensor.data_offsets[0] > tensor.data_offsets[1]) {
-      ss << key << ".data_offsets.BEGIN " << tensor.data_offsets[0]
-         << " must be less than or equal to data_offsets.END "
-         << tensor.data_offsets[1] << "\n";
-      valid = false;
+    return false;
+  }
+  st.metadata.at(kCompressionShuffle, &shuffle);
+  layout->shuffle = (shuffle == "1");
+  layout->data_offset = data.data_offsets[0];
+  layout->data_size = data.data_offsets[1] - data.data_offsets[0];
+  if (!parse_size_list(chunk_size, &chunk_size_v) ||
+      (chunk_size_v.size() != 1) || (chunk_size_v[0] == 0) ||
+      (chunk_size_v[0] % 8) || (chunk_size_v[0] > kMaxCompressionChunkSize) ||
+      (data.data_offsets[1] < data.data_offsets[0])) {
+    if (err) {
+      (*err) += "Invalid chunk size " + chunk_size + ".\n";
     }
-
-    size_t tensor_size = get_dtype_bytes(tensor.dtype) * get_shape_size(tensor);
-
-    if (tensor_size == 0) {
-      // OK
+    return false;
+  }
+  layout->chunk_size = chunk_size_v[0];
+
+  // Tensors, in order.
+  const std::string prefix = kCompressionTensor;
+  size_t offset = 0;
+  for (size_t i = 0; i < st.metadata.size(); i++) {
+    const std::string &key = st.metadata.keys()[i];
+    std::string value;
+    st.metadata.at(i, &value);
+    if (!starts_with(key, kCompressionPrefix)) {
+      layout->header.metadata.insert(key, value);
       continue;
     }
-
-    // data_offsets are absolute offset from the databuffer(file)
-    if (tensor.data_offsets[0] > databuffersize) {
-      ss << "Tensor `" << key << "`.data_offset.BEGIN "
-         << tensor.data_offsets[0] << " exceeds databuffer size "
-         << databuffersize << ".\n";
-      valid = false;
+    if (!starts_with(key, prefix)) {
+      continue;
     }
-
-    if (tensor.data_offsets[1] > databuffersize) {
-      ss << "Tensor `" << key << "`.data_offset.END "
-         << tensor.data_offsets[1] << " exceeds databuffer size "
-         << databuffersize << ".\n";
-      valid = false;
+    std::string name = key.substr(prefix.size());
+    tensor_t t;
+    size_t sep = value.find(';');
+    size_t nbytes = 0;
+    bool ok = (sep != std::string::npos) &&
+              dtype_from_str(value.substr(0, sep), &t.dtype) &&
+              parse_size_list(value.substr(sep + 1), &t.shape) &&
+              (t.shape.size() < kMaxDim);
+    if (ok) {
+      nbytes = get_dtype_bytes(t.dtype);
+      for (size_t d = 0; ok && (d < t.shape.size()); d++) {
+        ok = checked_mul(nbytes, t.shape[d], &nbytes);
+      }
     }
-
-    size_t data_size = tensor.data_offsets[1] - tensor.data_offsets[0];
-
-    if (tensor_size != data_size) {
-      ss << "Data size mismatch. The size in Tensor `" << key << "` is "
-         << tensor_size << ", but the size from data_offsets is " << data_size
-         << "\n";
-      valid = false;
+    size_t end = 0;
+    if (!ok || !checked_add(offset, nbytes, &end)) {
+      if (err) {
+        (*err) += "Invalid compressed tensor entry `" + key + "`.\n";
+      }
+      return false;
     }
+    t.data_offsets = {{offset, end}};
+    offset = end;
+    layout->header.tensors.insert(name, t);
+  }
 
-    ntensors++;
-    if (ntensors == st.tensors.size()) {
-      // Last element's data_offsets[1] must be equal to databuffer size.
-      if (tensor.data_offsets[1] != databuffersize) {
-        ss << "The last tensor's data_offset.END(" << tensor.data_offsets[1]
-           << ") must be equal to databufer size " << databuffersize << ".\n";
-        valid = false;
+  // Chunks: each tensor is split into `chunk_size` chunks.
+  std::vector<size_t> sizes;
+  if (!parse_size_list(chunks, &sizes)) {
+    if (err) {
+      (*err) += "Invalid chunk table.\n";
+    }
+    return false;
+  }
+  uint64_t coffset = 0;
+  for (size_t i = 0; i < layout->header.tensors.size(); i++) {
+    tensor_t t;
+    layout->header.tensors.at(i, &t);
+    layout->first_chunk.push_back(layout->chunks.size());
+    size_t nbytes = t.data_offsets[1] - t.data_offsets[0];
+    size_t num_chunks = nbytes / layout->chunk_size +
+                        ((nbytes % layout->chunk_size) ? 1 : 0);
+    if (num_chunks > (sizes.size() - layout->chunks.size())) {
+      if (err) {
+        (*err) += "Chunk table is too short.\n";
       }
+      return false;
+    }
+    for (size_t k = 0; k < num_chunks; k++) {
+      compressed_chunk c;
+      c.offset = coffset;
+      c.size = sizes[layout->chunks.size()];
+      c.raw_size =
+          (std::min)(layout->chunk_size, nbytes - k * layout->chunk_size);
+      // `coffset <= data_size` holds, so the range check does not wrap.
+      if ((c.size > c.raw_size) || (c.raw_size > c.size * 255) ||
+          (c.size > (layout->data_size - coffset))) {
+        if (err) {
+          (*err) += "Invalid size of chunk " +
+                    std::to_string(layout->chunks.size()) + ".\n";
+        }
+        return false;
+      }
+      coffset += c.size;
+      layout->chunks.push_back(c);
+    }
+  }
+  layout->first_chunk.push_back(layout->chunks.size());
+  if ((layout->chunks.size() != sizes.size()) ||
+      (coffset != layout->data_size)) {
+    if (err) {
+      (*err) += "Chunk table does not match the compressed data.\n";
     }
+    return false;
   }
+  return true;
+}
 
-  if (!valid) {
-    err = ss.str();
+// Decompress chunk `c` to `dst`. `scratch` has `chunk_size` bytes when
+// `itemsize`(shuffle) is non-zero.
+bool decompress_chunk(const compressed_chunk &c, const uint8_t *src,
+                      size_t itemsize, uint8_t *scratch, uint8_t *dst) {
+  if (c.size == c.raw_size) {  // stored(not shuffled)
+    memcpy(dst, src, c.raw_size);
+    return true;
+  }
+  if (!itemsize) {
+    return lz_decompress(src, c.size, dst, c.raw_size);
   }
+  if (!lz_decompress(src, c.size, scratch, c.raw_size)) {
+    return false;
+  }
+  unshuffle_bytes(scratch, c.raw_size, itemsize, dst);
+  return true;
+}
 
-  return valid;
+// Decompress chunks [first, last) of tensor `t` to `dst`. `src` is the
+// compressed data starting at chunk `first`.
+bool decompress_tensor_chunks(const compressed_layout &layout,
+                              const tensor_t &t, size_t first, size_t last,
+                              const uint8_t *src, uint8_t *dst,
+                              size_t num_threads, std::string *err) {
+  const size_t itemsize = layout.shuffle ? shuffle_itemsize(t.dtype) : 0;
+  const uint64_t base = layout.chunks[first].offset;
+  std::atomic<bool> ok{true};
+  parallel_for(last - first, num_threads, [&](size_t k) {
+    const compressed_chunk &c = layout.chunks[first + k];
+    std::unique_ptr<uint8_t[]> scratch;
+    if (itemsize && (c.size != c.raw_size)) {
+      scratch.reset(new uint8_t[c.raw_size]);
+    }
+    if (!decompress_chunk(c, src + (c.offset - base), itemsize,
+                          scratch.get(), dst + k * layout.chunk_size)) {
+      ok = false;
+    }
+  });
+  if (!ok && err) {
+    (*err) += "Failed to decompress a chunk(broken data).\n";
+  }
+  return ok;
 }
 
-bool save_to_memory(const safetensors_t &st, std::vector<uint8_t> *dst,
-                    std::string *warn, std::string *err) {
-  // directly serialize JSON string.
-  std::stringstream ss;
+// Decompress every chunk of `layout` to `st`. `compressed` is the data of
+// `__compressed__`.
+bool decompress_all(const compressed_layout &layout,
+                    const uint8_t *compressed, safetensors_t *st,
+                    std::string *err) {
+  size_t total = 0;
+  if (layout.header.tensors.size()) {
+    tensor_t t;
+    layout.header.tensors.at(layout.header.tensors.size() - 1, &t);
+    total = t.data_offsets[1];
+  }
+  std::vector<uint8_t> storage(total);
+
+  // All chunks of all tensors in one pool.
+  std::vector<size_t> tensor_of_chunk(layout.chunks.size());
+  std::vector<tensor_t> tensors(layout.header.tensors.size());
+  for (size_t i = 0; i < tensors.size(); i++) {
+    layout.header.tensors.at(i, &tensors[i]);
+    for (size_t k = layout.first_chunk[i]; k < layout.first_chunk[i + 1];
+         k++) {
+      tensor_of_chunk[k] = i;
+    }
+  }
+  std::atomic<bool> ok{true};
+  parallel_for(layout.chunks.size(), 0, [&](size_t k) {
+    const compressed_chunk &c = layout.chunks[k];
+    const size_t i = tensor_of_chunk[k];
+    const tensor_t &t = tensors[i];
+    const size_t itemsize =
+        layout.shuffle ? shuffle_itemsize(t.dtype) : 0;
+    std::unique_ptr<uint8_t[]> scratch;
+    if (itemsize && (c.size != c.raw_size)) {
+      scratch.reset(new uint8_t[c.raw_size]);
+    }
+    uint8_t *dst = storage.data() + t.data_offsets[0] +
+                   (k - layout.first_chunk[i]) * layout.chunk_size;
+    if (!decompress_chunk(c, compressed + c.offset, itemsize, scratch.get(),
+                          dst)) {
+      ok = false;
+    }
+  });
+  if (!ok) {
+    if (err) {
+      (*err) += "Failed to decompress a chunk(broken data).\n";
+    }
+    return false;
+  }
+  counter_add(g_counters.tensors_materialized, tensors.size());
 
-  // NOTE: The last offset **must** be the end of the file,
-  // so write __metadata__ first(if metadata part exists)
+  st->tensors = layout.header.tensors;
+  st->metadata = layout.header.metadata;
+  st->storage.swap(storage);
+  st->mmaped = false;
+  st->mmap_addr = nullptr;
+  st->mmap_size = 0;
+  st->databuffer_addr = nullptr;
+  st->databuffer_size = 0;
+  return true;
+}
 
-  std::string _err;
-  if (!validate_data_offsets(st, _err)) {
+bool load_compressed(safetensors_file &file, size_t head_size,
+                     safetensors_t *st, std::string *err) {
+  compressed_layout layout;
+  if (!parse_compressed_layout(*st, &layout, err)) {
+    return false;
+  }
+  const uint64_t avail = file.size - head_size;
+  if ((layout.data_offset > avail) ||
+      (layout.data_size > (avail - layout.data_offset))) {
     if (err) {
-      (*err) += "Invalid safensors is provided.\n";
-      (*err) += _err;
+      (*err) += "Compressed data is out of the file.\n";
     }
     return false;
   }
 
-  ss << "{";
-  if (st.metadata.size()) {
-    ss << "\"__metadata__\": {";
-    size_t nmeta = 0;
-    for (size_t i = 0; i < st.metadata.size(); i++) {
-      std::string key = st.metadata.keys()[i];
-      std::string value;
-      st.metadata.at(i, &value);
+  std::unique_ptr<uint8_t[]> compressed(
+      new uint8_t[(std::max)(size_t(layout.data_size), size_t(1))]);
+  if (!file.read_at(compressed.get(), size_t(layout.data_size),
+                    head_size + layout.data_offset, err)) {
+    return false;
+  }
+  counter_add(g_counters.bytes_read, head_size + layout.data_size);
 
-      if (nmeta > 0) {
-        ss << ", ";
-      }
-      ss << "\"" + key + "\": \"" << value << "\"";
-      nmeta++;
-    }
-    ss << "}";
+  return decompress_all(layout, compressed.get(), st, err);
+}
 
-    if (st.tensors.size()) {
-      ss << ", ";
+bool load_compressed(const uint8_t *addr, size_t nbytes, safetensors_t *st,
+                     std::string *err) {
+  compressed_layout layout;
+  if (!parse_compressed_layout(*st, &layout, err)) {
+    return false;
+  }
+  const size_t head_size = 8 + st->header_size;
+  const uint64_t avail = nbytes - head_size;
+  if ((layout.data_offset > avail) ||
+      (layout.data_size > (avail - layout.data_offset))) {
+    if (err) {
+      (*err) += "Compressed data is out of the buffer.\n";
     }
+    return false;
   }
 
-  size_t ntensors = 0;
-  {
-    for (size_t i = 0; i < st.tensors.size(); i++) {
+  return decompress_all(layout, addr + head_size + layout.data_offset, st,
+                        err);
+}
 
-      std::string key = st.tensors.keys()[i];
-      safetensors::tensor_t tensor;
-      st.tensors.at(i, &tensor);
+struct compressed_reader_impl {
+  safetensors_file *file{nullptr};
+  size_t head_size{0};
+  size_t num_threads{0};
+  compressed_layout layout;
 
-      if (tensor.shape.size() > safetensors::kMaxDim) {
-        if (err) {
-          (*err) += key + ".shape is too large.\n";
-          (*err) += _err;
-        }
-        return false;
-      }
+  ~compressed_reader_impl() { delete file; }
+};
 
-      if (ntensors > 0) {
-        ss << ", ";
-      }
-      ss << "\"" << key << "\": {";
-      ss << "\"dtype\": \"" << safetensors::get_dtype_str(tensor.dtype)
-         << "\", ";
-      ss << "\"shape\": [";
-      for (size_t i = 0; i < tensor.shape.size(); i++) {
-        if (i > 0) {
-          ss << ", ";
-        }
-        ss << tensor.shape[i];
-      }
-      ss << "]";
-      ss << ", \"data_offsets\": [" << tensor.data_offsets[0] << ", "
-         << tensor.data_offsets[1] << "]";
-      ss << "}";
-      ntensors++;
-    }
-  }
-  ss << "}";
+}  // namespace detail
 
-  std::string header_str = ss.str();
+bool is_compressed(const safetensors_t &st) {
+  return st.metadata.count(detail::kCompressionFormat) != 0;
+}
 
-  uint64_t header_size = header_str.size();  // do not include '\n'
+bool save_compressed(const safetensors_t &st, const std::string &filename,
+                     const compress_options &options,
+                     size_t *compressed_bytes, std::string *warn,
+                     std::string *err) {
+  SAFETENSORS_CPP_STATS_ENTRY();
 
-  const void *databuffer_addr{nullptr};
-  size_t databuffer_size{0};
-  if (st.mmaped) {
-    databuffer_size = st.databuffer_size;
-    databuffer_addr = st.databuffer_addr;
-  } else {
-    databuffer_size = st.storage.size();
-    databuffer_addr = reinterpret_cast<const void *>(st.storage.data());
+  if (is_compressed(st)) {
+    if (err) {
+      (*err) += "Input is already compressed.\n";
+    }
+    return false;
+  }
+  const size_t chunk_size = options.chunk_size / 8 * 8;
+  if ((chunk_size == 0) ||
+      (chunk_size > detail::kMaxCompressionChunkSize)) {
+    if (err) {
+      (*err) += "chunk_size must be in [8, 1 GB].\n";
+    }
+    return false;
   }
 
-  // make databuffer addr start from the multiple of 8.
-  size_t pad_bytes = 0;
-  if ((header_size % 8) != 0) {
-    pad_bytes = 8 - (header_size % 8);
+  struct chunk_job {
+    const uint8_t *src;
+    size_t size;
+    size_t itemsize;
+    std::vector<uint8_t> out;
+  };
+  std::vector<chunk_job> jobs;
+
+  safetensors_t layout;
+  for (size_t i = 0; i < st.metadata.size(); i++) {
+    std::string value;
+    st.metadata.at(i, &value);
+    layout.metadata.insert(st.metadata.keys()[i], value);
+  }
+  layout.metadata.insert(detail::kCompressionFormat,
+                         detail::kCompressionFormatName);
+  layout.metadata.insert(detail::kCompressionChunkSize,
+                         std::to_string(chunk_size));
+  layout.metadata.insert(detail::kCompressionShuffle,
+                         options.shuffle ? "1" : "0");
+  for (size_t i = 0; i < st.tensors.size(); i++) {
+    const std::string &name = st.tensors.keys()[i];
+    tensor_t t;
+    st.tensors.at(i, &t);
+    const uint8_t *data{nullptr};
+    size_t nbytes{0};
+    if (!get_tensor_data(st, name, &data, &nbytes, err)) {
+      return false;
+    }
+    std::string value = get_dtype_str(t.dtype) + ";";
+    for (size_t d = 0; d < t.shape.size(); d++) {
+      value += ((d > 0) ? "," : "") + std::to_string(t.shape[d]);
+    }
+    layout.metadata.insert(detail::kCompressionTensor + name, value);
+
+    size_t itemsize = options.shuffle ? detail::shuffle_itemsize(t.dtype) : 0;
+    for (size_t off = 0; off < nbytes; off += chunk_size) {
+      chunk_job job;
+      job.src = data + off;
+      job.size = (std::min)(chunk_size, nbytes - off);
+      job.itemsize = itemsize;
+      jobs.push_back(std::move(job));
+    }
   }
-  //printf("header_size = %d\n", int(header_size));
-  //printf("pad_bytes = %d\n", int(pad_bytes));
-  size_t padded_header_size = header_size + pad_bytes;
-  dst->resize(8 + padded_header_size + databuffer_size);
 
-  // write padded header_size
-  memcpy(dst->data(), &padded_header_size, 8);
+  detail::parallel_for(jobs.size(), options.num_threads, [&](size_t k) {
+    chunk_job &job = jobs[k];
+    std::unique_ptr<uint8_t[]> shuffled;
+    const uint8_t *src = job.src;
+    if (job.itemsize) {
+      shuffled.reset(new uint8_t[job.size]);
+      detail::shuffle_bytes(job.src, job.size, job.itemsize, shuffled.get());
+      src = shuffled.get();
+    }
+    job.out.resize(detail::lz_compress_bound(job.size));
+    size_t n = detail::lz_compress(src, job.size, job.out.data());
+    if (n >= job.size) {  // store the original bytes
+      job.out.assign(job.src, job.src + job.size);
+    } else {
+      job.out.resize(n);
+    }
+  });
 
-  // write header
-  memcpy(dst->data() + 8, header_str.data(), header_size);
+  std::string chunks;
+  size_t total = 0;
+  for (size_t k = 0; k < jobs.size(); k++) {
+    chunks += ((k > 0) ? "," : "") + std::to_string(jobs[k].out.size());
+    total += jobs[k].out.size();
+  }
+  layout.metadata.insert(detail::kCompressionChunks, chunks);
 
-  // Use whitespace for trailing padding.
-  memset(dst->data() + 8 + header_size, 0x20, pad_bytes);
+  tensor_t data;
+  data.dtype = dtype::kUINT8;
+  data.shape = {total};
+  data.data_offsets = {{0, 0}};  // computed by writer
+  layout.tensors.insert(detail::kCompressedTensorName, data);
 
-  memcpy(dst->data() + 8 + padded_header_size, databuffer_addr,
-         databuffer_size);
+  mmap_writer writer;
+  if (!writer.open(filename, layout, warn, err)) {
+    return false;
+  }
+  uint8_t *dst{nullptr};
+  size_t dst_nbytes{0};
+  if (!writer.get_tensor_data(detail::kCompressedTensorName, &dst,
+                              &dst_nbytes, err)) {
+    return false;
+  }
+  for (const chunk_job &job : jobs) {
+    memcpy(dst, job.out.data(), job.out.size());
+    dst += job.out.size();
+  }
+  if (!writer.finalize(err)) {
+    return false;
+  }
 
+  if (compressed_bytes) {
+    (*compressed_bytes) = total;
+  }
   return true;
 }
 
-bool save_to_file(const safetensors_t &st, const std::string &filename,
-                  std::string *warn, std::string *err) {
-  // TODO: Use more reliable io.
-  std::ofstream ofs(filename, std::ios::binary);
+compressed_reader::~compressed_reader() {
+  delete reinterpret_cast<detail::compressed_reader_impl *>(_impl);
+  _impl = nullptr;
+}
 
-  if (!ofs) {
+bool compressed_reader::open(const std::string &filename, size_t num_threads,
+                             std::string *warn, std::string *err) {
+  delete reinterpret_cast<detail::compressed_reader_impl *>(_impl);
+  _impl = nullptr;
+
+  std::unique_ptr<detail::compressed_reader_impl> p(
+      new detail::compressed_reader_impl());
+  p->num_threads = num_threads;
+  p->file = new detail::safetensors_file(filename.c_str(), "rb");
+  if (!p->file->is_valid()) {
     if (err) {
-      (*err) += "Failed to open `" + filename +
-                "` to write. File is either existing directory or "
-                "write-protected, or disk is full?\n";
+      (*err) += p->file->get_error();
     }
     return false;
   }
 
-  std::vector<uint8_t> buf;
-  if (!save_to_memory(st, &buf, warn, err)) {
+  std::vector<uint8_t> head;
+  safetensors_t st;
+  if (!detail::read_file_header(*p->file, filename, &head, &st, warn, err) ||
+      !detail::parse_compressed_layout(st, &p->layout, err)) {
     return false;
   }
-
-  ofs.write(reinterpret_cast<const char *>(buf.data()), buf.size());
-  if (!ofs) {
+  p->head_size = head.size();
+  const uint64_t avail = p->file->size - p->head_size;
+  if ((p->layout.data_offset > avail) ||
+      (p->layout.data_size > (avail - p->layout.data_offset))) {
     if (err) {
-      (*err) += "Failed to write safetensor data to `" + filename +
-                "`. Maybe no disk space available?(Required bytes : " +
-                std::to_string(buf.size()) + "\n";
+      (*err) += "Compressed data is out of the file.\n";
     }
     return false;
   }
 
+  _impl = p.release();
+
   return true;
 }
 
+const safetensors_t &compressed_reader::header() const {
+  static const safetensors_t empty;
+  const detail::compressed_reader_impl *p =
+      reinterpret_cast<const detail::compressed_reader_impl *>(_impl);
+  return p ? p->layout.header : empty;
+}
+
+bool compressed_reader::read_tensor(const std::string &name, uint8_t *dst,
+                                    size_t nbytes, std::string *err) const {
+  const detail::compressed_reader_impl *p =
+      reinterpret_cast<const detail::compressed_reader_impl *>(_impl);
+  if (!p || !dst) {
+    return false;
+  }
+  const detail::compressed_layout &layout = p->layout;
+  const std::vector<std::string> &keys = layout.header.tensors.keys();
+  size_t i = size_t(std::find(keys.begin(), keys.end(), name) - keys.begin());
+  tensor_t t;
+  if (!layout.header.tensors.at(name, &t) || (i >= keys.size())) {
+    if (err) {
+      (*err) += "Tensor `" + name + "` not found.\n";
+    }
+    return false;
+  }
+  if (nbytes != (t.data_offsets[1] - t.data_offsets[0])) {
+    if (err) {
+      (*err) += "Size of tensor `" + name + "` is " +
+                std::to_string(t.data_offsets[1] - t.data_offsets[0]) +
+                " bytes.\n";
+    }
+    return false;
+  }
+
+  size_t first = layout.first_chunk[i], last = layout.first_chunk[i + 1];
+  if (first == last) {
+    return true;  // empty tensor
+  }
+  uint64_t begin = layout.chunks[first].offset;
+  uint64_t end = layout.chunks[last - 1].offset + layout.chunks[last - 1].size;
+  std::unique_ptr<uint8_t[]> compressed(new uint8_t[size_t(end - begin)]);
+  if (!p->file->read_at(compressed.get(), size_t(end - begin),
+                        p->head_size + layout.data_offset + begin, err)) {
+    return false;
+  }
+  detail::counter_add(detail::g_counters.bytes_read, end - begin);
+
+  return detail::decompress_tensor_chunks(layout, t, first, last,
+                                          compressed.get(), dst,
+                                          p->num_threads, err);
+}
+
 }  // namespace safetensors
 
 #endif